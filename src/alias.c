@@ -0,0 +1,375 @@
+#include "alias.h"
+#include "cfg.h"
+#include "ir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#define UNTRACKED ((size_t)-3)
+
+size_t join_regions(size_t a, size_t b) {
+    if (a == b || b == NO_REGION)
+        return a;
+    else if (a == NO_REGION)
+        return b;
+
+    return ANY_REGION;
+}
+
+bool is_address_taken(AliasInfo *info, size_t var) {
+    return var < info->var_count && info->region_of[var] != NO_REGION;
+}
+
+// Whether a store through a pointer into the region can change what
+// loading the variable gives.
+bool region_may_hold(AliasInfo *info, size_t region, size_t var) {
+    return is_address_taken(info, var) && (region == ANY_REGION || region == info->region_of[var]);
+}
+
+static void take_address(AliasInfo *info, size_t var) {
+    if (var < info->var_count && info->region_of[var] == NO_REGION)
+        info->region_of[var] = info->region_count++;
+}
+
+// Inline asm names variables by their labels, like "_printchrc".
+static bool asm_names(char *code, VarKey *key) {
+    const size_t scope_len = strlen(key->scope);
+    const size_t name_len = strlen(key->name);
+
+    for (char *c = strchr(code, '_'); c != NULL; c = strchr(c + 1, '_')) {
+        if (c != code && (isalnum((unsigned char)c[-1]) || c[-1] == '_' || c[-1] == '@'))
+            continue;
+        else if (strncmp(c + 1, key->scope, scope_len) != 0 || strncmp(c + 1 + scope_len, key->name, name_len) != 0)
+            continue;
+
+        char after = c[1 + scope_len + name_len];
+
+        if (!isalnum((unsigned char)after) && after != '_' && after != '@')
+            return true;
+    }
+
+    return false;
+}
+
+static bool join_into(size_t *region, size_t with) {
+    size_t joined = join_regions(*region, with);
+
+    if (joined == *region)
+        return false;
+
+    *region = joined;
+    return true;
+}
+
+// What loading a variable gives, by what's known for the whole program.
+static size_t contents_region(AliasInfo *info, size_t var) {
+    if (var >= info->var_count)
+        return ANY_REGION;
+    else if (info->region_of[var] == NO_REGION)
+        return info->points_to[var];
+
+    // Buffers load as their address, and anything in memory can be
+    // changed through pointers.
+    return join_regions(join_regions(info->region_of[var], info->points_to[var]), info->stored);
+}
+
+AliasTracker create_alias_tracker(AliasInfo *info) {
+    AliasTracker tracker = (AliasTracker){ .info = info, .acc = ANY_REGION, .vars = malloc((info->var_count + 1) * sizeof(size_t)),
+        .written = malloc((info->var_count + 1) * sizeof(size_t)) };
+
+    for (size_t i = 0; i < info->var_count; i++)
+        tracker.vars[i] = UNTRACKED;
+
+    return tracker;
+}
+
+void delete_alias_tracker(AliasTracker *tracker) {
+    free(tracker->vars);
+    free(tracker->written);
+    free(tracker->stack);
+}
+
+// Only forgets what was written, so it's cheap to do at every label.
+void reset_alias_tracker(AliasTracker *tracker) {
+    tracker->acc = ANY_REGION;
+    tracker->depth = 0;
+
+    for (size_t i = 0; i < tracker->written_count; i++)
+        tracker->vars[tracker->written[i]] = UNTRACKED;
+
+    tracker->written_count = 0;
+}
+
+size_t value_region(AliasTracker *tracker, OpValue *value) {
+    AliasInfo *info = tracker->info;
+
+    switch (value->type) {
+        case VAL_INT: return NO_REGION;
+        case VAL_STRING: return info->string_region;
+        case VAL_REG: return tracker->acc;
+        case VAL_STACK: return tracker->depth > 0 ? tracker->stack[tracker->depth - 1] : info->pushed;
+        case VAL_VAR:
+        case VAL_RET: {
+            size_t var = value_to_var(info->vars, value);
+
+            if (var < info->var_count && tracker->vars[var] != UNTRACKED)
+                return tracker->vars[var];
+
+            return contents_region(info, var);
+        }
+        default: break;
+    }
+
+    return ANY_REGION;
+}
+
+// The region a deref or a store through a pointer accesses. Made up
+// addresses could be anywhere.
+size_t address_region(AliasTracker *tracker, Op *op) {
+    size_t region = op->type == OP_STORE_DEREF ? value_region(tracker, &op->dst) : tracker->acc;
+    return region == NO_REGION ? ANY_REGION : region;
+}
+
+static void set_var(AliasTracker *tracker, OpValue *value, size_t region) {
+    size_t var = value_to_var(tracker->info->vars, value);
+
+    if (var >= tracker->info->var_count)
+        return;
+    else if (tracker->vars[var] == UNTRACKED)
+        tracker->written[tracker->written_count++] = var;
+
+    tracker->vars[var] = region;
+}
+
+static void push_region(AliasTracker *tracker, size_t region) {
+    if (tracker->depth == tracker->capacity) {
+        tracker->capacity = tracker->capacity == 0 ? 16 : tracker->capacity * 2;
+        tracker->stack = realloc(tracker->stack, tracker->capacity * sizeof(size_t));
+    }
+
+    tracker->stack[tracker->depth++] = region;
+}
+
+// Pops what was pushed in the block, or anything that was pushed
+// anywhere.
+static size_t pop_region(AliasTracker *tracker) {
+    return tracker->depth > 0 ? tracker->stack[--tracker->depth] : tracker->info->pushed;
+}
+
+// Pointers stay in their region when an integer is added to or
+// subtracted from them, anything else made from a pointer could be
+// anywhere.
+static size_t math_region(OpType type, size_t acc, size_t operand) {
+    if (acc == NO_REGION && operand == NO_REGION)
+        return NO_REGION;
+    else if (type == OP_ADD && (acc == NO_REGION || operand == NO_REGION))
+        return acc == NO_REGION ? operand : acc;
+    else if (type == OP_SUB && operand == NO_REGION)
+        return acc;
+
+    return ANY_REGION;
+}
+
+void track_op(AliasTracker *tracker, Op *op) {
+    AliasInfo *info = tracker->info;
+
+    switch (op->type) {
+        case OP_LOAD:
+            tracker->acc = value_region(tracker, &op->src);
+            break;
+        case OP_STORE:
+            if (op->src.type != VAL__RES__)
+                set_var(tracker, &op->dst, tracker->acc);
+            break;
+        case OP_PUSH:
+            push_region(tracker, value_region(tracker, &op->src));
+            break;
+        case OP_POP: {
+            size_t region = pop_region(tracker);
+
+            if (IS_ACC(op->dst) || op->dst.type == VAL_NONE)
+                tracker->acc = region;
+            else
+                set_var(tracker, &op->dst, region);
+            break;
+        }
+        case OP_SWP: {
+            size_t acc = tracker->acc;
+            tracker->acc = value_region(tracker, &op->dst);
+            set_var(tracker, &op->dst, acc);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_AND:
+        case OP_OR:
+        case OP_XOR:
+            tracker->acc = math_region(op->type, tracker->acc, value_region(tracker, &op->src));
+            break;
+        case OP_NOT:
+        case OP_NEG:
+            tracker->acc = math_region(op->type, value_region(tracker, &op->src), NO_REGION);
+            break;
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_LT:
+        case OP_LTE:
+        case OP_GT:
+        case OP_GTE:
+            tracker->acc = NO_REGION;
+            break;
+        case OP_REF: {
+            size_t var = value_to_var(info->vars, &op->src);
+            tracker->acc = op->src.type == VAL_STRING ? info->string_region : is_address_taken(info, var) ? info->region_of[var] : ANY_REGION;
+            break;
+        }
+        case OP_DEREF:
+            tracker->acc = info->stored;
+            break;
+        case OP_STORE_DEREF: {
+            // The variables it can reach might now hold the value.
+            size_t region = address_region(tracker, op);
+
+            for (size_t i = 0; i < tracker->written_count; i++) {
+                size_t var = tracker->written[i];
+
+                if (region_may_hold(info, region, var))
+                    tracker->vars[var] = join_regions(tracker->vars[var], tracker->acc);
+            }
+            break;
+        }
+        case OP_CALL:
+        case OP_INLINE_ASM:
+            // Anything the callee or the asm writes is covered by the
+            // program wide facts.
+            reset_alias_tracker(tracker);
+            break;
+        default:
+            if (op_writes_acc(op))
+                tracker->acc = ANY_REGION;
+            break;
+    }
+
+    // Whatever else writes the top of the stack.
+    if (op->dst.type == VAL_STACK && tracker->depth > 0)
+        tracker->stack[tracker->depth - 1] = ANY_REGION;
+}
+
+AliasInfo build_alias_info(IR *ir, VarTable *vars) {
+    intern_all_vars(vars, ir);
+
+    AliasInfo info = (AliasInfo){ .vars = vars, .var_count = vars->count, .region_count = 0,
+        .region_of = malloc((vars->count + 1) * sizeof(size_t)), .points_to = malloc((vars->count + 1) * sizeof(size_t)),
+        .stored = NO_REGION, .pushed = NO_REGION };
+
+    for (size_t v = 0; v < info.var_count; v++) {
+        info.region_of[v] = NO_REGION;
+        info.points_to[v] = NO_REGION;
+    }
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        Op *op = &ir->ops[i];
+
+        if (op->type == OP_STORE && op->src.type == VAL__RES__)
+            take_address(&info, value_to_var(vars, &op->dst));
+        else if (op->type == OP_REF && op->src.type != VAL_STRING)
+            take_address(&info, value_to_var(vars, &op->src));
+        else if (op->type != OP_INLINE_ASM)
+            continue;
+
+        // Inline asm can do anything with what it names, and anything
+        // at all if it stores through a pointer.
+        for (size_t v = 0; v < info.var_count && op->type == OP_INLINE_ASM; v++) {
+            if (asm_names(op->src.string, &vars->keys[v])) {
+                take_address(&info, v);
+                info.points_to[v] = ANY_REGION;
+            }
+        }
+
+        if (op->type == OP_INLINE_ASM && strstr(op->src.string, "std") != NULL)
+            info.stored = ANY_REGION;
+    }
+
+    info.string_region = info.region_count++;
+
+    // Labels get the regions the accumulator may have at any jump to
+    // them. Go over the whole program until nothing changes.
+    size_t *labels = malloc((ir->label_count + 1) * sizeof(size_t));
+    AliasTracker tracker = create_alias_tracker(&info);
+    bool changed = true;
+
+    for (size_t i = 0; i < ir->label_count; i++)
+        labels[i] = NO_REGION;
+
+    while (changed) {
+        changed = false;
+        reset_alias_tracker(&tracker);
+
+        for (size_t i = 0; i < ir->op_count; i++) {
+            Op *op = &ir->ops[i];
+            size_t var;
+
+            switch (op->type) {
+                case OP_FUNC_BEGIN:
+                case OP_FUNC_END:
+                    reset_alias_tracker(&tracker);
+                    continue;
+                case OP_NEW_BRANCH: {
+                    size_t acc = tracker.acc;
+                    reset_alias_tracker(&tracker);
+
+                    if (op->src.branch < ir->label_count)
+                        tracker.acc = join_regions(acc, labels[op->src.branch]);
+                    continue;
+                }
+                case OP_STORE:
+                case OP_SWP:
+                    var = value_to_var(vars, &op->dst);
+
+                    if (var < info.var_count && op->src.type != VAL__RES__)
+                        changed |= join_into(&info.points_to[var], tracker.acc);
+                    break;
+                case OP_POP:
+                    var = value_to_var(vars, &op->dst);
+
+                    if (var < info.var_count)
+                        changed |= join_into(&info.points_to[var], value_region(&tracker, &(OpValue){ .type = VAL_STACK }));
+                    break;
+                case OP_PUSH:
+                    changed |= join_into(&info.pushed, value_region(&tracker, &op->src));
+                    break;
+                case OP_STORE_DEREF:
+                    changed |= join_into(&info.stored, tracker.acc);
+                    break;
+                default: break;
+            }
+
+            if (op_is_branch(op) || op->type == OP_JUMP) {
+                if (op->dst.branch < ir->label_count)
+                    changed |= join_into(&labels[op->dst.branch], tracker.acc);
+            }
+
+            track_op(&tracker, op);
+
+            // Nothing falls through these.
+            if (op->type == OP_JUMP || op->type == OP_RET)
+                tracker.acc = NO_REGION;
+        }
+    }
+
+    delete_alias_tracker(&tracker);
+    free(labels);
+    return info;
+}
+
+void delete_alias_info(AliasInfo *info) {
+    free(info->region_of);
+    free(info->points_to);
+}
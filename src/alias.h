@@ -0,0 +1,59 @@
+#ifndef ALIAS_H
+#define ALIAS_H
+
+#include "ir.h"
+#include "cfg.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+// Memory that pointers can reach is split into regions: one for every
+// buffer declared with __res__, one for every variable whose address
+// is taken by a ref or inline asm, and one for all of the string
+// constants. Everything else is a plain variable no pointer can touch.
+//
+// A value either isn't a pointer, points into one region, or could
+// point anywhere.
+#define NO_REGION ((size_t)-1)
+#define ANY_REGION ((size_t)-2)
+
+typedef struct {
+    VarTable *vars;
+    size_t var_count;
+    size_t region_count;
+    size_t string_region;
+    size_t *region_of; // The region a variable lives in, NO_REGION if none.
+
+    // Flow insensitive, over every op of the program.
+    size_t *points_to; // Where the value of a variable may point.
+    size_t stored;     // Where values stored through pointers may point.
+    size_t pushed;     // Where values pushed on the stack may point.
+} AliasInfo;
+
+// Follows the regions through a block, knowing exactly what the
+// variables written and the values pushed in it hold. At the start of
+// a block nothing is known but the program wide facts.
+typedef struct {
+    AliasInfo *info;
+    size_t acc;
+    size_t *vars;
+    size_t *written; // The variables in vars that are known.
+    size_t written_count;
+    size_t *stack;
+    size_t depth;
+    size_t capacity;
+} AliasTracker;
+
+AliasInfo build_alias_info(IR *ir, VarTable *vars);
+void delete_alias_info(AliasInfo *info);
+size_t join_regions(size_t a, size_t b);
+bool is_address_taken(AliasInfo *info, size_t var);
+bool region_may_hold(AliasInfo *info, size_t region, size_t var);
+
+AliasTracker create_alias_tracker(AliasInfo *info);
+void delete_alias_tracker(AliasTracker *tracker);
+void reset_alias_tracker(AliasTracker *tracker);
+size_t value_region(AliasTracker *tracker, OpValue *value);
+size_t address_region(AliasTracker *tracker, Op *op);
+void track_op(AliasTracker *tracker, Op *op);
+
+#endif
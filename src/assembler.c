@@ -0,0 +1,502 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "assembler.h"
+#include "cfg.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+
+#define NO_ADDRESS ((size_t)-1)
+#define MODE(mode) (1u << (mode))
+#define VALUE_MODES (MODE(OPERAND_ACC) | MODE(OPERAND_INT) | MODE(OPERAND_MEMORY) | MODE(OPERAND_STACK))
+
+static const char *mnemonics[INS_COUNT] = {
+    [INS_LDA] = "lda", [INS_STA] = "sta", [INS_REF] = "ref", [INS_LDD] = "ldd", [INS_STD] = "std", [INS_SWP] = "swp",
+    [INS_ADD] = "add", [INS_SUB] = "sub", [INS_MUL] = "mul", [INS_DIV] = "div", [INS_MOD] = "mod", [INS_SHL] = "shl",
+    [INS_SHR] = "shr", [INS_AND] = "and", [INS_OR] = "or", [INS_XOR] = "xor", [INS_NOT] = "not", [INS_NEG] = "neg",
+    [INS_PSH] = "psh", [INS_POP] = "pop", [INS_CMP] = "cmp", [INS_SEQ] = "seq", [INS_SNE] = "sne", [INS_SLT] = "slt",
+    [INS_SLE] = "sle", [INS_SGT] = "sgt", [INS_SGE] = "sge", [INS_BEQ] = "beq", [INS_BNE] = "bne", [INS_BLT] = "blt",
+    [INS_BLE] = "ble", [INS_BGT] = "bgt", [INS_BGE] = "bge", [INS_JMP] = "jmp", [INS_CSR] = "csr", [INS_RSR] = "rsr",
+    [INS_HLT] = "hlt", [INS_OPC] = "opc", [INS_OPI] = "opi", [INS_IPS] = "ips"
+};
+
+// The operands each instruction takes.
+static const unsigned int allowed_modes[INS_COUNT] = {
+    [INS_LDA] = VALUE_MODES, [INS_STA] = MODE(OPERAND_MEMORY), [INS_REF] = MODE(OPERAND_MEMORY),
+    [INS_LDD] = MODE(OPERAND_ACC) | MODE(OPERAND_MEMORY), [INS_STD] = MODE(OPERAND_MEMORY), [INS_SWP] = MODE(OPERAND_MEMORY),
+    [INS_ADD] = VALUE_MODES, [INS_SUB] = VALUE_MODES, [INS_MUL] = VALUE_MODES, [INS_DIV] = VALUE_MODES,
+    [INS_MOD] = VALUE_MODES, [INS_SHL] = VALUE_MODES, [INS_SHR] = VALUE_MODES, [INS_AND] = VALUE_MODES,
+    [INS_OR] = VALUE_MODES, [INS_XOR] = VALUE_MODES, [INS_NOT] = VALUE_MODES, [INS_NEG] = VALUE_MODES,
+    [INS_PSH] = VALUE_MODES, [INS_POP] = MODE(OPERAND_ACC) | MODE(OPERAND_MEMORY), [INS_CMP] = VALUE_MODES,
+    [INS_SEQ] = MODE(OPERAND_ACC), [INS_SNE] = MODE(OPERAND_ACC), [INS_SLT] = MODE(OPERAND_ACC),
+    [INS_SLE] = MODE(OPERAND_ACC), [INS_SGT] = MODE(OPERAND_ACC), [INS_SGE] = MODE(OPERAND_ACC),
+    [INS_BEQ] = MODE(OPERAND_CODE), [INS_BNE] = MODE(OPERAND_CODE), [INS_BLT] = MODE(OPERAND_CODE),
+    [INS_BLE] = MODE(OPERAND_CODE), [INS_BGT] = MODE(OPERAND_CODE), [INS_BGE] = MODE(OPERAND_CODE),
+    [INS_JMP] = MODE(OPERAND_CODE), [INS_CSR] = MODE(OPERAND_CODE), [INS_RSR] = MODE(OPERAND_ACC),
+    [INS_HLT] = MODE(OPERAND_ACC), [INS_OPC] = VALUE_MODES, [INS_OPI] = VALUE_MODES, [INS_IPS] = MODE(OPERAND_MEMORY)
+};
+
+typedef struct {
+    Program *program;
+    size_t code_capacity;
+    size_t line_offset; // Of the line being assembled.
+    size_t data_capacity;
+    size_t symbol_capacity;
+
+    VarTable labels;
+    size_t *addresses; // By label, NO_ADDRESS until it's defined.
+    bool *in_code;
+    size_t label_capacity;
+
+    // Instructions waiting for a label's address, their operand is the
+    // label until then.
+    size_t *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+} Assembler;
+
+const char *mnemonic_name(Mnemonic mnemonic) {
+    return mnemonics[mnemonic];
+}
+
+static bool same_word(char *a, const char *b) {
+    for (; *a != '\0' && *b != '\0'; a++, b++) {
+        if (tolower((unsigned char)*a) != *b)
+            return false;
+    }
+
+    return *a == *b;
+}
+
+// Splits off the next word of the line.
+static char *next_word(char **cursor) {
+    char *word = *cursor;
+
+    while (*word == ' ' || *word == '\t' || *word == '\r')
+        word++;
+
+    if (*word == '\0')
+        return NULL;
+
+    char *end = word;
+
+    while (*end != '\0' && *end != ' ' && *end != '\t' && *end != '\r')
+        end++;
+
+    *cursor = *end == '\0' ? end : end + 1;
+    *end = '\0';
+    return word;
+}
+
+// The table only borrows names, and the line they're in is reused.
+static size_t label_id(Assembler *as, char *name) {
+    const size_t count = as->labels.count;
+    const size_t id = intern_var(&as->labels, "", name);
+
+    if (as->labels.count > count)
+        as->labels.keys[id].name = mystrdup(name);
+
+    if (id >= as->label_capacity) {
+        const size_t old = as->label_capacity;
+        as->label_capacity = as->labels.capacity;
+        as->addresses = realloc(as->addresses, as->label_capacity * sizeof(size_t));
+        as->in_code = realloc(as->in_code, as->label_capacity * sizeof(bool));
+
+        for (size_t i = old; i < as->label_capacity; i++)
+            as->addresses[i] = NO_ADDRESS;
+    }
+
+    return id;
+}
+
+static bool define_label(Assembler *as, char *name, bool in_code) {
+    const size_t id = label_id(as, name);
+    Program *program = as->program;
+
+    if (as->addresses[id] != NO_ADDRESS)
+        return false;
+
+    as->addresses[id] = in_code ? program->code_count : program->data_count;
+    as->in_code[id] = in_code;
+
+    if (program->symbol_count == as->symbol_capacity) {
+        as->symbol_capacity *= 2;
+        program->symbols = realloc(program->symbols, as->symbol_capacity * sizeof(Symbol));
+    }
+
+    program->symbols[program->symbol_count++] = (Symbol){ .name = mystrdup(name), .address = as->addresses[id], .in_code = in_code,
+        .subroutine = false };
+    return true;
+}
+
+static void push_data(Assembler *as, int64_t word) {
+    Program *program = as->program;
+
+    if (program->data_count == as->data_capacity) {
+        as->data_capacity *= 2;
+        program->data = realloc(program->data, as->data_capacity * sizeof(int64_t));
+    }
+
+    program->data[program->data_count++] = word;
+}
+
+static bool parse_int(char *word, int64_t *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(word, &end, 10);
+    return end != word && *end == '\0' && errno == 0;
+}
+
+// A string the way mas reads it, with the escapes the lexer lets through.
+static bool push_string(Assembler *as, char *str) {
+    const size_t len = strlen(str);
+
+    if (len < 2 || str[0] != '"' || str[len - 1] != '"')
+        return false;
+
+    for (size_t i = 1; i < len - 1; i++) {
+        char c = str[i];
+
+        if (c == '\\') {
+            switch (str[++i]) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = '\0'; break;
+                case '\'':
+                case '"':
+                case '\\':
+                    c = str[i];
+                    break;
+                default: return false;
+            }
+        }
+
+        push_data(as, (unsigned char)c);
+    }
+
+    push_data(as, 0);
+    return true;
+}
+
+static bool assemble_data(Assembler *as, char *line) {
+    char *name = next_word(&line);
+
+    if (name == NULL)
+        return true;
+    else if (name[0] != '_' || !define_label(as, name, false))
+        return false;
+
+    char *kind = next_word(&line);
+    int64_t value;
+
+    if (kind == NULL)
+        return true;
+    else if (same_word(kind, "res")) {
+        char *size = next_word(&line);
+
+        if (size == NULL || !parse_int(size, &value) || value < 0 || next_word(&line) != NULL)
+            return false;
+
+        // The label holds the address of the buffer right after it.
+        push_data(as, as->program->data_count + 1);
+
+        for (int64_t i = 0; i < value; i++)
+            push_data(as, 0);
+
+        return true;
+    } else if (!same_word(kind, "dat"))
+        return false;
+
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    char *end = line + strlen(line);
+
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        *--end = '\0';
+
+    if (*line == '"')
+        return push_string(as, line);
+    else if (!parse_int(line, &value))
+        return false;
+
+    push_data(as, value);
+    return true;
+}
+
+static Mnemonic find_mnemonic(char *word) {
+    Mnemonic mnemonic = 0;
+
+    while (mnemonic < INS_COUNT && !same_word(word, mnemonics[mnemonic]))
+        mnemonic++;
+
+    return mnemonic;
+}
+
+static bool add_instruction(Assembler *as, Mnemonic mnemonic, char *operand) {
+    Instruction ins = (Instruction){ .mnemonic = mnemonic, .mode = OPERAND_ACC, .operand = 0 };
+
+    if (operand == NULL)
+        ins.mode = OPERAND_ACC;
+    else if (strcmp(operand, "^") == 0)
+        ins.mode = OPERAND_STACK;
+    else if (operand[0] == '_') {
+        // The mode depends on where the label ends up.
+        ins.operand = label_id(as, operand);
+
+        if (as->fixup_count == as->fixup_capacity) {
+            as->fixup_capacity *= 2;
+            as->fixups = realloc(as->fixups, as->fixup_capacity * sizeof(size_t));
+        }
+
+        as->fixups[as->fixup_count++] = as->program->code_count;
+    } else if (parse_int(operand, &ins.operand))
+        ins.mode = OPERAND_INT;
+    else
+        return false;
+
+    if ((operand == NULL || operand[0] != '_') && !(allowed_modes[mnemonic] & MODE(ins.mode)))
+        return false;
+
+    Program *program = as->program;
+
+    if (program->code_count == as->code_capacity) {
+        as->code_capacity *= 2;
+        program->code = realloc(program->code, as->code_capacity * sizeof(Instruction));
+        program->offsets = realloc(program->offsets, as->code_capacity * sizeof(size_t));
+    }
+
+    program->offsets[program->code_count] = as->line_offset;
+    program->code[program->code_count++] = ins;
+    return true;
+}
+
+static bool assemble_text(Assembler *as, char *line) {
+    char *word = next_word(&line);
+
+    if (word != NULL && word[0] == '_') {
+        if (!define_label(as, word, true))
+            return false;
+
+        word = next_word(&line);
+
+        if (word != NULL && same_word(word, "dsr")) {
+            as->program->symbols[as->program->symbol_count - 1].subroutine = true;
+            word = next_word(&line);
+        }
+    }
+
+    // Inline asm blocks keep all of their instructions on one line, the
+    // word after a mnemonic is its operand unless it's another one.
+    while (word != NULL) {
+        const Mnemonic mnemonic = find_mnemonic(word);
+        char *operand = next_word(&line);
+        char *next = NULL;
+
+        if (mnemonic == INS_COUNT)
+            return false;
+        else if (operand != NULL && find_mnemonic(operand) != INS_COUNT) {
+            next = operand;
+            operand = NULL;
+        } else if (operand != NULL)
+            next = next_word(&line);
+
+        if (!add_instruction(as, mnemonic, operand))
+            return false;
+
+        word = next;
+    }
+
+    return true;
+}
+
+static AsmStatus resolve_labels(Assembler *as, char **undefined) {
+    for (size_t i = 0; i < as->fixup_count; i++) {
+        Instruction *ins = &as->program->code[as->fixups[i]];
+        const size_t id = (size_t)ins->operand;
+
+        if (as->addresses[id] == NO_ADDRESS) {
+            *undefined = mystrdup(as->labels.keys[id].name);
+            return ASM_UNDEFINED_LABEL;
+        }
+
+        ins->mode = as->in_code[id] ? OPERAND_CODE : OPERAND_MEMORY;
+        ins->operand = (int64_t)as->addresses[id];
+
+        if (!(allowed_modes[ins->mnemonic] & MODE(ins->mode)))
+            return ASM_UNSUPPORTED;
+    }
+
+    return ASM_OK;
+}
+
+AsmStatus assemble(FILE *src, Program *program, char **undefined) {
+    *program = (Program){ .code = malloc(64 * sizeof(Instruction)), .offsets = malloc(64 * sizeof(size_t)), .code_count = 0,
+        .data = malloc(64 * sizeof(int64_t)), .data_count = 0, .symbols = malloc(64 * sizeof(Symbol)), .symbol_count = 0 };
+    *undefined = NULL;
+
+    Assembler as = (Assembler){ .program = program, .code_capacity = 64, .line_offset = 0, .data_capacity = 64, .symbol_capacity = 64, .labels = create_var_table(),
+        .addresses = NULL, .in_code = NULL, .label_capacity = 0, .fixups = malloc(64 * sizeof(size_t)), .fixup_count = 0,
+        .fixup_capacity = 64 };
+
+    bool in_data = false;
+    AsmStatus status = ASM_OK;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t offset = 0;
+    ssize_t len;
+
+    // A line at a time, so only the program is held and not its source.
+    while (status == ASM_OK && (len = getline(&line, &line_size, src)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        char *start = line;
+        as.line_offset = offset;
+        offset += (size_t)len;
+
+        while (*start == ' ' || *start == '\t')
+            start++;
+
+        if (same_word(start, ".text") || same_word(start, ".data"))
+            in_data = tolower((unsigned char)start[1]) == 'd';
+        else if (!(in_data ? assemble_data(&as, line) : assemble_text(&as, line)))
+            status = ASM_UNSUPPORTED;
+    }
+
+    free(line);
+
+    if (status == ASM_OK)
+        status = resolve_labels(&as, undefined);
+
+    for (size_t i = 0; i < as.labels.count; i++)
+        free(as.labels.keys[i].name);
+
+    delete_var_table(&as.labels);
+    free(as.addresses);
+    free(as.in_code);
+    free(as.fixups);
+
+    if (status != ASM_OK)
+        delete_program(program);
+
+    return status;
+}
+
+void delete_program(Program *program) {
+    for (size_t i = 0; i < program->symbol_count; i++)
+        free(program->symbols[i].name);
+
+    free(program->code);
+    free(program->offsets);
+    free(program->data);
+    free(program->symbols);
+    *program = (Program){ .code = NULL, .offsets = NULL, .code_count = 0, .data = NULL, .data_count = 0, .symbols = NULL, .symbol_count = 0 };
+}
+
+static void write_word(FILE *out, uint64_t word, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        fputc((int)((word >> (i * 8)) & 0xff), out);
+}
+
+static bool read_word(FILE *in, uint64_t *word, int bytes) {
+    *word = 0;
+
+    for (int i = 0; i < bytes; i++) {
+        const int c = fgetc(in);
+
+        if (c == EOF)
+            return false;
+
+        *word |= (uint64_t)c << (i * 8);
+    }
+
+    return true;
+}
+
+bool write_binary(Program *program, FILE *out) {
+    fputs(BINARY_MAGIC, out);
+    write_word(out, program->code_count, 8);
+    write_word(out, program->data_count, 8);
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        const Instruction *ins = &program->code[i];
+        write_word(out, ins->mnemonic, 1);
+        write_word(out, ins->mode, 1);
+        write_word(out, (uint64_t)ins->operand, 8);
+    }
+
+    for (size_t i = 0; i < program->data_count; i++)
+        write_word(out, (uint64_t)program->data[i], 8);
+
+    return !ferror(out);
+}
+
+// Everything the emulator trusts is checked, the operands of memory and
+// code addresses have to be in the program. A label can be defined at
+// the very end, so the address right after the last one is allowed.
+bool read_binary(FILE *in, Program *program) {
+    *program = (Program){ .code = NULL, .offsets = NULL, .code_count = 0, .data = NULL, .data_count = 0, .symbols = NULL, .symbol_count = 0 };
+    char magic[sizeof(BINARY_MAGIC) - 1];
+    uint64_t code_count;
+    uint64_t data_count;
+
+    if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, BINARY_MAGIC, sizeof(magic)) != 0
+        || !read_word(in, &code_count, 8) || !read_word(in, &data_count, 8))
+        return false;
+
+    // The counts aren't trusted with an allocation until that much is read.
+    size_t code_capacity = 64;
+    size_t data_capacity = 64;
+    program->code = malloc(code_capacity * sizeof(Instruction));
+    program->data = malloc(data_capacity * sizeof(int64_t));
+
+    for (uint64_t i = 0; i < code_count; i++) {
+        uint64_t mnemonic;
+        uint64_t mode;
+        uint64_t operand;
+
+        if (!read_word(in, &mnemonic, 1) || !read_word(in, &mode, 1) || !read_word(in, &operand, 8) || mnemonic >= INS_COUNT
+            || mode > OPERAND_CODE || !(allowed_modes[mnemonic] & MODE(mode))
+            || (mode == OPERAND_MEMORY && operand > data_count) || (mode == OPERAND_CODE && operand > code_count)) {
+            delete_program(program);
+            return false;
+        }
+
+        if (program->code_count == code_capacity) {
+            code_capacity *= 2;
+            program->code = realloc(program->code, code_capacity * sizeof(Instruction));
+        }
+
+        program->code[program->code_count++] = (Instruction){ .mnemonic = (Mnemonic)mnemonic, .mode = (OperandMode)mode,
+            .operand = (int64_t)operand };
+    }
+
+    for (uint64_t i = 0; i < data_count; i++) {
+        uint64_t word;
+
+        if (!read_word(in, &word, 8)) {
+            delete_program(program);
+            return false;
+        }
+
+        if (program->data_count == data_capacity) {
+            data_capacity *= 2;
+            program->data = realloc(program->data, data_capacity * sizeof(int64_t));
+        }
+
+        program->data[program->data_count++] = (int64_t)word;
+    }
+
+    if (fgetc(in) != EOF) {
+        delete_program(program);
+        return false;
+    }
+
+    return true;
+}
\ No newline at end of file
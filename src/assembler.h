@@ -0,0 +1,110 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Numbered the way binaries store them, new ones go at the end.
+typedef enum {
+    INS_LDA,
+    INS_STA,
+    INS_REF,
+    INS_LDD,
+    INS_STD,
+    INS_SWP,
+    INS_ADD,
+    INS_SUB,
+    INS_MUL,
+    INS_DIV,
+    INS_MOD,
+    INS_SHL,
+    INS_SHR,
+    INS_AND,
+    INS_OR,
+    INS_XOR,
+    INS_NOT,
+    INS_NEG,
+    INS_PSH,
+    INS_POP,
+    INS_CMP,
+    INS_SEQ,
+    INS_SNE,
+    INS_SLT,
+    INS_SLE,
+    INS_SGT,
+    INS_SGE,
+    INS_BEQ,
+    INS_BNE,
+    INS_BLT,
+    INS_BLE,
+    INS_BGT,
+    INS_BGE,
+    INS_JMP,
+    INS_CSR,
+    INS_RSR,
+    INS_HLT,
+    INS_OPC,
+    INS_OPI,
+    INS_IPS,
+    INS_COUNT
+} Mnemonic;
+
+typedef enum {
+    OPERAND_ACC,    // Nothing written, the accumulator.
+    OPERAND_INT,
+    OPERAND_MEMORY, // A data address.
+    OPERAND_STACK,  // ^, the top of the stack.
+    OPERAND_CODE    // Where to jump or call to.
+} OperandMode;
+
+typedef struct {
+    Mnemonic mnemonic;
+    OperandMode mode;
+    int64_t operand;
+} Instruction;
+
+typedef struct {
+    char *name;
+    size_t address;
+    bool in_code;
+    bool subroutine; // Declared with dsr.
+} Symbol;
+
+// Code and data are addressed separately, both from 0, and the program
+// starts at the first instruction.
+typedef struct {
+    Instruction *code;
+    size_t *offsets; // Where the line of each instruction starts in the source.
+    size_t code_count;
+    int64_t *data;
+    size_t data_count;
+    Symbol *symbols; // In the order they're defined.
+    size_t symbol_count;
+} Program;
+
+typedef enum {
+    ASM_OK,
+    ASM_UNSUPPORTED, // Left for mas, like instructions the backend never writes.
+    ASM_UNDEFINED_LABEL
+} AsmStatus;
+
+// Assembles the backend's output from src, read from where it is. The
+// name of an undefined label is given back in undefined for the caller
+// to free.
+AsmStatus assemble(FILE *src, Program *program, char **undefined);
+void delete_program(Program *program);
+
+// A Minstral binary, every number little endian: the magic, the code and
+// data counts in 8 bytes each, every instruction as its mnemonic and mode
+// in a byte each and the operand in 8, then the data words in 8 each.
+// Labels are already resolved, so only what the emulator needs is kept.
+#define BINARY_MAGIC "MIN\x01"
+
+bool write_binary(Program *program, FILE *out);
+// False if in isn't a binary write_binary could have written.
+bool read_binary(FILE *in, Program *program);
+const char *mnemonic_name(Mnemonic mnemonic);
+
+#endif
\ No newline at end of file
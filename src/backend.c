@@ -0,0 +1,149 @@
+#include "backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+const Backend backends[TARGET_COUNT] = {
+    [TARGET_MINSTRAL] = { .name = "minstral", .emit_program = NULL, .source_extension = NULL },
+    [TARGET_X86_64] = { .name = "x86-64", .emit_program = emit_x86_64, .source_extension = NULL },
+    [TARGET_C] = { .name = "c", .emit_program = emit_c, .source_extension = "c" }
+};
+
+// TARGET_COUNT if there's no such target.
+Target find_target(char *name) {
+    Target target = 0;
+
+    while (target < TARGET_COUNT && strcmp(backends[target].name, name) != 0)
+        target++;
+
+    return target;
+}
+
+bool open_sink(Sink *sink, FILE *out, bool uppercase) {
+    *sink = (Sink){ .sections = { out, tmpfile(), tmpfile() }, .sizes = { 0 }, .uppercase = uppercase, .marks = { NULL },
+        .mark_counts = { 0 }, .mark_capacities = { 0 } };
+
+    if (sink->sections[SECT_SUBROUTINES] != NULL && sink->sections[SECT_DATA] != NULL)
+        return true;
+
+    for (Section s = SECT_SUBROUTINES; s < SECT_COUNT; s++) {
+        if (sink->sections[s] != NULL)
+            fclose(sink->sections[s]);
+    }
+
+    return false;
+}
+
+void sink_write(Sink *sink, Section section, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+
+    if (!sink->uppercase) {
+        sink->sizes[section] += vfprintf(sink->sections[section], format, args);
+        va_end(args);
+        return;
+    }
+
+    // Most lines fit, inline assembly and long strings might not.
+    char buffer[256];
+    va_list copy;
+    va_copy(copy, args);
+    const int len = vsnprintf(buffer, sizeof(buffer), format, args);
+    char *text = buffer;
+
+    if ((size_t)len >= sizeof(buffer)) {
+        text = malloc(len + 1);
+        vsnprintf(text, len + 1, format, copy);
+    }
+
+    va_end(copy);
+    va_end(args);
+
+    for (int i = 0; i < len; i++) {
+        if (isalpha(text[i]) && text[i] <= 'z')
+            text[i] = toupper(text[i]);
+    }
+
+    fwrite(text, 1, len, sink->sections[section]);
+    sink->sizes[section] += len;
+
+    if (text != buffer)
+        free(text);
+}
+
+static bool same_location(Location *a, Location *b) {
+    return a->ln == b->ln && a->col == b->col && strcmp(a->file, b->file) == 0;
+}
+
+// What's written to the section from here on came from loc, until the
+// next mark.
+void sink_mark(Sink *sink, Section section, Location *loc) {
+    size_t *count = &sink->mark_counts[section];
+    SourceMark *last = *count > 0 ? &sink->marks[section][*count - 1] : NULL;
+
+    if (last != NULL && last->offset == sink->sizes[section]) {
+        // Nothing was written for the one before.
+        last->loc = *loc;
+        return;
+    } else if (last != NULL && same_location(&last->loc, loc))
+        return;
+
+    if (*count == sink->mark_capacities[section]) {
+        sink->mark_capacities[section] = *count == 0 ? 64 : *count * 2;
+        sink->marks[section] = realloc(sink->marks[section], sink->mark_capacities[section] * sizeof(SourceMark));
+    }
+
+    sink->marks[section][(*count)++] = (SourceMark){ .offset = sink->sizes[section], .loc = *loc };
+}
+
+// Moves the marks of a section onto the text's, after what's there.
+static void move_marks(Sink *sink, Section section) {
+    for (size_t i = 0; i < sink->mark_counts[section]; i++) {
+        SourceMark mark = sink->marks[section][i];
+        mark.offset += sink->sizes[SECT_TEXT];
+
+        if (sink->mark_counts[SECT_TEXT] == sink->mark_capacities[SECT_TEXT]) {
+            sink->mark_capacities[SECT_TEXT] = sink->mark_counts[SECT_TEXT] == 0 ? 64 : sink->mark_counts[SECT_TEXT] * 2;
+            sink->marks[SECT_TEXT] = realloc(sink->marks[SECT_TEXT], sink->mark_capacities[SECT_TEXT] * sizeof(SourceMark));
+        }
+
+        sink->marks[SECT_TEXT][sink->mark_counts[SECT_TEXT]++] = mark;
+    }
+
+    sink->mark_counts[section] = 0;
+}
+
+static void copy_section(Sink *sink, Section section) {
+    FILE *temp = sink->sections[section];
+    char buffer[4096];
+    size_t len;
+
+    rewind(temp);
+
+    while ((len = fread(buffer, 1, sizeof(buffer), temp)) > 0)
+        fwrite(buffer, 1, len, sink->sections[SECT_TEXT]);
+
+    fclose(temp);
+}
+
+// Puts the subroutines and data after the text.
+void finish_sink(Sink *sink) {
+    move_marks(sink, SECT_SUBROUTINES);
+    copy_section(sink, SECT_SUBROUTINES);
+
+    if (sink->sizes[SECT_DATA] > 0)
+        sink_write(sink, SECT_TEXT, ".data\n");
+
+    copy_section(sink, SECT_DATA);
+}
+
+void delete_sink_marks(Sink *sink) {
+    for (Section s = 0; s < SECT_COUNT; s++) {
+        free(sink->marks[s]);
+        sink->marks[s] = NULL;
+        sink->mark_counts[s] = sink->mark_capacities[s] = 0;
+    }
+}
\ No newline at end of file
@@ -2,7 +2,69 @@
 #define BACKEND_H
 
 #include "ir.h"
+#include "assembler.h"
+#include <stdio.h>
+#include <stdbool.h>
 
-char *emit_asm(IR *ir);
+typedef enum {
+    SECT_TEXT,
+    SECT_SUBROUTINES,
+    SECT_DATA,
+    SECT_COUNT
+} Section;
+
+// Where the code for an op starts in the output.
+typedef struct {
+    size_t offset;
+    Location loc;
+} SourceMark;
+
+// Where the backend writes to. The text goes straight to the output
+// file, the subroutines and data wait in temporary files until
+// finish_sink() copies them after it, so nothing is held in memory.
+// Marks are kept by section the same way and all end up in the text's.
+typedef struct {
+    FILE *sections[SECT_COUNT];
+    size_t sizes[SECT_COUNT];
+    bool uppercase;
+
+    SourceMark *marks[SECT_COUNT];
+    size_t mark_counts[SECT_COUNT];
+    size_t mark_capacities[SECT_COUNT];
+} Sink;
+
+bool open_sink(Sink *sink, FILE *out, bool uppercase);
+void sink_write(Sink *sink, Section section, const char *format, ...);
+void sink_mark(Sink *sink, Section section, Location *loc);
+void finish_sink(Sink *sink);
+void delete_sink_marks(Sink *sink);
+
+// libs is the omitted library code, or NULL if it's in the program.
+void emit_asm(IR *ir, IR *libs, Sink *sink);
+
+typedef enum {
+    TARGET_MINSTRAL,
+    TARGET_X86_64,
+    TARGET_C,
+    TARGET_COUNT
+} Target;
+
+struct SourceMap;
+
+// Every target starts from the Minstral assembly. The others translate
+// the assembled program, so inline asm works the same everywhere, into
+// an executable or a source file that cc builds. Runtime errors are
+// reported at the line map gives, or against file, like the emulator.
+typedef struct {
+    const char *name;
+    bool (*emit_program)(Program *program, char *file, struct SourceMap *map, FILE *out); // NULL for Minstral, mas builds those.
+    char *source_extension; // NULL if what's emitted is the executable.
+} Backend;
+
+extern const Backend backends[TARGET_COUNT];
+
+Target find_target(char *name);
+bool emit_x86_64(Program *program, char *file, struct SourceMap *map, FILE *out);
+bool emit_c(Program *program, char *file, struct SourceMap *map, FILE *out);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include "../backend.h"
+#include "../assembler.h"
+#include "../source_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <ctype.h>
+
+#define SLACK_WORDS 1024
+#define VALUE_STACK_WORDS 65536
+#define NO_FUNCTION ((size_t)-1)
+
+// Every subroutine becomes a function, and the code before the first
+// one is main(). The accumulator, flags and stack pointer are locals so
+// the C compiler can keep them in registers, and go through globals
+// across calls since subroutines share them. Data cells that are only
+// ever named become their own globals, anything whose address is taken
+// stays in mem[] where pointers work like they do in the VM.
+typedef struct {
+    Program *program;
+    char *file;
+    SourceMap *map;
+    FILE *out;
+    bool *entry;     // By instruction, starts a function.
+    bool *target;    // By instruction, jumped to.
+    size_t *function; // The entry of the function each instruction is in, NO_FUNCTION for main.
+    bool *scalar;    // By data cell.
+    const char **names; // A symbol for every instruction and cell, NULL if there isn't one.
+    const char **data_names;
+} Translation;
+
+static bool is_branch(Mnemonic mnemonic) {
+    return mnemonic >= INS_BEQ && mnemonic <= INS_BGE;
+}
+
+static const char *relation(Mnemonic mnemonic) {
+    switch (mnemonic) {
+        case INS_SEQ: case INS_BEQ: return "==";
+        case INS_SNE: case INS_BNE: return "!=";
+        case INS_SLT: case INS_BLT: return "<";
+        case INS_SLE: case INS_BLE: return "<=";
+        case INS_SGT: case INS_BGT: return ">";
+        default: return ">=";
+    }
+}
+
+static void find_functions(Translation *t) {
+    Program *program = t->program;
+
+    for (size_t i = 0; i < program->symbol_count; i++) {
+        Symbol *symbol = &program->symbols[i];
+
+        if (symbol->in_code) {
+            t->names[symbol->address] = symbol->name;
+            t->entry[symbol->address] |= symbol->subroutine;
+        } else
+            t->data_names[symbol->address] = symbol->name;
+    }
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        Instruction *ins = &program->code[i];
+
+        if (ins->mnemonic == INS_CSR)
+            t->entry[ins->operand] = true;
+        else if (ins->mode == OPERAND_CODE)
+            t->target[ins->operand] = true;
+    }
+
+    size_t function = NO_FUNCTION;
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        if (t->entry[i])
+            function = i;
+
+        t->function[i] = function;
+    }
+}
+
+// A cell can be its own global if it's a whole symbol by itself and
+// nothing takes its address.
+static void find_scalars(Translation *t) {
+    Program *program = t->program;
+    bool *addressed = calloc(program->data_count + 1, sizeof(bool));
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        Instruction *ins = &program->code[i];
+
+        if ((ins->mnemonic == INS_REF || ins->mnemonic == INS_IPS) && ins->mode == OPERAND_MEMORY)
+            addressed[ins->operand] = true;
+    }
+
+    for (size_t i = 0; i < program->data_count; i++) {
+        const bool alone = i + 1 == program->data_count || t->data_names[i + 1] != NULL;
+        t->scalar[i] = t->data_names[i] != NULL && alone && !addressed[i];
+    }
+
+    free(addressed);
+}
+
+static char *operand_text(Translation *t, Instruction *ins, char *buffer) {
+    switch (ins->mode) {
+        case OPERAND_ACC:
+            return "acc";
+        case OPERAND_INT:
+            if (ins->operand == INT64_MIN)
+                return "INT64_MIN";
+
+            sprintf(buffer, "INT64_C(%" PRId64 ")", ins->operand);
+            return buffer;
+        case OPERAND_MEMORY:
+            sprintf(buffer, t->scalar[ins->operand] ? "v%" PRId64 : "mem[%" PRId64 "]", ins->operand);
+            return buffer;
+        case OPERAND_STACK:
+            return "stack[sp - 1]";
+        default: break;
+    }
+
+    return "0";
+}
+
+// The runtime error for a division at address, as a C string literal.
+static void write_error(Translation *t, size_t address, const char *what) {
+    char *message = runtime_error(t->map, t->file, address, what);
+
+    fputc('"', t->out);
+
+    for (char *c = message; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\')
+            fprintf(t->out, "\\%c", *c);
+        else if (isprint((unsigned char)*c))
+            fputc(*c, t->out);
+        else
+            fprintf(t->out, "\\%03o", (unsigned char)*c);
+    }
+
+    fputc('"', t->out);
+    free(message);
+}
+
+// Jumps within the function are gotos. One to the start of another
+// subroutine is a tail call, anywhere else in one can't be done in C.
+static bool write_jump(Translation *t, size_t function, size_t to) {
+    FILE *out = t->out;
+
+    if (to == t->program->code_count)
+        fprintf(out, "HALT();\n");
+    else if (t->function[to] == function && !(t->entry[to] && to != function))
+        fprintf(out, "goto l%zu;\n", to);
+    else if (!t->entry[to])
+        return false;
+    else if (function == NO_FUNCTION)
+        fprintf(out, "{ CALL(f%zu); HALT(); }\n", to);
+    else
+        fprintf(out, "{ SAVE(); f%zu(); return; }\n", to);
+
+    return true;
+}
+
+static bool write_instruction(Translation *t, size_t i) {
+    Instruction *ins = &t->program->code[i];
+    FILE *out = t->out;
+    char buffer[64];
+    const char *x = operand_text(t, ins, buffer);
+
+    fprintf(out, "    ");
+
+    switch (ins->mnemonic) {
+        case INS_LDA: fprintf(out, "acc = %s;\n", x); break;
+        case INS_STA: fprintf(out, "%s = acc;\n", x); break;
+        case INS_REF: fprintf(out, "acc = %" PRId64 ";\n", ins->operand); break;
+        case INS_LDD: fprintf(out, "acc = mem[%s];\n", x); break;
+        case INS_STD: fprintf(out, "mem[%s] = acc;\n", x); break;
+        case INS_SWP: fprintf(out, "{ int64_t t = %s; %s = acc; acc = t; }\n", x, x); break;
+        case INS_ADD: fprintf(out, "acc = (int64_t)((uint64_t)acc + (uint64_t)%s);\n", x); break;
+        case INS_SUB: fprintf(out, "acc = (int64_t)((uint64_t)acc - (uint64_t)%s);\n", x); break;
+        case INS_MUL: fprintf(out, "acc = (int64_t)((uint64_t)acc * (uint64_t)%s);\n", x); break;
+        case INS_DIV:
+        case INS_MOD:
+            fprintf(out, "acc = %s(acc, %s, ", ins->mnemonic == INS_DIV ? "mb_div" : "mb_mod", x);
+            write_error(t, i, "division by zero");
+            fprintf(out, ");\n");
+            break;
+        case INS_SHL: fprintf(out, "acc = (int64_t)((uint64_t)acc << (%s & 63));\n", x); break;
+        case INS_SHR: fprintf(out, "acc >>= (%s & 63);\n", x); break;
+        case INS_AND: fprintf(out, "acc &= %s;\n", x); break;
+        case INS_OR: fprintf(out, "acc |= %s;\n", x); break;
+        case INS_XOR: fprintf(out, "acc ^= %s;\n", x); break;
+        case INS_NOT: fprintf(out, "acc = ~%s;\n", x); break;
+        case INS_NEG: fprintf(out, "acc = (int64_t)(0 - (uint64_t)%s);\n", x); break;
+        case INS_PSH: fprintf(out, "stack[sp] = %s; sp++;\n", x); break;
+        case INS_POP: fprintf(out, "%s = stack[--sp];\n", x); break;
+        case INS_CMP: fprintf(out, "fa = acc; fo = %s;\n", x); break;
+        case INS_SEQ:
+        case INS_SNE:
+        case INS_SLT:
+        case INS_SLE:
+        case INS_SGT:
+        case INS_SGE:
+            fprintf(out, "acc = fo %s fa;\n", relation(ins->mnemonic));
+            break;
+        case INS_CSR: fprintf(out, "CALL(f%" PRId64 ");\n", ins->operand); break;
+        case INS_RSR:
+            // Returning from main ends the program.
+            fprintf(out, t->function[i] == NO_FUNCTION ? "HALT();\n" : "SAVE(); return;\n");
+            break;
+        case INS_HLT: fprintf(out, "HALT();\n"); break;
+        case INS_OPC: fprintf(out, "putchar((int)(%s & 0xff));\n", x); break;
+        case INS_OPI: fprintf(out, "printf(\"%%\" PRId64, %s);\n", x); break;
+        case INS_IPS: fprintf(out, "read_line(%" PRId64 ");\n", ins->operand); break;
+        case INS_JMP: return write_jump(t, t->function[i], (size_t)ins->operand);
+        default:
+            if (!is_branch(ins->mnemonic))
+                return false;
+
+            fprintf(out, "if (fo %s fa) ", relation(ins->mnemonic));
+            return write_jump(t, t->function[i], (size_t)ins->operand);
+    }
+
+    return true;
+}
+
+static void write_prelude(Translation *t) {
+    Program *program = t->program;
+    FILE *out = t->out;
+    size_t initialized = program->data_count;
+
+    while (initialized > 0 && (program->data[initialized - 1] == 0 || t->scalar[initialized - 1]))
+        initialized--;
+
+    fprintf(out, "// Generated by mbc.\n"
+                 "#include <stdio.h>\n"
+                 "#include <stdlib.h>\n"
+                 "#include <stdint.h>\n"
+                 "#include <inttypes.h>\n\n"
+                 "#define LOAD() int64_t acc = g_acc, fa = g_fa, fo = g_fo; size_t sp = g_sp\n"
+                 "#define SAVE() (g_acc = acc, g_fa = fa, g_fo = fo, g_sp = sp)\n"
+                 "#define CALL(f) do { SAVE(); f(); acc = g_acc; fa = g_fa; fo = g_fo; sp = g_sp; } while (0)\n"
+                 "#define HALT() do { fflush(stdout); exit(0); } while (0)\n\n"
+                 "static int64_t mem[%zu] = {", program->data_count + SLACK_WORDS);
+
+    for (size_t i = 0; i < initialized; i++)
+        fprintf(out, "%s%" PRId64 ",", i % 16 == 0 ? "\n    " : " ", t->scalar[i] ? 0 : program->data[i]);
+
+    fprintf(out, "\n};\n\n");
+
+    for (size_t i = 0; i < program->data_count; i++) {
+        if (t->scalar[i])
+            fprintf(out, "static int64_t v%zu = %" PRId64 "; // %s\n", i, program->data[i], t->data_names[i]);
+    }
+
+    fprintf(out, "\nstatic int64_t stack[%d];\n"
+                 "static int64_t g_acc, g_fa, g_fo;\n"
+                 "static size_t g_sp;\n\n"
+                 "static void read_line(int64_t address) {\n"
+                 "    int c;\n"
+                 "    fflush(stdout);\n\n"
+                 "    while ((c = getchar()) != EOF && c != '\\n')\n"
+                 "        mem[address++] = c;\n\n"
+                 "    mem[address] = 0;\n"
+                 "}\n\n"
+                 "static void divide_by_zero(const char *error) {\n"
+                 "    fflush(stdout);\n"
+                 "    fputs(error, stderr);\n"
+                 "    exit(1);\n"
+                 "}\n\n"
+                 "// Dividing by 0 or the most negative number by -1 is undefined in C.\n"
+                 "static inline int64_t mb_div(int64_t a, int64_t b, const char *error) {\n"
+                 "    if (b == 0)\n"
+                 "        divide_by_zero(error);\n\n"
+                 "    return b == -1 ? (int64_t)(0 - (uint64_t)a) : a / b;\n"
+                 "}\n\n"
+                 "static inline int64_t mb_mod(int64_t a, int64_t b, const char *error) {\n"
+                 "    if (b == 0)\n"
+                 "        divide_by_zero(error);\n\n"
+                 "    return b == -1 ? 0 : a %% b;\n"
+                 "}\n\n", VALUE_STACK_WORDS);
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        if (t->entry[i])
+            fprintf(out, "static void f%zu(void); // %s\n", i, t->names[i] != NULL ? t->names[i] : "");
+    }
+}
+
+// main() runs from the start to the first subroutine.
+static bool write_function(Translation *t, size_t start, size_t function) {
+    Program *program = t->program;
+    FILE *out = t->out;
+    size_t end = start;
+
+    if (function == NO_FUNCTION)
+        fprintf(out, "\nint main(void) {\n");
+    else {
+        fprintf(out, "\nstatic void f%zu(void) {\n", start);
+        end++;
+    }
+
+    fprintf(out, "    LOAD();\n");
+
+    while (end < program->code_count && !t->entry[end])
+        end++;
+
+    for (size_t i = start; i < end; i++) {
+        if (t->target[i])
+            fprintf(out, "l%zu:;\n", i);
+
+        if (!write_instruction(t, i))
+            return false;
+    }
+
+    // Falling off the end runs into whatever is next.
+    const Mnemonic last = end > start ? program->code[end - 1].mnemonic : INS_COUNT;
+
+    if (last != INS_JMP && last != INS_RSR && last != INS_HLT) {
+        fprintf(out, "    ");
+        write_jump(t, function, end);
+    }
+
+    fprintf(out, "}\n");
+    return true;
+}
+
+// Portable C11 that does what the program does on the VM.
+bool emit_c(Program *program, char *file, SourceMap *map, FILE *out) {
+    const size_t code_count = program->code_count + 1;
+    Translation t = (Translation){ .program = program, .file = file, .map = map, .out = out, .entry = calloc(code_count, sizeof(bool)),
+        .target = calloc(code_count, sizeof(bool)), .function = malloc(code_count * sizeof(size_t)),
+        .scalar = calloc(program->data_count + 1, sizeof(bool)), .names = calloc(code_count, sizeof(char *)),
+        .data_names = calloc(program->data_count + 1, sizeof(char *)) };
+
+    find_functions(&t);
+    find_scalars(&t);
+    write_prelude(&t);
+
+    bool ok = write_function(&t, 0, NO_FUNCTION);
+
+    for (size_t i = 0; i < program->code_count && ok; i++) {
+        if (t.entry[i])
+            ok = write_function(&t, i, i);
+    }
+
+    free(t.entry);
+    free(t.target);
+    free(t.function);
+    free(t.scalar);
+    free(t.names);
+    free(t.data_names);
+    return ok && !ferror(out);
+}
\ No newline at end of file
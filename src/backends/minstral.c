@@ -1,6 +1,10 @@
 #include "../backend.h"
 #include "../ir.h"
 #include "../utils.h"
+#include "../cfg.h"
+#include "../alias.h"
+#include "../cost.h"
+#include "../assembler.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,460 +13,659 @@
 #include <stdint.h>
 #include <inttypes.h>
 
-#define STARTING_SECT_CAP 128
-#define STARTING_VAR_CAP 8
-#define TABLE_SIZE 1000
+#define STARTING_TABLE_CAP 64
+#define MAX_LOWERING 2
+#define ACC_OPERAND ((OpValue){ .type = VAL_NONE })
 
+// One of the ways to write an op, an operand of VAL_NONE is the
+// accumulator.
 typedef struct {
-    Source source;
-    char *name;
-    bool used;
-} Variable;
-
-static Variable variables[TABLE_SIZE];
-static char *data_sect;
-static size_t data_sect_size = 0;
-static size_t data_sect_cap = STARTING_SECT_CAP;
-static size_t data_sect_count = 0;
-
-static char *subroutines;
-static size_t subroutines_size = 0;
-static size_t subroutines_cap = STARTING_SECT_CAP;
-
-void data_sect_append(char *data) {
-    const size_t len = strlen(data);
-
-    if (data_sect_size + len + 1 >= data_sect_cap) {
-        data_sect_cap *= 2;
-        data_sect = realloc(data_sect, data_sect_cap);
+    Mnemonic mnemonics[MAX_LOWERING];
+    OpValue operands[MAX_LOWERING];
+    size_t count;
+} Lowering;
+
+// The label is the scope and name run together, that's what has to be
+// unique in the assembly.
+typedef struct {
+    char *label;
+    uint32_t hash;
+    size_t id;
+} Entry;
+
+// Open addressing with linear probing, NULL labels are empty slots.
+typedef struct {
+    Entry *entries;
+    size_t count;
+    size_t capacity;
+} Table;
+
+static Table variables;
+static Table strings; // Each literal is only written once.
+static bool pool_strings;
+static size_t string_count;
+
+// Code goes to the text until a subroutine starts.
+static Section code_sect = SECT_TEXT;
+
+static uint32_t hash_FNV1a(uint32_t h, const char *data) {
+    for (; *data != '\0'; data++) {
+        h ^= (unsigned char)*data;
+        h *= 16777619;
     }
 
-    strcat(data_sect, data);
-    data_sect_size += len;
+    return h;
 }
 
-void subroutines_append(char *data) {
-    const size_t len = strlen(data);
-
-    if (subroutines_size + len + 1 >= subroutines_cap) {
-        subroutines_cap *= 2;
-        subroutines = realloc(subroutines, subroutines_cap);
-    }
+static uint32_t hash_key(char *scope, char *name) {
+    return hash_FNV1a(hash_FNV1a(2166136261UL, scope), name);
+}
 
-    strcat(subroutines, data);
-    subroutines_size += len;
+static bool is_label(char *label, char *scope, char *name) {
+    const size_t len = strlen(scope);
+    return strncmp(label, scope, len) == 0 && strcmp(label + len, name) == 0;
 }
 
-uint32_t hash_FNV1a(const char *data, size_t size) {
-    uint32_t h = 2166136261UL;
+// The entry's slot, or the empty one it would go in.
+static Entry *find_entry(Table *table, char *scope, char *name, uint32_t hash) {
+    size_t i = hash & (table->capacity - 1);
 
-    for (size_t i = 0; i < size; i++) {
-        h ^= data[i];
-        h *= 16777619;
-    }
+    while (table->entries[i].label != NULL && (table->entries[i].hash != hash || !is_label(table->entries[i].label, scope, name)))
+        i = (i + 1) & (table->capacity - 1);
 
-    return h % TABLE_SIZE;
+    return &table->entries[i];
 }
 
-Variable *find_variable(Source *source, char *name) {
-    char *data = malloc(strlen(source->scope) + strlen(name) + 2);
-    sprintf(data, "_%s%s", source->scope, name);
-    Variable *var = &variables[hash_FNV1a(data, strlen(data))];
-    free(data);
-    return var;
+static Table create_table() {
+    return (Table){ .entries = calloc(STARTING_TABLE_CAP, sizeof(Entry)), .count = 0, .capacity = STARTING_TABLE_CAP };
 }
 
-bool variable_exists(Source *source, char *name) {
-    return find_variable(source, name)->used;
+static void delete_table(Table *table) {
+    for (size_t i = 0; i < table->capacity; i++)
+        free(table->entries[i].label);
+
+    free(table->entries);
 }
 
-void add_variable(Source *source, char *name) {
-    Variable *var = find_variable(source, name);
-    assert(!var->used);
-    var->name = name;
-    var->used = true;
+static void grow_table(Table *table) {
+    Entry *old = table->entries;
+    const size_t old_cap = table->capacity;
 
-    char *data = malloc(strlen(source->scope) + strlen(name) + 15);
-    sprintf(data, "_%s%s dat 0\n", source->scope, name);
+    table->capacity *= 2;
+    table->entries = calloc(table->capacity, sizeof(Entry));
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].label == NULL)
+            continue;
+
+        size_t k = old[i].hash & (table->capacity - 1);
+
+        while (table->entries[k].label != NULL)
+            k = (k + 1) & (table->capacity - 1);
+
+        table->entries[k] = old[i];
+    }
 
-    data_sect_append(data);
-    free(data);
+    free(old);
 }
 
-size_t get_string(char *str) {
-    char *data = malloc(strlen(str) + 32);
-    sprintf(data, "_@c%zu dat \"%s\"\n", data_sect_count, str);
-    data_sect_append(data);
-    free(data);
-    return data_sect_count++;
+// Returns the new entry, or NULL if it's already there.
+static Entry *add_entry(Table *table, char *scope, char *name) {
+    // Kept under half full so probes stay short.
+    if ((table->count + 1) * 2 > table->capacity)
+        grow_table(table);
+
+    const uint32_t hash = hash_key(scope, name);
+    Entry *entry = find_entry(table, scope, name, hash);
+
+    if (entry->label != NULL)
+        return NULL;
+
+    entry->label = malloc(strlen(scope) + strlen(name) + 1);
+    sprintf(entry->label, "%s%s", scope, name);
+    entry->hash = hash;
+    entry->id = table->count++;
+    return entry;
 }
 
-char *emit_stmt(Op *op);
+bool variable_exists(Source *source, char *name) {
+    return find_entry(&variables, source->scope, name, hash_key(source->scope, name))->label != NULL;
+}
 
-char *emit_asm(IR *ir) {
-    size_t capacity = STARTING_SECT_CAP;
-    char *code = malloc(STARTING_SECT_CAP);
-    strcpy(code, ".text\n");
-    size_t code_len = 6;
+void add_variable(Sink *sink, Source *source, char *name) {
+    Entry *var = add_entry(&variables, source->scope, name);
+    assert(var != NULL);
 
-    data_sect = malloc(STARTING_SECT_CAP);
-    data_sect[0] = '\0';
-    data_sect_count = 0;
+    if (var != NULL)
+        sink_write(sink, SECT_DATA, "_%s%s dat 0\n", source->scope, name);
+}
 
-    subroutines = malloc(STARTING_SECT_CAP);
-    subroutines[0] = '\0';
-    
-    bool in_subroutine = false;
+size_t get_string(Sink *sink, char *str) {
+    if (pool_strings) {
+        Entry *entry = add_entry(&strings, "", str);
 
-    for (size_t i = 0; i < ir->op_count; i++) {
-        char *stmt = emit_stmt(&ir->ops[i]);
+        if (entry == NULL)
+            return find_entry(&strings, "", str, hash_key("", str))->id;
+    }
 
+    sink_write(sink, SECT_DATA, "_@c%zu dat \"%s\"\n", string_count, str);
+    return string_count++;
+}
+
+static void add_subroutines(Table *table, IR *ir) {
+    for (size_t i = 0; i < ir->op_count; i++) {
         if (ir->ops[i].type == OP_FUNC_BEGIN)
-            in_subroutine = true;
+            add_entry(table, "", ir->ops[i].src.ident);
+    }
+}
 
-        if (in_subroutine) {
-            subroutines_append(stmt);
-            free(stmt);
+// Whether the ops from start up to end can write to a string literal.
+// Calling a subroutine whose code isn't known counts as a write.
+static bool writes_strings(IR *ir, AliasInfo *alias, size_t start, size_t end, Table *known) {
+    AliasTracker tracker = create_alias_tracker(alias);
+    bool written = false;
+
+    for (size_t i = start; i < end && !written; i++) {
+        Op *op = &ir->ops[i];
+
+        if (op->type == OP_FUNC_BEGIN || op->type == OP_FUNC_END || op->type == OP_NEW_BRANCH)
+            reset_alias_tracker(&tracker);
+        else if (op->type == OP_STORE_DEREF) {
+            const size_t region = address_region(&tracker, op);
+            written = region == ANY_REGION || region == alias->string_region;
+        } else if (op->type == OP_INLINE_ASM)
+            written = strstr(op->src.string, "std") != NULL;
+        else if (op->type == OP_CALL)
+            written = find_entry(known, "", op->src.ident, hash_key("", op->src.ident))->label == NULL;
+
+        track_op(&tracker, op);
+    }
+
+    delete_alias_tracker(&tracker);
+    return written;
+}
 
-            if (ir->ops[i].type == OP_FUNC_END)
-                in_subroutine = false;
-            
+// Marks the library subroutines called from start up to end, by the
+// index of their OP_FUNC_BEGIN.
+static void mark_library_calls(IR *whole, size_t lib_start, bool *called, size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+        if (whole->ops[i].type != OP_CALL)
             continue;
+
+        for (size_t k = lib_start; k < whole->op_count; k++) {
+            if (whole->ops[k].type == OP_FUNC_BEGIN && strcmp(whole->ops[k].src.ident, whole->ops[i].src.ident) == 0)
+                called[k] = true;
         }
+    }
+}
+
+// Only the library subroutines the program can end up calling matter,
+// print() leaves its string alone even though stringrev() doesn't.
+static bool library_writes_strings(IR *whole, size_t lib_start, AliasInfo *alias, Table *known) {
+    bool *called = calloc(whole->op_count + 1, sizeof(bool));
+    bool *scanned = calloc(whole->op_count + 1, sizeof(bool));
+    bool written = false;
+    bool changed = true;
+
+    mark_library_calls(whole, lib_start, called, 0, lib_start);
+
+    while (changed && !written) {
+        changed = false;
 
-        // Yeahhh I don't wanna call strlen() a billion times.
-        const size_t stmt_len = strlen(stmt);
+        for (size_t i = lib_start; i < whole->op_count && !written; i++) {
+            if (!called[i] || scanned[i])
+                continue;
 
-        // Extra +4 for "hlt\n"
-        if (code_len + stmt_len + 5 >= capacity) {
-            while (code_len + stmt_len + 5 >= capacity)
-                capacity *= 2;
+            size_t end = i;
 
-            code = realloc(code, capacity);
+            while (end < whole->op_count && whole->ops[end].type != OP_FUNC_END)
+                end++;
+
+            written = writes_strings(whole, alias, i, end, known);
+            mark_library_calls(whole, lib_start, called, i, end);
+            scanned[i] = changed = true;
         }
+    }
+
+    free(scanned);
+    free(called);
+    return written;
+}
 
-        strcat(code, stmt);
-        free(stmt);
-        code_len += stmt_len;
+// Literals can only share a label when nothing can write to them, like
+// stringrev() on a literal would. The omitted library's parameters get
+// their values from the program, so the two are looked at as one.
+static bool strings_may_change(IR *ir, IR *libs) {
+    IR whole = *ir;
+
+    if (libs != NULL) {
+        whole.op_count = ir->op_count + libs->op_count;
+        whole.ops = malloc((whole.op_count + 1) * sizeof(Op));
+        memcpy(whole.ops, ir->ops, ir->op_count * sizeof(Op));
+        memcpy(whole.ops + ir->op_count, libs->ops, libs->op_count * sizeof(Op));
     }
 
-    strcat(code, "hlt\n");
-    code_len += 4;
+    VarTable vars = create_var_table();
+    AliasInfo alias = build_alias_info(&whole, &vars);
+    Table known = create_table();
 
-    code = realloc(code, code_len + subroutines_size + 1);
-    strcat(code, subroutines);
-    free(subroutines);
-    code_len += subroutines_size;
+    add_subroutines(&known, &whole);
+    bool written = writes_strings(&whole, &alias, 0, ir->op_count, &known);
 
-    if (data_sect_size > 0) {
-        code = realloc(code, (code_len + data_sect_size + 7));
-        strcat(code, ".data\n");
-        strcat(code, data_sect);
-    }
+    if (!written && libs != NULL)
+        written = library_writes_strings(&whole, ir->op_count, &alias, &known);
+
+    if (libs != NULL)
+        free(whole.ops);
 
-    free(data_sect);
-    return code;
+    delete_table(&known);
+    delete_alias_info(&alias);
+    delete_var_table(&vars);
+    return written;
 }
 
-static char *value_to_string(OpValue *value) {
-    char *code;
+void emit_stmt(Sink *sink, Op *op);
+
+void emit_asm(IR *ir, IR *libs, Sink *sink) {
+    sink_write(sink, SECT_TEXT, ".text\n");
+    variables = create_table();
+    strings = create_table();
+    pool_strings = !strings_may_change(ir, libs);
+    string_count = 0;
+    code_sect = SECT_TEXT;
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type == OP_FUNC_BEGIN)
+            code_sect = SECT_SUBROUTINES;
+
+        if (ir->ops[i].loc.file != NULL)
+            sink_mark(sink, code_sect, &ir->ops[i].loc);
+
+        emit_stmt(sink, &ir->ops[i]);
 
+        if (ir->ops[i].type == OP_FUNC_END)
+            code_sect = SECT_TEXT;
+    }
+
+    sink_write(sink, SECT_TEXT, "hlt\n");
+    delete_table(&variables);
+    delete_table(&strings);
+}
+
+static void emit_value(Sink *sink, Section section, OpValue *value) {
     switch (value->type) {
         case VAL_INT:
-            code = malloc(32);
-            sprintf(code, "%" PRId64, value->int_const);
-            return code;
-        case VAL_STRING:
-            code = malloc(32);
-            sprintf(code, "_@c%zu", get_string(value->string));
-            return code;
+            sink_write(sink, section, "%" PRId64, value->int_const);
+            return;
+        case VAL_STRING: {
+            const size_t id = get_string(sink, value->string);
+            sink_write(sink, section, "_@c%zu", id);
+            return;
+        }
         case VAL_VAR:
-            code = malloc(strlen(value->source.scope) + strlen(value->var) + 3);
-            sprintf(code, "_%s%s", value->source.scope, value->var);
-            return code;
+            sink_write(sink, section, "_%s%s", value->source.scope, value->var);
+            return;
         case VAL_RET:
-            code = malloc(strlen(value->source.func) + 6);
-            sprintf(code, "_%s@ret", value->source.func);
-            return code;
+            sink_write(sink, section, "_%s@ret", value->source.func);
+            return;
         case VAL_REG:
             assert(value->reg == TEMP_REG);
-            return calloc(1, sizeof(char));
-        case VAL_STACK: return mystrdup("^");
+            return;
+        case VAL_STACK:
+            sink_write(sink, section, "^");
+            return;
         case VAL_BRANCH:
-            code = malloc(strlen(value->source.func) + 32);
-            sprintf(code, "_%s@l%u", value->source.func, value->branch);
-            return code;
+            sink_write(sink, section, "_%s@l%u", value->source.func, value->branch);
+            return;
         case VAL__RES__:
-            code = malloc(32);
-            sprintf(code, "res %" PRId64, value->int_const);
-            return code;
+            sink_write(sink, section, "res %" PRId64, value->int_const);
+            return;
         default: break;
     }
 
     assert(false);
-    return calloc(1, sizeof(char));
 }
 
-char *emit_func_begin(Op *op) {
+// An instruction with its operand, which is empty for the accumulator.
+static void emit_insn(Sink *sink, const char *mnemonic, OpValue *value) {
+    sink_write(sink, code_sect, "%s ", mnemonic);
+    emit_value(sink, code_sect, value);
+    sink_write(sink, code_sect, "\n");
+}
+
+static Lowering lowering(size_t count, Mnemonic first, OpValue operand) {
+    return (Lowering){ .mnemonics = { first }, .operands = { operand }, .count = count };
+}
+
+static unsigned int lowering_cost(Lowering *lowering) {
+    unsigned int total = 0;
+
+    for (size_t i = 0; i < lowering->count; i++)
+        total += insn_cost(lowering->mnemonics[i], lowering->operands[i].type != VAL_NONE);
+
+    return total;
+}
+
+// Writes the cheapest under the cost table, the first of equals.
+static void emit_cheapest(Sink *sink, Lowering *lowerings, size_t count) {
+    Lowering *best = &lowerings[0];
+
+    for (size_t i = 1; i < count; i++) {
+        if (lowering_cost(&lowerings[i]) < lowering_cost(best))
+            best = &lowerings[i];
+    }
+
+    for (size_t i = 0; i < best->count; i++) {
+        if (best->operands[i].type == VAL_NONE)
+            sink_write(sink, code_sect, "%s\n", mnemonic_name(best->mnemonics[i]));
+        else
+            emit_insn(sink, mnemonic_name(best->mnemonics[i]), &best->operands[i]);
+    }
+}
+
+void emit_func_begin(Sink *sink, Op *op) {
     // Return value.
     char *ret_var = malloc(strlen(op->src.ident) + 6);
     sprintf(ret_var, "%s@ret", op->src.ident);
-    add_variable(&op->src.source, ret_var);
+    add_variable(sink, &op->src.source, ret_var);
     free(ret_var);
 
-    char *code = malloc(strlen(op->src.ident) + 11);
-    sprintf(code, "_%s dsr\n", op->src.ident);
-    return code;
+    sink_write(sink, code_sect, "_%s dsr\n", op->src.ident);
 }
 
-char *emit_new_var(Op *op) {
-    add_variable(&op->src.source, op->src.var);
-    return calloc(1, sizeof(char));
+void emit_new_var(Sink *sink, Op *op) {
+    add_variable(sink, &op->src.source, op->src.var);
 }
 
-char *emit_ref(Op *op) {
-    char *src = value_to_string(&op->src);
-    char *code = malloc(strlen(src) + 8);
-    sprintf(code, "ref %s\n", src);
-    free(src);
-    return code;
+void emit_ref(Sink *sink, Op *op) {
+    emit_insn(sink, "ref", &op->src);
 }
 
-char *emit_load(Op *op) {
+void emit_load(Sink *sink, Op *op) {
     if (op->src.type == VAL_REG && op->src.reg == TEMP_REG)
-        return calloc(1, sizeof(char));
+        return;
     else if (op->src.type == VAL_STRING)
-        return emit_ref(op);
-
-    char *src = value_to_string(&op->src);
-    char *code = malloc(strlen(src) + 8);
-    sprintf(code, "lda %s\n", src);
-    free(src);
-    return code;
+        emit_ref(sink, op);
+    else if (op->src.type == VAL_INT && op->src.int_const == 0) {
+        // The accumulator xored with itself is 0 too.
+        Lowering lowerings[] = { lowering(1, INS_LDA, op->src), lowering(1, INS_XOR, ACC_OPERAND) };
+        emit_cheapest(sink, lowerings, 2);
+    } else
+        emit_insn(sink, "lda", &op->src);
 }
 
-char *emit__res__(Op *op) {
+void emit__res__(Sink *sink, Op *op) {
     assert(op->dst.type == VAL_VAR);
 
-    char *var = value_to_string(&op->dst);
-    char *res = value_to_string(&op->src);
-
-    char *code = malloc(strlen(var) + strlen(res) + 3);
-    sprintf(code, "%s %s\n", var, res);
-
-    free(var);
-    free(res);
-
-    data_sect_append(code);
-    free(code);
-    return calloc(1, sizeof(char));
+    emit_value(sink, SECT_DATA, &op->dst);
+    sink_write(sink, SECT_DATA, " ");
+    emit_value(sink, SECT_DATA, &op->src);
+    sink_write(sink, SECT_DATA, "\n");
 }
 
-char *emit_store(Op *op) {
+void emit_store(Sink *sink, Op *op) {
     if (op->src.type == VAL__RES__)
-        return emit__res__(op);
-
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
-    sprintf(code, "sta %s\n", dst);
-    free(dst);
-    return code;
+        emit__res__(sink, op);
+    else
+        emit_insn(sink, "sta", &op->dst);
 }
 
-char *emit_call(Op *op) {
-    char *code = malloc(strlen(op->src.ident) + 11);
-    sprintf(code, "csr _%s\n", op->src.ident);
-    return code;
+void emit_call(Sink *sink, Op *op) {
+    sink_write(sink, code_sect, "csr _%s\n", op->src.ident);
 }
 
-char *emit_inline_asm(Op *op) {
+void emit_inline_asm(Sink *sink, Op *op) {
     const size_t len = strlen(op->src.string);
 
-    if (len == 0)
-        return calloc(1, sizeof(char));
-    else if (op->src.string[len - 1] == '\n')
-        return mystrdup(op->src.string);
-
-    char *copy = malloc(len + 2);
-    sprintf(copy, "%s\n", op->src.string);
-    return copy;
+    if (len > 0)
+        sink_write(sink, code_sect, "%s%s", op->src.string, op->src.string[len - 1] == '\n' ? "" : "\n");
 }
 
-char *emit_push(Op *op) {
-    char *src = value_to_string(&op->src);
-    char *code = malloc(strlen(src) + 8);
-    sprintf(code, "psh %s\n", src);
-    free(src);
-    return code;
+void emit_push(Sink *sink, Op *op) {
+    emit_insn(sink, "psh", &op->src);
 }
 
-char *emit_pop(Op *op) {
+void emit_pop(Sink *sink, Op *op) {
     if (op->dst.type == VAL_REG && op->dst.reg == TEMP_REG)
-        return mystrdup("pop\n");
+        sink_write(sink, code_sect, "pop\n");
+    else
+        emit_insn(sink, "pop", &op->dst);
+}
 
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
-    sprintf(code, "pop %s\n", dst);
-    free(dst);
-    return code;
+// Constants that make the op do nothing, or something an instruction
+// without an operand does, have other ways to write it.
+static void emit_math_const(Sink *sink, Op *op, Mnemonic mnemonic) {
+    const int64_t n = op->src.int_const;
+    const bool power_of_two = n > 2 && (n & (n - 1)) == 0;
+    Lowering lowerings[3];
+    size_t count = 0;
+
+    lowerings[count++] = lowering(1, mnemonic, op->src);
+
+    switch (op->type) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_OR:
+        case OP_XOR:
+            if (n == 0)
+                lowerings[count++] = lowering(0, INS_LDA, ACC_OPERAND);
+            break;
+        case OP_SHL:
+        case OP_SHR:
+            if ((n & 63) == 0)
+                lowerings[count++] = lowering(0, INS_LDA, ACC_OPERAND);
+            break;
+        case OP_AND:
+            if (n == -1)
+                lowerings[count++] = lowering(0, INS_LDA, ACC_OPERAND);
+            else if (n == 0)
+                lowerings[count++] = lowering(1, INS_XOR, ACC_OPERAND);
+            break;
+        case OP_MUL:
+            if (n == 0)
+                lowerings[count++] = lowering(1, INS_XOR, ACC_OPERAND);
+            else if (n == 1)
+                lowerings[count++] = lowering(0, INS_LDA, ACC_OPERAND);
+            else if (n == -1)
+                lowerings[count++] = lowering(1, INS_NEG, ACC_OPERAND);
+            else if (n == 2)
+                lowerings[count++] = lowering(1, INS_ADD, ACC_OPERAND);
+            else if (power_of_two) {
+                int k = 0;
+
+                while ((INT64_C(1) << k) != n)
+                    k++;
+
+                lowerings[count++] = lowering(1, INS_SHL, (OpValue){ .type = VAL_INT, .int_const = k });
+            }
+            break;
+        case OP_DIV:
+            if (n == 1)
+                lowerings[count++] = lowering(0, INS_LDA, ACC_OPERAND);
+            else if (n == -1)
+                lowerings[count++] = lowering(1, INS_NEG, ACC_OPERAND);
+            break;
+        case OP_MOD:
+            if (n == 1 || n == -1)
+                lowerings[count++] = lowering(1, INS_XOR, ACC_OPERAND);
+            break;
+        default: break;
+    }
+
+    emit_cheapest(sink, lowerings, count);
 }
 
-char *emit_math(Op *op) {
+void emit_math(Sink *sink, Op *op) {
     // Value is already loaded in the accumulator,
     // alter the top of stack directly.
     if (op->src.type == VAL_REG && op->src.reg == TEMP_REG && op->dst.type == VAL_STACK)
         op->src.type = VAL_STACK;
 
-    char *src = value_to_string(&op->src);
-    char *code = malloc(strlen(src) + 8);
+    Mnemonic mnemonic;
 
     switch (op->type) {
         case OP_ADD:
-            sprintf(code, "add %s\n", src);
+            mnemonic = INS_ADD;
             break;
         case OP_SUB:
-            sprintf(code, "sub %s\n", src);
+            mnemonic = INS_SUB;
             break;
         case OP_MUL:
-            sprintf(code, "mul %s\n", src);
+            mnemonic = INS_MUL;
             break;
         case OP_DIV:
-            sprintf(code, "div %s\n", src);
+            mnemonic = INS_DIV;
             break;
         case OP_MOD:
-            sprintf(code, "mod %s\n", src);
+            mnemonic = INS_MOD;
             break;
         case OP_SHL:
-            sprintf(code, "shl %s\n", src);
+            mnemonic = INS_SHL;
             break;
         case OP_SHR:
-            sprintf(code, "shr %s\n", src);
+            mnemonic = INS_SHR;
             break;
         case OP_AND:
-            sprintf(code, "and %s\n", src);
+            mnemonic = INS_AND;
             break;
         case OP_OR:
-            sprintf(code, "or %s\n", src);
+            mnemonic = INS_OR;
             break;
         case OP_XOR:
-            sprintf(code, "xor %s\n", src);
+            mnemonic = INS_XOR;
             break;
         case OP_NOT:
-            if (op->src.type == VAL_REG && op->src.reg == TEMP_REG)
-                strcpy(code, "not\n");
-            else
-                sprintf(code, "not %s\n", src);
+            mnemonic = INS_NOT;
             break;
         default:
-            if (op->src.type == VAL_REG && op->src.reg == TEMP_REG)
-                strcpy(code, "neg\n");
-            else
-                sprintf(code, "neg %s\n", src);
+            mnemonic = INS_NEG;
             break;
     }
 
-    free(src);
-    return code;
+    // Not and neg on the accumulator don't take an operand at all.
+    if ((op->type == OP_NOT || op->type == OP_NEG) && op->src.type == VAL_REG && op->src.reg == TEMP_REG)
+        sink_write(sink, code_sect, "%s\n", mnemonic_name(mnemonic));
+    else if (op->src.type == VAL_INT)
+        emit_math_const(sink, op, mnemonic);
+    else
+        emit_insn(sink, mnemonic_name(mnemonic), &op->src);
 }
 
-char *emit_swp(Op *op) {
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
-    sprintf(code, "swp %s\n", dst);
-    free(dst);
-    return code;
+void emit_swp(Sink *sink, Op *op) {
+    emit_insn(sink, "swp", &op->dst);
 }
 
-char *emit_compare(Op *op) {
-    char *src = value_to_string(&op->src);
-    char *code = malloc(strlen(src) + 8);
-    sprintf(code, "cmp %s\n", src);
-    free(src);
-    return code;
+void emit_compare(Sink *sink, Op *op) {
+    emit_insn(sink, "cmp", &op->src);
 }
 
-char *emit_status(Op *op) {
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
+void emit_status(Sink *sink, Op *op) {
+    const char *mnemonic;
 
     switch (op->type) {
         case OP_EQ:
-            sprintf(code, "seq %s\n", dst);
+            mnemonic = "seq";
             break;
         case OP_NEQ:
-            sprintf(code, "sne %s\n", dst);
+            mnemonic = "sne";
             break;
         case OP_LT:
-            sprintf(code, "slt %s\n", dst);
+            mnemonic = "slt";
             break;
         case OP_LTE:
-            sprintf(code, "sle %s\n", dst);
+            mnemonic = "sle";
             break;
         case OP_GT:
-            sprintf(code, "sgt %s\n", dst);
+            mnemonic = "sgt";
             break;
         default:
-            sprintf(code, "sge %s\n", dst);
+            mnemonic = "sge";
             break;
     }
 
-    free(dst);
-    return code;
+    emit_insn(sink, mnemonic, &op->dst);
 }
 
-char *emit_branch_bool(Op *op) {
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 16);
-    sprintf(code, "cmp 0\n"
-                  "b%s %s\n", op->type == OP_BRANCH_TRUE ? "ne" : "eq", dst);
+void emit_branch_bool(Sink *sink, Op *op) {
+    sink_write(sink, code_sect, "cmp 0\n");
+    emit_insn(sink, op->type == OP_BRANCH_TRUE ? "bne" : "beq", &op->dst);
+}
+
+// Branches on the flags of the last compare.
+void emit_branch_cond(Sink *sink, Op *op) {
+    const char *mnemonic;
 
-    free(dst);
-    return code;
+    switch (op->type) {
+        case OP_BRANCH_EQ:
+            mnemonic = "beq";
+            break;
+        case OP_BRANCH_NEQ:
+            mnemonic = "bne";
+            break;
+        case OP_BRANCH_LT:
+            mnemonic = "blt";
+            break;
+        case OP_BRANCH_LTE:
+            mnemonic = "ble";
+            break;
+        case OP_BRANCH_GT:
+            mnemonic = "bgt";
+            break;
+        default:
+            mnemonic = "bge";
+            break;
+    }
+
+    emit_insn(sink, mnemonic, &op->dst);
 }
 
-char *emit_new_branch(Op *op) {
-    char *code = malloc(strlen(op->src.source.func) + 32);
-    sprintf(code, "_%s@l%u\n", op->src.source.func, op->src.branch);
-    return code;
+void emit_new_branch(Sink *sink, Op *op) {
+    sink_write(sink, code_sect, "_%s@l%u\n", op->src.source.func, op->src.branch);
 }
 
-char *emit_jump(Op *op) {
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
-    sprintf(code, "jmp %s\n", dst);
-    free(dst);
-    return code;
+void emit_jump(Sink *sink, Op *op) {
+    emit_insn(sink, "jmp", &op->dst);
 }
 
-char *emit_deref(Op *op) {
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
-    sprintf(code, "ldd %s\n", dst);
-    free(dst);
-    return code;
+void emit_deref(Sink *sink, Op *op) {
+    emit_insn(sink, "ldd", &op->dst);
 }
 
-char *emit_store_deref(Op *op) {
-    char *dst = value_to_string(&op->dst);
-    char *code = malloc(strlen(dst) + 8);
-    sprintf(code, "std %s\n", dst);
-    free(dst);
-    return code;
+void emit_store_deref(Sink *sink, Op *op) {
+    emit_insn(sink, "std", &op->dst);
 }
 
-char *emit_stmt(Op *op) {
+void emit_stmt(Sink *sink, Op *op) {
     switch (op->type) {
         case OP_FUNC_END:
-        case OP_NOP: return calloc(1, sizeof(char));
-        case OP_FUNC_BEGIN: return emit_func_begin(op);
-        case OP_RET: return mystrdup("rsr\n");
-        case OP_NEW_VAR: return emit_new_var(op);
-        case OP_LOAD: return emit_load(op);
-        case OP_STORE: return emit_store(op);
-        case OP_CALL: return emit_call(op);
-        case OP_INLINE_ASM: return emit_inline_asm(op);
-        case OP_PUSH: return emit_push(op);
-        case OP_POP: return emit_pop(op);
+        case OP_NOP: break;
+        case OP_FUNC_BEGIN:
+            emit_func_begin(sink, op);
+            break;
+        case OP_RET:
+            sink_write(sink, code_sect, "rsr\n");
+            break;
+        case OP_NEW_VAR:
+            emit_new_var(sink, op);
+            break;
+        case OP_LOAD:
+            emit_load(sink, op);
+            break;
+        case OP_STORE:
+            emit_store(sink, op);
+            break;
+        case OP_CALL:
+            emit_call(sink, op);
+            break;
+        case OP_INLINE_ASM:
+            emit_inline_asm(sink, op);
+            break;
+        case OP_PUSH:
+            emit_push(sink, op);
+            break;
+        case OP_POP:
+            emit_pop(sink, op);
+            break;
         case OP_ADD:
         case OP_SUB:
         case OP_MUL:
@@ -474,25 +677,52 @@ char *emit_stmt(Op *op) {
         case OP_OR:
         case OP_XOR:
         case OP_NOT:
-        case OP_NEG: return emit_math(op);
-        case OP_SWP: return emit_swp(op);
-        case OP_COMPARE: return emit_compare(op);
+        case OP_NEG:
+            emit_math(sink, op);
+            break;
+        case OP_SWP:
+            emit_swp(sink, op);
+            break;
+        case OP_COMPARE:
+            emit_compare(sink, op);
+            break;
         case OP_EQ:
         case OP_NEQ:
         case OP_LT:
         case OP_LTE:
         case OP_GT:
-        case OP_GTE: return emit_status(op);
+        case OP_GTE:
+            emit_status(sink, op);
+            break;
         case OP_BRANCH_TRUE:
-        case OP_BRANCH_FALSE: return emit_branch_bool(op);
-        case OP_NEW_BRANCH: return emit_new_branch(op);
-        case OP_JUMP: return emit_jump(op);
-        case OP_REF: return emit_ref(op);
-        case OP_DEREF: return emit_deref(op);
-        case OP_STORE_DEREF: return emit_store_deref(op);
-        default: break;
+        case OP_BRANCH_FALSE:
+            emit_branch_bool(sink, op);
+            break;
+        case OP_BRANCH_EQ:
+        case OP_BRANCH_NEQ:
+        case OP_BRANCH_LT:
+        case OP_BRANCH_LTE:
+        case OP_BRANCH_GT:
+        case OP_BRANCH_GTE:
+            emit_branch_cond(sink, op);
+            break;
+        case OP_NEW_BRANCH:
+            emit_new_branch(sink, op);
+            break;
+        case OP_JUMP:
+            emit_jump(sink, op);
+            break;
+        case OP_REF:
+            emit_ref(sink, op);
+            break;
+        case OP_DEREF:
+            emit_deref(sink, op);
+            break;
+        case OP_STORE_DEREF:
+            emit_store_deref(sink, op);
+            break;
+        default:
+            assert(false);
+            break;
     }
-
-    assert(false);
-    return calloc(1, sizeof(char));
-}
\ No newline at end of file
+}
@@ -0,0 +1,567 @@
+#include "../backend.h"
+#include "../assembler.h"
+#include "../x86.h"
+#include "../source_map.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+
+#define TEXT_VADDR 0x400000
+#define DATA_VADDR 0x40000000
+#define HEADERS_SIZE (64 + 2 * 56)
+#define PAGE_SIZE 0x1000
+
+// Past the data, pointers that run a little off the end still land in
+// memory like they do in the VM.
+#define SLACK_WORDS 1024
+#define VALUE_STACK_WORDS 65536
+#define OUT_SIZE 4096
+
+// The accumulator is rax, r12 holds the address of the data and every
+// cell is 8 bytes from it. The value stack for psh and pop grows up
+// from rbx, apart from the call stack, since subroutines like push()
+// return with something still on it. cmp leaves its two sides in r13
+// and r14 for the branches and sets after it.
+typedef struct {
+    size_t stack;
+    size_t out;
+    size_t out_len;
+    size_t saved_rsp;
+    size_t size;
+} Layout;
+
+typedef struct {
+    Code code;
+    Layout layout;
+    char *file;
+    SourceMap *map;
+    size_t first; // Instruction i has label first + i.
+    size_t entry;
+    size_t halt;
+    size_t flush;
+    size_t putc;
+    size_t puti;
+    size_t gets;
+    size_t divide_by_zero;
+} Translation;
+
+static Layout layout_memory(Program *program) {
+    Layout layout;
+    layout.stack = (program->data_count + SLACK_WORDS) * 8;
+    layout.out = layout.stack + VALUE_STACK_WORDS * 8;
+    layout.out_len = layout.out + OUT_SIZE;
+    layout.saved_rsp = layout.out_len + 8;
+    layout.size = layout.saved_rsp + 8;
+    return layout;
+}
+
+static int32_t cell(int64_t address) {
+    return (int32_t)(address * 8);
+}
+
+// reg = the operand.
+static void load_operand(Code *code, int reg, Instruction *ins) {
+    switch (ins->mode) {
+        case OPERAND_ACC:
+            if (reg != RAX)
+                x86_rr(code, true, X86_LOAD, reg, RAX);
+            break;
+        case OPERAND_INT:
+            x86_mov_imm(code, reg, ins->operand);
+            break;
+        case OPERAND_MEMORY:
+            x86_mem(code, true, X86_LOAD, reg, R12, NO_INDEX, 1, cell(ins->operand));
+            break;
+        case OPERAND_STACK:
+            x86_mem(code, true, X86_LOAD, reg, RBX, NO_INDEX, 1, -8);
+            break;
+        default: assert(false);
+    }
+}
+
+// rax = rax op operand, straight from memory when it's there.
+static void math_operand(Code *code, uint32_t opcode, Instruction *ins) {
+    if (ins->mode == OPERAND_MEMORY)
+        x86_mem(code, true, opcode, RAX, R12, NO_INDEX, 1, cell(ins->operand));
+    else if (ins->mode == OPERAND_STACK)
+        x86_mem(code, true, opcode, RAX, RBX, NO_INDEX, 1, -8);
+    else if (ins->mode == OPERAND_ACC)
+        x86_rr(code, true, opcode, RAX, RAX);
+    else {
+        load_operand(code, RCX, ins);
+        x86_rr(code, true, opcode, RAX, RCX);
+    }
+}
+
+// The VM compares the operand against the accumulator.
+static Cond condition(Mnemonic mnemonic) {
+    switch (mnemonic) {
+        case INS_SEQ: case INS_BEQ: return CC_E;
+        case INS_SNE: case INS_BNE: return CC_NE;
+        case INS_SLT: case INS_BLT: return CC_L;
+        case INS_SLE: case INS_BLE: return CC_LE;
+        case INS_SGT: case INS_BGT: return CC_G;
+        default: return CC_GE;
+    }
+}
+
+// The error goes right after the call to divide_by_zero, which finds it
+// at the return address.
+static void put_error(Translation *t, size_t address, const char *what) {
+    char *message = runtime_error(t->map, t->file, address, what);
+    const size_t len = strlen(message);
+
+    put32(&t->code, (uint32_t)len);
+
+    for (size_t i = 0; i < len; i++)
+        put8(&t->code, (uint8_t)message[i]);
+
+    free(message);
+}
+
+static void translate_instruction(Translation *t, Instruction *ins, size_t address) {
+    Code *code = &t->code;
+
+    switch (ins->mnemonic) {
+        case INS_LDA:
+            load_operand(code, RAX, ins);
+            break;
+        case INS_STA:
+            x86_mem(code, true, X86_STORE, RAX, R12, NO_INDEX, 1, cell(ins->operand));
+            break;
+        case INS_REF:
+            x86_mov_imm(code, RAX, ins->operand);
+            break;
+        case INS_LDD:
+            if (ins->mode == OPERAND_MEMORY)
+                load_operand(code, RAX, ins);
+
+            x86_mem(code, true, X86_LOAD, RAX, R12, RAX, 8, 0);
+            break;
+        case INS_STD:
+            load_operand(code, RCX, ins);
+            x86_mem(code, true, X86_STORE, RAX, R12, RCX, 8, 0);
+            break;
+        case INS_SWP:
+            load_operand(code, RCX, ins);
+            x86_mem(code, true, X86_STORE, RAX, R12, NO_INDEX, 1, cell(ins->operand));
+            x86_rr(code, true, X86_LOAD, RAX, RCX);
+            break;
+        case INS_ADD: math_operand(code, X86_ADD, ins); break;
+        case INS_SUB: math_operand(code, X86_SUB, ins); break;
+        case INS_MUL: math_operand(code, X86_IMUL, ins); break;
+        case INS_AND: math_operand(code, X86_AND, ins); break;
+        case INS_OR: math_operand(code, X86_OR, ins); break;
+        case INS_XOR: math_operand(code, X86_XOR, ins); break;
+        case INS_DIV:
+        case INS_MOD: {
+            // idiv faults on 0 and on the most negative number over -1.
+            // The VM stops on the first, and over -1 it negates or gives 0.
+            const size_t nonzero = new_label(code);
+            const size_t divide = new_label(code);
+            const size_t done = new_label(code);
+
+            load_operand(code, RCX, ins);
+            x86_rr(code, true, X86_TEST, RCX, RCX);
+            x86_jcc(code, CC_NE, nonzero);
+            x86_call(code, t->divide_by_zero);
+            put_error(t, address, "division by zero");
+
+            place_label(code, nonzero);
+            x86_rr(code, true, X86_GROUP_IMM, 7, RCX);
+            put32(code, (uint32_t)-1);
+            x86_jcc(code, CC_NE, divide);
+
+            if (ins->mnemonic == INS_DIV)
+                x86_rr(code, true, X86_GROUP_UNARY, 3, RAX);
+            else
+                x86_rr(code, false, X86_XOR, RAX, RAX);
+
+            x86_jmp(code, done);
+
+            place_label(code, divide);
+            x86_cqo(code);
+            x86_rr(code, true, X86_GROUP_UNARY, 7, RCX);
+
+            if (ins->mnemonic == INS_MOD)
+                x86_rr(code, true, X86_LOAD, RAX, RDX);
+
+            place_label(code, done);
+            break;
+        }
+        case INS_SHL:
+        case INS_SHR:
+            load_operand(code, RCX, ins);
+            x86_rr(code, true, X86_GROUP_SHIFT, ins->mnemonic == INS_SHL ? 4 : 7, RAX);
+            break;
+        case INS_NOT:
+        case INS_NEG:
+            load_operand(code, RAX, ins);
+            x86_rr(code, true, X86_GROUP_UNARY, ins->mnemonic == INS_NOT ? 2 : 3, RAX);
+            break;
+        case INS_PSH: {
+            const int reg = ins->mode == OPERAND_ACC ? RAX : RCX;
+            load_operand(code, reg, ins);
+            x86_mem(code, true, X86_STORE, reg, RBX, NO_INDEX, 1, 0);
+            x86_mem(code, true, X86_LEA, RBX, RBX, NO_INDEX, 1, 8);
+            break;
+        }
+        case INS_POP:
+            x86_mem(code, true, X86_LEA, RBX, RBX, NO_INDEX, 1, -8);
+
+            if (ins->mode == OPERAND_ACC)
+                x86_mem(code, true, X86_LOAD, RAX, RBX, NO_INDEX, 1, 0);
+            else {
+                x86_mem(code, true, X86_LOAD, RCX, RBX, NO_INDEX, 1, 0);
+                x86_mem(code, true, X86_STORE, RCX, R12, NO_INDEX, 1, cell(ins->operand));
+            }
+            break;
+        case INS_CMP:
+            x86_rr(code, true, X86_LOAD, R13, RAX);
+            load_operand(code, R14, ins);
+            break;
+        case INS_SEQ:
+        case INS_SNE:
+        case INS_SLT:
+        case INS_SLE:
+        case INS_SGT:
+        case INS_SGE:
+            x86_rr(code, true, X86_CMP, R14, R13);
+            x86_setcc(code, condition(ins->mnemonic), RAX);
+            break;
+        case INS_BEQ:
+        case INS_BNE:
+        case INS_BLT:
+        case INS_BLE:
+        case INS_BGT:
+        case INS_BGE:
+            x86_rr(code, true, X86_CMP, R14, R13);
+            x86_jcc(code, condition(ins->mnemonic), t->first + (size_t)ins->operand);
+            break;
+        case INS_JMP:
+            x86_jmp(code, t->first + (size_t)ins->operand);
+            break;
+        case INS_CSR:
+            x86_call(code, t->first + (size_t)ins->operand);
+            break;
+        case INS_RSR:
+            x86_ret(code);
+            break;
+        case INS_HLT:
+            x86_jmp(code, t->halt);
+            break;
+        case INS_OPC:
+            load_operand(code, RDI, ins);
+            x86_call(code, t->putc);
+            break;
+        case INS_OPI:
+            load_operand(code, RDI, ins);
+            x86_call(code, t->puti);
+            break;
+        case INS_IPS:
+            x86_mov_imm(code, RDI, ins->operand);
+            x86_call(code, t->gets);
+            break;
+        default: assert(false);
+    }
+}
+
+// The runtime only has to keep rax, everything the program holds
+// between instructions is in rbx and r12 to r14.
+static void write_flush(Translation *t) {
+    Code *code = &t->code;
+    const int saved[] = { RAX, RCX, RDX, RSI, RDI, R11 };
+    const size_t done = new_label(code);
+
+    place_label(code, t->flush);
+
+    for (int i = 0; i < 6; i++)
+        x86_push(code, saved[i]);
+
+    x86_mem(code, true, X86_LOAD, RDX, R12, NO_INDEX, 1, (int32_t)t->layout.out_len);
+    x86_rr(code, true, X86_TEST, RDX, RDX);
+    x86_jcc(code, CC_E, done);
+    x86_mov_imm(code, RAX, 1); // write
+    x86_mov_imm(code, RDI, 1);
+    x86_mem(code, true, X86_LEA, RSI, R12, NO_INDEX, 1, (int32_t)t->layout.out);
+    x86_syscall(code);
+    x86_mem(code, true, X86_STORE_IMM, 0, R12, NO_INDEX, 1, (int32_t)t->layout.out_len);
+    put32(code, 0);
+
+    place_label(code, done);
+
+    for (int i = 5; i >= 0; i--)
+        x86_pop(code, saved[i]);
+
+    x86_ret(code);
+}
+
+// The character is in dil.
+static void write_putc(Translation *t) {
+    Code *code = &t->code;
+    const size_t done = new_label(code);
+
+    place_label(code, t->putc);
+    x86_mem(code, true, X86_LOAD, RCX, R12, NO_INDEX, 1, (int32_t)t->layout.out_len);
+    x86_mem(code, false, X86_STORE_BYTE, RDI, R12, RCX, 1, (int32_t)t->layout.out);
+    x86_rr(code, true, X86_GROUP_INC, 0, RCX);
+    x86_mem(code, true, X86_STORE, RCX, R12, NO_INDEX, 1, (int32_t)t->layout.out_len);
+    x86_rr(code, true, X86_GROUP_IMM, 7, RCX);
+    put32(code, OUT_SIZE);
+    x86_jcc(code, CC_B, done);
+    x86_call(code, t->flush);
+
+    place_label(code, done);
+    x86_ret(code);
+}
+
+// The integer is in rdi, its digits are built backwards on the stack.
+static void write_puti(Translation *t) {
+    Code *code = &t->code;
+    const size_t positive = new_label(code);
+    const size_t digits = new_label(code);
+    const size_t print = new_label(code);
+
+    place_label(code, t->puti);
+    x86_push(code, RAX);
+    x86_rr(code, true, X86_LOAD, RAX, RDI);
+    x86_rr(code, true, X86_LOAD, R8, RDI);
+    x86_rr(code, true, X86_GROUP_IMM, 5, RSP);
+    put32(code, 32);
+    x86_mem(code, true, X86_LEA, RSI, RSP, NO_INDEX, 1, 32);
+    x86_rr(code, true, X86_TEST, RAX, RAX);
+    x86_jcc(code, CC_NS, positive);
+    x86_rr(code, true, X86_GROUP_UNARY, 3, RAX);
+
+    // Divided unsigned, so the most negative number comes out right.
+    place_label(code, positive);
+    x86_mov_imm(code, RCX, 10);
+
+    place_label(code, digits);
+    x86_rr(code, false, X86_XOR, RDX, RDX);
+    x86_rr(code, true, X86_GROUP_UNARY, 6, RCX);
+    x86_rr(code, true, X86_GROUP_IMM, 0, RDX);
+    put32(code, '0');
+    x86_rr(code, true, X86_GROUP_INC, 1, RSI);
+    x86_mem(code, false, X86_STORE_BYTE, RDX, RSI, NO_INDEX, 1, 0);
+    x86_rr(code, true, X86_TEST, RAX, RAX);
+    x86_jcc(code, CC_NE, digits);
+    x86_rr(code, true, X86_TEST, R8, R8);
+    x86_jcc(code, CC_NS, print);
+    x86_rr(code, true, X86_GROUP_INC, 1, RSI);
+    x86_mem(code, false, 0xc6, 0, RSI, NO_INDEX, 1, 0);
+    put8(code, '-');
+
+    place_label(code, print);
+    x86_mem(code, false, X86_LOAD_BYTE, RDI, RSI, NO_INDEX, 1, 0);
+    x86_call(code, t->putc);
+    x86_rr(code, true, X86_GROUP_INC, 0, RSI);
+    x86_mem(code, true, X86_LEA, RDX, RSP, NO_INDEX, 1, 32);
+    x86_rr(code, true, X86_CMP, RSI, RDX);
+    x86_jcc(code, CC_B, print);
+
+    x86_rr(code, true, X86_GROUP_IMM, 0, RSP);
+    put32(code, 32);
+    x86_pop(code, RAX);
+    x86_ret(code);
+}
+
+// Reads a line a byte at a time into the cells from rdi on, without the
+// newline and ended by a 0.
+static void write_gets(Translation *t) {
+    Code *code = &t->code;
+    const size_t loop = new_label(code);
+    const size_t done = new_label(code);
+
+    place_label(code, t->gets);
+    x86_push(code, RAX);
+    x86_call(code, t->flush);
+    x86_mem(code, true, X86_LEA, R8, R12, RDI, 8, 0);
+    x86_rr(code, true, X86_GROUP_IMM, 5, RSP);
+    put32(code, 8);
+
+    place_label(code, loop);
+    x86_rr(code, false, X86_XOR, RAX, RAX); // read
+    x86_rr(code, false, X86_XOR, RDI, RDI);
+    x86_rr(code, true, X86_LOAD, RSI, RSP);
+    x86_mov_imm(code, RDX, 1);
+    x86_syscall(code);
+    x86_rr(code, true, X86_GROUP_IMM, 7, RAX);
+    put32(code, 1);
+    x86_jcc(code, CC_NE, done);
+    x86_mem(code, false, X86_LOAD_BYTE, RAX, RSP, NO_INDEX, 1, 0);
+    x86_rr(code, true, X86_GROUP_IMM, 7, RAX);
+    put32(code, '\n');
+    x86_jcc(code, CC_E, done);
+    x86_mem(code, true, X86_STORE, RAX, R8, NO_INDEX, 1, 0);
+    x86_mem(code, true, X86_LEA, R8, R8, NO_INDEX, 1, 8);
+    x86_jmp(code, loop);
+
+    place_label(code, done);
+    x86_mem(code, true, X86_STORE_IMM, 0, R8, NO_INDEX, 1, 0);
+    put32(code, 0);
+    x86_rr(code, true, X86_GROUP_IMM, 0, RSP);
+    put32(code, 8);
+    x86_pop(code, RAX);
+    x86_ret(code);
+}
+
+// Writes out what the program printed, then the error after the call
+// and exits with 1 like mbc run does.
+static void write_divide_by_zero(Translation *t) {
+    Code *code = &t->code;
+
+    place_label(code, t->divide_by_zero);
+    x86_call(code, t->flush);
+    x86_pop(code, RSI);
+    x86_mem(code, false, X86_LOAD, RDX, RSI, NO_INDEX, 1, 0);
+    x86_mem(code, true, X86_LEA, RSI, RSI, NO_INDEX, 1, 4);
+    x86_mov_imm(code, RAX, 1); // write
+    x86_mov_imm(code, RDI, 2);
+    x86_syscall(code);
+    x86_mov_imm(code, RAX, 60); // exit
+    x86_mov_imm(code, RDI, 1);
+    x86_syscall(code);
+}
+
+static const int callee_saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+// Callable as a function, hlt returns from it with everything the
+// program left on the call stack dropped.
+static Translation translate(Program *program, uint64_t data_base, char *file, SourceMap *map) {
+    Translation t = (Translation){ .code = create_code(), .layout = layout_memory(program), .file = file, .map = map };
+    Code *code = &t.code;
+
+    t.first = code->label_count;
+
+    for (size_t i = 0; i <= program->code_count; i++)
+        new_label(code);
+
+    t.entry = new_label(code);
+    t.halt = new_label(code);
+    t.flush = new_label(code);
+    t.putc = new_label(code);
+    t.puti = new_label(code);
+    t.gets = new_label(code);
+    t.divide_by_zero = new_label(code);
+
+    place_label(code, t.entry);
+
+    for (int i = 0; i < 6; i++)
+        x86_push(code, callee_saved[i]);
+
+    x86_mov_imm(code, R12, (int64_t)data_base);
+    x86_mem(code, true, X86_LEA, RBX, R12, NO_INDEX, 1, (int32_t)t.layout.stack);
+    x86_mem(code, true, X86_STORE, RSP, R12, NO_INDEX, 1, (int32_t)t.layout.saved_rsp);
+    x86_mov_imm(code, RAX, 0);
+    x86_mov_imm(code, R13, 0);
+    x86_mov_imm(code, R14, 0);
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        place_label(code, t.first + i);
+        translate_instruction(&t, &program->code[i], i);
+    }
+
+    // Running off the end stops like hlt does.
+    place_label(code, t.first + program->code_count);
+    place_label(code, t.halt);
+    x86_call(code, t.flush);
+    x86_mem(code, true, X86_LOAD, RSP, R12, NO_INDEX, 1, (int32_t)t.layout.saved_rsp);
+
+    for (int i = 5; i >= 0; i--)
+        x86_pop(code, callee_saved[i]);
+
+    x86_mov_imm(code, RAX, 0);
+    x86_ret(code);
+
+    write_flush(&t);
+    write_putc(&t);
+    write_puti(&t);
+    write_gets(&t);
+    write_divide_by_zero(&t);
+    return t;
+}
+
+static void put16(Code *code, uint16_t word) {
+    put8(code, (uint8_t)word);
+    put8(code, (uint8_t)(word >> 8));
+}
+
+static void write_program_header(Code *elf, uint32_t flags, uint64_t offset, uint64_t vaddr, uint64_t file_size, uint64_t mem_size) {
+    put32(elf, 1); // PT_LOAD
+    put32(elf, flags);
+    put64(elf, offset);
+    put64(elf, vaddr);
+    put64(elf, vaddr);
+    put64(elf, file_size);
+    put64(elf, mem_size);
+    put64(elf, PAGE_SIZE);
+}
+
+// A static executable with no sections, just the code segment and the
+// data segment, whose zeros at the end and everything after come from
+// the loader like a .bss.
+bool emit_x86_64(Program *program, char *file, SourceMap *map, FILE *out) {
+    Translation t = translate(program, DATA_VADDR, file, map);
+    Code *code = &t.code;
+
+    // _start, hlt comes back here.
+    const size_t start = code->len;
+    x86_call(code, t.entry);
+    x86_mov_imm(code, RAX, 60); // exit
+    x86_mov_imm(code, RDI, 0);
+    x86_syscall(code);
+
+    if (!link_code(code)) {
+        delete_code(code);
+        return false;
+    }
+
+    size_t data_words = program->data_count;
+
+    while (data_words > 0 && program->data[data_words - 1] == 0)
+        data_words--;
+
+    const uint64_t text_size = HEADERS_SIZE + code->len;
+    const uint64_t data_offset = (text_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    Code elf = create_code();
+
+    static const uint8_t ident[16] = { 0x7f, 'E', 'L', 'F', 2, 1, 1 };
+
+    for (int i = 0; i < 16; i++)
+        put8(&elf, ident[i]);
+
+    put16(&elf, 2);  // ET_EXEC
+    put16(&elf, 62); // EM_X86_64
+    put32(&elf, 1);
+    put64(&elf, TEXT_VADDR + HEADERS_SIZE + start);
+    put64(&elf, 64);
+    put64(&elf, 0);
+    put32(&elf, 0);
+    put16(&elf, 64);
+    put16(&elf, 56);
+    put16(&elf, 2);
+    put16(&elf, 64);
+    put16(&elf, 0);
+    put16(&elf, 0);
+
+    write_program_header(&elf, 5, 0, TEXT_VADDR, text_size, text_size);
+    write_program_header(&elf, 6, data_offset, DATA_VADDR, data_words * 8, t.layout.size);
+
+    for (size_t i = 0; i < code->len; i++)
+        put8(&elf, code->bytes[i]);
+
+    while (elf.len < data_offset)
+        put8(&elf, 0);
+
+    for (size_t i = 0; i < data_words; i++)
+        put64(&elf, (uint64_t)program->data[i]);
+
+    const bool written = fwrite(elf.bytes, 1, elf.len, out) == elf.len;
+    delete_code(&elf);
+    delete_code(code);
+    return written;
+}
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "callgraph.h"
+#include "cfg.h"
+#include "ir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+// The frame of a subroutine is its parameters, return value and every
+// variable declared in its nested scopes, like "stringrev@while12".
+bool in_frame(char *func, char *scope) {
+    const size_t len = strlen(func);
+    return strncmp(func, scope, len) == 0 && (scope[len] == '\0' || scope[len] == '@');
+}
+
+Function *find_function(CallGraph *graph, char *name) {
+    for (size_t i = 0; i < graph->func_count; i++) {
+        if (strcmp(graph->funcs[i].name, name) == 0)
+            return &graph->funcs[i];
+    }
+
+    return NULL;
+}
+
+static void add_callee(Function *func, size_t callee) {
+    for (size_t i = 0; i < func->callee_count; i++) {
+        if (func->callees[i] == callee)
+            return;
+    }
+
+    func->callees = realloc(func->callees, (func->callee_count + 1) * sizeof(size_t));
+    func->callees[func->callee_count++] = callee;
+}
+
+static bool is_callee_var(CallGraph *graph, Function *func, size_t var) {
+    for (size_t i = 0; i < func->callee_count; i++) {
+        if (strcmp(graph->funcs[func->callees[i]].name, graph->vars->keys[var].scope) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void note_access(CallGraph *graph, Function *func, size_t var, bool *touches_outside) {
+    if (var == NO_VAR || is_scratch_var(graph->vars, var))
+        return;
+
+    if (!in_frame(func->name, graph->vars->keys[var].scope) && !is_callee_var(graph, func, var))
+        *touches_outside = true;
+}
+
+CallGraph build_call_graph(IR *ir, VarTable *vars) {
+    CallGraph graph = (CallGraph){ .funcs = NULL, .func_count = 0, .vars = vars };
+    intern_all_vars(vars, ir);
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type != OP_FUNC_BEGIN)
+            continue;
+
+        size_t end = i;
+
+        while (end < ir->op_count && ir->ops[end].type != OP_FUNC_END)
+            end++;
+
+        graph.funcs = realloc(graph.funcs, (graph.func_count + 1) * sizeof(Function));
+        graph.funcs[graph.func_count++] = (Function){ .name = ir->ops[i].src.ident, .begin = i, .end = end, .param_count = (size_t)ir->ops[i].dst.int_const,
+            .mod = calloc(vars->count + 1, sizeof(bool)), .ref = calloc(vars->count + 1, sizeof(bool)), .mod_size = vars->count };
+        i = end;
+    }
+
+    bool *touches_outside = calloc(graph.func_count + 1, sizeof(bool));
+
+    for (size_t f = 0; f < graph.func_count; f++) {
+        Function *func = &graph.funcs[f];
+
+        // Callees first, the frame check needs to know them.
+        for (size_t i = func->begin + 1; i < func->end; i++) {
+            if (ir->ops[i].type != OP_CALL)
+                continue;
+
+            Function *callee = find_function(&graph, ir->ops[i].src.ident);
+
+            if (callee == NULL)
+                func->has_asm = true; // Nothing is known about it.
+            else
+                add_callee(func, callee - graph.funcs);
+        }
+
+        for (size_t i = func->begin + 1; i < func->end; i++) {
+            Op *op = &ir->ops[i];
+            size_t written = op_writes_var(vars, op);
+            size_t read = op_reads_var(vars, op);
+
+            if (written != NO_VAR)
+                func->mod[written] = true;
+
+            if (read != NO_VAR)
+                func->ref[read] = true;
+
+            note_access(&graph, func, written, &touches_outside[f]);
+            note_access(&graph, func, read, &touches_outside[f]);
+
+            if (op->type == OP_STORE && op->src.type != VAL__RES__ && op->dst.type == VAL_RET)
+                func->mod[value_to_var(vars, &op->dst)] = true;
+            else if (op->type == OP_INLINE_ASM)
+                func->has_asm = true;
+            else if (op->type == OP_DEREF)
+                func->loads_memory = true;
+            else if (op->type == OP_STORE_DEREF)
+                func->stores_memory = true;
+        }
+
+        func->pure = !touches_outside[f];
+    }
+
+    free(touches_outside);
+
+    // Propagate through the callees until nothing changes.
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t f = 0; f < graph.func_count; f++) {
+            Function *func = &graph.funcs[f];
+
+            for (size_t i = 0; i < func->callee_count; i++) {
+                Function *callee = &graph.funcs[func->callees[i]];
+
+                if ((callee->has_asm && !func->has_asm) || (callee->loads_memory && !func->loads_memory) ||
+                        (callee->stores_memory && !func->stores_memory) || (!callee->pure && func->pure))
+                    changed = true;
+
+                func->has_asm |= callee->has_asm;
+                func->loads_memory |= callee->loads_memory;
+                func->stores_memory |= callee->stores_memory;
+                func->pure &= callee->pure;
+
+                for (size_t v = 0; v < func->mod_size; v++) {
+                    if ((callee->mod[v] && !func->mod[v]) || (callee->ref[v] && !func->ref[v]))
+                        changed = true;
+
+                    func->mod[v] |= callee->mod[v];
+                    func->ref[v] |= callee->ref[v];
+                }
+            }
+        }
+    }
+
+    for (size_t f = 0; f < graph.func_count; f++)
+        graph.funcs[f].pure &= !graph.funcs[f].has_asm && !graph.funcs[f].stores_memory;
+
+    return graph;
+}
+
+void delete_call_graph(CallGraph *graph) {
+    for (size_t i = 0; i < graph->func_count; i++) {
+        free(graph->funcs[i].callees);
+        free(graph->funcs[i].mod);
+        free(graph->funcs[i].ref);
+    }
+
+    free(graph->funcs);
+}
+
+bool call_may_write(CallGraph *graph, char *callee, size_t var) {
+    Function *func = find_function(graph, callee);
+
+    if (func == NULL || func->has_asm)
+        return true;
+
+    // Variables made up after the graph was built can't be touched.
+    return var < func->mod_size && func->mod[var];
+}
+
+bool call_may_read(CallGraph *graph, char *callee, size_t var) {
+    Function *func = find_function(graph, callee);
+
+    if (func == NULL || func->has_asm)
+        return true;
+
+    return var < func->mod_size && func->ref[var];
+}
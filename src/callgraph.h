@@ -0,0 +1,42 @@
+#ifndef CALLGRAPH_H
+#define CALLGRAPH_H
+
+#include "ir.h"
+#include "cfg.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+typedef struct {
+    char *name;
+    size_t begin; // Index of OP_FUNC_BEGIN.
+    size_t end;   // Index of OP_FUNC_END.
+    size_t param_count;
+    size_t *callees;
+    size_t callee_count;
+
+    // Everything below is transitive through the callees.
+    bool has_asm;
+    bool loads_memory;  // OP_DEREF
+    bool stores_memory; // OP_STORE_DEREF
+    bool pure;
+
+    // Variables the subroutine may write or read, indexed by VarTable id.
+    bool *mod;
+    bool *ref;
+    size_t mod_size;
+} Function;
+
+typedef struct {
+    Function *funcs;
+    size_t func_count;
+    VarTable *vars;
+} CallGraph;
+
+CallGraph build_call_graph(IR *ir, VarTable *vars);
+void delete_call_graph(CallGraph *graph);
+Function *find_function(CallGraph *graph, char *name);
+bool in_frame(char *func, char *scope);
+bool call_may_write(CallGraph *graph, char *callee, size_t var);
+bool call_may_read(CallGraph *graph, char *callee, size_t var);
+
+#endif
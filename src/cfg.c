@@ -0,0 +1,560 @@
+#include "cfg.h"
+#include "ir.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#define STARTING_TABLE_CAP 64
+
+static uint32_t hash_key(char *scope, char *name) {
+    uint32_t h = 2166136261UL;
+
+    for (char *c = scope; *c != '\0'; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619;
+    }
+
+    // Separate the two so "ab" + "c" and "a" + "bc" don't always collide.
+    h ^= 0xff;
+    h *= 16777619;
+
+    for (char *c = name; *c != '\0'; c++) {
+        h ^= (unsigned char)*c;
+        h *= 16777619;
+    }
+
+    return h;
+}
+
+VarTable create_var_table() {
+    VarTable table = (VarTable){ .keys = malloc(STARTING_TABLE_CAP * sizeof(VarKey)), .count = 0, .capacity = STARTING_TABLE_CAP };
+    table.bucket_count = STARTING_TABLE_CAP * 2;
+    table.buckets = malloc(table.bucket_count * sizeof(size_t));
+
+    for (size_t i = 0; i < table.bucket_count; i++)
+        table.buckets[i] = NO_VAR;
+
+    return table;
+}
+
+void delete_var_table(VarTable *table) {
+    free(table->keys);
+    free(table->buckets);
+}
+
+static void rehash(VarTable *table) {
+    free(table->buckets);
+    table->bucket_count *= 2;
+    table->buckets = malloc(table->bucket_count * sizeof(size_t));
+
+    for (size_t i = 0; i < table->bucket_count; i++)
+        table->buckets[i] = NO_VAR;
+
+    for (size_t i = 0; i < table->count; i++) {
+        size_t slot = hash_key(table->keys[i].scope, table->keys[i].name) & (table->bucket_count - 1);
+
+        while (table->buckets[slot] != NO_VAR)
+            slot = (slot + 1) & (table->bucket_count - 1);
+
+        table->buckets[slot] = i;
+    }
+}
+
+size_t intern_var(VarTable *table, char *scope, char *name) {
+    size_t slot = hash_key(scope, name) & (table->bucket_count - 1);
+
+    while (table->buckets[slot] != NO_VAR) {
+        VarKey *key = &table->keys[table->buckets[slot]];
+
+        if (strcmp(key->scope, scope) == 0 && strcmp(key->name, name) == 0)
+            return table->buckets[slot];
+
+        slot = (slot + 1) & (table->bucket_count - 1);
+    }
+
+    if (table->count + 1 >= table->capacity) {
+        table->capacity *= 2;
+        table->keys = realloc(table->keys, table->capacity * sizeof(VarKey));
+    }
+
+    table->keys[table->count] = (VarKey){ .scope = scope, .name = name };
+    table->buckets[slot] = table->count;
+
+    // Keep the load factor under a half.
+    if (++table->count * 2 >= table->bucket_count)
+        rehash(table);
+
+    return table->count - 1;
+}
+
+size_t value_to_var(VarTable *table, OpValue *value) {
+    if (value->type == VAL_VAR)
+        return intern_var(table, value->source.scope, value->var);
+    else if (value->type == VAL_RET)
+        return intern_var(table, value->source.func, "@ret");
+
+    return NO_VAR;
+}
+
+void intern_all_vars(VarTable *table, IR *ir) {
+    for (size_t i = 0; i < ir->op_count; i++) {
+        value_to_var(table, &ir->ops[i].dst);
+        value_to_var(table, &ir->ops[i].src);
+    }
+}
+
+// @temp and the scratch slots @t0, @t1... only ever live within the
+// lowering of a single statement and never across a call, so they're
+// never read across calls, returns or inline assembly.
+bool is_scratch_var(VarTable *table, size_t var) {
+    if (var == NO_VAR || table->keys[var].scope[0] != '\0')
+        return false;
+
+    char *name = table->keys[var].name;
+    return strcmp(name, "@temp") == 0 || (strncmp(name, "@t", 2) == 0 && isdigit(name[2]));
+}
+
+bool op_reads_acc(Op *op) {
+    switch (op->type) {
+        case OP_LOAD:
+        case OP_PUSH: return IS_ACC(op->src);
+        case OP_STORE: return op->src.type != VAL__RES__;
+        case OP_NOT:
+        case OP_NEG: return op->src.type == VAL_REG;
+        case OP_SWP:
+        case OP_COMPARE:
+        case OP_BRANCH_TRUE:
+        case OP_BRANCH_FALSE:
+        case OP_DEREF:
+        case OP_STORE_DEREF:
+        case OP_INLINE_ASM: return true;
+        default: break;
+    }
+
+    return IS_MATH(op->type);
+}
+
+bool op_writes_acc(Op *op) {
+    switch (op->type) {
+        case OP_LOAD: return !IS_ACC(op->src);
+        case OP_POP: return op->dst.type == VAL_REG || op->dst.type == VAL_NONE;
+        case OP_NOT:
+        case OP_NEG:
+        case OP_SWP:
+        case OP_REF:
+        case OP_DEREF:
+        case OP_CALL:
+        case OP_INLINE_ASM: return true;
+        default: break;
+    }
+
+    return IS_MATH(op->type) || IS_SET(op->type);
+}
+
+size_t op_reads_var(VarTable *table, Op *op) {
+    switch (op->type) {
+        case OP_LOAD:
+        case OP_PUSH:
+        case OP_COMPARE: return value_to_var(table, &op->src);
+        case OP_SWP:
+        case OP_STORE_DEREF: return value_to_var(table, &op->dst);
+        default: break;
+    }
+
+    return IS_MATH(op->type) ? value_to_var(table, &op->src) : NO_VAR;
+}
+
+size_t op_writes_var(VarTable *table, Op *op) {
+    switch (op->type) {
+        case OP_STORE:
+            if (op->src.type == VAL__RES__)
+                return NO_VAR;
+            __attribute__((fallthrough));
+        case OP_POP:
+        case OP_SWP: return value_to_var(table, &op->dst);
+        default: break;
+    }
+
+    return NO_VAR;
+}
+
+bool op_is_branch(Op *op) {
+    return op->type == OP_BRANCH_TRUE || op->type == OP_BRANCH_FALSE || IS_CONDITIONAL_BRANCH(op->type);
+}
+
+bool op_ends_block(Op *op) {
+    return op_is_branch(op) || op->type == OP_JUMP || op->type == OP_RET;
+}
+
+// Routine 0 is the main program, routine n is the nth subroutine.
+size_t nth_routine(IR *ir, size_t n) {
+    if (n == 0)
+        return MAIN_ROUTINE;
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type == OP_FUNC_BEGIN && --n == 0)
+            return i;
+    }
+
+    return NO_ROUTINE;
+}
+
+static void add_edge(CFG *cfg, size_t from, size_t to) {
+    Block *a = &cfg->blocks[from];
+    Block *b = &cfg->blocks[to];
+
+    a->succs = realloc(a->succs, (a->succ_count + 1) * sizeof(size_t));
+    a->succs[a->succ_count++] = to;
+
+    b->preds = realloc(b->preds, (b->pred_count + 1) * sizeof(size_t));
+    b->preds[b->pred_count++] = from;
+}
+
+static void compute_order(CFG *cfg) {
+    bool *visited = calloc(cfg->block_count, sizeof(bool));
+    size_t *stack = malloc(cfg->block_count * sizeof(size_t));
+    size_t *next_succ = calloc(cfg->block_count, sizeof(size_t));
+    size_t *postorder = malloc(cfg->block_count * sizeof(size_t));
+    size_t stack_size = 0;
+    size_t count = 0;
+
+    stack[stack_size++] = 0;
+    visited[0] = true;
+
+    while (stack_size > 0) {
+        size_t b = stack[stack_size - 1];
+
+        if (next_succ[b] < cfg->blocks[b].succ_count) {
+            size_t s = cfg->blocks[b].succs[next_succ[b]++];
+
+            if (!visited[s]) {
+                visited[s] = true;
+                stack[stack_size++] = s;
+            }
+
+            continue;
+        }
+
+        postorder[count++] = b;
+        stack_size--;
+    }
+
+    cfg->order = malloc(count * sizeof(size_t));
+    cfg->order_count = count;
+
+    for (size_t i = 0; i < count; i++) {
+        cfg->order[i] = postorder[count - i - 1];
+        cfg->blocks[cfg->order[i]].rpo = i;
+    }
+
+    free(visited);
+    free(stack);
+    free(next_succ);
+    free(postorder);
+}
+
+static size_t intersect(CFG *cfg, size_t a, size_t b) {
+    while (a != b) {
+        while (cfg->blocks[a].rpo > cfg->blocks[b].rpo)
+            a = cfg->blocks[a].idom;
+
+        while (cfg->blocks[b].rpo > cfg->blocks[a].rpo)
+            b = cfg->blocks[b].idom;
+    }
+
+    return a;
+}
+
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy.
+static void compute_dominators(CFG *cfg) {
+    cfg->blocks[0].idom = 0;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t i = 1; i < cfg->order_count; i++) {
+            Block *block = &cfg->blocks[cfg->order[i]];
+            size_t idom = NO_BLOCK;
+
+            for (size_t j = 0; j < block->pred_count; j++) {
+                size_t pred = block->preds[j];
+
+                if (cfg->blocks[pred].idom == NO_BLOCK)
+                    continue;
+
+                idom = idom == NO_BLOCK ? pred : intersect(cfg, pred, idom);
+            }
+
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+CFG build_cfg(IR *ir, size_t begin) {
+    CFG cfg = (CFG){ .ir = ir, .begin = begin, .index = malloc((ir->op_count + 1) * sizeof(size_t)), .index_count = 0 };
+
+    if (begin == MAIN_ROUTINE) {
+        bool in_subroutine = false;
+
+        for (size_t i = 0; i < ir->op_count; i++) {
+            if (ir->ops[i].type == OP_FUNC_BEGIN)
+                in_subroutine = true;
+            else if (!in_subroutine)
+                cfg.index[cfg.index_count++] = i;
+            else if (ir->ops[i].type == OP_FUNC_END)
+                in_subroutine = false;
+        }
+    } else {
+        for (size_t i = begin + 1; i < ir->op_count && ir->ops[i].type != OP_FUNC_END; i++)
+            cfg.index[cfg.index_count++] = i;
+    }
+
+    // Find the leaders.
+    size_t *block_at = malloc((cfg.index_count + 1) * sizeof(size_t));
+    cfg.blocks = malloc((cfg.index_count + 1) * sizeof(Block));
+    cfg.block_count = 0;
+
+    for (size_t i = 0; i < cfg.index_count; i++) {
+        Op *op = &ir->ops[cfg.index[i]];
+
+        if (i == 0 || op->type == OP_NEW_BRANCH || op_ends_block(&ir->ops[cfg.index[i - 1]])) {
+            if (cfg.block_count > 0)
+                cfg.blocks[cfg.block_count - 1].end = i;
+
+            cfg.blocks[cfg.block_count++] = (Block){ .start = i, .idom = NO_BLOCK, .rpo = NO_BLOCK };
+        }
+
+        block_at[i] = cfg.block_count - 1;
+    }
+
+    // An empty routine still gets an entry block.
+    if (cfg.block_count == 0)
+        cfg.blocks[cfg.block_count++] = (Block){ .start = 0, .idom = NO_BLOCK, .rpo = NO_BLOCK };
+
+    cfg.blocks[cfg.block_count - 1].end = cfg.index_count;
+
+    size_t *label_block = malloc((ir->label_count + 1) * sizeof(size_t));
+
+    for (size_t i = 0; i <= ir->label_count; i++)
+        label_block[i] = NO_BLOCK;
+
+    for (size_t i = 0; i < cfg.index_count; i++) {
+        Op *op = &ir->ops[cfg.index[i]];
+
+        if (op->type == OP_NEW_BRANCH && op->src.branch < ir->label_count)
+            label_block[op->src.branch] = block_at[i];
+    }
+
+    for (size_t b = 0; b < cfg.block_count; b++) {
+        Block *block = &cfg.blocks[b];
+        Op *last = block->end > block->start ? &ir->ops[cfg.index[block->end - 1]] : NULL;
+        bool falls_through = true;
+
+        if (last != NULL && (last->type == OP_JUMP || op_is_branch(last))) {
+            if (last->dst.branch < ir->label_count && label_block[last->dst.branch] != NO_BLOCK)
+                add_edge(&cfg, b, label_block[last->dst.branch]);
+
+            falls_through = last->type != OP_JUMP;
+        } else if (last != NULL && last->type == OP_RET)
+            falls_through = false;
+
+        if (falls_through && b + 1 < cfg.block_count)
+            add_edge(&cfg, b, b + 1);
+    }
+
+    free(block_at);
+    free(label_block);
+
+    compute_order(&cfg);
+    compute_dominators(&cfg);
+    return cfg;
+}
+
+void delete_cfg(CFG *cfg) {
+    for (size_t i = 0; i < cfg->block_count; i++) {
+        free(cfg->blocks[i].succs);
+        free(cfg->blocks[i].preds);
+    }
+
+    free(cfg->blocks);
+    free(cfg->index);
+    free(cfg->order);
+}
+
+size_t block_of(CFG *cfg, size_t pos) {
+    size_t low = 0;
+    size_t high = cfg->block_count;
+
+    while (high - low > 1) {
+        size_t mid = (low + high) / 2;
+
+        if (cfg->blocks[mid].start <= pos)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+bool dominates(CFG *cfg, size_t a, size_t b) {
+    if (cfg->blocks[b].idom == NO_BLOCK)
+        return false;
+
+    while (b != a && b != 0)
+        b = cfg->blocks[b].idom;
+
+    return b == a;
+}
+
+// Natural loops, one per header, from back edges whose target
+// dominates their source.
+Loop *find_loops(CFG *cfg, size_t *out_loop_count) {
+    Loop *loops = NULL;
+    size_t loop_count = 0;
+    size_t *worklist = malloc(cfg->block_count * sizeof(size_t));
+
+    for (size_t b = 0; b < cfg->block_count; b++) {
+        for (size_t i = 0; i < cfg->blocks[b].succ_count; i++) {
+            size_t header = cfg->blocks[b].succs[i];
+
+            if (!dominates(cfg, header, b))
+                continue;
+
+            Loop *loop = NULL;
+
+            for (size_t j = 0; j < loop_count; j++) {
+                if (loops[j].header == header)
+                    loop = &loops[j];
+            }
+
+            if (loop == NULL) {
+                loops = realloc(loops, (loop_count + 1) * sizeof(Loop));
+                loop = &loops[loop_count++];
+                *loop = (Loop){ .header = header, .body = calloc(cfg->block_count, sizeof(bool)), .size = 1 };
+                loop->body[header] = true;
+            }
+
+            size_t worklist_size = 0;
+
+            if (!loop->body[b]) {
+                loop->body[b] = true;
+                loop->size++;
+                worklist[worklist_size++] = b;
+            }
+
+            while (worklist_size > 0) {
+                Block *block = &cfg->blocks[worklist[--worklist_size]];
+
+                for (size_t j = 0; j < block->pred_count; j++) {
+                    size_t pred = block->preds[j];
+
+                    if (loop->body[pred] || cfg->blocks[pred].idom == NO_BLOCK)
+                        continue;
+
+                    loop->body[pred] = true;
+                    loop->size++;
+                    worklist[worklist_size++] = pred;
+                }
+            }
+        }
+    }
+
+    free(worklist);
+    *out_loop_count = loop_count;
+    return loops;
+}
+
+void delete_loops(Loop *loops, size_t loop_count) {
+    for (size_t i = 0; i < loop_count; i++)
+        free(loops[i].body);
+
+    free(loops);
+}
+
+// Walks forward from pos until every path either reads or overwrites
+// the value, reads win.
+static bool live_at(CFG *cfg, VarTable *table, size_t pos, size_t var) {
+    bool *visited = calloc(cfg->block_count, sizeof(bool));
+    size_t *worklist = malloc((cfg->block_count + 1) * sizeof(size_t));
+    size_t worklist_size = 0;
+    bool live = false;
+
+    size_t first = pos < cfg->index_count ? block_of(cfg, pos) : NO_BLOCK;
+    size_t from = pos;
+
+    if (first == NO_BLOCK)
+        live = var != NO_VAR && cfg->begin != MAIN_ROUTINE && !is_scratch_var(table, var);
+    else
+        worklist[worklist_size++] = first;
+
+    while (!live && worklist_size > 0) {
+        size_t b = worklist[--worklist_size];
+        Block *block = &cfg->blocks[b];
+        size_t start = b == first && from != NO_BLOCK ? from : block->start;
+        bool killed = false;
+
+        // Only the first visit may start in the middle of the block.
+        if (b == first)
+            from = NO_BLOCK;
+
+        for (size_t i = start; i < block->end && !killed && !live; i++) {
+            Op *op = &cfg->ir->ops[cfg->index[i]];
+
+            if (var == NO_VAR) {
+                live = op_reads_acc(op);
+                killed = op_writes_acc(op);
+                continue;
+            }
+
+            switch (op->type) {
+                case OP_CALL:
+                case OP_INLINE_ASM:
+                case OP_DEREF:
+                    live = !is_scratch_var(table, var);
+                    break;
+                case OP_RET:
+                    live = !is_scratch_var(table, var);
+                    break;
+                default:
+                    live = op_reads_var(table, op) == var;
+                    killed = op_writes_var(table, op) == var;
+                    break;
+            }
+        }
+
+        if (killed || live)
+            continue;
+
+        // Falling off a subroutine's end can't happen, it always returns.
+        if (block->succ_count == 0 && var != NO_VAR && cfg->begin != MAIN_ROUTINE && !is_scratch_var(table, var))
+            live = true;
+
+        for (size_t i = 0; i < block->succ_count; i++) {
+            if (!visited[block->succs[i]]) {
+                visited[block->succs[i]] = true;
+                worklist[worklist_size++] = block->succs[i];
+            }
+        }
+    }
+
+    free(visited);
+    free(worklist);
+    return live;
+}
+
+bool acc_live_at(CFG *cfg, size_t pos) {
+    return live_at(cfg, NULL, pos, NO_VAR);
+}
+
+bool var_live_at(CFG *cfg, VarTable *table, size_t pos, size_t var) {
+    return live_at(cfg, table, pos, var);
+}
@@ -0,0 +1,90 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "ir.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+#define NO_BLOCK ((size_t)-1)
+#define NO_VAR ((size_t)-1)
+#define MAIN_ROUTINE ((size_t)-1)
+#define NO_ROUTINE ((size_t)-2)
+
+#define IS_ACC(op) (op.type == VAL_REG && op.reg == TEMP_REG)
+#define IS_MATH(type) (type >= OP_ADD && type <= OP_XOR)
+#define IS_SET(type) (type >= OP_EQ && type <= OP_GTE)
+#define IS_CONDITIONAL_BRANCH(type) (type >= OP_BRANCH_EQ && type <= OP_BRANCH_GTE)
+
+// Variables are interned by (scope, name), which is exactly what the
+// backend turns into a label, so two values with the same id always
+// live in the same data slot. Return values are interned as
+// (function, "@ret").
+typedef struct {
+    char *scope;
+    char *name;
+} VarKey;
+
+typedef struct {
+    VarKey *keys;
+    size_t count;
+    size_t capacity;
+    size_t *buckets;
+    size_t bucket_count;
+} VarTable;
+
+VarTable create_var_table();
+void delete_var_table(VarTable *table);
+size_t intern_var(VarTable *table, char *scope, char *name);
+size_t value_to_var(VarTable *table, OpValue *value);
+void intern_all_vars(VarTable *table, IR *ir);
+bool is_scratch_var(VarTable *table, size_t var);
+
+// What a single op does to the accumulator.
+bool op_reads_acc(Op *op);
+bool op_writes_acc(Op *op);
+size_t op_reads_var(VarTable *table, Op *op);
+size_t op_writes_var(VarTable *table, Op *op);
+bool op_is_branch(Op *op);
+bool op_ends_block(Op *op);
+
+typedef struct {
+    size_t start; // Position in CFG.index of the first op.
+    size_t end;   // One past the last op.
+    size_t *succs;
+    size_t succ_count;
+    size_t *preds;
+    size_t pred_count;
+    size_t idom;
+    size_t rpo;
+} Block;
+
+// The control flow graph of one routine, either a subroutine or the
+// main program, whose ops are scattered around the subroutines.
+typedef struct {
+    IR *ir;
+    size_t begin; // Index of OP_FUNC_BEGIN or MAIN_ROUTINE.
+    size_t *index; // Op indices of the routine in program order.
+    size_t index_count;
+    Block *blocks;
+    size_t block_count;
+    size_t *order; // Reachable blocks in reverse postorder.
+    size_t order_count;
+} CFG;
+
+typedef struct {
+    size_t header;
+    bool *body; // Indexed by block.
+    size_t size;
+} Loop;
+
+size_t nth_routine(IR *ir, size_t n);
+CFG build_cfg(IR *ir, size_t begin);
+void delete_cfg(CFG *cfg);
+size_t block_of(CFG *cfg, size_t pos);
+bool dominates(CFG *cfg, size_t a, size_t b);
+Loop *find_loops(CFG *cfg, size_t *out_loop_count);
+void delete_loops(Loop *loops, size_t loop_count);
+bool acc_live_at(CFG *cfg, size_t pos);
+bool var_live_at(CFG *cfg, VarTable *table, size_t pos, size_t var);
+
+#endif
@@ -1,22 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "compile.h"
 #include "parser.h"
 #include "ast.h"
 #include "ir.h"
 #include "optimizer.h"
+#include "passes.h"
 #include "backend.h"
 #include "error.h"
 #include "symbol_table.h"
 #include "utils.h"
+#include "assembler.h"
+#include "cost.h"
+#include "emulator.h"
+#include "source_map.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
-#include <ctype.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 
 #define STDLIB_PATH "/usr/local/share/minstral-basic/basic.mb"
 
-int compile(char *infile, char *outfile, unsigned int flags) {
+extern char **environ;
+
+// Runs a program without going through a shell and waits for it, false
+// if it couldn't be started.
+static bool wait_for_program(char **argv, int *status) {
+    pid_t pid;
+    return posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) == 0 && waitpid(pid, status, 0) == pid;
+}
+
+// Returns the exit status or -1 if it couldn't be started.
+static int run_program(char **argv) {
+    int status;
+
+    if (!wait_for_program(argv, &status))
+        return -1;
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Runs what was built. If a signal kills it that's reported, instead of
+// being passed off as an exit status, and the status is what a shell
+// would give.
+static int run_built(char *infile, char **argv) {
+    int status;
+
+    if (!wait_for_program(argv, &status)) {
+        log_error(infile, 0, 0);
+        fprintf(stderr, "failed to run '%s'\n", argv[0]);
+        return EXIT_FAILURE;
+    } else if (WIFSIGNALED(status)) {
+        log_error(infile, 0, 0);
+        fprintf(stderr, "'%s' was killed by signal %d (%s)\n", argv[0], WTERMSIG(status), strsignal(WTERMSIG(status)));
+        return 128 + WTERMSIG(status);
+    }
+
+    return WEXITSTATUS(status);
+}
+
+// What to run the output file as, it's never looked up on the PATH.
+static char *executable_path(char *outfile) {
+    if (strchr(outfile, '/') != NULL)
+        return mystrdup(outfile);
+
+    char *path = malloc(strlen(outfile) + 3);
+    sprintf(path, "./%s", outfile);
+    return path;
+}
+
+// Assembles what the backend wrote in process, so mistakes like a label
+// missing from inline asm show up as our own errors. Anything the
+// assembler doesn't know is left to mas when it's the one building.
+static bool assemble_output(char *infile, FILE *f, Program *program, Target target) {
+    rewind(f);
+    char *undefined;
+    const AsmStatus status = assemble(f, program, &undefined);
+
+    if (status == ASM_OK || (status == ASM_UNSUPPORTED && backends[target].emit_program == NULL))
+        return true;
+
+    log_error(infile, 0, 0);
+
+    if (status == ASM_UNDEFINED_LABEL) {
+        fprintf(stderr, "undefined label '%s'\n", undefined);
+        free(undefined);
+    } else
+        fprintf(stderr, "inline assembly can't be translated for target '%s'\n", backends[target].name);
+
+    return false;
+}
+
+// For mas, when the assembly was only written to a temporary file.
+static bool copy_file(FILE *f, char *path) {
+    FILE *out = fopen(path, "wb");
+
+    if (out == NULL)
+        return false;
+
+    rewind(f);
+    char buffer[4096];
+    size_t len;
+    bool written = true;
+
+    while (written && (len = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        written = fwrite(buffer, 1, len, out) == len;
+
+    written &= !ferror(f);
+    return fclose(out) == 0 && written;
+}
+
+static int build_native(char *infile, char *outfile, Program *program, SourceMap *map, Target target, unsigned int flags) {
+    const Backend *backend = &backends[target];
+    char *path = backend->source_extension != NULL ? replace_file_extension(infile, backend->source_extension, true) : mystrdup(outfile);
+    FILE *out = fopen(path, "wb");
+    bool written = out != NULL && backend->emit_program(program, infile, map, out);
+
+    if (out != NULL)
+        written &= fclose(out) == 0;
+
+    delete_program(program);
+
+    if (!written || (backend->source_extension == NULL && chmod(outfile, 0755) != 0)) {
+        log_error(infile, 0, 0);
+        fprintf(stderr, "failed to write to file '%s'\n", path);
+        free(path);
+        return EXIT_FAILURE;
+    }
+
+    // Source is left behind if it doesn't build, like assembly mas rejects.
+    if (backend->source_extension != NULL) {
+        if (run_program((char *[]){ "cc", "-O2", "-o", outfile, path, NULL }) != 0) {
+            log_error(infile, 0, 0);
+            fprintf(stderr, "failed to compile '%s'\n", path);
+            free(path);
+            return EXIT_FAILURE;
+        } else if (remove(path) != 0) {
+            log_error(infile, 0, 0);
+            fprintf(stderr, "failed to remove '%s'\n", path);
+            free(path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    free(path);
+
+    if (!(flags & COMP_RUN))
+        return EXIT_SUCCESS;
+
+    char *argv[] = { executable_path(outfile), NULL };
+    const int runstatus = run_built(infile, argv);
+    free(argv[0]);
+    return runstatus;
+}
+
+int compile(char *infile, char *outfile, char *passes, Target target, unsigned int flags) {
     create_duplicates();
     create_symbol_table();
     AST *stdlib_root = NULL;
@@ -59,29 +201,14 @@ int compile(char *infile, char *outfile, unsigned int flags) {
         stdlib_root = NULL;
     }
 
-    IR ir = ast_to_ir(root);
-
-    if (!(flags & COMP_UNOPTIMIZED))
-        optimize_ir(&ir);
-
-    char *code = (flags & COMP_IR) ? ir_to_string(&ir, flags & COMP_IR_NOPS) : emit_asm(&ir);
-    
-    delete_ir(&ir);
-    delete_ast(root);
-    delete_symbol_table();
-
-    if (flags & COMP_OMIT_LIBS && stdlib_root != NULL)
-        delete_ast(stdlib_root);
-    else
-        delete_duplicates();
+    IR ir = ast_to_ir(root, flags);
+    set_cost_table((flags & COMP_OPTIMIZE_SIZE) ? &size_costs : &speed_costs);
 
-    if (flags & COMP_UPPERCASE) {
-        const size_t len = strlen(code);
+    if (!(flags & COMP_UNOPTIMIZED)) {
+        optimize_ir(&ir, passes, flags & COMP_TIME_PASSES);
 
-        for (size_t i = 0; i < len; i++) {
-            if (isalpha(code[i]) && code[i] <= 'z')
-                code[i] = toupper(code[i]);
-        }
+        if (flags & COMP_PEEPHOLE_STATS)
+            print_peephole_stats(stderr);
     }
 
     char *outasm;
@@ -91,50 +218,185 @@ int compile(char *infile, char *outfile, unsigned int flags) {
     else
         outasm = replace_file_extension(infile, (flags & COMP_IR) ? "ir" : "min", true);
 
-    FILE *f = fopen(outasm, "w");
+    const bool assembling = !(flags & COMP_DONT_ASSEMBLE) && !(flags & COMP_IR);
+    const bool native = assembling && backends[target].emit_program != NULL;
+
+    // Only mas needs the assembly in a file of its own, everything else
+    // just reads it back once.
+    const bool to_mas = assembling && !native && (flags & COMP_EXTERNAL_VM);
+    FILE *f = assembling && !to_mas ? tmpfile() : fopen(outasm, assembling ? "w+" : "w");
+    Sink sink;
 
-    if (f == NULL) {
+    if (f == NULL || !open_sink(&sink, f, flags & COMP_UPPERCASE)) {
         log_error(infile, 0, 0);
         fprintf(stderr, "failed to write to file '%s'\n", outasm);
-        free(code);
+
+        if (f != NULL)
+            fclose(f);
+
+        delete_ir(&ir);
+        delete_ast(root);
+        delete_symbol_table();
+        free(outasm);
         return EXIT_FAILURE;
     }
 
-    fputs(code, f);
-    free(code);
+    if (flags & COMP_IR) {
+        char *code = ir_to_string(&ir, flags & COMP_IR_NOPS);
+        sink_write(&sink, SECT_TEXT, "%s", code);
+        free(code);
+    } else if (flags & COMP_OMIT_LIBS && stdlib_root != NULL) {
+        // The library isn't emitted, but the backend still looks at what
+        // the calls into it do.
+        IR libs = ast_to_ir(stdlib_root, flags);
+        emit_asm(&ir, &libs, &sink);
+        delete_ir(&libs);
+    } else
+        emit_asm(&ir, NULL, &sink);
+
+    finish_sink(&sink);
+    Program program = (Program){ .code = NULL, .data = NULL };
+    bool assembled = !assembling || assemble_output(infile, f, &program, target);
+
+    // The assembler left the program to mas after all.
+    if (assembled && assembling && !native && !to_mas && program.code == NULL && !copy_file(f, outasm)) {
+        log_error(infile, 0, 0);
+        fprintf(stderr, "failed to write to file '%s'\n", outasm);
+        assembled = false;
+    }
+
     fclose(f);
 
-    if ((flags & COMP_DONT_ASSEMBLE) || flags & COMP_IR) {
+    // The locations point into the AST, so the map is made before it goes.
+    SourceMap map = assembled && assembling ? create_source_map(&program, &sink) : (SourceMap){ .ranges = NULL, .files = NULL };
+    delete_sink_marks(&sink);
+    bool mapped = true;
+
+    if (assembled && (flags & COMP_SOURCE_MAP)) {
+        char *mappath = replace_file_extension(infile, "map", true);
+
+        if (!write_source_map(&map, mappath)) {
+            log_error(infile, 0, 0);
+            fprintf(stderr, "failed to write to file '%s'\n", mappath);
+            mapped = false;
+        }
+
+        free(mappath);
+    }
+
+    delete_ir(&ir);
+    delete_ast(root);
+    delete_symbol_table();
+
+    if (flags & COMP_OMIT_LIBS && stdlib_root != NULL)
+        delete_ast(stdlib_root);
+    else
+        delete_duplicates();
+
+    const bool emulating = assembled && program.code != NULL && (flags & COMP_RUN) && !(flags & COMP_EXTERNAL_VM) && !native;
+
+    // The emulator and the native targets report runtime errors with it.
+    if (!emulating && !native)
+        delete_source_map(&map);
+
+    if (!mapped) {
+        if (emulating || native)
+            delete_source_map(&map);
+
+        delete_program(&program);
+        free(outasm);
+        return EXIT_FAILURE;
+    } else if (!assembling) {
         free(outasm);
         return EXIT_SUCCESS;
+    } else if (native) {
+        free(outasm);
+
+        if (!assembled) {
+            delete_source_map(&map);
+            return EXIT_FAILURE;
+        }
+
+        const int status = build_native(infile, outfile, &program, &map, target, flags);
+        delete_source_map(&map);
+        return status;
     }
 
-    char *cmd = malloc(strlen(outfile) + strlen(outasm) + 22);
-    sprintf(cmd, "mas asm -o %s %s", outfile, outasm);
+    // Runs go through the built-in emulator and builds are written here,
+    // unless the assembler left the program to mas or mas was asked for.
+    if (emulating) {
+        free(outasm);
+        const int runstatus = emulate(&program, infile, !(flags & COMP_NO_JIT), &map);
+        delete_source_map(&map);
+        delete_program(&program);
+        return runstatus;
+    } else if (program.code != NULL && !(flags & COMP_EXTERNAL_VM)) {
+        free(outasm);
+        FILE *out = fopen(outfile, "wb");
+        bool written = out != NULL && write_binary(&program, out);
+
+        if (out != NULL)
+            written &= fclose(out) == 0;
+
+        delete_program(&program);
+
+        if (!written) {
+            log_error(infile, 0, 0);
+            fprintf(stderr, "failed to write to file '%s'\n", outfile);
+            return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    delete_program(&program);
+
+    if (!assembled || run_program((char *[]){ "mas", "asm", "-o", outfile, outasm, NULL }) != 0) {
+        if (assembled) {
+            log_error(infile, 0, 0);
+            fprintf(stderr, "failed to assemble '%s' with mas\n", outasm);
+        }
 
-    if (system(cmd) != 0) {
-        log_error(infile, 0, 0);
-        fprintf(stderr, "failed to assemble '%s'\n", outasm);
-        free(cmd);
         free(outasm);
         return EXIT_FAILURE;
     } else if (remove(outasm) != 0) {
         log_error(infile, 0, 0);
         fprintf(stderr, "failed to remove '%s'\n", outasm);
         free(outasm);
-        free(cmd);
         return EXIT_FAILURE;
     }
 
     free(outasm);
 
-    if (!(flags & COMP_RUN)) {
-        free(cmd);
+    if (!(flags & COMP_RUN))
         return EXIT_SUCCESS;
-    }
 
-    sprintf(cmd, "mas exe ./%s", outfile);
-    int runstatus = system(cmd);
-    free(cmd);
+    char *exe = executable_path(outfile);
+    const int runstatus = run_built(infile, (char *[]){ "mas", "exe", exe, NULL });
+    free(exe);
     return runstatus;
+}
+
+int execute(char *infile, unsigned int flags) {
+    FILE *in = fopen(infile, "rb");
+
+    if (in == NULL) {
+        log_error(infile, 0, 0);
+        fprintf(stderr, "no such file exists\n");
+        return EXIT_FAILURE;
+    }
+
+    Program program;
+    const bool loaded = read_binary(in, &program);
+    fclose(in);
+
+    if (!loaded) {
+        log_error(infile, 0, 0);
+        fprintf(stderr, "not a Minstral binary built by mbc, ones built with -mas run with mas exe\n");
+        return EXIT_FAILURE;
+    }
+
+    const int status = emulate(&program, infile, !(flags & COMP_NO_JIT), NULL);
+    delete_program(&program);
+    return status;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef COMPILE_H
 #define COMPILE_H
 
+#include "backend.h"
 #include <stdbool.h>
 
 #define COMP_DONT_ASSEMBLE (0x01)
@@ -12,7 +13,17 @@
 #define COMP_IR_NOPS (0x40)
 #define COMP_FREESTANDING (0x80)
 #define COMP_OMIT_LIBS (0x100)
+#define COMP_UNROLL_LOOPS (0x200)
+#define COMP_PEEPHOLE_STATS (0x400)
+#define COMP_TIME_PASSES (0x800)
+#define COMP_EXTERNAL_VM (0x1000)
+#define COMP_NO_JIT (0x2000)
+#define COMP_SOURCE_MAP (0x4000)
+#define COMP_OPTIMIZE_SIZE (0x8000)
+#define COMP_EXECUTE (0x10000)
 
-int compile(char *infile, char *outfile, unsigned int flags);
+int compile(char *infile, char *outfile, char *passes, Target target, unsigned int flags);
+// Runs a binary built by compile on the built-in emulator.
+int execute(char *infile, unsigned int flags);
 
 #endif
\ No newline at end of file
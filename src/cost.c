@@ -0,0 +1,105 @@
+#include "cost.h"
+#include "ir.h"
+#include "assembler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Every instruction pays for its fetch and decode, the ALU ops on top
+// of that are what make multiplies and divides worth avoiding.
+static const InsCost minstral_insns[INS_COUNT] = {
+    [INS_LDA] = { 1, 1 }, [INS_STA] = { 1, 1 }, [INS_REF] = { 1, 1 }, [INS_LDD] = { 2, 1 }, [INS_STD] = { 2, 1 },
+    [INS_SWP] = { 1, 1 }, [INS_ADD] = { 1, 1 }, [INS_SUB] = { 1, 1 }, [INS_MUL] = { 4, 1 }, [INS_DIV] = { 20, 1 },
+    [INS_MOD] = { 20, 1 }, [INS_SHL] = { 1, 1 }, [INS_SHR] = { 1, 1 }, [INS_AND] = { 1, 1 }, [INS_OR] = { 1, 1 },
+    [INS_XOR] = { 1, 1 }, [INS_NOT] = { 1, 1 }, [INS_NEG] = { 1, 1 }, [INS_PSH] = { 1, 1 }, [INS_POP] = { 1, 1 },
+    [INS_CMP] = { 1, 1 }, [INS_SEQ] = { 1, 1 }, [INS_SNE] = { 1, 1 }, [INS_SLT] = { 1, 1 }, [INS_SLE] = { 1, 1 },
+    [INS_SGT] = { 1, 1 }, [INS_SGE] = { 1, 1 }, [INS_BEQ] = { 1, 1 }, [INS_BNE] = { 1, 1 }, [INS_BLT] = { 1, 1 },
+    [INS_BLE] = { 1, 1 }, [INS_BGT] = { 1, 1 }, [INS_BGE] = { 1, 1 }, [INS_JMP] = { 1, 1 }, [INS_CSR] = { 2, 1 },
+    [INS_RSR] = { 2, 1 }, [INS_HLT] = { 1, 1 }, [INS_OPC] = { 1, 1 }, [INS_OPI] = { 1, 1 }, [INS_IPS] = { 1, 1 }
+};
+
+const CostTable speed_costs = { .insns = minstral_insns, .cycle_weight = 8, .size_weight = 1 };
+const CostTable size_costs = { .insns = minstral_insns, .cycle_weight = 1, .size_weight = 8 };
+
+static const CostTable *table = &speed_costs;
+
+void set_cost_table(const CostTable *costs) {
+    table = costs;
+}
+
+unsigned int insn_cost(Mnemonic mnemonic, bool has_operand) {
+    const InsCost *cost = &table->insns[mnemonic];
+    return cost->cycles * table->cycle_weight + (cost->size + has_operand) * table->size_weight;
+}
+
+// What the backend writes for each op, branching on a bool is a cmp 0
+// and a branch. Inline asm counts as one instruction.
+static const Mnemonic lowerings[][2] = {
+    [OP_NOP] = { INS_COUNT, INS_COUNT },
+    [OP_FUNC_BEGIN] = { INS_COUNT, INS_COUNT },
+    [OP_FUNC_END] = { INS_COUNT, INS_COUNT },
+    [OP_NEW_VAR] = { INS_COUNT, INS_COUNT },
+    [OP_RET] = { INS_RSR, INS_COUNT },
+    [OP_LOAD] = { INS_LDA, INS_COUNT },
+    [OP_STORE] = { INS_STA, INS_COUNT },
+    [OP_CALL] = { INS_CSR, INS_COUNT },
+    [OP_INLINE_ASM] = { INS_LDA, INS_COUNT },
+    [OP_PUSH] = { INS_PSH, INS_COUNT },
+    [OP_POP] = { INS_POP, INS_COUNT },
+    [OP_ADD] = { INS_ADD, INS_COUNT },
+    [OP_SUB] = { INS_SUB, INS_COUNT },
+    [OP_MUL] = { INS_MUL, INS_COUNT },
+    [OP_DIV] = { INS_DIV, INS_COUNT },
+    [OP_MOD] = { INS_MOD, INS_COUNT },
+    [OP_SHL] = { INS_SHL, INS_COUNT },
+    [OP_SHR] = { INS_SHR, INS_COUNT },
+    [OP_AND] = { INS_AND, INS_COUNT },
+    [OP_OR] = { INS_OR, INS_COUNT },
+    [OP_XOR] = { INS_XOR, INS_COUNT },
+    [OP_NOT] = { INS_NOT, INS_COUNT },
+    [OP_NEG] = { INS_NEG, INS_COUNT },
+    [OP_SWP] = { INS_SWP, INS_COUNT },
+    [OP_COMPARE] = { INS_CMP, INS_COUNT },
+    [OP_EQ] = { INS_SEQ, INS_COUNT },
+    [OP_NEQ] = { INS_SNE, INS_COUNT },
+    [OP_LT] = { INS_SLT, INS_COUNT },
+    [OP_LTE] = { INS_SLE, INS_COUNT },
+    [OP_GT] = { INS_SGT, INS_COUNT },
+    [OP_GTE] = { INS_SGE, INS_COUNT },
+    [OP_BRANCH_TRUE] = { INS_CMP, INS_BNE },
+    [OP_BRANCH_FALSE] = { INS_CMP, INS_BEQ },
+    [OP_BRANCH_EQ] = { INS_BEQ, INS_COUNT },
+    [OP_BRANCH_NEQ] = { INS_BNE, INS_COUNT },
+    [OP_BRANCH_LT] = { INS_BLT, INS_COUNT },
+    [OP_BRANCH_LTE] = { INS_BLE, INS_COUNT },
+    [OP_BRANCH_GT] = { INS_BGT, INS_COUNT },
+    [OP_BRANCH_GTE] = { INS_BGE, INS_COUNT },
+    [OP_JUMP] = { INS_JMP, INS_COUNT },
+    [OP_REF] = { INS_REF, INS_COUNT },
+    [OP_DEREF] = { INS_LDD, INS_COUNT },
+    [OP_STORE_DEREF] = { INS_STD, INS_COUNT },
+    [OP_NEW_BRANCH] = { INS_COUNT, INS_COUNT }
+};
+
+static bool has_operand(OpValue *value) {
+    return value->type != VAL_NONE && !(value->type == VAL_REG && value->reg == TEMP_REG);
+}
+
+unsigned int op_cost(Op *op) {
+    const bool operand = has_operand(&op->src) || has_operand(&op->dst);
+    unsigned int total = 0;
+
+    for (int i = 0; i < 2 && lowerings[op->type][i] != INS_COUNT; i++)
+        total += insn_cost(lowerings[op->type][i], operand);
+
+    return total;
+}
+
+unsigned int ops_cost(Op *ops, size_t count) {
+    unsigned int total = 0;
+
+    for (size_t i = 0; i < count; i++)
+        total += op_cost(&ops[i]);
+
+    return total;
+}
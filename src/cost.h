@@ -0,0 +1,34 @@
+#ifndef COST_H
+#define COST_H
+
+#include "ir.h"
+#include "assembler.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+// What one Minstral instruction takes to run and to encode.
+typedef struct {
+    unsigned int cycles;
+    unsigned int size; // In words, one more with an operand.
+} InsCost;
+
+// How cycles weigh against size, -O2 goes for speed and -Os for size.
+typedef struct {
+    const InsCost *insns;
+    unsigned int cycle_weight;
+    unsigned int size_weight;
+} CostTable;
+
+extern const CostTable speed_costs;
+extern const CostTable size_costs;
+
+// Everything after this is costed with table.
+void set_cost_table(const CostTable *table);
+unsigned int insn_cost(Mnemonic mnemonic, bool has_operand);
+
+// Estimated cost of each op on the Minstral VM, after being turned into
+// its instructions by the backend.
+unsigned int op_cost(Op *op);
+unsigned int ops_cost(Op *ops, size_t count);
+
+#endif
@@ -0,0 +1,337 @@
+#include "emulator.h"
+#include "assembler.h"
+#include "jit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Computed gotos are a GNU extension, everything else gets a switch.
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO
+#endif
+
+#define SLACK_WORDS 1024
+#define VALUE_STACK_WORDS 65536
+#define CALL_STACK_DEPTH (1 << 20)
+#define OUT_SIZE 8192
+
+// Instructions that take any operand get a handler for each mode, in
+// the order of OperandMode, so decoding is just an add.
+#define VALUE_HANDLERS(name) X(name##_ACC) X(name##_INT) X(name##_MEMORY) X(name##_STACK)
+
+// END comes first so no handler that takes a value is 0.
+#define HANDLERS \
+    X(END) \
+    VALUE_HANDLERS(LDA) VALUE_HANDLERS(ADD) VALUE_HANDLERS(SUB) VALUE_HANDLERS(MUL) VALUE_HANDLERS(DIV) \
+    VALUE_HANDLERS(MOD) VALUE_HANDLERS(SHL) VALUE_HANDLERS(SHR) VALUE_HANDLERS(AND) VALUE_HANDLERS(OR) \
+    VALUE_HANDLERS(XOR) VALUE_HANDLERS(NOT) VALUE_HANDLERS(NEG) VALUE_HANDLERS(PSH) VALUE_HANDLERS(CMP) \
+    VALUE_HANDLERS(OPC) VALUE_HANDLERS(OPI) \
+    X(STA) X(REF) X(LDD_ACC) X(LDD_MEMORY) X(STD) X(SWP) X(POP_ACC) X(POP_MEMORY) \
+    X(SEQ) X(SNE) X(SLT) X(SLE) X(SGT) X(SGE) \
+    X(BEQ) X(BNE) X(BLT) X(BLE) X(BGT) X(BGE) \
+    X(JMP) X(CSR) X(RSR) X(HLT) X(IPS)
+
+typedef enum {
+#define X(name) H_##name,
+    HANDLERS
+#undef X
+    H_COUNT
+} Handler;
+
+typedef struct {
+    Handler handler;
+    int64_t operand;
+} Decoded;
+
+typedef struct {
+    char data[OUT_SIZE];
+    size_t len;
+} Output;
+
+static const Handler value_handlers[INS_COUNT] = {
+    [INS_LDA] = H_LDA_ACC, [INS_ADD] = H_ADD_ACC, [INS_SUB] = H_SUB_ACC, [INS_MUL] = H_MUL_ACC, [INS_DIV] = H_DIV_ACC,
+    [INS_MOD] = H_MOD_ACC, [INS_SHL] = H_SHL_ACC, [INS_SHR] = H_SHR_ACC, [INS_AND] = H_AND_ACC, [INS_OR] = H_OR_ACC,
+    [INS_XOR] = H_XOR_ACC, [INS_NOT] = H_NOT_ACC, [INS_NEG] = H_NEG_ACC, [INS_PSH] = H_PSH_ACC, [INS_CMP] = H_CMP_ACC,
+    [INS_OPC] = H_OPC_ACC, [INS_OPI] = H_OPI_ACC
+};
+
+static const Handler other_handlers[INS_COUNT] = {
+    [INS_STA] = H_STA, [INS_REF] = H_REF, [INS_STD] = H_STD, [INS_SWP] = H_SWP, [INS_SEQ] = H_SEQ, [INS_SNE] = H_SNE,
+    [INS_SLT] = H_SLT, [INS_SLE] = H_SLE, [INS_SGT] = H_SGT, [INS_SGE] = H_SGE, [INS_BEQ] = H_BEQ, [INS_BNE] = H_BNE,
+    [INS_BLT] = H_BLT, [INS_BLE] = H_BLE, [INS_BGT] = H_BGT, [INS_BGE] = H_BGE, [INS_JMP] = H_JMP, [INS_CSR] = H_CSR,
+    [INS_RSR] = H_RSR, [INS_HLT] = H_HLT, [INS_IPS] = H_IPS
+};
+
+// One more than there are instructions, running off the end stops.
+static Decoded *decode(Program *program) {
+    Decoded *code = malloc((program->code_count + 1) * sizeof(Decoded));
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        Instruction *ins = &program->code[i];
+        Handler handler;
+
+        if (ins->mnemonic == INS_LDD)
+            handler = ins->mode == OPERAND_ACC ? H_LDD_ACC : H_LDD_MEMORY;
+        else if (ins->mnemonic == INS_POP)
+            handler = ins->mode == OPERAND_ACC ? H_POP_ACC : H_POP_MEMORY;
+        else if (value_handlers[ins->mnemonic] != 0)
+            handler = value_handlers[ins->mnemonic] + ins->mode;
+        else
+            handler = other_handlers[ins->mnemonic];
+
+        code[i] = (Decoded){ .handler = handler, .operand = ins->operand };
+    }
+
+    code[program->code_count] = (Decoded){ .handler = H_END, .operand = 0 };
+    return code;
+}
+
+static void flush_output(Output *out) {
+    fwrite(out->data, 1, out->len, stdout);
+    fflush(stdout);
+    out->len = 0;
+}
+
+static inline void put_char(Output *out, char c) {
+    if (out->len == OUT_SIZE)
+        flush_output(out);
+
+    out->data[out->len++] = c;
+}
+
+static void put_int(Output *out, int64_t value) {
+    char digits[24];
+    size_t len = 0;
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+
+    do {
+        digits[len++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    if (value < 0)
+        put_char(out, '-');
+
+    while (len > 0)
+        put_char(out, digits[--len]);
+}
+
+#ifdef USE_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#define TARGET(name) L_##name:
+#define DISPATCH() goto *targets[ip->handler]
+#else
+#define TARGET(name) case name:
+#define DISPATCH() continue
+#endif
+
+// Plain blocks, a continue inside do while (0) wouldn't reach the switch.
+#define NEXT() { ip++; DISPATCH(); }
+#define JUMP(to) { ip = code + (to); DISPATCH(); }
+// Jumps backward are where loops are, they go by the JIT.
+#define TAKE(to) { target = (to); if (target <= ip - code && jit != NULL) goto back_edge; JUMP(target); }
+#define CHECK_ADDRESS(address) do { if ((uint64_t)(address) >= mem_size) goto bad_address; } while (0)
+
+#define VALUE_OP(name, body) \
+    TARGET(H_##name##_ACC) { const int64_t x = acc; body; NEXT(); } \
+    TARGET(H_##name##_INT) { const int64_t x = ip->operand; body; NEXT(); } \
+    TARGET(H_##name##_MEMORY) { const int64_t x = mem[ip->operand]; body; NEXT(); } \
+    TARGET(H_##name##_STACK) { const int64_t x = sp[-1]; body; NEXT(); }
+
+#define BRANCH(name, relation) TARGET(H_##name) { if (fo relation fa) TAKE(ip->operand); NEXT(); }
+#define SET(name, relation) TARGET(H_##name) { acc = fo relation fa; NEXT(); }
+
+int emulate(Program *program, char *file, bool use_jit, SourceMap *map) {
+    Decoded *code = decode(program);
+    Jit *jit = use_jit ? create_jit(program) : NULL;
+    const size_t mem_size = program->data_count + SLACK_WORDS;
+    int64_t *mem = calloc(mem_size, sizeof(int64_t));
+    memcpy(mem, program->data, program->data_count * sizeof(int64_t));
+
+    // The cell below the stack is there so ^ on an empty stack reads 0.
+    int64_t *stack = calloc(VALUE_STACK_WORDS + 1, sizeof(int64_t));
+    int64_t *const stack_base = stack + 1;
+    int64_t *const stack_end = stack_base + VALUE_STACK_WORDS;
+    Decoded **calls = malloc(CALL_STACK_DEPTH * sizeof(Decoded *));
+    Decoded **const calls_end = calls + CALL_STACK_DEPTH;
+
+    Output *out = malloc(sizeof(Output));
+    out->len = 0;
+
+    Decoded *ip = code;
+    int64_t *sp = stack_base;
+    Decoded **rp = calls;
+    int64_t acc = 0;
+    int64_t fa = 0;
+    int64_t fo = 0;
+    int64_t target = 0;
+    const char *error = NULL;
+
+#ifdef USE_COMPUTED_GOTO
+    static const void *const targets[H_COUNT] = {
+#define X(name) &&L_H_##name,
+        HANDLERS
+#undef X
+    };
+
+    DISPATCH();
+#else
+    for (;;) switch (ip->handler) {
+#endif
+
+    VALUE_OP(LDA, acc = x)
+    VALUE_OP(ADD, acc = (int64_t)((uint64_t)acc + (uint64_t)x))
+    VALUE_OP(SUB, acc = (int64_t)((uint64_t)acc - (uint64_t)x))
+    VALUE_OP(MUL, acc = (int64_t)((uint64_t)acc * (uint64_t)x))
+    VALUE_OP(DIV, if (x == 0) goto divide_by_zero; acc = x == -1 ? (int64_t)(0 - (uint64_t)acc) : acc / x)
+    VALUE_OP(MOD, if (x == 0) goto divide_by_zero; acc = x == -1 ? 0 : acc % x)
+    VALUE_OP(SHL, acc = (int64_t)((uint64_t)acc << (x & 63)))
+    VALUE_OP(SHR, acc >>= (x & 63))
+    VALUE_OP(AND, acc &= x)
+    VALUE_OP(OR, acc |= x)
+    VALUE_OP(XOR, acc ^= x)
+    VALUE_OP(NOT, acc = ~x)
+    VALUE_OP(NEG, acc = (int64_t)(0 - (uint64_t)x))
+    VALUE_OP(PSH, if (sp == stack_end) goto stack_overflow; *sp++ = x)
+    VALUE_OP(CMP, fa = acc; fo = x)
+    VALUE_OP(OPC, put_char(out, (char)(x & 0xff)))
+    VALUE_OP(OPI, put_int(out, x))
+
+    TARGET(H_STA) { mem[ip->operand] = acc; NEXT(); }
+    TARGET(H_REF) { acc = ip->operand; NEXT(); }
+    TARGET(H_LDD_ACC) { CHECK_ADDRESS(acc); acc = mem[acc]; NEXT(); }
+    TARGET(H_LDD_MEMORY) {
+        const int64_t address = mem[ip->operand];
+        CHECK_ADDRESS(address);
+        acc = mem[address];
+        NEXT();
+    }
+    TARGET(H_STD) {
+        const int64_t address = mem[ip->operand];
+        CHECK_ADDRESS(address);
+        mem[address] = acc;
+        NEXT();
+    }
+    TARGET(H_SWP) {
+        const int64_t value = mem[ip->operand];
+        mem[ip->operand] = acc;
+        acc = value;
+        NEXT();
+    }
+    TARGET(H_POP_ACC) { if (sp == stack_base) goto stack_underflow; acc = *--sp; NEXT(); }
+    TARGET(H_POP_MEMORY) { if (sp == stack_base) goto stack_underflow; mem[ip->operand] = *--sp; NEXT(); }
+
+    SET(SEQ, ==)
+    SET(SNE, !=)
+    SET(SLT, <)
+    SET(SLE, <=)
+    SET(SGT, >)
+    SET(SGE, >=)
+
+    BRANCH(BEQ, ==)
+    BRANCH(BNE, !=)
+    BRANCH(BLT, <)
+    BRANCH(BLE, <=)
+    BRANCH(BGT, >)
+    BRANCH(BGE, >=)
+
+    TARGET(H_JMP) { TAKE(ip->operand); }
+    TARGET(H_CSR) {
+        if (rp == calls_end)
+            goto call_overflow;
+
+        *rp++ = ip + 1;
+        JUMP(ip->operand);
+    }
+    TARGET(H_RSR) {
+        if (rp == calls)
+            goto bad_return;
+
+        ip = *--rp;
+        DISPATCH();
+    }
+    TARGET(H_IPS) {
+        int64_t address = ip->operand;
+        int c;
+        flush_output(out);
+
+        while ((c = getchar()) != EOF && c != '\n') {
+            CHECK_ADDRESS(address + 1);
+            mem[address++] = c;
+        }
+
+        mem[address] = 0;
+        NEXT();
+    }
+    TARGET(H_HLT)
+    TARGET(H_END)
+        goto halt;
+
+back_edge:
+    {
+        JitFunction function = jit_back_edge(jit, (size_t)target);
+        ip = code + target;
+
+        if (function != NULL) {
+            JitState state = (JitState){ .acc = acc, .fa = fa, .fo = fo, .sp = sp, .mem = mem, .mem_size = mem_size,
+                .stack_base = stack_base, .stack_end = stack_end, .out = out->data, .out_len = out->len, .out_size = OUT_SIZE };
+            ip = code + function(&state);
+            acc = state.acc;
+            fa = state.fa;
+            fo = state.fo;
+            sp = state.sp;
+            out->len = state.out_len;
+        }
+
+        DISPATCH();
+    }
+
+#ifndef USE_COMPUTED_GOTO
+    default: goto halt;
+    }
+#endif
+
+divide_by_zero:
+    error = "division by zero";
+    goto halt;
+stack_overflow:
+    error = "stack overflow";
+    goto halt;
+stack_underflow:
+    error = "pop from an empty stack";
+    goto halt;
+call_overflow:
+    error = "subroutine calls nested too deep";
+    goto halt;
+bad_return:
+    error = "return without a subroutine call";
+    goto halt;
+bad_address:
+    error = "memory access out of bounds";
+
+halt:
+    flush_output(out);
+
+    if (error != NULL) {
+        char *message = runtime_error(map, file, (size_t)(ip - code), error);
+        fputs(message, stderr);
+        free(message);
+    }
+
+    if (jit != NULL)
+        delete_jit(jit);
+
+    free(code);
+    free(mem);
+    free(stack);
+    free(calls);
+    free(out);
+    return error == NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifdef USE_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
\ No newline at end of file
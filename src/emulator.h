@@ -0,0 +1,13 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include "assembler.h"
+#include "source_map.h"
+#include <stdbool.h>
+
+// Runs an assembled program on the built-in Minstral VM and returns its
+// exit status. Runtime errors are reported at the source line map gives,
+// or against file. Hot loops are compiled to native code with use_jit.
+int emulate(Program *program, char *file, bool use_jit, SourceMap *map);
+
+#endif
\ No newline at end of file
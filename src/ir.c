@@ -2,6 +2,7 @@
 #include "ast.h"
 #include "error.h"
 #include "utils.h"
+#include "compile.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,23 +15,149 @@
 #define STARTING_PROG_CAP 16
 #define SOURCE(ast) (Source){ .scope = ast->scope.full, .func = ast->scope.func, .module = ast->scope.module }
 
-#define LOADING_VALUE_WILL_CORRUPT(type) (type == AST_CALL || type == AST_MATH || type == AST_CONDITION || type == AST_INDEX)
+// Unrolling limits, in ops of the loop body.
+#define MAX_FULL_UNROLL_TRIPS 16
+#define MAX_UNROLLED_SIZE 192
+#define UNROLL_FACTOR 4
 
 static IR program;
 static OpValue temp_var;
 static OpValue temp_reg;
 
+// Scratch slots @t0, @t1, ... hold values while something else is
+// worked out in the accumulator. They're handed out like a stack, so
+// a slot is free again as soon as the value it held is used.
+static OpValue *scratch_slots;
+static size_t scratch_count;
+static size_t scratch_used;
+
+// A variable the accumulator is known to hold, so loading it again
+// can be skipped.
+static OpValue acc_holds;
+static bool track_acc;
+
 static unsigned int label_count;
+static bool unroll_loops;
 static unsigned int cur_loop_label;
 static unsigned int cur_end_loop_label;
+static Location cur_loc; // Of the statement being pushed.
+
+static bool same_var(OpValue *a, OpValue *b) {
+    return a->type == VAL_VAR && b->type == VAL_VAR && strcmp(a->var, b->var) == 0 && strcmp(a->source.scope, b->source.scope) == 0;
+}
+
+// A push forgets the accumulator too, the peephole pushes the loaded
+// value directly and expects it to be reloaded afterwards.
+static void update_acc_holds(OpType type, OpValue *dst, OpValue *src) {
+    switch (type) {
+        case OP_NOP:
+        case OP_NEW_VAR:
+        case OP_COMPARE:
+        case OP_BRANCH_TRUE:
+        case OP_BRANCH_FALSE:
+        case OP_JUMP:
+            return;
+        case OP_LOAD:
+            if (dst->type == VAL_REG)
+                acc_holds = src->type == VAL_VAR ? *src : (OpValue){ .type = VAL_NONE };
+            return;
+        case OP_STORE:
+            if (src->type == VAL_REG && dst->type == VAL_VAR) {
+                acc_holds = *dst;
+                return;
+            }
+            break;
+        default: break;
+    }
+
+    acc_holds = (OpValue){ .type = VAL_NONE };
+}
 
 static void push(OpType type, OpValue dst, OpValue src) {
+    // Still there from the last statement.
+    if (track_acc && type == OP_LOAD && dst.type == VAL_REG && same_var(&src, &acc_holds))
+        return;
+
     if (program.op_count + 1 >= program.op_capacity) {
         program.op_capacity *= 2;
         program.ops = realloc(program.ops, program.op_capacity * sizeof(Op));
     }
 
-    program.ops[program.op_count++] = (Op){ .type = type, .dst = dst, .src = src };
+    program.ops[program.op_count++] = (Op){ .type = type, .dst = dst, .src = src, .loc = cur_loc };
+    update_acc_holds(type, &dst, &src);
+}
+
+// Throws away everything pushed from count on.
+static void truncate_program(size_t count) {
+    program.op_count = count;
+    acc_holds = (OpValue){ .type = VAL_NONE };
+}
+
+static OpValue alloc_scratch() {
+    if (scratch_used == scratch_count) {
+        char *name = malloc(32);
+        sprintf(name, "@t%zu", scratch_count);
+
+        scratch_slots = realloc(scratch_slots, (scratch_count + 1) * sizeof(OpValue));
+        scratch_slots[scratch_count++] = (OpValue){ .type = VAL_VAR, .source = temp_var.source, .var = ir_own_name(&program, name) };
+    }
+
+    return scratch_slots[scratch_used++];
+}
+
+static void free_scratch() {
+    assert(scratch_used > 0);
+    scratch_used--;
+}
+
+static AST *unparen(AST *ast) {
+    while (ast->type == AST_PARENS)
+        ast = ast->parens;
+
+    return ast;
+}
+
+// Values that can be used as an operand without any code. Strings
+// have to be loaded to get their address.
+static bool is_simple(AST *ast) {
+    ast = unparen(ast);
+    return ast->type == AST_INT || ast->type == AST_VAR;
+}
+
+// Whether working out the value can overwrite @temp.
+static bool clobbers_temp(AST *ast) {
+    ast = unparen(ast);
+    return ast->type == AST_CALL || ast->type == AST_MATH || ast->type == AST_CONDITION || ast->type == AST_INDEX;
+}
+
+// A call can overwrite any scratch slot, so whatever has to survive
+// one goes on the stack instead.
+static bool has_call(AST *ast) {
+    if (ast == NULL)
+        return false;
+
+    switch (ast->type) {
+        case AST_CALL: return true;
+        case AST_PARENS: return has_call(ast->parens);
+        case AST_NOT:
+        case AST_UNARY: return has_call(ast->not_value);
+        case AST_INDEX: return has_call(ast->index.base) || has_call(ast->index.index) || has_call(ast->index.value);
+        case AST_MATH:
+            for (size_t i = 0; i < ast->math.values.size; i += 2) {
+                if (has_call(ast->math.values.items[i]))
+                    return true;
+            }
+            return false;
+        case AST_CONDITION:
+            for (size_t i = 0; i < ast->condition.values.size; i += 2) {
+                if (has_call(ast->condition.values.items[i]))
+                    return true;
+            }
+            return false;
+        default: break;
+    }
+
+    return false;
 }
 
 void push_stmt(AST *ast);
@@ -75,9 +202,16 @@ OpValue ast_to_value(AST *ast) {
     return NOVAL;
 }
 
-IR ast_to_ir(AST *ast) {
+IR ast_to_ir(AST *ast, unsigned int flags) {
     program = (IR){ .ops = malloc(STARTING_PROG_CAP * sizeof(Op)), .op_count = 0, .op_capacity = STARTING_PROG_CAP };
     label_count = 0;
+    unroll_loops = (flags & COMP_UNROLL_LOOPS) && !(flags & COMP_UNOPTIMIZED);
+    track_acc = !(flags & COMP_UNOPTIMIZED);
+    acc_holds = NOVAL;
+    cur_loc = (Location){ .file = NULL };
+    scratch_slots = NULL;
+    scratch_count = 0;
+    scratch_used = 0;
 
     // Temporaries.
     temp_reg = (OpValue){ .type = VAL_REG, .reg = TEMP_REG };
@@ -88,12 +222,23 @@ IR ast_to_ir(AST *ast) {
         push_stmt(ast->root.items[i]);
 
     push(OP_NOP, NOVAL, NOVAL);
+    program.label_count = label_count;
+
+    // Declare the scratch slots next to @temp, where no pass removes them.
+    Op decls[scratch_count + 1];
+
+    for (size_t i = 0; i < scratch_count; i++)
+        decls[i] = (Op){ .type = OP_NEW_VAR, .dst = NOVAL, .src = scratch_slots[i] };
+
+    ir_insert(&program, 1, decls, scratch_count);
+    free(scratch_slots);
     return program;
 }
 
 void push_func(AST *ast) {
-    push(OP_FUNC_BEGIN, NOVAL, (OpValue){ .source = SOURCE(ast), .ident = ast->func.name });
-    label_count = 0;
+    // Labels keep counting up through subroutines so that every label
+    // number is unique in the program, the optimizer relies on it.
+    push(OP_FUNC_BEGIN, (OpValue){ .type = VAL_INT, .int_const = ast->func.params.size }, (OpValue){ .source = SOURCE(ast), .ident = ast->func.name });
 
     for (size_t i = 0; i < ast->func.params.size; i++)
         push(OP_NEW_VAR, NOVAL, (OpValue){ .type = VAL_VAR, .source = SOURCE(ast->func.params.items[i]), .var = ast->func.params.items[i]->decl.name });
@@ -165,17 +310,6 @@ int oper_to_prec(TokenType oper) {
     return 2;
 }
 
-bool higher_prec_later(ASTList *values, int cur) {
-    int cur_prec = oper_to_prec(values->items[cur]->oper);
-
-    for (size_t i = cur + 2; i < values->size; i += 2) {
-        if (oper_to_prec(values->items[i]->oper) > cur_prec)
-            return true;
-    }
-
-    return false;
-}
-
 OpType oper_to_optype(TokenType oper) {
     switch (oper) {
         case TOK_PLUS: return OP_ADD;
@@ -191,101 +325,110 @@ OpType oper_to_optype(TokenType oper) {
     }
 }
 
-void push_math(AST *ast) {
-    ASTList *values = &ast->math.values;
-
-    size_t mid_opers[values->size / 2];
-    size_t mid_oper_count = 0;
-
-    size_t low_opers[values->size / 2];
-    size_t low_oper_count = 0;
-
-    push(OP_LOAD, temp_reg, ast_to_value(values->items[0]));
-    push(OP_PUSH, NOVAL, temp_reg);
-
-    for (size_t i = 1; i < values->size; i += 2) {
-        TokenType oper = values->items[i]->oper;
-        AST *value = values->items[i + 1];
-
-        if (oper_to_prec(oper) == 2) {
-            push(OP_LOAD, temp_reg, ast_to_value(value));
-            push(OP_STORE, temp_var, temp_reg);
-
-            push(OP_POP, temp_reg, NOVAL);
-            push(oper_to_optype(oper), temp_reg, temp_var);
-            push(OP_PUSH, NOVAL, temp_reg);
-            continue;
-        }
-        
-        if (oper_to_prec(oper) == 1 && higher_prec_later(values, i) && 
-                (i + 2 > values->size || oper_to_prec(values->items[i + 2]->oper) != oper_to_prec(oper))) {
-
-            push(OP_LOAD, temp_reg, ast_to_value(value));
-            push(OP_PUSH, NOVAL, temp_reg);
-
-            mid_opers[mid_oper_count++] = oper;
-            continue;
-        }
-    
-        if (mid_oper_count > 0) {
-            for (size_t j = 0; j < mid_oper_count; j++) {
-                push(OP_POP, temp_var, NOVAL);
-                push(OP_POP, temp_reg, NOVAL);
-
-                push(oper_to_optype(mid_opers[j]), temp_reg, temp_var);
-                push(OP_PUSH, NOVAL, temp_reg);
-            }
-
-            mid_oper_count = 0;
-        }
-
-        if (oper_to_prec(oper) == 0 && higher_prec_later(values, i) && 
-                (i + 2 > values->size || oper_to_prec(values->items[i + 2]->oper) != oper_to_prec(oper))) {
-
-            push(OP_LOAD, temp_reg, ast_to_value(value));
-            push(OP_PUSH, NOVAL, temp_reg);
+// Works out values[first..last] of a math expression into the
+// accumulator, splitting at the last operator with the lowest
+// precedence so everything is left associative.
+static void push_math_range(ASTList *values, size_t first, size_t last) {
+    if (first == last) {
+        push(OP_LOAD, temp_reg, ast_to_value(values->items[first]));
+        return;
+    }
 
-            low_opers[low_oper_count++] = oper;
-            continue;
-        }
+    size_t split = first + 1;
 
-        if (low_oper_count > 0) {
-            for (size_t j = 0; j < low_oper_count; j++) {
-                push(OP_POP, temp_var, NOVAL);
-                push(OP_POP, temp_reg, NOVAL);
+    for (size_t i = first + 1; i < last; i += 2) {
+        if (oper_to_prec(values->items[i]->oper) <= oper_to_prec(values->items[split]->oper))
+            split = i;
+    }
 
-                push(oper_to_optype(low_opers[j]), temp_reg, temp_var);
-                push(OP_PUSH, NOVAL, temp_reg);
-            }
+    OpType type = oper_to_optype(values->items[split]->oper);
+    bool rhs_calls = false;
+    bool lhs_calls = false;
 
-            low_oper_count = 0;
-        }
+    for (size_t i = first; i <= last; i += 2) {
+        if (i < split)
+            lhs_calls |= has_call(values->items[i]);
+        else
+            rhs_calls |= has_call(values->items[i]);
+    }
 
-        push(OP_LOAD, temp_reg, ast_to_value(value));
+    if (split + 1 == last && is_simple(values->items[last])) {
+        push_math_range(values, first, split - 1);
+        push(type, temp_reg, ast_to_value(values->items[last]));
+    } else if (rhs_calls) {
+        push_math_range(values, first, split - 1);
+        push(OP_PUSH, NOVAL, temp_reg);
+        push_math_range(values, split + 1, last);
         push(OP_STORE, temp_var, temp_reg);
-
         push(OP_POP, temp_reg, NOVAL);
-        push(oper_to_optype(oper), temp_reg, temp_var);
-        push(OP_PUSH, NOVAL, temp_reg);
+        push(type, temp_reg, temp_var);
+    } else if (!lhs_calls) {
+        // Nothing can tell which side goes first.
+        OpValue slot = alloc_scratch();
+        push_math_range(values, split + 1, last);
+        push(OP_STORE, slot, temp_reg);
+        push_math_range(values, first, split - 1);
+        push(type, temp_reg, slot);
+        free_scratch();
+    } else {
+        OpValue slot = alloc_scratch();
+        push_math_range(values, first, split - 1);
+        push(OP_STORE, slot, temp_reg);
+        push_math_range(values, split + 1, last);
+        push(OP_STORE, temp_var, temp_reg);
+        push(OP_LOAD, temp_reg, slot);
+        push(type, temp_reg, temp_var);
+        free_scratch();
     }
+}
 
-    for (size_t j = 0; j < mid_oper_count; j++) {
-        push(OP_POP, temp_var, NOVAL);
-        push(OP_POP, temp_reg, NOVAL);
+void push_math(AST *ast) {
+    push_math_range(&ast->math.values, 0, ast->math.values.size - 1);
+}
 
-        push(oper_to_optype(mid_opers[j]), temp_reg, temp_var);
+// Leaves the flags of comparing left to right.
+static void push_comparison(AST *left, AST *right) {
+    if (is_simple(right) || unparen(right)->type == AST_STRING) {
+        push(OP_LOAD, temp_reg, ast_to_value(left));
+        push(OP_COMPARE, temp_reg, ast_to_value(right));
+    } else if (has_call(right)) {
+        push(OP_LOAD, temp_reg, ast_to_value(left));
         push(OP_PUSH, NOVAL, temp_reg);
-    }
-
-    for (size_t j = 0; j < low_oper_count; j++) {
-        push(OP_POP, temp_var, NOVAL);
+        push(OP_LOAD, temp_reg, ast_to_value(right));
+        push(OP_STORE, temp_var, temp_reg);
         push(OP_POP, temp_reg, NOVAL);
+        push(OP_COMPARE, temp_reg, temp_var);
+    } else if (!has_call(left)) {
+        OpValue slot = alloc_scratch();
+        push(OP_LOAD, temp_reg, ast_to_value(right));
+        push(OP_STORE, slot, temp_reg);
+        push(OP_LOAD, temp_reg, ast_to_value(left));
+        push(OP_COMPARE, temp_reg, slot);
+        free_scratch();
+    } else {
+        OpValue slot = alloc_scratch();
+        push(OP_LOAD, temp_reg, ast_to_value(left));
+        push(OP_STORE, slot, temp_reg);
+        push(OP_LOAD, temp_reg, ast_to_value(right));
+        push(OP_STORE, temp_var, temp_reg);
+        push(OP_LOAD, temp_reg, slot);
+        push(OP_COMPARE, temp_reg, temp_var);
+        free_scratch();
+    }
+}
 
-        push(oper_to_optype(low_opers[j]), temp_reg, temp_var);
+static void push_result(OpValue result) {
+    if (result.type == VAL_NONE)
         push(OP_PUSH, NOVAL, temp_reg);
-    }
+    else
+        push(OP_STORE, result, temp_reg);
+}
 
-    push(OP_POP, temp_reg, NOVAL);
+static void pop_result(OpValue result) {
+    if (result.type == VAL_NONE)
+        push(OP_POP, temp_reg, NOVAL);
+    else
+        push(OP_LOAD, temp_reg, result);
 }
 
 void push_condition(AST *ast) {
@@ -295,6 +438,11 @@ void push_condition(AST *ast) {
     unsigned int done_label = label_count++;
     bool pushed = false;
 
+    // The result so far is kept in a slot between the comparisons, or
+    // on the stack if there's a call that could overwrite it.
+    bool use_slot = count > 3 && !has_call(ast);
+    OpValue result = use_slot ? alloc_scratch() : NOVAL;
+
     for (size_t i = 2; i < count; i += 4) {
         AST *left = values->items[i - 2];
         AST *right = values->items[i];
@@ -304,15 +452,7 @@ void push_condition(AST *ast) {
 
         bool pushed_res = false;
 
-        push(OP_LOAD, temp_reg, ast_to_value(left));
-
-        if (LOADING_VALUE_WILL_CORRUPT(right->type)) {
-            push(OP_PUSH, NOVAL, temp_reg);
-            push(OP_LOAD, temp_var, ast_to_value(right));
-            push(OP_POP, NOVAL, temp_reg);
-            push(OP_COMPARE, temp_reg, temp_var);
-        } else
-            push(OP_COMPARE, temp_reg, ast_to_value(right));
+        push_comparison(left, right);
 
         switch (oper) {
             case TOK_EQ:
@@ -342,7 +482,7 @@ void push_condition(AST *ast) {
 
         if (pushed_res || last_oper == TOK_AND) {
             push(OP_STORE, temp_var, temp_reg);
-            push(OP_POP, temp_reg, NOVAL);
+            pop_result(result);
         }
 
         if (last_oper == TOK_AND && i != 2) {
@@ -356,7 +496,7 @@ void push_condition(AST *ast) {
             if (last_oper != TOK_AND && next_oper != TOK_AND && count > 3) {
                 if (pushed) {
                     push(OP_STORE, temp_var, temp_reg);
-                    push(OP_POP, temp_reg, NOVAL);
+                    pop_result(result);
                     just_popped = true;
                 }
 
@@ -366,7 +506,7 @@ void push_condition(AST *ast) {
             if (last_oper == TOK_OR) {
                 if (!just_popped) {
                     push(OP_STORE, temp_var, temp_reg);
-                    push(OP_POP, temp_reg, NOVAL);
+                    pop_result(result);
                 }
 
                 push(OP_OR, temp_reg, temp_var);
@@ -374,12 +514,15 @@ void push_condition(AST *ast) {
         }
 
         if (count > 3 && (next_oper == TOK_AND || next_oper == TOK_OR)) {
-            push(OP_PUSH, NOVAL, temp_reg);
+            push_result(result);
             pushed = true;
         }
     }
 
     push(OP_NEW_BRANCH, NOVAL, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = done_label });
+
+    if (use_slot)
+        free_scratch();
 }
 
 void push_block(ASTList *block) {
@@ -413,15 +556,233 @@ void push_if(AST *ast) {
     push(OP_NEW_BRANCH, NOVAL, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = final_label });
 }
 
-void push_for(AST *ast) {
-    if (ast->for_stmt.counter->type == AST_DECL || ast->for_stmt.counter->type == AST_ASSIGN)
-        push_stmt(ast->for_stmt.counter);
+// Constants are used as they are, anything else is evaluated once
+// before the loop into a hidden slot.
+static OpValue loop_invariant_value(AST *ast, AST *value, char *prefix) {
+    if (value->type == AST_INT)
+        return ast_to_value(value);
+
+    OpValue slot = (OpValue){ .type = VAL_VAR, .source = SOURCE(ast), .var = ir_new_name(&program, prefix) };
+    push(OP_NEW_VAR, NOVAL, slot);
+    push(OP_LOAD, temp_reg, ast_to_value(value));
+    push(OP_STORE, slot, temp_reg);
+    return slot;
+}
 
-    unsigned int condition_label = label_count++;
+// The number of times a for loop with constant bounds runs, or -1 if
+// it can't be known.
+static int64_t trip_count(AST *ast) {
+    AST *counter = ast->for_stmt.counter;
+    AST *start = counter->type == AST_DECL ? counter->decl.value : counter->type == AST_ASSIGN ? counter->assign.value : NULL;
+    AST *end = ast->for_stmt.end;
+    AST *step = ast->for_stmt.step;
+
+    if (start == NULL || start->type != AST_INT || end->type != AST_INT || step->type != AST_INT)
+        return -1;
+
+    int64_t from = start->constant.i64;
+    int64_t to = end->constant.i64;
+    int64_t by = step->constant.i64;
+    const int64_t limit = INT64_C(1) << 62;
+
+    if (from <= -limit || from >= limit || to <= -limit || to >= limit)
+        return -1;
+
+    // Counting the wrong way would never end.
+    if (!ast->for_stmt.reverse && by > 0)
+        return to >= from ? (to - from) / by + 1 : 0;
+    else if (ast->for_stmt.reverse && by < 0)
+        return from > to ? (from - to - 1) / -by + 1 : 0;
+
+    return -1;
+}
+
+// A body can be copied if nothing in it leaves the iteration early or
+// touches the counter behind the loop's back.
+static bool can_copy_body(size_t start, size_t end, OpValue *var, bool counter_is_local, unsigned int next_label, unsigned int final_label) {
+    for (size_t i = start; i < end; i++) {
+        Op *op = &program.ops[i];
+
+        switch (op->type) {
+            case OP_JUMP:
+                if (op->dst.branch == next_label || op->dst.branch == final_label)
+                    return false;
+                break;
+            case OP_STORE:
+            case OP_POP:
+                if (same_var(&op->dst, var))
+                    return false;
+                break;
+            case OP_REF:
+                if (same_var(&op->src, var))
+                    return false;
+                break;
+            case OP_INLINE_ASM: return false;
+            case OP_CALL:
+                if (!counter_is_local)
+                    return false;
+                break;
+            default: break;
+        }
+    }
+
+    return true;
+}
+
+// The variable or buffer an op declares, if it declares one.
+static OpValue *declared_var(Op *op) {
+    if (op->type == OP_NEW_VAR)
+        return &op->src;
+    else if (op->type == OP_STORE && op->src.type == VAL__RES__)
+        return &op->dst;
+
+    return NULL;
+}
+
+// Copies after the first must not declare their variables or buffers
+// again.
+static void drop_redeclarations(size_t first_start, size_t first_end, size_t start) {
+    for (size_t i = start; i < program.op_count; i++) {
+        OpValue *var = declared_var(&program.ops[i]);
+
+        if (var == NULL)
+            continue;
+
+        for (size_t j = first_start; j < first_end; j++) {
+            OpValue *first = declared_var(&program.ops[j]);
+
+            if (first != NULL && same_var(first, var)) {
+                program.ops[i].type = OP_NOP;
+                break;
+            }
+        }
+    }
+}
+
+static void push_for_body(AST *ast, unsigned int next_loop_label, unsigned int final_label) {
+    unsigned int before_loop_label = cur_loop_label;
+    unsigned int before_end_loop_label = cur_end_loop_label;
+
+    cur_loop_label = next_loop_label;
+    cur_end_loop_label = final_label;
+
+    push_block(&ast->for_stmt.body);
+
+    cur_loop_label = before_loop_label;
+    cur_end_loop_label = before_end_loop_label;
+}
+
+static void push_step(OpValue var, int64_t step) {
+    push(OP_LOAD, temp_reg, var);
+    push(OP_ADD, temp_reg, (OpValue){ .type = VAL_INT, .int_const = step });
+    push(OP_STORE, var, temp_reg);
+}
+
+// Small loops are copied out completely, bigger ones run the body
+// several times per trip around the loop after peeling off the
+// iterations that don't fit. Returns false if the loop can't be
+// unrolled, nothing is pushed then.
+static bool push_unrolled_for(AST *ast, OpValue var) {
+    int64_t trips = trip_count(ast);
+
+    if (trips < 0)
+        return false;
+    else if (trips == 0)
+        return true;
+
+    const int64_t start = ast->for_stmt.counter->type == AST_DECL ? ast->for_stmt.counter->decl.value->constant.i64 : ast->for_stmt.counter->assign.value->constant.i64;
+    const int64_t step = ast->for_stmt.step->constant.i64;
     unsigned int next_loop_label = label_count++;
     unsigned int final_label = label_count++;
 
+    // Push the first copy to see how big the body is and what's in it.
+    const size_t first = program.op_count;
+    push_for_body(ast, next_loop_label, final_label);
+    const size_t first_end = program.op_count;
+
+    size_t size = 0;
+
+    for (size_t i = first; i < first_end; i++)
+        size += program.ops[i].type != OP_NOP && declared_var(&program.ops[i]) == NULL;
+
+    if (!can_copy_body(first, first_end, &var, ast->for_stmt.counter->type == AST_DECL, next_loop_label, final_label) || size == 0) {
+        truncate_program(first);
+        return false;
+    }
+
+    if (trips <= MAX_FULL_UNROLL_TRIPS && (size_t)trips * size <= MAX_UNROLLED_SIZE) {
+        for (int64_t i = 1; i < trips; i++) {
+            push(OP_LOAD, temp_reg, (OpValue){ .type = VAL_INT, .int_const = start + i * step });
+            push(OP_STORE, var, temp_reg);
+
+            const size_t copy = program.op_count;
+            push_for_body(ast, next_loop_label, final_label);
+            drop_redeclarations(first, first_end, copy);
+        }
+
+        // Leave the counter where the loop would have.
+        push(OP_LOAD, temp_reg, (OpValue){ .type = VAL_INT, .int_const = start + trips * step });
+        push(OP_STORE, var, temp_reg);
+        return true;
+    }
+
+    const int64_t factor = MAX_UNROLLED_SIZE / size < UNROLL_FACTOR ? (int64_t)(MAX_UNROLLED_SIZE / size) : UNROLL_FACTOR;
+
+    if (factor < 2 || trips < factor * 2) {
+        truncate_program(first);
+        return false;
+    }
+
+    // The first copy is the start of the peeled iterations, if there
+    // are any. It's the one that declares the body's variables.
+    const int64_t peeled = trips % factor;
+    size_t decl_start = first;
+    size_t decl_end = first_end;
+
+    if (peeled == 0)
+        truncate_program(first);
+    else {
+        push_step(var, step);
+
+        for (int64_t i = 1; i < peeled; i++) {
+            const size_t copy = program.op_count;
+            push_for_body(ast, next_loop_label, final_label);
+            drop_redeclarations(decl_start, decl_end, copy);
+            push_step(var, step);
+        }
+    }
+
+    // What's left is a multiple of the factor, so the condition only
+    // has to be checked once every factor iterations.
+    unsigned int condition_label = label_count++;
+
+    push(OP_LOAD, temp_reg, var);
     push(OP_NEW_BRANCH, NOVAL, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = condition_label });
+    push(OP_COMPARE, temp_reg, ast_to_value(ast->for_stmt.end));
+    push(ast->for_stmt.reverse ? OP_LT : OP_GTE, temp_reg, NOVAL);
+    push(OP_BRANCH_FALSE, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = final_label }, temp_reg);
+
+    for (int64_t i = 0; i < factor; i++) {
+        const size_t copy = program.op_count;
+        push_for_body(ast, next_loop_label, final_label);
+
+        if (peeled == 0 && i == 0) {
+            decl_start = copy;
+            decl_end = program.op_count;
+        } else
+            drop_redeclarations(decl_start, decl_end, copy);
+
+        push_step(var, step);
+    }
+
+    push(OP_JUMP, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = condition_label }, NOVAL);
+    push(OP_NEW_BRANCH, NOVAL, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = final_label });
+    return true;
+}
+
+void push_for(AST *ast) {
+    if (ast->for_stmt.counter->type == AST_DECL || ast->for_stmt.counter->type == AST_ASSIGN)
+        push_stmt(ast->for_stmt.counter);
 
     OpValue var;
 
@@ -432,8 +793,22 @@ void push_for(AST *ast) {
     else
         var = (OpValue){ .type = VAL_VAR, .source = SOURCE(ast->for_stmt.counter->assign.sym), .var = ast->for_stmt.counter->assign.name };
 
+    if (unroll_loops && push_unrolled_for(ast, var))
+        return;
+
+    unsigned int condition_label = label_count++;
+    unsigned int next_loop_label = label_count++;
+    unsigned int final_label = label_count++;
+
+    OpValue end = loop_invariant_value(ast, ast->for_stmt.end, "@for_end");
+    OpValue step = loop_invariant_value(ast, ast->for_stmt.step, "@for_step");
+
+    // The counter is in the accumulator whenever the condition is
+    // reached, the step leaves it there on the way back.
     push(OP_LOAD, temp_reg, var);
-    push(OP_COMPARE, temp_reg, ast_to_value(ast->for_stmt.end));
+    push(OP_NEW_BRANCH, NOVAL, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = condition_label });
+
+    push(OP_COMPARE, temp_reg, end);
     push(ast->for_stmt.reverse ? OP_LT : OP_GTE, temp_reg, NOVAL);
     push(OP_BRANCH_FALSE, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = final_label }, temp_reg);
 
@@ -448,7 +823,7 @@ void push_for(AST *ast) {
     push(OP_NEW_BRANCH, NOVAL, (OpValue){ .type = VAL_BRANCH, .source = SOURCE(ast), .branch = next_loop_label });
 
     push(OP_LOAD, temp_reg, var);
-    push(OP_ADD, temp_reg, ast_to_value(ast->for_stmt.step));
+    push(OP_ADD, temp_reg, step);
     push(OP_STORE, var, temp_reg);
 
     cur_loop_label = before_loop_label;
@@ -482,31 +857,64 @@ void push_while(AST *ast) {
     cur_end_loop_label = before_end_loop_label;
 }
 
+// Leaves the address of base[index] in the accumulator.
+static void push_address(AST *base, AST *index) {
+    if (is_simple(index)) {
+        push(OP_LOAD, temp_reg, ast_to_value(base));
+        push(OP_ADD, temp_reg, ast_to_value(index));
+    } else if (is_simple(base) && !has_call(index)) {
+        push(OP_LOAD, temp_reg, ast_to_value(index));
+        push(OP_ADD, temp_reg, ast_to_value(base));
+    } else if (has_call(index)) {
+        push(OP_LOAD, temp_reg, ast_to_value(base));
+        push(OP_PUSH, NOVAL, temp_reg);
+        push(OP_LOAD, temp_reg, ast_to_value(index));
+        push(OP_STORE, temp_var, temp_reg);
+        push(OP_POP, temp_reg, NOVAL);
+        push(OP_ADD, temp_reg, temp_var);
+    } else {
+        OpValue slot = alloc_scratch();
+        push(OP_LOAD, temp_reg, ast_to_value(base));
+        push(OP_STORE, slot, temp_reg);
+        push(OP_LOAD, temp_reg, ast_to_value(index));
+        push(OP_ADD, temp_reg, slot);
+        free_scratch();
+    }
+}
+
 void push_index(AST *ast) {
-    push(OP_LOAD, temp_reg, ast_to_value(ast->index.base));
-    push(OP_ADD, temp_reg, ast_to_value(ast->index.index));
+    push_address(ast->index.base, ast->index.index);
 
     if (ast->index.value == NULL) {
         push(OP_DEREF, temp_reg, temp_reg);
         return;
     }
 
-    if (LOADING_VALUE_WILL_CORRUPT(ast->index.value->type)) {
-        // Can't store this in temp var because it will be
-        // overwritten when loading the value.
+    if (!clobbers_temp(ast->index.value)) {
+        push(OP_STORE, temp_var, temp_reg);
+        push(OP_LOAD, temp_reg, ast_to_value(ast->index.value));
+        push(OP_STORE_DEREF, temp_var, temp_reg);
+    } else if (!has_call(ast->index.value)) {
+        OpValue slot = alloc_scratch();
+        push(OP_STORE, slot, temp_reg);
+        push(OP_LOAD, temp_reg, ast_to_value(ast->index.value));
+        push(OP_STORE_DEREF, slot, temp_reg);
+        free_scratch();
+    } else {
+        // The call could overwrite any slot.
         push(OP_PUSH, NOVAL, temp_reg);
         push(OP_LOAD, temp_reg, ast_to_value(ast->index.value));
         push(OP_POP, temp_var, NOVAL);
         push(OP_STORE_DEREF, temp_var, temp_reg);
-        return;
     }
-
-    push(OP_STORE, temp_var, temp_reg);
-    push(OP_LOAD, temp_reg, ast_to_value(ast->index.value));
-    push(OP_STORE_DEREF, temp_var, temp_reg);
 }
 
 void push_stmt(AST *ast) {
+    // What comes after a block, like the jump back in a loop, is still
+    // the statement around it.
+    const Location outer = cur_loc;
+    cur_loc = (Location){ .file = ast->scope.file, .ln = ast->ln, .col = ast->col };
+
     switch (ast->type) {
         case AST_FUNC:
             push_func(ast);
@@ -552,12 +960,65 @@ void push_stmt(AST *ast) {
             assert(false);
             break;
     }
+
+    cur_loc = outer;
 }
 
 void delete_ir(IR *ir) {
+    for (size_t i = 0; i < ir->name_count; i++)
+        free(ir->names[i]);
+
+    free(ir->names);
     free(ir->ops);
 }
 
+// Inserts ops before the op at pos, shifting everything after it. Ops
+// without a location get the one of the op they were put in front of.
+void ir_insert(IR *ir, size_t pos, Op *ops, size_t count) {
+    if (count == 0)
+        return;
+
+    const Location loc = pos < ir->op_count ? ir->ops[pos].loc : pos > 0 ? ir->ops[pos - 1].loc : (Location){ .file = NULL };
+
+    if (ir->op_count + count >= ir->op_capacity) {
+        while (ir->op_count + count >= ir->op_capacity)
+            ir->op_capacity *= 2;
+
+        ir->ops = realloc(ir->ops, ir->op_capacity * sizeof(Op));
+    }
+
+    memmove(&ir->ops[pos + count], &ir->ops[pos], (ir->op_count - pos) * sizeof(Op));
+    memcpy(&ir->ops[pos], ops, count * sizeof(Op));
+    ir->op_count += count;
+
+    for (size_t i = pos; i < pos + count; i++) {
+        if (ir->ops[i].loc.file == NULL)
+            ir->ops[i].loc = loc;
+    }
+}
+
+unsigned int ir_new_label(IR *ir) {
+    return ir->label_count++;
+}
+
+// Hands a malloc'd name over to the IR, which frees it.
+char *ir_own_name(IR *ir, char *name) {
+    if (ir->name_count + 1 >= ir->name_capacity) {
+        ir->name_capacity = ir->name_capacity == 0 ? 16 : ir->name_capacity * 2;
+        ir->names = realloc(ir->names, ir->name_capacity * sizeof(char *));
+    }
+
+    ir->names[ir->name_count++] = name;
+    return name;
+}
+
+// Makes up a unique variable name like "@licm3". The IR owns it.
+char *ir_new_name(IR *ir, char *prefix) {
+    char *name = malloc(strlen(prefix) + 32);
+    sprintf(name, "%s%zu", prefix, ir->name_count);
+    return ir_own_name(ir, name);
+}
+
 static char *value_to_string(OpValue *value) {
     char *string;
     switch (value->type) {
@@ -690,6 +1151,24 @@ char *op_to_string(Op *op) {
         case OP_BRANCH_FALSE:
             sprintf(code, "branch false %s\n", dst);
             break;
+        case OP_BRANCH_EQ:
+            sprintf(code, "branch eq %s\n", dst);
+            break;
+        case OP_BRANCH_NEQ:
+            sprintf(code, "branch neq %s\n", dst);
+            break;
+        case OP_BRANCH_LT:
+            sprintf(code, "branch lt %s\n", dst);
+            break;
+        case OP_BRANCH_LTE:
+            sprintf(code, "branch lte %s\n", dst);
+            break;
+        case OP_BRANCH_GT:
+            sprintf(code, "branch gt %s\n", dst);
+            break;
+        case OP_BRANCH_GTE:
+            sprintf(code, "branch gte %s\n", dst);
+            break;
         case OP_JUMP:
             sprintf(code, "jump %s\n", dst);
             break;
@@ -713,27 +1192,16 @@ char *op_to_string(Op *op) {
 }
 
 char *ir_to_string(IR *ir, bool show_nops) {
-    char *string = malloc(1024);
-    string[0] = '\0';
-    size_t capacity = 1024;
-    size_t string_len = 0;
+    StringBuilder string = create_string_builder();
 
     for (size_t i = 0; i < ir->op_count; i++) {
         if (!show_nops && ir->ops[i].type == OP_NOP)
             continue;
 
         char *op = op_to_string(&ir->ops[i]);
-        const size_t len = strlen(op);
-
-        if (string_len + len + 1 >= capacity) {
-            capacity *= 2;
-            string = realloc(string, capacity);
-        }
-
-        strcat(string, op);
+        append_string(&string, op);
         free(op);
-        string_len += len;
     }
 
-    return string;
+    return string.data;
 }
\ No newline at end of file
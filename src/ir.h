@@ -76,6 +76,12 @@ typedef enum {
     OP_GTE,
     OP_BRANCH_TRUE,
     OP_BRANCH_FALSE,
+    OP_BRANCH_EQ,
+    OP_BRANCH_NEQ,
+    OP_BRANCH_LT,
+    OP_BRANCH_LTE,
+    OP_BRANCH_GT,
+    OP_BRANCH_GTE,
     OP_JUMP,
     OP_NEW_BRANCH,
     OP_REF,
@@ -83,20 +89,38 @@ typedef enum {
     OP_STORE_DEREF
 } OpType;
 
+// Where in the source an op came from, file is NULL if it's unknown.
+typedef struct {
+    char *file;
+    size_t ln;
+    size_t col;
+} Location;
+
 typedef struct {
     OpType type;
     OpValue dst;
     OpValue src;
+    Location loc;
 } Op;
 
 typedef struct {
     Op *ops;
     size_t op_count;
     size_t op_capacity;
+    unsigned int label_count;
+
+    // Names of variables made up by the optimizer, freed with the IR.
+    char **names;
+    size_t name_count;
+    size_t name_capacity;
 } IR;
 
-IR ast_to_ir(AST *ast);
+IR ast_to_ir(AST *ast, unsigned int flags);
 void delete_ir(IR *ir);
+void ir_insert(IR *ir, size_t pos, Op *ops, size_t count);
+unsigned int ir_new_label(IR *ir);
+char *ir_own_name(IR *ir, char *name);
+char *ir_new_name(IR *ir, char *prefix);
 char *ir_to_string(IR *ir, bool show_nops);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,412 @@
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "assembler.h"
+#include "x86.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <assert.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED
+#include <sys/mman.h>
+#endif
+
+#define HOT_BACK_EDGES 1000
+#define MAX_REGION 512
+#define MAX_REGIONS 1024
+#define PAGE_SIZE 0x1000
+
+#ifdef JIT_SUPPORTED
+
+// Compiled code keeps the accumulator in rax, the stack pointer in rbx
+// and a copy of the top of the stack in r15, so ^ never touches memory.
+// r12 is the data like in the x86-64 target, r13 and r14 are what cmp
+// compared and rbp is the JitState.
+typedef struct {
+    Code code;
+    size_t start;
+    size_t end;
+    size_t first; // Instruction i has label first + i - start.
+    size_t epilogue;
+
+    size_t *exits; // Labels of the exits, each going to exit_targets.
+    size_t *exit_targets;
+    size_t exit_count;
+    size_t exit_capacity;
+} Region;
+
+#define STATE(field) ((int32_t)offsetof(JitState, field))
+
+static int32_t cell(int64_t address) {
+    return (int32_t)(address * 8);
+}
+
+// Everything but calls and the I/O that has to go through the emulator.
+static bool can_compile(Instruction *ins) {
+    switch (ins->mnemonic) {
+        case INS_CSR:
+        case INS_RSR:
+        case INS_HLT:
+        case INS_OPI:
+        case INS_IPS:
+            return false;
+        default: return true;
+    }
+}
+
+// A label that leaves for the interpreter at target.
+static size_t exit_to(Region *r, size_t target) {
+    for (size_t i = 0; i < r->exit_count; i++) {
+        if (r->exit_targets[i] == target)
+            return r->exits[i];
+    }
+
+    if (r->exit_count == r->exit_capacity) {
+        r->exit_capacity *= 2;
+        r->exits = realloc(r->exits, r->exit_capacity * sizeof(size_t));
+        r->exit_targets = realloc(r->exit_targets, r->exit_capacity * sizeof(size_t));
+    }
+
+    r->exits[r->exit_count] = new_label(&r->code);
+    r->exit_targets[r->exit_count] = target;
+    return r->exits[r->exit_count++];
+}
+
+static size_t jump_label(Region *r, int64_t target) {
+    if ((size_t)target >= r->start && (size_t)target < r->end)
+        return r->first + (size_t)target - r->start;
+
+    return exit_to(r, (size_t)target);
+}
+
+// reg = the operand.
+static void load_operand(Code *code, int reg, Instruction *ins) {
+    switch (ins->mode) {
+        case OPERAND_ACC:
+            if (reg != RAX)
+                x86_rr(code, true, X86_LOAD, reg, RAX);
+            break;
+        case OPERAND_INT:
+            x86_mov_imm(code, reg, ins->operand);
+            break;
+        case OPERAND_MEMORY:
+            x86_mem(code, true, X86_LOAD, reg, R12, NO_INDEX, 1, cell(ins->operand));
+            break;
+        case OPERAND_STACK:
+            if (reg != R15)
+                x86_rr(code, true, X86_LOAD, reg, R15);
+            break;
+        default: assert(false);
+    }
+}
+
+// rax = rax op operand.
+static void math_operand(Code *code, uint32_t opcode, Instruction *ins) {
+    if (ins->mode == OPERAND_MEMORY)
+        x86_mem(code, true, opcode, RAX, R12, NO_INDEX, 1, cell(ins->operand));
+    else if (ins->mode == OPERAND_STACK)
+        x86_rr(code, true, opcode, RAX, R15);
+    else if (ins->mode == OPERAND_ACC)
+        x86_rr(code, true, opcode, RAX, RAX);
+    else {
+        x86_mov_imm(code, RCX, ins->operand);
+        x86_rr(code, true, opcode, RAX, RCX);
+    }
+}
+
+// Leaves at i when the address in rcx is outside the data.
+static void check_address(Region *r, size_t i) {
+    x86_mem(&r->code, true, X86_CMP, RCX, RBP, NO_INDEX, 1, STATE(mem_size));
+    x86_jcc(&r->code, CC_AE, exit_to(r, i));
+}
+
+static Cond condition(Mnemonic mnemonic) {
+    switch (mnemonic) {
+        case INS_SEQ: case INS_BEQ: return CC_E;
+        case INS_SNE: case INS_BNE: return CC_NE;
+        case INS_SLT: case INS_BLT: return CC_L;
+        case INS_SLE: case INS_BLE: return CC_LE;
+        case INS_SGT: case INS_BGT: return CC_G;
+        default: return CC_GE;
+    }
+}
+
+// Anything that can fail leaves for the interpreter before it changes
+// something, so the interpreter does it again and reports it.
+static void compile_instruction(Region *r, size_t i, Instruction *ins) {
+    Code *code = &r->code;
+
+    switch (ins->mnemonic) {
+        case INS_LDA:
+            load_operand(code, RAX, ins);
+            break;
+        case INS_STA:
+            x86_mem(code, true, X86_STORE, RAX, R12, NO_INDEX, 1, cell(ins->operand));
+            break;
+        case INS_REF:
+            x86_mov_imm(code, RAX, ins->operand);
+            break;
+        case INS_LDD:
+            if (ins->mode == OPERAND_MEMORY)
+                load_operand(code, RCX, ins);
+            else
+                x86_rr(code, true, X86_LOAD, RCX, RAX);
+
+            check_address(r, i);
+            x86_mem(code, true, X86_LOAD, RAX, R12, RCX, 8, 0);
+            break;
+        case INS_STD:
+            load_operand(code, RCX, ins);
+            check_address(r, i);
+            x86_mem(code, true, X86_STORE, RAX, R12, RCX, 8, 0);
+            break;
+        case INS_SWP:
+            load_operand(code, RCX, ins);
+            x86_mem(code, true, X86_STORE, RAX, R12, NO_INDEX, 1, cell(ins->operand));
+            x86_rr(code, true, X86_LOAD, RAX, RCX);
+            break;
+        case INS_ADD: math_operand(code, X86_ADD, ins); break;
+        case INS_SUB: math_operand(code, X86_SUB, ins); break;
+        case INS_MUL: math_operand(code, X86_IMUL, ins); break;
+        case INS_AND: math_operand(code, X86_AND, ins); break;
+        case INS_OR: math_operand(code, X86_OR, ins); break;
+        case INS_XOR: math_operand(code, X86_XOR, ins); break;
+        case INS_DIV:
+        case INS_MOD:
+            // idiv faults on 0 and on the most negative number over -1.
+            load_operand(code, RCX, ins);
+            x86_rr(code, true, X86_TEST, RCX, RCX);
+            x86_jcc(code, CC_E, exit_to(r, i));
+            x86_rr(code, true, X86_GROUP_IMM, 7, RCX);
+            put32(code, (uint32_t)-1);
+            x86_jcc(code, CC_E, exit_to(r, i));
+            x86_cqo(code);
+            x86_rr(code, true, X86_GROUP_UNARY, 7, RCX);
+
+            if (ins->mnemonic == INS_MOD)
+                x86_rr(code, true, X86_LOAD, RAX, RDX);
+            break;
+        case INS_SHL:
+        case INS_SHR:
+            load_operand(code, RCX, ins);
+            x86_rr(code, true, X86_GROUP_SHIFT, ins->mnemonic == INS_SHL ? 4 : 7, RAX);
+            break;
+        case INS_NOT:
+        case INS_NEG:
+            load_operand(code, RAX, ins);
+            x86_rr(code, true, X86_GROUP_UNARY, ins->mnemonic == INS_NOT ? 2 : 3, RAX);
+            break;
+        case INS_PSH: {
+            const int reg = ins->mode == OPERAND_ACC ? RAX : ins->mode == OPERAND_STACK ? R15 : RCX;
+            x86_mem(code, true, X86_CMP, RBX, RBP, NO_INDEX, 1, STATE(stack_end));
+            x86_jcc(code, CC_E, exit_to(r, i));
+            load_operand(code, reg, ins);
+            x86_mem(code, true, X86_STORE, reg, RBX, NO_INDEX, 1, 0);
+            x86_mem(code, true, X86_LEA, RBX, RBX, NO_INDEX, 1, 8);
+
+            if (reg != R15)
+                x86_rr(code, true, X86_LOAD, R15, reg);
+            break;
+        }
+        case INS_POP:
+            x86_mem(code, true, X86_CMP, RBX, RBP, NO_INDEX, 1, STATE(stack_base));
+            x86_jcc(code, CC_E, exit_to(r, i));
+            x86_mem(code, true, X86_LEA, RBX, RBX, NO_INDEX, 1, -8);
+
+            if (ins->mode == OPERAND_ACC)
+                x86_rr(code, true, X86_LOAD, RAX, R15);
+            else
+                x86_mem(code, true, X86_STORE, R15, R12, NO_INDEX, 1, cell(ins->operand));
+
+            x86_mem(code, true, X86_LOAD, R15, RBX, NO_INDEX, 1, -8);
+            break;
+        case INS_CMP:
+            x86_rr(code, true, X86_LOAD, R13, RAX);
+            load_operand(code, R14, ins);
+            break;
+        case INS_SEQ:
+        case INS_SNE:
+        case INS_SLT:
+        case INS_SLE:
+        case INS_SGT:
+        case INS_SGE:
+            x86_rr(code, true, X86_CMP, R14, R13);
+            x86_setcc(code, condition(ins->mnemonic), RAX);
+            break;
+        case INS_BEQ:
+        case INS_BNE:
+        case INS_BLT:
+        case INS_BLE:
+        case INS_BGT:
+        case INS_BGE:
+            x86_rr(code, true, X86_CMP, R14, R13);
+            x86_jcc(code, condition(ins->mnemonic), jump_label(r, ins->operand));
+            break;
+        case INS_JMP:
+            x86_jmp(code, jump_label(r, ins->operand));
+            break;
+        case INS_OPC:
+            // Straight into the emulator's buffer, it flushes a full one.
+            x86_mem(code, true, X86_LOAD, RCX, RBP, NO_INDEX, 1, STATE(out_len));
+            x86_mem(code, true, X86_CMP, RCX, RBP, NO_INDEX, 1, STATE(out_size));
+            x86_jcc(code, CC_AE, exit_to(r, i));
+            load_operand(code, RSI, ins);
+            x86_mem(code, true, X86_LOAD, RDX, RBP, NO_INDEX, 1, STATE(out));
+            x86_mem(code, false, X86_STORE_BYTE, RSI, RDX, RCX, 1, 0);
+            x86_rr(code, true, X86_GROUP_INC, 0, RCX);
+            x86_mem(code, true, X86_STORE, RCX, RBP, NO_INDEX, 1, STATE(out_len));
+            break;
+        default: assert(false);
+    }
+}
+
+static const int saved[] = { RBX, RBP, R12, R13, R14, R15 };
+
+static void write_prologue(Region *r) {
+    Code *code = &r->code;
+
+    for (int i = 0; i < 6; i++)
+        x86_push(code, saved[i]);
+
+    x86_rr(code, true, X86_LOAD, RBP, RDI);
+    x86_mem(code, true, X86_LOAD, RAX, RBP, NO_INDEX, 1, STATE(acc));
+    x86_mem(code, true, X86_LOAD, R13, RBP, NO_INDEX, 1, STATE(fa));
+    x86_mem(code, true, X86_LOAD, R14, RBP, NO_INDEX, 1, STATE(fo));
+    x86_mem(code, true, X86_LOAD, RBX, RBP, NO_INDEX, 1, STATE(sp));
+    x86_mem(code, true, X86_LOAD, R12, RBP, NO_INDEX, 1, STATE(mem));
+    x86_mem(code, true, X86_LOAD, R15, RBX, NO_INDEX, 1, -8);
+}
+
+// Every exit puts where to carry on from in rcx and comes through here.
+static void write_exits(Region *r) {
+    Code *code = &r->code;
+
+    for (size_t i = 0; i < r->exit_count; i++) {
+        place_label(code, r->exits[i]);
+        x86_mov_imm(code, RCX, (int64_t)r->exit_targets[i]);
+        x86_jmp(code, r->epilogue);
+    }
+
+    place_label(code, r->epilogue);
+    x86_mem(code, true, X86_STORE, RAX, RBP, NO_INDEX, 1, STATE(acc));
+    x86_mem(code, true, X86_STORE, R13, RBP, NO_INDEX, 1, STATE(fa));
+    x86_mem(code, true, X86_STORE, R14, RBP, NO_INDEX, 1, STATE(fo));
+    x86_mem(code, true, X86_STORE, RBX, RBP, NO_INDEX, 1, STATE(sp));
+    x86_rr(code, true, X86_LOAD, RAX, RCX);
+
+    for (int i = 5; i >= 0; i--)
+        x86_pop(code, saved[i]);
+
+    x86_ret(code);
+}
+
+// Written while writable and then made executable, never both at once.
+static JitFunction map_code(Jit *jit, Code *code) {
+    const size_t size = (code->len + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (region == MAP_FAILED)
+        return NULL;
+
+    memcpy(region, code->bytes, code->len);
+
+    if (mprotect(region, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(region, size);
+        return NULL;
+    }
+
+    jit->regions[jit->region_count] = region;
+    jit->region_sizes[jit->region_count++] = size;
+
+    // ISO C has no cast from data to function pointers.
+    JitFunction function;
+    memcpy(&function, &region, sizeof(function));
+    return function;
+}
+
+// From start up to the first instruction that can't be compiled, jumps
+// out of that leave for the interpreter.
+static JitFunction compile_region(Jit *jit, size_t start) {
+    Program *program = jit->program;
+    size_t end = start;
+
+    while (end < program->code_count && end - start < MAX_REGION && can_compile(&program->code[end]))
+        end++;
+
+    if (end == start || jit->region_count == MAX_REGIONS)
+        return NULL;
+
+    Region r = (Region){ .code = create_code(), .start = start, .end = end, .exits = malloc(16 * sizeof(size_t)),
+        .exit_targets = malloc(16 * sizeof(size_t)), .exit_count = 0, .exit_capacity = 16 };
+    r.first = r.code.label_count;
+
+    for (size_t i = start; i < end; i++)
+        new_label(&r.code);
+
+    r.epilogue = new_label(&r.code);
+    write_prologue(&r);
+
+    for (size_t i = start; i < end; i++) {
+        place_label(&r.code, r.first + i - start);
+        compile_instruction(&r, i, &program->code[i]);
+    }
+
+    x86_jmp(&r.code, exit_to(&r, end));
+    write_exits(&r);
+
+    JitFunction function = link_code(&r.code) ? map_code(jit, &r.code) : NULL;
+    delete_code(&r.code);
+    free(r.exits);
+    free(r.exit_targets);
+    return function;
+}
+
+#else
+
+static JitFunction compile_region(Jit *jit, size_t start) {
+    (void)jit;
+    (void)start;
+    return NULL;
+}
+
+#endif
+
+Jit *create_jit(Program *program) {
+#ifdef JIT_SUPPORTED
+    Jit *jit = malloc(sizeof(Jit));
+    jit->program = program;
+    jit->counts = calloc(program->code_count + 1, sizeof(uint32_t));
+    jit->entries = calloc(program->code_count + 1, sizeof(JitFunction));
+    jit->regions = malloc(MAX_REGIONS * sizeof(void *));
+    jit->region_sizes = malloc(MAX_REGIONS * sizeof(size_t));
+    jit->region_count = 0;
+    return jit;
+#else
+    (void)program;
+    return NULL;
+#endif
+}
+
+void delete_jit(Jit *jit) {
+#ifdef JIT_SUPPORTED
+    for (size_t i = 0; i < jit->region_count; i++)
+        munmap(jit->regions[i], jit->region_sizes[i]);
+#endif
+
+    free(jit->counts);
+    free(jit->entries);
+    free(jit->regions);
+    free(jit->region_sizes);
+    free(jit);
+}
+
+JitFunction jit_back_edge(Jit *jit, size_t target) {
+    if (jit->entries[target] == NULL && ++jit->counts[target] == HOT_BACK_EDGES)
+        jit->entries[target] = compile_region(jit, target);
+
+    return jit->entries[target];
+}
\ No newline at end of file
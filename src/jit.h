@@ -0,0 +1,45 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "assembler.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// What compiled code reads and writes of the emulator, it's handed
+// over on entry and taken back on exit.
+typedef struct {
+    int64_t acc;
+    int64_t fa;
+    int64_t fo;
+    int64_t *sp;
+    int64_t *mem;
+    uint64_t mem_size;
+    int64_t *stack_base;
+    int64_t *stack_end;
+    char *out;
+    uint64_t out_len;
+    uint64_t out_size;
+} JitState;
+
+// Runs until something it can't do and returns the instruction the
+// interpreter carries on from.
+typedef int64_t (*JitFunction)(JitState *state);
+
+typedef struct {
+    Program *program;
+    uint32_t *counts;      // Times each instruction was jumped back to.
+    JitFunction *entries;  // Compiled code starting at each instruction.
+    void **regions;        // Mappings to free, with their sizes in region_sizes.
+    size_t *region_sizes;
+    size_t region_count;
+} Jit;
+
+// NULL where there's no x86-64 to compile to.
+Jit *create_jit(Program *program);
+void delete_jit(Jit *jit);
+
+// Called for every backward jump that's taken, gives back compiled code
+// for the target once it's hot.
+JitFunction jit_back_edge(Jit *jit, size_t target);
+
+#endif
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "compile.h"
+#include "optimizer.h"
 #include "error.h"
+#include "backend.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,15 +12,25 @@ void help(char *prog) {
            "commands:\n"
            "    asm                 produce an assembly file\n"
            "    build               produce a binary file\n"
+           "    exe                 run a minstral binary on the built-in emulator\n"
            "    ir                  produce an ir file\n"
-           "    run                 produce and execute a binary file\n"
+           "    run                 execute the program\n"
            "options:\n"
            "    -o <output file>    specify the output filename\n"
            "    -unopt              disable optimization\n"
+           "    -O0 -O1 -O2 -Os     set the optimization level, -O2 by default\n"
+           "    -funroll-loops      unroll for loops with constant bounds at -O2\n"
+           "    -target=<target>    build for minstral (default), x86-64 or c\n"
+           "    -mas                assemble and run with mas instead of the built-in assembler and emulator\n"
+           "    -map                write a source map from instructions to source lines\n"
            "dev options:\n"
            "    -freestanding       don't use the standard library\n"
            "    -nops               show nops in ir output\n"
            "    -no-omit-libs       don't omit library code when assembling\n"
+           "    -passes=<passes>    run a comma separated list of optimization passes\n"
+           "    -time-passes        print the time and op count change of every pass\n"
+           "    -peephole-stats     print how many times each peephole rule fired\n"
+           "    -no-jit             interpret every instruction when running\n"
            , prog);
 }
 
@@ -40,6 +52,8 @@ int main(int argc, char **argv) {
         flags |= COMP_IR;
     else if (strcmp(command, "run") == 0)
         flags |= COMP_RUN;
+    else if (strcmp(command, "exe") == 0)
+        flags |= COMP_EXECUTE;
     else if (strcmp(command, "build") != 0) {
         log_error(NULL, 0, 0);
         fprintf(stderr, "unknown command '%s'\n", command);
@@ -48,6 +62,9 @@ int main(int argc, char **argv) {
 
     char *infile = NULL;
     char *outfile = "a.out";
+    char *passes = NULL;
+    char *level = "2";
+    Target target = TARGET_MINSTRAL;
 
     for (int i = 2; i < argc; i++) {
         if (strcmp(argv[i], "-nops") == 0) {
@@ -71,6 +88,33 @@ int main(int argc, char **argv) {
             flags |= COMP_UPPERCASE;
         else if (strcmp(argv[i], "-unopt") == 0)
             flags |= COMP_UNOPTIMIZED;
+        else if (strncmp(argv[i], "-O", 2) == 0) {
+            level = argv[i] + 2;
+            passes = level_pipeline(level);
+
+            if (passes == NULL) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "unknown optimization level '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+
+            if (strcmp(argv[i], "-Os") == 0)
+                flags |= COMP_OPTIMIZE_SIZE;
+            else
+                flags &= ~COMP_OPTIMIZE_SIZE;
+        } else if (strncmp(argv[i], "-passes=", 8) == 0) {
+            passes = argv[i] + 8;
+            char *unknown = unknown_pass(passes);
+
+            if (unknown != NULL) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "unknown pass '%.*s'\n", (int)strcspn(unknown, ","), unknown);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-time-passes") == 0)
+            flags |= COMP_TIME_PASSES;
+        else if (strcmp(argv[i], "-funroll-loops") == 0)
+            flags |= COMP_UNROLL_LOOPS;
         else if (strcmp(argv[i], "-no-omit-libs") == 0) {
             if (!(flags & COMP_OMIT_LIBS)) {
                 log_error(NULL, 0, 0);
@@ -79,8 +123,47 @@ int main(int argc, char **argv) {
             }
 
             flags &= ~COMP_OMIT_LIBS;
+        } else if (strncmp(argv[i], "-target=", 8) == 0) {
+            target = find_target(argv[i] + 8);
+
+            if (target == TARGET_COUNT) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "unknown target '%s'\n", argv[i] + 8);
+                return EXIT_FAILURE;
+            } else if (target != TARGET_MINSTRAL && (flags & (COMP_DONT_ASSEMBLE | COMP_IR))) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "invalid option '%s' used with command '%s'\n", argv[i], command);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-map") == 0) {
+            if (flags & (COMP_DONT_ASSEMBLE | COMP_IR)) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "invalid option '%s' used with command '%s'\n", argv[i], command);
+                return EXIT_FAILURE;
+            }
+
+            flags |= COMP_SOURCE_MAP;
+        } else if (strcmp(argv[i], "-mas") == 0) {
+            if (flags & (COMP_DONT_ASSEMBLE | COMP_IR | COMP_EXECUTE)) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "invalid option '%s' used with command '%s'\n", argv[i], command);
+                return EXIT_FAILURE;
+            }
+
+            flags |= COMP_EXTERNAL_VM;
         } else if (strcmp(argv[i], "-freestanding") == 0)
             flags |= COMP_FREESTANDING;
+        else if (strcmp(argv[i], "-peephole-stats") == 0)
+            flags |= COMP_PEEPHOLE_STATS;
+        else if (strcmp(argv[i], "-no-jit") == 0) {
+            if (!(flags & (COMP_RUN | COMP_EXECUTE))) {
+                log_error(NULL, 0, 0);
+                fprintf(stderr, "invalid option '%s' used with command '%s'\n", argv[i], command);
+                return EXIT_FAILURE;
+            }
+
+            flags |= COMP_NO_JIT;
+        }
         else if (i == argc - 1)
             infile = argv[i];
         else {
@@ -96,5 +179,12 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    return compile(infile, outfile, flags);
+    if (flags & COMP_EXECUTE)
+        return execute(infile, flags);
+
+    // Unrolling trades size for speed, so it's only done at -O2.
+    if (strcmp(level, "2") != 0)
+        flags &= ~COMP_UNROLL_LOOPS;
+
+    return compile(infile, outfile, passes, target, flags);
 }
\ No newline at end of file
@@ -1,187 +1,131 @@
 #include "optimizer.h"
 #include "ir.h"
+#include "cfg.h"
+#include "passes.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    void (*run)(IR *ir);
+} Pass;
+
+static const Pass passes[] = {
+    { "dead-subroutines", dead_subroutine_elimination },
+    { "pure-calls", evaluate_pure_calls },
+    { "peephole", peephole },
+    { "licm", loop_invariant_code_motion },
+    { "strength", strength_reduction },
+    { "fuse-branches", fuse_compare_branches },
+    { "thread-jumps", thread_jumps },
+    { "gvn", global_value_numbering },
+    { "dse", dead_store_elimination },
+    { "overlay", overlay_data_slots }
+};
+
+// No point in optimizing what's never called, which includes whatever
+// was only called with constants. The peephole pass leaves the loops
+// tidy enough to see what's invariant, then cleans up after the
+// hoisting. Sharing data slots goes last, nothing after it has to
+// untangle which subroutine a slot belongs to.
+#define O2_PIPELINE "dead-subroutines,pure-calls,dead-subroutines,peephole,licm,strength,fuse-branches,thread-jumps,gvn,dse,peephole,overlay"
+
+// Only the cheap passes, for fast builds that still aren't terrible.
+#define O1_PIPELINE "dead-subroutines,peephole,fuse-branches,thread-jumps,peephole"
+
+// The -O2 passes without loop invariant code motion, which adds a
+// preheader to every loop it hoists out of. Strength reduction is
+// costed by size here, so it only takes rewrites that are no bigger,
+// like a multiply by a power of two.
+#define OS_PIPELINE "dead-subroutines,pure-calls,dead-subroutines,peephole,strength,fuse-branches,thread-jumps,gvn,dse,peephole,overlay"
+
+static const Pass *find_pass(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+        if (strlen(passes[i].name) == len && strncmp(passes[i].name, name, len) == 0)
+            return &passes[i];
+    }
 
-#define IS_ACC(op) (op.type == VAL_REG && op.reg == TEMP_REG)
-#define IS_MATH(type) (type >= OP_ADD && type <= OP_XOR)
-
-static void step(Optimizer *opt) {
-    if (opt->pos + 1 < opt->ir->op_count)
-        opt->op = &opt->ir->ops[++opt->pos];
-}
-
-// Peek and skip any NOPs if encountered.
-static Op *peek(Optimizer *opt, int offset) {
-    Op *op;
-
-    if (opt->pos + offset >= opt->ir->op_count)
-        op = &opt->ir->ops[opt->ir->op_count - 1];
-    else if ((int)opt->pos + offset < 1)
-        op = &opt->ir->ops[0];
-    else
-        op = &opt->ir->ops[opt->pos + offset];
-
-    while (op->type == OP_NOP && offset + 1 < (int)opt->ir->op_count)
-        op = peek(opt, offset < 0 ? offset - 1 : offset + 1);
-
-    return op;
+    return NULL;
 }
 
-static void jump_to(Optimizer *opt, size_t pos) {
-    opt->op = &opt->ir->ops[pos];
-    opt->pos = pos;
+char *level_pipeline(char *level) {
+    if (strcmp(level, "0") == 0)
+        return "";
+    else if (strcmp(level, "1") == 0)
+        return O1_PIPELINE;
+    else if (strcmp(level, "2") == 0)
+        return O2_PIPELINE;
+    else if (strcmp(level, "s") == 0)
+        return OS_PIPELINE;
+
+    return NULL;
 }
 
-// Eliminates ops that have no effect, like loading the accumulator
-// into itself.
-void dead_code_elimination(Optimizer *opt) {
-    if ((opt->op->type == OP_LOAD || opt->op->type == OP_STORE) && IS_ACC(opt->op->dst) && IS_ACC(opt->op->src)) {
-        opt->op->type = OP_NOP;
-        return;
-    }
-
-    Op *next = peek(opt, 1);
+// Returns the first name in the pipeline that isn't a pass, or NULL.
+char *unknown_pass(char *pipeline) {
+    for (char *name = pipeline; *name != '\0'; ) {
+        size_t len = strcspn(name, ",");
 
-    // No point to store into a variable then load the variable back,
-    // the value is still in the accumulator.
-    if (opt->op->type == OP_STORE && IS_ACC(opt->op->src) && opt->op->dst.type == VAL_VAR &&
-            next->type == OP_LOAD && IS_ACC(next->dst) && next->src.type == VAL_VAR &&
-            strcmp(opt->op->dst.var, next->src.var) == 0 && 
-            strcmp(opt->op->dst.source.scope, next->src.source.scope) == 0) {
+        if (find_pass(name, len) == NULL)
+            return name;
 
-        next->type = OP_NOP;
+        name += len + (name[len] == ',');
     }
+
+    return NULL;
 }
 
-// Tries (not perfectly) to evaluate constant expressions into
-// as little constants as possible.
-void weak_constant_folding(Optimizer *opt) {
-    if (opt->op->type != OP_LOAD || !IS_ACC(opt->op->dst) || opt->op->src.type != VAL_INT)
-        return;
+static size_t count_ops(IR *ir) {
+    size_t count = 0;
 
-    Op *next = peek(opt, 1);
+    for (size_t i = 0; i < ir->op_count; i++)
+        count += ir->ops[i].type != OP_NOP;
 
-    // A common pattern in math expressions is the following:
-    // load [int]
-    // store @temp
-    // load
-    // math @temp
+    return count;
+}
 
-    if (!IS_MATH(next->type))
-        return;
-        
-    if (next->src.type == VAL_INT) {
-        switch (next->type) {
-            case OP_ADD:
-                opt->op->src.int_const += next->src.int_const;
-                break;
-            case OP_SUB:
-                opt->op->src.int_const -= next->src.int_const;
-                break;
-            case OP_MUL:
-                opt->op->src.int_const *= next->src.int_const;
-                break;
-            case OP_DIV:
-                opt->op->src.int_const /= next->src.int_const;
-                break;
-            case OP_MOD:
-                opt->op->src.int_const %= next->src.int_const;
-                break;
-            case OP_SHL:
-                opt->op->src.int_const <<= next->src.int_const;
-                break;
-            case OP_SHR:
-                opt->op->src.int_const >>= next->src.int_const;
-                break;
-            case OP_AND:
-                opt->op->src.int_const &= next->src.int_const;
-                break;
-            case OP_OR:
-                opt->op->src.int_const |= next->src.int_const;
-                break;
-            default:
-                opt->op->src.int_const ^= next->src.int_const;
-                break;
-        }
-    } // NOT and NEG don't have int operands.
-    else if (opt->op->type == OP_NOT)
-        opt->op->src.int_const = !opt->op->src.int_const;
-    else if (opt->op->type == OP_NEG)
-        opt->op->src.int_const = -opt->op->src.int_const;
-    else
+// Runs the comma separated passes in order, or the -O2 ones if the
+// pipeline is NULL.
+void optimize_ir(IR *ir, char *pipeline, bool time_passes) {
+    if (ir->op_count == 0)
         return;
+    else if (pipeline == NULL)
+        pipeline = O2_PIPELINE;
 
-    next->type = OP_NOP;
-}
+    if (time_passes)
+        fprintf(stderr, "%-18s %10s %8s %8s\n", "pass", "time (ms)", "ops", "delta");
 
-// Reduces stack usage like push and pops by elimination and propogation.
-void stack_reduction(Optimizer *opt) {
-    Op *next = peek(opt, 1);
+    const size_t start_ops = count_ops(ir);
+    double total = 0.0;
 
-    if (opt->op->type == OP_LOAD && next->type == OP_PUSH && IS_ACC(next->src)) {
-        opt->op->type = OP_NOP;
-        next->src = opt->op->src;
-        return;
-    } else if (opt->op->type == OP_PUSH && next->type == OP_POP) {
-        opt->op->type = OP_LOAD;
-        opt->op->dst = (OpValue){ .type = VAL_REG, .reg = TEMP_REG };
-        next->type = OP_STORE;
-        next->src = (OpValue){ .type = VAL_REG, .reg = TEMP_REG };
-    } else if (opt->op->type == OP_POP && IS_ACC(opt->op->dst) && 
-            next->type == OP_STORE && IS_ACC(next->src)) {
-        opt->op->type = OP_NOP;
-        next->type = OP_POP;
-        return;
-    }
+    for (char *name = pipeline; *name != '\0'; ) {
+        size_t len = strcspn(name, ",");
+        const Pass *pass = find_pass(name, len);
+        assert(pass != NULL);
 
-    // A common math pattern:
-    // push
-    // load
-    // store @temp
-    // pop @acc
-    // math
+        const size_t before = time_passes ? count_ops(ir) : 0;
+        const clock_t start = clock();
 
-    if (opt->op->type != OP_PUSH || IS_ACC(opt->op->src) || next->type != OP_LOAD)
-        return;
+        pass->run(ir);
 
-    Op *next2 = peek(opt, 2);
-    Op *next3 = peek(opt, 3);
+        if (time_passes) {
+            const double ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+            const size_t after = count_ops(ir);
 
-    if (next2->type != OP_STORE || next2->dst.type != VAL_VAR || strcmp(next2->dst.var, "@temp") != 0 ||
-            next3->type != OP_POP || !IS_ACC(next3->dst))
-        return;
+            total += ms;
+            fprintf(stderr, "%-18s %10.3f %8zu %+8lld\n", pass->name, ms, after, (long long)after - (long long)before);
+        }
 
-    opt->op->type = OP_NOP;
-    next3->type = OP_LOAD;
-    next3->src = opt->op->src;
-}
+        name += len + (name[len] == ',');
+    }
 
-static void pass(Optimizer *opt) {
-    while (opt->pos + 2 < opt->ir->op_count) {
-        dead_code_elimination(opt);
-        //weak_constant_folding(opt);
-        stack_reduction(opt);
-        step(opt);
+    if (time_passes) {
+        const size_t after = count_ops(ir);
+        fprintf(stderr, "%-18s %10.3f %8zu %+8lld\n", "total", total, after, (long long)after - (long long)start_ops);
     }
 }
-
-void optimize_ir(IR *ir) {
-    if (ir->op_count == 0)
-        return;
-
-    Optimizer opt = (Optimizer){ .ir = ir, .op = &ir->ops[0], .pos = 0 };
-
-    // Do three passes.
-    pass(&opt);
-    jump_to(&opt, 0);
-
-    pass(&opt);
-    jump_to(&opt, 0);
-
-    pass(&opt);
-}
\ No newline at end of file
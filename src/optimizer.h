@@ -3,13 +3,10 @@
 
 #include "ir.h"
 #include <stdio.h>
+#include <stdbool.h>
 
-typedef struct {
-    IR *ir;
-    Op *op;
-    size_t pos;
-} Optimizer;
-
-void optimize_ir(IR *ir);
+char *level_pipeline(char *level);
+char *unknown_pass(char *pipeline);
+void optimize_ir(IR *ir, char *pipeline, bool time_passes);
 
 #endif
\ No newline at end of file
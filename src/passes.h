@@ -0,0 +1,19 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include "ir.h"
+#include <stdio.h>
+
+void dead_subroutine_elimination(IR *ir);
+void evaluate_pure_calls(IR *ir);
+void loop_invariant_code_motion(IR *ir);
+void strength_reduction(IR *ir);
+void fuse_compare_branches(IR *ir);
+void global_value_numbering(IR *ir);
+void dead_store_elimination(IR *ir);
+void overlay_data_slots(IR *ir);
+void thread_jumps(IR *ir);
+void peephole(IR *ir);
+void print_peephole_stats(FILE *out);
+
+#endif
@@ -0,0 +1,235 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#define MAX_THREAD_HOPS 32
+
+static bool is_any_branch(Op *op) {
+    return op_is_branch(op) || op->type == OP_JUMP;
+}
+
+static OpType invert_branch(OpType type) {
+    switch (type) {
+        case OP_BRANCH_TRUE: return OP_BRANCH_FALSE;
+        case OP_BRANCH_FALSE: return OP_BRANCH_TRUE;
+        case OP_BRANCH_EQ: return OP_BRANCH_NEQ;
+        case OP_BRANCH_NEQ: return OP_BRANCH_EQ;
+        case OP_BRANCH_LT: return OP_BRANCH_GTE;
+        case OP_BRANCH_LTE: return OP_BRANCH_GT;
+        case OP_BRANCH_GT: return OP_BRANCH_LTE;
+        default: break;
+    }
+
+    return OP_BRANCH_LT;
+}
+
+static size_t *count_label_refs(IR *ir) {
+    size_t *refs = calloc(ir->label_count + 1, sizeof(size_t));
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (is_any_branch(&ir->ops[i]) && ir->ops[i].dst.branch < ir->label_count)
+            refs[ir->ops[i].dst.branch]++;
+    }
+
+    return refs;
+}
+
+// A condition ends up as:
+// compare @acc, x
+// lt @acc
+// branch true [label]
+// which sets the accumulator just to test it again. The branch can
+// use the compare's flags directly when nothing reads the accumulator
+// afterwards.
+static void fuse_routine(IR *ir, size_t begin, size_t *refs) {
+    CFG cfg = build_cfg(ir, begin);
+
+    for (size_t b = 0; b < cfg.block_count; b++) {
+        Block *block = &cfg.blocks[b];
+        Op *branch = &ir->ops[cfg.index[block->end - 1]];
+
+        if (branch->type != OP_BRANCH_TRUE && branch->type != OP_BRANCH_FALSE)
+            continue;
+
+        // Find the set op, skipping the unused done label of the condition.
+        size_t pos = block->end - 1;
+        Op *set = NULL;
+
+        for (size_t k = pos; k > 0 && set == NULL; k--) {
+            Op *op = &ir->ops[cfg.index[k - 1]];
+
+            if (op->type == OP_NOP || (op->type == OP_NEW_BRANCH && refs[op->src.branch] == 0))
+                continue;
+            else if (IS_SET(op->type) && IS_ACC(op->dst))
+                set = op;
+            else
+                break;
+
+            pos = k - 1;
+        }
+
+        if (set == NULL)
+            continue;
+
+        Op *compare = NULL;
+
+        for (size_t k = pos; k > 0; k--) {
+            Op *op = &ir->ops[cfg.index[k - 1]];
+
+            if (op->type == OP_NOP)
+                continue;
+            else if (op->type == OP_COMPARE && IS_ACC(op->dst))
+                compare = op;
+
+            break;
+        }
+
+        if (compare == NULL)
+            continue;
+
+        bool acc_live = false;
+
+        for (size_t i = 0; i < block->succ_count; i++)
+            acc_live |= acc_live_at(&cfg, cfg.blocks[block->succs[i]].start);
+
+        if (acc_live)
+            continue;
+
+        OpType fused = OP_BRANCH_EQ + (set->type - OP_EQ);
+        branch->type = branch->type == OP_BRANCH_TRUE ? fused : invert_branch(fused);
+        branch->src = (OpValue){ .type = VAL_NONE };
+        set->type = OP_NOP;
+    }
+
+    delete_cfg(&cfg);
+}
+
+void fuse_compare_branches(IR *ir) {
+    size_t *refs = count_label_refs(ir);
+
+    for (size_t n = 0; nth_routine(ir, n) != NO_ROUTINE; n++)
+        fuse_routine(ir, nth_routine(ir, n), refs);
+
+    free(refs);
+}
+
+// The next op that emits code, or op_count.
+static size_t next_code(IR *ir, size_t pos) {
+    while (pos < ir->op_count && (ir->ops[pos].type == OP_NOP || ir->ops[pos].type == OP_NEW_VAR))
+        pos++;
+
+    return pos;
+}
+
+// True if control falls from pos straight into the label.
+static bool falls_into(IR *ir, size_t pos, unsigned int label) {
+    for (pos = next_code(ir, pos); pos < ir->op_count && ir->ops[pos].type == OP_NEW_BRANCH; pos = next_code(ir, pos + 1)) {
+        if (ir->ops[pos].src.branch == label)
+            return true;
+    }
+
+    return false;
+}
+
+static bool thread_once(IR *ir) {
+    size_t *labels = malloc((ir->label_count + 1) * sizeof(size_t));
+    bool changed = false;
+
+    for (size_t i = 0; i < ir->label_count; i++)
+        labels[i] = ir->op_count;
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type == OP_NEW_BRANCH && ir->ops[i].src.branch < ir->label_count)
+            labels[ir->ops[i].src.branch] = i;
+    }
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        Op *op = &ir->ops[i];
+
+        if (!is_any_branch(op) || op->dst.branch >= ir->label_count)
+            continue;
+
+        // Go straight to where a chain of jumps ends up, unless it's
+        // a cycle that never ends up anywhere.
+        OpValue original = op->dst;
+        size_t hops = 0;
+
+        for (; hops < MAX_THREAD_HOPS; hops++) {
+            size_t target = labels[op->dst.branch];
+
+            while (target < ir->op_count && ir->ops[target].type == OP_NEW_BRANCH)
+                target = next_code(ir, target + 1);
+
+            if (target >= ir->op_count || ir->ops[target].type != OP_JUMP || ir->ops[target].dst.branch == op->dst.branch ||
+                    &ir->ops[target] == op)
+                break;
+
+            op->dst = ir->ops[target].dst;
+        }
+
+        if (hops == MAX_THREAD_HOPS)
+            op->dst = original;
+        else if (op->dst.branch != original.branch)
+            changed = true;
+
+        if (falls_into(ir, i + 1, op->dst.branch)) {
+            // Nothing to jump over.
+            op->type = OP_NOP;
+            changed = true;
+            continue;
+        } else if (op->type == OP_JUMP)
+            continue;
+
+        // branch [a], jump [b], a: -> inverted branch [b], a:
+        size_t next = next_code(ir, i + 1);
+
+        if (next < ir->op_count && ir->ops[next].type == OP_JUMP && falls_into(ir, next + 1, op->dst.branch)) {
+            op->type = invert_branch(op->type);
+            op->dst = ir->ops[next].dst;
+            ir->ops[next].type = OP_NOP;
+            changed = true;
+        }
+    }
+
+    // Code after a jump or return that no label leads to never runs.
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type != OP_JUMP && ir->ops[i].type != OP_RET)
+            continue;
+
+        for (size_t k = i + 1; k < ir->op_count; k++) {
+            OpType type = ir->ops[k].type;
+
+            if (type == OP_NEW_BRANCH || type == OP_FUNC_BEGIN || type == OP_FUNC_END || type == OP_INLINE_ASM)
+                break;
+            else if (type == OP_NOP || type == OP_NEW_VAR)
+                continue;
+
+            ir->ops[k].type = OP_NOP;
+            changed = true;
+        }
+    }
+
+    // Drop the labels nothing goes to anymore, which may make more
+    // code unreachable.
+    size_t *refs = count_label_refs(ir);
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type == OP_NEW_BRANCH && ir->ops[i].src.branch < ir->label_count && refs[ir->ops[i].src.branch] == 0) {
+            ir->ops[i].type = OP_NOP;
+            changed = true;
+        }
+    }
+
+    free(refs);
+    free(labels);
+    return changed;
+}
+
+void thread_jumps(IR *ir) {
+    while (thread_once(ir));
+}
@@ -0,0 +1,88 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../callgraph.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+static void mark(bool *live, size_t func, size_t *worklist, size_t *worklist_size) {
+    if (live[func])
+        return;
+
+    live[func] = true;
+    worklist[(*worklist_size)++] = func;
+}
+
+// Inline asm can call or touch a subroutine through any label of it,
+// like "csr _foo" or "sta _foobar" for its parameter bar, so keep every
+// subroutine that a label in the block starts with.
+static void mark_asm(CallGraph *graph, bool *live, char *code, size_t *worklist, size_t *worklist_size) {
+    for (char *c = code; *c != '\0'; c++) {
+        if (*c != '_' || (c != code && (isalnum((unsigned char)c[-1]) || c[-1] == '_' || c[-1] == '@')))
+            continue;
+
+        for (size_t f = 0; f < graph->func_count; f++) {
+            if (strncmp(c + 1, graph->funcs[f].name, strlen(graph->funcs[f].name)) == 0)
+                mark(live, f, worklist, worklist_size);
+        }
+    }
+}
+
+// Removes every subroutine the main program can't reach through calls.
+void dead_subroutine_elimination(IR *ir) {
+    VarTable vars = create_var_table();
+    CallGraph graph = build_call_graph(ir, &vars);
+
+    bool *live = calloc(graph.func_count + 1, sizeof(bool));
+    size_t *worklist = malloc((graph.func_count + 1) * sizeof(size_t));
+    size_t worklist_size = 0;
+
+    // The main program is everything outside of the subroutines.
+    size_t depth = 0;
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        Op *op = &ir->ops[i];
+
+        if (op->type == OP_FUNC_BEGIN)
+            depth++;
+        else if (op->type == OP_FUNC_END)
+            depth--;
+        else if (depth > 0)
+            continue;
+        else if (op->type == OP_CALL) {
+            Function *callee = find_function(&graph, op->src.ident);
+
+            if (callee != NULL)
+                mark(live, callee - graph.funcs, worklist, &worklist_size);
+        } else if (op->type == OP_INLINE_ASM)
+            mark_asm(&graph, live, op->src.string, worklist, &worklist_size);
+    }
+
+    while (worklist_size > 0) {
+        Function *func = &graph.funcs[worklist[--worklist_size]];
+
+        for (size_t i = 0; i < func->callee_count; i++)
+            mark(live, func->callees[i], worklist, &worklist_size);
+
+        for (size_t i = func->begin + 1; i < func->end; i++) {
+            if (ir->ops[i].type == OP_INLINE_ASM)
+                mark_asm(&graph, live, ir->ops[i].src.string, worklist, &worklist_size);
+        }
+    }
+
+    for (size_t f = 0; f < graph.func_count; f++) {
+        if (live[f])
+            continue;
+
+        for (size_t i = graph.funcs[f].begin; i <= graph.funcs[f].end; i++)
+            ir->ops[i].type = OP_NOP;
+    }
+
+    free(live);
+    free(worklist);
+    delete_call_graph(&graph);
+    delete_var_table(&vars);
+}
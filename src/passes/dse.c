@@ -0,0 +1,145 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../callgraph.h"
+#include "../alias.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// Dead store elimination.
+//
+// A store to a variable that's overwritten on every path before it's
+// read again does nothing. Only variables whose address is never taken
+// are removed, nothing can read those behind the optimizer's back, so
+// stores through pointers and derefs in between don't matter.
+
+typedef struct {
+    IR *ir;
+    CFG *cfg;
+    VarTable *vars;
+    CallGraph *graph;
+    AliasInfo *alias;
+    size_t var_count;
+    bool **live_in; // Indexed by block, then by variable.
+} Liveness;
+
+// Everything anyone outside the routine could read.
+static void gen_all(Liveness *lv, bool *live) {
+    for (size_t v = 0; v < lv->var_count; v++)
+        live[v] |= !is_scratch_var(lv->vars, v);
+}
+
+// Steps the live variables back over the op.
+static void transfer(Liveness *lv, Op *op, bool *live) {
+    switch (op->type) {
+        case OP_INLINE_ASM:
+        case OP_RET:
+            gen_all(lv, live);
+            return;
+        case OP_CALL:
+            for (size_t v = 0; v < lv->var_count; v++)
+                live[v] |= !is_scratch_var(lv->vars, v) && call_may_read(lv->graph, op->src.ident, v);
+            return;
+        default: break;
+    }
+
+    size_t written = op_writes_var(lv->vars, op);
+    size_t read = op_reads_var(lv->vars, op);
+
+    if (written < lv->var_count)
+        live[written] = false;
+
+    if (read < lv->var_count)
+        live[read] = true;
+}
+
+static void live_out(Liveness *lv, size_t block, bool *live) {
+    Block *b = &lv->cfg->blocks[block];
+    memset(live, 0, lv->var_count * sizeof(bool));
+
+    // Falling off a subroutine can't happen, but the main program just ends.
+    if (b->succ_count == 0 && lv->cfg->begin != MAIN_ROUTINE)
+        gen_all(lv, live);
+
+    for (size_t i = 0; i < b->succ_count; i++) {
+        bool *in = lv->live_in[b->succs[i]];
+
+        for (size_t v = 0; v < lv->var_count; v++)
+            live[v] |= in[v];
+    }
+}
+
+static void solve(Liveness *lv) {
+    bool *live = malloc((lv->var_count + 1) * sizeof(bool));
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t block = lv->cfg->block_count; block-- > 0; ) {
+            Block *b = &lv->cfg->blocks[block];
+            live_out(lv, block, live);
+
+            for (size_t i = b->end; i-- > b->start; )
+                transfer(lv, &lv->ir->ops[lv->cfg->index[i]], live);
+
+            if (memcmp(live, lv->live_in[block], lv->var_count * sizeof(bool)) != 0) {
+                memcpy(lv->live_in[block], live, lv->var_count * sizeof(bool));
+                changed = true;
+            }
+        }
+    }
+
+    free(live);
+}
+
+static void remove_dead_stores(Liveness *lv) {
+    bool *live = malloc((lv->var_count + 1) * sizeof(bool));
+
+    for (size_t block = 0; block < lv->cfg->block_count; block++) {
+        Block *b = &lv->cfg->blocks[block];
+        live_out(lv, block, live);
+
+        for (size_t i = b->end; i-- > b->start; ) {
+            Op *op = &lv->ir->ops[lv->cfg->index[i]];
+            size_t var = op->type == OP_STORE && IS_ACC(op->src) ? value_to_var(lv->vars, &op->dst) : NO_VAR;
+
+            if (var < lv->var_count && !live[var] && !is_address_taken(lv->alias, var))
+                op->type = OP_NOP;
+            else
+                transfer(lv, op, live);
+        }
+    }
+
+    free(live);
+}
+
+void dead_store_elimination(IR *ir) {
+    VarTable vars = create_var_table();
+    CallGraph graph = build_call_graph(ir, &vars);
+    AliasInfo alias = build_alias_info(ir, &vars);
+
+    for (size_t n = 0; nth_routine(ir, n) != NO_ROUTINE; n++) {
+        CFG cfg = build_cfg(ir, nth_routine(ir, n));
+        Liveness lv = (Liveness){ .ir = ir, .cfg = &cfg, .vars = &vars, .graph = &graph, .alias = &alias,
+            .var_count = vars.count, .live_in = malloc((cfg.block_count + 1) * sizeof(bool *)) };
+
+        for (size_t b = 0; b < cfg.block_count; b++)
+            lv.live_in[b] = calloc(lv.var_count + 1, sizeof(bool));
+
+        solve(&lv);
+        remove_dead_stores(&lv);
+
+        for (size_t b = 0; b < cfg.block_count; b++)
+            free(lv.live_in[b]);
+
+        free(lv.live_in);
+        delete_cfg(&cfg);
+    }
+
+    delete_alias_info(&alias);
+    delete_call_graph(&graph);
+    delete_var_table(&vars);
+}
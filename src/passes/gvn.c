@@ -0,0 +1,544 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../callgraph.h"
+#include "../alias.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+
+#define NO_VN 0
+#define MAX_STACK 16
+#define STARTING_EXPR_CAP 256
+
+// Value numbering over the accumulator machine.
+//
+// Every value the accumulator, a variable or a stack slot can hold gets
+// a number, and two equal numbers always mean the same value. A load
+// of something the accumulator already holds, a store of what the
+// variable already holds, or a computation whose result is already in
+// a variable is then redundant.
+//
+// Blocks are visited in reverse postorder and start with what all of
+// their predecessors agree on, so the facts carry over along dominating
+// paths. Loop headers start with nothing since their back edges haven't
+// been seen yet.
+//
+// Memory has a number for every alias region that changes when the
+// region is stored to, so a store into one array doesn't forget what
+// was loaded from another.
+
+typedef enum {
+    KEY_CONST,
+    KEY_OP,
+    KEY_DEREF
+} KeyKind;
+
+typedef struct {
+    KeyKind kind;
+    int type;
+    uint64_t a;
+    uint64_t b;
+    uint32_t vn;
+} Expr;
+
+typedef struct {
+    uint32_t acc;
+    uint32_t memory; // Changes with any store.
+    uint32_t *regions;
+    uint32_t *vars;
+    uint32_t stack[MAX_STACK];
+    size_t depth; // Known slots on top of the stack.
+} State;
+
+typedef struct {
+    IR *ir;
+    CFG *cfg;
+    VarTable *vars;
+    CallGraph *graph;
+    size_t var_count;
+    AliasInfo *alias;
+    AliasTracker tracker;
+
+    Expr *exprs;
+    size_t expr_count;
+    size_t expr_capacity;
+    uint32_t next_vn;
+
+    State *exits;
+    bool *done;
+} Numbering;
+
+static uint32_t fresh(Numbering *num) {
+    return num->next_vn++;
+}
+
+static uint64_t hash_expr(KeyKind kind, int type, uint64_t a, uint64_t b) {
+    uint64_t h = 1469598103934665603ULL;
+    uint64_t parts[] = { (uint64_t)kind, (uint64_t)type, a, b };
+
+    for (size_t i = 0; i < 4; i++) {
+        h ^= parts[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static void grow_exprs(Numbering *num) {
+    Expr *old = num->exprs;
+    size_t old_capacity = num->expr_capacity;
+
+    num->expr_capacity = old_capacity == 0 ? STARTING_EXPR_CAP : old_capacity * 2;
+    num->exprs = calloc(num->expr_capacity, sizeof(Expr));
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].vn == NO_VN)
+            continue;
+
+        size_t slot = hash_expr(old[i].kind, old[i].type, old[i].a, old[i].b) & (num->expr_capacity - 1);
+
+        while (num->exprs[slot].vn != NO_VN)
+            slot = (slot + 1) & (num->expr_capacity - 1);
+
+        num->exprs[slot] = old[i];
+    }
+
+    free(old);
+}
+
+// The number of an expression, made up the first time it's seen.
+static uint32_t lookup(Numbering *num, KeyKind kind, int type, uint64_t a, uint64_t b) {
+    if ((num->expr_count + 1) * 2 >= num->expr_capacity)
+        grow_exprs(num);
+
+    size_t slot = hash_expr(kind, type, a, b) & (num->expr_capacity - 1);
+
+    while (num->exprs[slot].vn != NO_VN) {
+        Expr *e = &num->exprs[slot];
+
+        if (e->kind == kind && e->type == type && e->a == a && e->b == b)
+            return e->vn;
+
+        slot = (slot + 1) & (num->expr_capacity - 1);
+    }
+
+    num->exprs[slot] = (Expr){ .kind = kind, .type = type, .a = a, .b = b, .vn = fresh(num) };
+    num->expr_count++;
+    return num->exprs[slot].vn;
+}
+
+static size_t tracked_var(Numbering *num, OpValue *value) {
+    size_t var = value_to_var(num->vars, value);
+    return var < num->var_count ? var : NO_VAR;
+}
+
+static uint32_t value_vn(Numbering *num, State *state, OpValue *value) {
+    switch (value->type) {
+        case VAL_INT: return lookup(num, KEY_CONST, 0, (uint64_t)value->int_const, 0);
+        case VAL_REG: return state->acc;
+        case VAL_VAR:
+        case VAL_RET: {
+            size_t var = tracked_var(num, value);
+
+            if (var == NO_VAR)
+                return fresh(num);
+            else if (state->vars[var] == NO_VN)
+                state->vars[var] = fresh(num);
+
+            return state->vars[var];
+        }
+        default: break;
+    }
+
+    // Strings are a new copy every time they're loaded.
+    return fresh(num);
+}
+
+static void forget_vars(Numbering *num, State *state) {
+    memset(state->vars, 0, num->var_count * sizeof(uint32_t));
+}
+
+static void forget_all_regions(Numbering *num, State *state) {
+    state->memory = fresh(num);
+
+    for (size_t r = 0; r < num->alias->region_count; r++)
+        state->regions[r] = fresh(num);
+}
+
+// After a store through a pointer into the region.
+static void forget_region(Numbering *num, State *state, size_t region) {
+    if (region == ANY_REGION)
+        forget_all_regions(num, state);
+    else {
+        state->memory = fresh(num);
+        state->regions[region] = fresh(num);
+    }
+
+    for (size_t v = 0; v < num->var_count; v++) {
+        if (region_may_hold(num->alias, region, v))
+            state->vars[v] = NO_VN;
+    }
+}
+
+static void set_var(Numbering *num, State *state, OpValue *value, uint32_t vn) {
+    size_t var = tracked_var(num, value);
+
+    if (var == NO_VAR)
+        return;
+
+    state->vars[var] = vn;
+
+    if (is_address_taken(num->alias, var)) {
+        state->memory = fresh(num);
+        state->regions[num->alias->region_of[var]] = fresh(num);
+    }
+}
+
+static void push_vn(State *state, uint32_t vn) {
+    if (state->depth == MAX_STACK) {
+        memmove(state->stack, state->stack + 1, (MAX_STACK - 1) * sizeof(uint32_t));
+        state->depth--;
+    }
+
+    state->stack[state->depth++] = vn;
+}
+
+static uint32_t pop_vn(Numbering *num, State *state) {
+    return state->depth > 0 ? state->stack[--state->depth] : fresh(num);
+}
+
+static bool is_commutative(OpType type) {
+    return type == OP_ADD || type == OP_MUL || type == OP_AND || type == OP_OR || type == OP_XOR;
+}
+
+// A variable in the routine's reach that holds the value, if any.
+static OpValue *holder_of(Numbering *num, State *state, uint32_t vn, size_t block) {
+    for (size_t i = num->cfg->blocks[block].start; i < num->cfg->blocks[block].end; i++) {
+        Op *op = &num->ir->ops[num->cfg->index[i]];
+
+        if (op->type != OP_LOAD && op->type != OP_STORE)
+            continue;
+
+        OpValue *value = op->type == OP_LOAD ? &op->src : &op->dst;
+
+        if (value->type != VAL_VAR && value->type != VAL_RET)
+            continue;
+
+        size_t var = tracked_var(num, value);
+
+        if (var != NO_VAR && state->vars[var] == vn)
+            return value;
+    }
+
+    return NULL;
+}
+
+static void number_call(Numbering *num, State *state, Op *op) {
+    Function *callee = find_function(num->graph, op->src.ident);
+    state->acc = fresh(num);
+
+    if (callee == NULL || callee->has_asm) {
+        forget_vars(num, state);
+        forget_all_regions(num, state);
+        state->depth = 0;
+        return;
+    }
+
+    for (size_t v = 0; v < num->var_count; v++) {
+        if (call_may_write(num->graph, op->src.ident, v))
+            state->vars[v] = NO_VN;
+    }
+
+    if (callee->stores_memory)
+        forget_region(num, state, ANY_REGION);
+}
+
+static void number_block(Numbering *num, size_t block, State *state) {
+    Block *b = &num->cfg->blocks[block];
+    reset_alias_tracker(&num->tracker);
+
+    for (size_t i = b->start; i < b->end; i++) {
+        Op *op = &num->ir->ops[num->cfg->index[i]];
+        Op original = *op;
+
+        // Anything on the stack that isn't just pushed or popped.
+        if ((op->src.type == VAL_STACK || op->dst.type == VAL_STACK) && op->type != OP_PUSH && op->type != OP_POP) {
+            state->depth = 0;
+
+            if (op_writes_acc(op))
+                state->acc = fresh(num);
+
+            track_op(&num->tracker, &original);
+            continue;
+        }
+
+        switch (op->type) {
+            case OP_LOAD: {
+                if (!IS_ACC(op->dst) || IS_ACC(op->src))
+                    break;
+
+                uint32_t vn = value_vn(num, state, &op->src);
+
+                if (vn == state->acc)
+                    op->type = OP_NOP;
+                else
+                    state->acc = vn;
+                break;
+            }
+            case OP_STORE: {
+                if (op->src.type == VAL__RES__) {
+                    set_var(num, state, &op->dst, fresh(num));
+                    break;
+                }
+
+                size_t var = tracked_var(num, &op->dst);
+
+                if (var != NO_VAR && state->vars[var] == state->acc && !is_address_taken(num->alias, var))
+                    op->type = OP_NOP;
+                else
+                    set_var(num, state, &op->dst, state->acc);
+                break;
+            }
+            case OP_PUSH:
+                push_vn(state, value_vn(num, state, &op->src));
+
+                // Like the lowering, forget what a pushed accumulator
+                // holds so the value is loaded again afterwards. The
+                // peephole can then push the loaded value directly.
+                if (IS_ACC(op->src))
+                    state->acc = fresh(num);
+                break;
+            case OP_POP: {
+                uint32_t vn = pop_vn(num, state);
+
+                if (op->dst.type == VAL_NONE || IS_ACC(op->dst))
+                    state->acc = vn;
+                else
+                    set_var(num, state, &op->dst, vn);
+                break;
+            }
+            case OP_SWP: {
+                uint32_t acc = state->acc;
+                state->acc = value_vn(num, state, &op->dst);
+                set_var(num, state, &op->dst, acc);
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_SHL:
+            case OP_SHR:
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
+            case OP_NOT:
+            case OP_NEG: {
+                if (!IS_ACC(op->dst)) {
+                    state->acc = fresh(num);
+                    break;
+                }
+
+                uint64_t a = state->acc;
+                uint64_t rhs = (op->type == OP_NOT || op->type == OP_NEG) ? 0 : value_vn(num, state, &op->src);
+
+                if (is_commutative(op->type) && rhs < a) {
+                    uint64_t t = a;
+                    a = rhs;
+                    rhs = t;
+                }
+
+                uint32_t vn = lookup(num, KEY_OP, op->type, a, rhs);
+                OpValue *holder = holder_of(num, state, vn, block);
+
+                // Already worked out and sitting in a variable.
+                if (holder != NULL)
+                    *op = (Op){ .type = OP_LOAD, .dst = op->dst, .src = *holder, .loc = op->loc };
+
+                state->acc = vn;
+                break;
+            }
+            case OP_DEREF: {
+                size_t region = address_region(&num->tracker, op);
+                uint32_t vn = lookup(num, KEY_DEREF, 0, state->acc, region == ANY_REGION ? state->memory : state->regions[region]);
+                OpValue *holder = holder_of(num, state, vn, block);
+
+                // Loaded before and nothing stored into the region since.
+                if (holder != NULL)
+                    *op = (Op){ .type = OP_LOAD, .dst = (OpValue){ .type = VAL_REG, .reg = TEMP_REG }, .src = *holder, .loc = op->loc };
+
+                state->acc = vn;
+                break;
+            }
+            case OP_STORE_DEREF:
+                forget_region(num, state, address_region(&num->tracker, op));
+                break;
+            case OP_REF:
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LT:
+            case OP_LTE:
+            case OP_GT:
+            case OP_GTE:
+                state->acc = fresh(num);
+                break;
+            case OP_CALL:
+                number_call(num, state, op);
+                break;
+            case OP_INLINE_ASM:
+                state->acc = fresh(num);
+                state->depth = 0;
+                forget_all_regions(num, state);
+                forget_vars(num, state);
+                break;
+            default: break;
+        }
+
+        track_op(&num->tracker, &original);
+    }
+}
+
+// Whatever all the predecessors agree on.
+static void entry_state(Numbering *num, size_t block, State *state) {
+    Block *b = &num->cfg->blocks[block];
+    bool first = true;
+
+    state->acc = fresh(num);
+    state->depth = 0;
+    forget_all_regions(num, state);
+    forget_vars(num, state);
+
+    for (size_t i = 0; i < b->pred_count; i++) {
+        size_t pred = b->preds[i];
+
+        // Unreachable.
+        if (num->cfg->blocks[pred].rpo == NO_BLOCK)
+            continue;
+
+        if (!num->done[pred]) {
+            state->acc = fresh(num);
+            state->depth = 0;
+            forget_all_regions(num, state);
+            forget_vars(num, state);
+            return;
+        }
+
+        State *exit = &num->exits[pred];
+
+        if (first) {
+            state->acc = exit->acc;
+            state->memory = exit->memory;
+            memcpy(state->regions, exit->regions, num->alias->region_count * sizeof(uint32_t));
+            state->depth = exit->depth;
+            memcpy(state->stack, exit->stack, exit->depth * sizeof(uint32_t));
+            memcpy(state->vars, exit->vars, num->var_count * sizeof(uint32_t));
+            first = false;
+            continue;
+        }
+
+        if (state->acc != exit->acc)
+            state->acc = fresh(num);
+
+        if (state->memory != exit->memory)
+            state->memory = fresh(num);
+
+        for (size_t r = 0; r < num->alias->region_count; r++) {
+            if (state->regions[r] != exit->regions[r])
+                state->regions[r] = fresh(num);
+        }
+
+        if (state->depth != exit->depth || memcmp(state->stack, exit->stack, exit->depth * sizeof(uint32_t)) != 0)
+            state->depth = 0;
+
+        for (size_t v = 0; v < num->var_count; v++) {
+            if (state->vars[v] != exit->vars[v])
+                state->vars[v] = NO_VN;
+        }
+    }
+}
+
+// Drops ops that only write the accumulator when nothing reads it.
+static void remove_dead_acc_writes(CFG *cfg) {
+    for (size_t block = 0; block < cfg->block_count; block++) {
+        Block *b = &cfg->blocks[block];
+        bool live = false;
+
+        for (size_t i = 0; i < b->succ_count && !live; i++)
+            live = acc_live_at(cfg, cfg->blocks[b->succs[i]].start);
+
+        for (size_t i = b->end; i > b->start; i--) {
+            Op *op = &cfg->ir->ops[cfg->index[i - 1]];
+
+            // Divisions are kept since they might trap.
+            bool pure = op->type == OP_LOAD || op->type == OP_REF || op->type == OP_DEREF || op->type == OP_NOT || op->type == OP_NEG ||
+                IS_SET(op->type) || (IS_MATH(op->type) && op->type != OP_DIV && op->type != OP_MOD);
+            bool removable = pure && IS_ACC(op->dst) && op->src.type != VAL_STACK;
+
+            if (!live && removable && op_writes_acc(op)) {
+                op->type = OP_NOP;
+                continue;
+            }
+
+            if (op_writes_acc(op))
+                live = false;
+
+            if (op_reads_acc(op))
+                live = true;
+        }
+    }
+}
+
+static void number_routine(Numbering *num, size_t begin) {
+    CFG cfg = build_cfg(num->ir, begin);
+    num->cfg = &cfg;
+    num->exits = malloc((cfg.block_count + 1) * sizeof(State));
+    num->done = calloc(cfg.block_count + 1, sizeof(bool));
+
+    for (size_t i = 0; i < cfg.block_count; i++) {
+        num->exits[i].vars = calloc(num->var_count + 1, sizeof(uint32_t));
+        num->exits[i].regions = calloc(num->alias->region_count + 1, sizeof(uint32_t));
+    }
+
+    for (size_t i = 0; i < cfg.order_count; i++) {
+        size_t block = cfg.order[i];
+        State *state = &num->exits[block];
+
+        entry_state(num, block, state);
+        number_block(num, block, state);
+        num->done[block] = true;
+    }
+
+    remove_dead_acc_writes(&cfg);
+
+    for (size_t i = 0; i < cfg.block_count; i++) {
+        free(num->exits[i].vars);
+        free(num->exits[i].regions);
+    }
+
+    free(num->exits);
+    free(num->done);
+    delete_cfg(&cfg);
+}
+
+void global_value_numbering(IR *ir) {
+    VarTable vars = create_var_table();
+    CallGraph graph = build_call_graph(ir, &vars);
+
+    AliasInfo alias = build_alias_info(ir, &vars);
+    Numbering num = (Numbering){ .ir = ir, .vars = &vars, .graph = &graph, .var_count = vars.count,
+        .alias = &alias, .tracker = create_alias_tracker(&alias), .next_vn = NO_VN + 1 };
+
+    for (size_t n = 0; nth_routine(ir, n) != NO_ROUTINE; n++)
+        number_routine(&num, nth_routine(ir, n));
+
+    free(num.exprs);
+    delete_alias_tracker(&num.tracker);
+    delete_alias_info(&alias);
+    delete_call_graph(&graph);
+    delete_var_table(&vars);
+}
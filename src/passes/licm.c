@@ -0,0 +1,794 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../callgraph.h"
+#include "../alias.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+
+#define NO_POS ((size_t)-1)
+#define MAX_DEPTH 16
+#define MAX_PENDING 16
+
+// Loop-invariant code motion.
+//
+// The IR is accumulator based, so an "expression" is a run of ops that
+// starts by loading the accumulator and ends with the value in it, like:
+// load b
+// store @temp
+// load a
+// mul @temp
+// If every operand of such a run is invariant in the loop, the run is
+// computed once in a preheader into a new variable and the run in the
+// loop becomes a single load of it.
+//
+// Stores through pointers only stop derefs of the regions they can
+// store into from being hoisted.
+
+typedef struct {
+    IR *ir;
+    CFG *cfg;
+    VarTable *vars;
+    CallGraph *graph;
+    Loop *loop;
+    char *func;
+
+    bool *written;
+    size_t written_size;
+    size_t temp;
+    bool temp_live;
+
+    AliasInfo *alias;
+    AliasTracker tracker;
+    size_t *deref_regions; // Indexed by position, for the derefs.
+    bool *stored;          // Indexed by region.
+    bool any_store;        // Into a region that isn't known.
+    bool has_store;
+
+    size_t *exits;
+    size_t exit_count;
+    size_t test; // The block whose branch leaves the loop when it's tested at the top, or NO_BLOCK.
+} LoopInfo;
+
+typedef struct {
+    size_t start;
+    size_t end;
+    bool guarded; // Only safe once the loop is known to be entered.
+} Hoist;
+
+typedef struct {
+    bool known;
+    int64_t value;
+} Const;
+
+static Op *op_at(LoopInfo *info, size_t pos) {
+    return &info->ir->ops[info->cfg->index[pos]];
+}
+
+static bool is_temp(LoopInfo *info, OpValue *value) {
+    return value->type == VAL_VAR && value_to_var(info->vars, value) == info->temp;
+}
+
+static bool is_invariant(LoopInfo *info, OpValue *value) {
+    if (value->type == VAL_INT || value->type == VAL_STRING)
+        return true;
+    else if (value->type != VAL_VAR)
+        return false;
+
+    size_t var = value_to_var(info->vars, value);
+    return !is_scratch_var(info->vars, var) && (var >= info->written_size || !info->written[var]);
+}
+
+// A block is guaranteed to execute if the loop can't be left without
+// going through it. Only those may hoist ops that could fault or never
+// return, like calls, derefs and divisions by a variable.
+static bool is_guaranteed(LoopInfo *info, size_t block) {
+    if (info->exit_count == 0)
+        return block == info->loop->header;
+
+    for (size_t i = 0; i < info->exit_count; i++) {
+        if (!dominates(info->cfg, block, info->exits[i]))
+            return false;
+    }
+
+    return true;
+}
+
+// for and while loops test at the top, so the header is an exit and no
+// block in the body dominates it. If the preheader is guarded by a copy
+// of the test, it only runs when the loop is entered. A block that every
+// trip goes through, before it goes back to the header or leaves some
+// other way, then runs whenever the preheader does.
+static bool is_guaranteed_after_test(LoopInfo *info, size_t block) {
+    if (info->test == NO_BLOCK)
+        return false;
+
+    for (size_t i = 0; i < info->exit_count; i++) {
+        if (info->exits[i] != info->test && !dominates(info->cfg, block, info->exits[i]))
+            return false;
+    }
+
+    Block *header = &info->cfg->blocks[info->loop->header];
+
+    for (size_t i = 0; i < header->pred_count; i++) {
+        if (info->loop->body[header->preds[i]] && !dominates(info->cfg, block, header->preds[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static bool called_in(char **called, size_t called_count, char *name) {
+    for (size_t i = 0; i < called_count; i++) {
+        if (strcmp(called[i], name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static Const operand_const(LoopInfo *info, OpValue *value, Const temp) {
+    if (value->type == VAL_INT)
+        return (Const){ .known = true, .value = value->int_const };
+    else if (is_temp(info, value))
+        return temp;
+
+    return (Const){ .known = false };
+}
+
+// Finds the longest invariant run starting at pos, returns the
+// position of its last op or NO_POS. guarded is set if the run needs
+// the preheader to be guarded by the loop test.
+static size_t match_run(LoopInfo *info, size_t block, size_t pos, bool *guarded) {
+    Block *b = &info->cfg->blocks[block];
+    Op *first = op_at(info, pos);
+
+    if (first->type != OP_LOAD || !is_invariant(info, &first->src))
+        return NO_POS;
+
+    const bool guaranteed = is_guaranteed(info, block);
+    const bool after_test = !guaranteed && is_guaranteed_after_test(info, block);
+    bool needs_guard = false;
+
+    bool acc_valid = false;
+    bool temp_valid = false;
+    Const acc = { .known = false };
+    Const temp = { .known = false };
+
+    Const stack[MAX_DEPTH];
+    size_t depth = 0;
+
+    // Callee parameters stored in the run that are waiting for their call.
+    size_t pending[MAX_PENDING];
+    char *pending_func[MAX_PENDING];
+    size_t pending_count = 0;
+
+    char *called[MAX_PENDING];
+    size_t called_count = 0;
+
+    // Every position the run could end at, with whether @temp was
+    // stored before it and whether it needs the guard.
+    size_t *ends = malloc((b->end - pos) * sizeof(size_t));
+    bool *ends_stored_temp = malloc((b->end - pos) * sizeof(bool));
+    bool *ends_guarded = malloc((b->end - pos) * sizeof(bool));
+    size_t end_count = 0;
+
+    size_t computations = 0;
+    bool stored_temp = false;
+
+    for (size_t k = pos; k < b->end; k++) {
+        Op *op = op_at(info, k);
+        bool ok = true;
+
+        switch (op->type) {
+            case OP_NOP:
+            case OP_NEW_VAR: continue;
+            case OP_LOAD:
+                if (IS_ACC(op->src))
+                    ok = acc_valid;
+                else if (is_temp(info, &op->src)) {
+                    ok = temp_valid;
+                    acc = temp;
+                } else if (op->src.type == VAL_RET)
+                    ok = called_in(called, called_count, op->src.source.func);
+                else
+                    ok = is_invariant(info, &op->src);
+
+                if (!is_temp(info, &op->src))
+                    acc = operand_const(info, &op->src, temp);
+
+                acc_valid = true;
+                break;
+            case OP_STORE:
+                if (!acc_valid || op->src.type == VAL__RES__)
+                    ok = false;
+                else if (is_temp(info, &op->dst)) {
+                    temp_valid = true;
+                    temp = acc;
+                    stored_temp = true;
+                } else {
+                    // Arguments of a pure call.
+                    Function *callee = op->dst.type == VAL_VAR ? find_function(info->graph, op->dst.source.scope) : NULL;
+
+                    if (callee == NULL || !callee->pure || pending_count == MAX_PENDING)
+                        ok = false;
+                    else {
+                        pending[pending_count] = value_to_var(info->vars, &op->dst);
+                        pending_func[pending_count++] = callee->name;
+                    }
+                }
+                break;
+            case OP_PUSH:
+                if (depth == MAX_DEPTH)
+                    ok = false;
+                else if (IS_ACC(op->src)) {
+                    ok = acc_valid;
+                    stack[depth++] = acc;
+                } else if (is_temp(info, &op->src)) {
+                    ok = temp_valid;
+                    stack[depth++] = temp;
+                } else {
+                    ok = is_invariant(info, &op->src);
+                    stack[depth++] = operand_const(info, &op->src, temp);
+                }
+                break;
+            case OP_POP:
+                if (depth == 0)
+                    ok = false;
+                else if (IS_ACC(op->dst)) {
+                    acc = stack[--depth];
+                    acc_valid = true;
+                } else if (is_temp(info, &op->dst)) {
+                    temp = stack[--depth];
+                    temp_valid = true;
+                    stored_temp = true;
+                } else
+                    ok = false;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_SHL:
+            case OP_SHR:
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR: {
+                if (!acc_valid)
+                    ok = false;
+                else if (is_temp(info, &op->src))
+                    ok = temp_valid;
+                else if (op->src.type == VAL_RET)
+                    ok = called_in(called, called_count, op->src.source.func);
+                else
+                    ok = is_invariant(info, &op->src);
+
+                Const rhs = operand_const(info, &op->src, temp);
+
+                // Don't make a division by zero happen that wouldn't have.
+                if ((op->type == OP_DIV || op->type == OP_MOD) && !guaranteed && (!rhs.known || rhs.value == 0)) {
+                    ok = after_test;
+                    needs_guard = true;
+                }
+
+                acc.known = false;
+                computations++;
+                break;
+            }
+            case OP_NOT:
+            case OP_NEG:
+                if (IS_ACC(op->src))
+                    ok = acc_valid;
+                else
+                    ok = is_invariant(info, &op->src);
+
+                acc_valid = true;
+                acc.known = false;
+                computations++;
+                break;
+            case OP_DEREF: {
+                size_t region = info->deref_regions[k];
+                ok = acc_valid && (guaranteed || after_test) && !info->any_store && (region == ANY_REGION ? !info->has_store : !info->stored[region]);
+                needs_guard |= !guaranteed;
+                acc.known = false;
+                computations++;
+                break;
+            }
+            case OP_CALL: {
+                Function *callee = find_function(info->graph, op->src.ident);
+                ok = (guaranteed || after_test) && callee != NULL && callee->pure && called_count < MAX_PENDING;
+                needs_guard |= !guaranteed;
+
+                if (!ok)
+                    break;
+
+                // Every parameter has to be stored in the run.
+                size_t stored = 0;
+
+                for (size_t i = 0; i < pending_count; i++) {
+                    if (pending_func[i] != callee->name)
+                        continue;
+
+                    bool duplicate = false;
+
+                    for (size_t j = 0; j < i; j++)
+                        duplicate |= pending_func[j] == callee->name && pending[j] == pending[i];
+
+                    if (!duplicate)
+                        stored++;
+                }
+
+                if (stored != callee->param_count) {
+                    ok = false;
+                    break;
+                }
+
+                size_t remaining = 0;
+
+                for (size_t i = 0; i < pending_count; i++) {
+                    if (pending_func[i] != callee->name) {
+                        pending[remaining] = pending[i];
+                        pending_func[remaining++] = pending_func[i];
+                    }
+                }
+
+                pending_count = remaining;
+                called[called_count++] = callee->name;
+                acc_valid = false;
+                computations++;
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+
+        if (!ok)
+            break;
+
+        if (acc_valid && computations > 0 && depth == 0 && pending_count == 0) {
+            ends[end_count] = k;
+            ends_stored_temp[end_count] = stored_temp;
+            ends_guarded[end_count++] = needs_guard;
+        }
+    }
+
+    // Take the longest run whose @temp, which is gone after hoisting,
+    // isn't read later.
+    size_t best = NO_POS;
+
+    while (end_count > 0 && best == NO_POS) {
+        end_count--;
+
+        if (!ends_stored_temp[end_count] || (!info->temp_live && !var_live_at(info->cfg, info->vars, ends[end_count] + 1, info->temp))) {
+            best = ends[end_count];
+            *guarded = ends_guarded[end_count];
+        }
+    }
+
+    free(ends);
+    free(ends_stored_temp);
+    free(ends_guarded);
+    return best;
+}
+
+// Variables in the region can change and derefs of it can't move.
+static void mark_stored(LoopInfo *info, size_t region) {
+    info->has_store = true;
+
+    if (region == ANY_REGION)
+        info->any_store = true;
+    else
+        info->stored[region] = true;
+
+    for (size_t v = 0; v < info->written_size; v++) {
+        if (region_may_hold(info->alias, region, v))
+            info->written[v] = true;
+    }
+}
+
+// Whether the op can run again right before the header without
+// changing what the loop does.
+static bool can_repeat(LoopInfo *info, Op *op) {
+    switch (op->type) {
+        case OP_NOP:
+        case OP_NEW_BRANCH:
+        case OP_LOAD:
+        case OP_COMPARE:
+        case OP_NOT:
+        case OP_NEG:
+        case OP_DEREF:
+            return true;
+        case OP_STORE: {
+            // Only to a scratch slot the test sets before reading.
+            size_t var = value_to_var(info->vars, &op->dst);
+            return op->dst.type == VAL_VAR && is_scratch_var(info->vars, var)
+                && !var_live_at(info->cfg, info->vars, info->cfg->blocks[info->loop->header].start, var);
+        }
+        default: break;
+    }
+
+    return IS_MATH(op->type) || IS_SET(op->type);
+}
+
+// The header and the blocks it falls through to, up to one whose branch
+// leaves the loop, if they only work out the condition.
+static size_t find_test(LoopInfo *info) {
+    CFG *cfg = info->cfg;
+    size_t b = info->loop->header;
+
+    for (size_t n = 0; n < cfg->block_count; n++) {
+        Block *block = &cfg->blocks[b];
+
+        if (block->end == block->start)
+            return NO_BLOCK;
+
+        for (size_t i = block->start; i + 1 < block->end; i++) {
+            if (!can_repeat(info, op_at(info, i)))
+                return NO_BLOCK;
+        }
+
+        Op *last = op_at(info, block->end - 1);
+
+        if (op_is_branch(last))
+            return block->succ_count == 2 && info->loop->body[block->succs[0]] != info->loop->body[block->succs[1]] ? b : NO_BLOCK;
+        else if (!can_repeat(info, last) || block->succ_count != 1 || block->succs[0] != b + 1)
+            return NO_BLOCK;
+
+        b++;
+
+        if (!info->loop->body[b] || cfg->blocks[b].pred_count != 1)
+            return NO_BLOCK;
+    }
+
+    return NO_BLOCK;
+}
+
+// A copy of the test that jumps to skip when the loop isn't entered.
+static size_t write_guard(LoopInfo *info, Op *out, unsigned int skip) {
+    CFG *cfg = info->cfg;
+    size_t count = 0;
+
+    for (size_t b = info->loop->header; b <= info->test; b++) {
+        const size_t end = b == info->test ? cfg->blocks[b].end - 1 : cfg->blocks[b].end;
+
+        for (size_t i = cfg->blocks[b].start; i < end; i++) {
+            Op *op = op_at(info, i);
+
+            if (op->type != OP_NOP && op->type != OP_NEW_BRANCH)
+                out[count++] = *op;
+        }
+    }
+
+    Block *test = &cfg->blocks[info->test];
+    Op branch = *op_at(info, test->end - 1);
+    const bool stays = info->test + 1 < cfg->block_count && info->loop->body[info->test + 1];
+
+    if (stays) {
+        branch.dst.branch = skip;
+        out[count++] = branch;
+        return count;
+    }
+
+    // The branch goes into the loop and falling through leaves it.
+    const unsigned int enter = ir_new_label(info->ir);
+    OpValue label = branch.dst;
+
+    branch.dst.branch = enter;
+    out[count++] = branch;
+    label.branch = skip;
+    out[count++] = (Op){ .type = OP_JUMP, .dst = label, .loc = branch.loc };
+    label.branch = enter;
+    out[count++] = (Op){ .type = OP_NEW_BRANCH, .src = label, .loc = branch.loc };
+    return count;
+}
+
+static size_t find_insertion_point(LoopInfo *info) {
+    CFG *cfg = info->cfg;
+    Block *header = &cfg->blocks[info->loop->header];
+    size_t outside = NO_BLOCK;
+
+    if (info->loop->header == 0)
+        return NO_POS;
+
+    for (size_t i = 0; i < header->pred_count; i++) {
+        if (info->loop->body[header->preds[i]])
+            continue;
+        else if (outside != NO_BLOCK)
+            return NO_POS;
+
+        outside = header->preds[i];
+    }
+
+    if (outside == NO_BLOCK)
+        return NO_POS;
+
+    Block *pred = &cfg->blocks[outside];
+    Op *last = &info->ir->ops[cfg->index[pred->end - 1]];
+
+    if (last->type == OP_JUMP)
+        return cfg->index[pred->end - 1];
+    else if (outside + 1 == info->loop->header && !op_is_branch(last))
+        return cfg->index[header->start];
+
+    return NO_POS;
+}
+
+static bool same_operand(LoopInfo *info, OpValue *a, OpValue *b) {
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type) {
+        case VAL_INT: return a->int_const == b->int_const;
+        case VAL_STRING: return strcmp(a->string, b->string) == 0;
+        case VAL_REG: return a->reg == b->reg;
+        case VAL_IDENT: return strcmp(a->ident, b->ident) == 0;
+        case VAL_VAR:
+        case VAL_RET: return value_to_var(info->vars, a) == value_to_var(info->vars, b);
+        case VAL_NONE:
+        case VAL_STACK: return true;
+        default: break;
+    }
+
+    return false;
+}
+
+// Whether the run does the same as the ops already moved into the
+// preheader, which end with storing the variable.
+static bool same_run(LoopInfo *info, Hoist *run, Op *moved) {
+    size_t k = 0;
+
+    for (size_t i = run->start; i <= run->end; i++) {
+        Op *op = op_at(info, i);
+
+        if (op->type == OP_NOP || op->type == OP_NEW_VAR)
+            continue;
+        else if (moved[k].type != op->type || !same_operand(info, &moved[k].dst, &op->dst) || !same_operand(info, &moved[k].src, &op->src))
+            return false;
+
+        k++;
+    }
+
+    return moved[k].type == OP_STORE && moved[k].dst.type == VAL_VAR && strncmp(moved[k].dst.var, "@licm", 5) == 0;
+}
+
+static bool hoist_loop(LoopInfo *info) {
+    CFG *cfg = info->cfg;
+    Loop *loop = info->loop;
+
+    memset(info->written, 0, info->written_size * sizeof(bool));
+    memset(info->stored, 0, info->alias->region_count * sizeof(bool));
+    info->exit_count = 0;
+    info->any_store = false;
+    info->has_store = false;
+
+    for (size_t b = 0; b < cfg->block_count; b++) {
+        if (!loop->body[b])
+            continue;
+
+        Block *block = &cfg->blocks[b];
+        reset_alias_tracker(&info->tracker);
+
+        for (size_t i = 0; i < block->succ_count; i++) {
+            if (!loop->body[block->succs[i]]) {
+                info->exits[info->exit_count++] = b;
+                break;
+            }
+        }
+
+        for (size_t i = block->start; i < block->end; i++) {
+            Op *op = op_at(info, i);
+            size_t var = op_writes_var(info->vars, op);
+
+            if (var != NO_VAR && var < info->written_size) {
+                info->written[var] = true;
+
+                // Derefs can read it.
+                if (is_address_taken(info->alias, var))
+                    mark_stored(info, info->alias->region_of[var]);
+            }
+
+            if (op->type == OP_DEREF)
+                info->deref_regions[i] = address_region(&info->tracker, op);
+            else if (op->type == OP_STORE_DEREF)
+                mark_stored(info, address_region(&info->tracker, op));
+
+            track_op(&info->tracker, op);
+
+            // A barrier, anything could change.
+            if (op->type == OP_INLINE_ASM)
+                return false;
+            else if (op->type != OP_CALL)
+                continue;
+
+            Function *callee = find_function(info->graph, op->src.ident);
+
+            if (callee == NULL || callee->has_asm)
+                return false;
+            else if (callee->stores_memory)
+                mark_stored(info, ANY_REGION);
+
+            for (size_t v = 0; v < info->written_size; v++)
+                info->written[v] |= call_may_write(info->graph, op->src.ident, v);
+        }
+    }
+
+    size_t insert_at = find_insertion_point(info);
+
+    if (insert_at == NO_POS)
+        return false;
+
+    info->test = find_test(info);
+
+    Block *header = &cfg->blocks[loop->header];
+    info->temp_live = var_live_at(cfg, info->vars, header->start, info->temp);
+
+    Hoist *hoists = NULL;
+    size_t hoist_count = 0;
+    bool guard = false;
+
+    for (size_t b = 0; b < cfg->block_count; b++) {
+        if (!loop->body[b])
+            continue;
+
+        for (size_t i = cfg->blocks[b].start; i < cfg->blocks[b].end; i++) {
+            bool guarded = false;
+            size_t end = match_run(info, b, i, &guarded);
+
+            if (end == NO_POS)
+                continue;
+
+            hoists = realloc(hoists, (hoist_count + 1) * sizeof(Hoist));
+            hoists[hoist_count++] = (Hoist){ .start = i, .end = end, .guarded = guarded };
+            guard |= guarded;
+            i = end;
+        }
+    }
+
+    if (hoist_count == 0) {
+        free(hoists);
+        return false;
+    }
+
+    // Build the preheader, saving the accumulator if the header needs it.
+    // The guard is copied before any run is moved out of the test.
+    size_t preheader_cap = cfg->blocks[info->test == NO_BLOCK ? loop->header : info->test].end - header->start + 8;
+    Op *preheader = malloc(preheader_cap * sizeof(Op));
+    size_t preheader_count = 0;
+    bool save_acc = acc_live_at(cfg, header->start);
+    OpValue acc = (OpValue){ .type = VAL_REG, .reg = TEMP_REG };
+    const unsigned int skip = guard ? ir_new_label(info->ir) : 0;
+
+    if (save_acc)
+        preheader[preheader_count++] = (Op){ .type = OP_PUSH, .src = acc };
+
+    if (guard)
+        preheader_count += write_guard(info, preheader + preheader_count, skip);
+
+    for (size_t h = 0; h < hoist_count; h++) {
+        size_t needed = preheader_count + (hoists[h].end - hoists[h].start) + 8;
+
+        if (needed >= preheader_cap) {
+            preheader_cap = needed * 2;
+            preheader = realloc(preheader, preheader_cap * sizeof(Op));
+        }
+
+        // The same run twice gets the same variable.
+        size_t same = NO_POS;
+
+        for (size_t j = 0; j < h && same == NO_POS; j++) {
+            if (hoists[j].start != NO_POS && same_run(info, &hoists[h], preheader + hoists[j].start))
+                same = j;
+        }
+
+        if (same != NO_POS) {
+            for (size_t i = hoists[h].start; i <= hoists[h].end; i++) {
+                if (op_at(info, i)->type != OP_NEW_VAR)
+                    op_at(info, i)->type = OP_NOP;
+            }
+
+            *op_at(info, hoists[h].end) = (Op){ .type = OP_LOAD, .dst = acc, .src = preheader[hoists[same].start - 1].src,
+                .loc = op_at(info, hoists[h].end)->loc };
+            hoists[h].start = hoists[h].end = NO_POS;
+            continue;
+        }
+
+        OpValue var = (OpValue){ .type = VAL_VAR, .source = (Source){ .scope = info->func, .func = info->func, .module = "" },
+            .var = ir_new_name(info->ir, "@licm") };
+
+        preheader[preheader_count++] = (Op){ .type = OP_NEW_VAR, .src = var };
+        const size_t run_start = preheader_count;
+
+        for (size_t i = hoists[h].start; i <= hoists[h].end; i++) {
+            Op *op = op_at(info, i);
+
+            if (op->type == OP_NOP || op->type == OP_NEW_VAR)
+                continue;
+
+            preheader[preheader_count++] = *op;
+            op->type = OP_NOP;
+        }
+
+        preheader[preheader_count++] = (Op){ .type = OP_STORE, .dst = var, .src = acc };
+        *op_at(info, hoists[h].end) = (Op){ .type = OP_LOAD, .dst = acc, .src = var, .loc = op_at(info, hoists[h].end)->loc };
+
+        // Where it went, for the runs after it.
+        hoists[h].start = run_start;
+        hoists[h].end = preheader_count - 1;
+    }
+
+    if (guard) {
+        Op *branch = op_at(info, cfg->blocks[info->test].end - 1);
+        OpValue label = branch->dst;
+        label.branch = skip;
+        preheader[preheader_count++] = (Op){ .type = OP_NEW_BRANCH, .src = label, .loc = branch->loc };
+    }
+
+    if (save_acc)
+        preheader[preheader_count++] = (Op){ .type = OP_POP, .dst = acc };
+
+    ir_insert(info->ir, insert_at, preheader, preheader_count);
+    free(preheader);
+    free(hoists);
+    return true;
+}
+
+static int compare_loops(const void *a, const void *b) {
+    const Loop *x = a;
+    const Loop *y = b;
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+// Returns true if the routine changed, its op indices are stale then.
+static bool hoist_routine(IR *ir, size_t begin, VarTable *vars, CallGraph *graph, AliasInfo *alias) {
+    CFG cfg = build_cfg(ir, begin);
+    size_t loop_count;
+    Loop *loops = find_loops(&cfg, &loop_count);
+    bool changed = false;
+
+    // Inner loops first, their preheaders can then go further out.
+    if (loop_count > 1)
+        qsort(loops, loop_count, sizeof(Loop), compare_loops);
+
+    LoopInfo info = (LoopInfo){ .ir = ir, .cfg = &cfg, .vars = vars, .graph = graph,
+        .func = begin == MAIN_ROUTINE ? GLOBAL : ir->ops[begin].src.ident,
+        .written = calloc(vars->count + 1, sizeof(bool)), .written_size = vars->count,
+        .temp = intern_var(vars, GLOBAL, "@temp"),
+        .exits = malloc((cfg.block_count + 1) * sizeof(size_t)), .alias = alias, .tracker = create_alias_tracker(alias),
+        .deref_regions = malloc((cfg.index_count + 1) * sizeof(size_t)), .stored = malloc((alias->region_count + 1) * sizeof(bool)) };
+
+    for (size_t i = 0; i < loop_count && !changed; i++) {
+        info.loop = &loops[i];
+        changed = hoist_loop(&info);
+    }
+
+    free(info.written);
+    free(info.exits);
+    free(info.deref_regions);
+    free(info.stored);
+    delete_alias_tracker(&info.tracker);
+    delete_loops(loops, loop_count);
+    delete_cfg(&cfg);
+    return changed;
+}
+
+void loop_invariant_code_motion(IR *ir) {
+    VarTable vars = create_var_table();
+    CallGraph graph = build_call_graph(ir, &vars);
+    AliasInfo alias = build_alias_info(ir, &vars);
+
+    for (size_t n = 0; nth_routine(ir, n) != NO_ROUTINE; n++) {
+        // Every hoist moves code into an outer loop, so go again
+        // until the routine settles.
+        while (hoist_routine(ir, nth_routine(ir, n), &vars, &graph, &alias));
+    }
+
+    delete_alias_info(&alias);
+    delete_call_graph(&graph);
+    delete_var_table(&vars);
+}
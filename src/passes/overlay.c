@@ -0,0 +1,825 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../callgraph.h"
+#include "../alias.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+// Data slot sharing.
+//
+// Every variable gets a data slot of its own, but the variables of a
+// subroutine only mean anything while it's running. Subroutines that
+// can never be running at the same time, because neither one can end
+// up calling the other, keep their variables in shared slots, and so
+// do two variables of one subroutine that are never live at once.
+//
+// A variable can't share if it's read before it's written, it keeps
+// its value between calls then, or if its address is taken. Buffers
+// from __res__ share with other buffers as long as their address can't
+// outlive the call that declared them.
+
+#define NO_FUNC ((size_t)-1)
+#define NO_NODE ((size_t)-1)
+
+typedef struct {
+    IR *ir;
+    VarTable *vars;
+    CallGraph *graph;
+    AliasInfo *alias;
+    CFG *cfgs; // Indexed by routine.
+    size_t routine_count;
+    size_t var_count;
+    size_t func_count;
+    size_t *owner;  // The subroutine whose frame a variable is in, NO_FUNC if none.
+    bool *is_param;
+    bool *declared; // By a NEW_VAR in its own subroutine.
+    bool *carried;  // Read before it's written somewhere.
+    bool *reach;    // [f * func_count + g], whether f can end up calling g.
+    bool *eligible; // Subroutines whose variables can share.
+
+    // The variables that can share and what they interfere with.
+    size_t *node_of;
+    size_t *nodes;
+    size_t node_count;
+    bool *adj;     // [a * node_count + b]
+    bool *crosses; // [node * func_count + f], live across a call that can run f.
+} Overlay;
+
+typedef struct {
+    Overlay *ov;
+    CFG *cfg;
+    size_t func; // NO_FUNC for the main program.
+    bool **live_in;
+} Liveness;
+
+typedef struct {
+    Overlay *ov;
+    size_t buffer;
+    bool *holds;   // Variables that may hold the address anywhere.
+    bool *scratch; // Scratch variables that hold it in the current block.
+    bool acc;
+    bool *stack;
+    size_t depth;
+    size_t capacity;
+    bool changed;
+    bool escapes;
+} Escape;
+
+typedef struct {
+    size_t var;
+    size_t size;
+    size_t op; // The store of __res__ that declares it.
+    size_t slot;
+} Buffer;
+
+static bool reaches(Overlay *ov, size_t f, size_t g) {
+    return ov->reach[f * ov->func_count + g];
+}
+
+static bool may_overlap(Overlay *ov, size_t f, size_t g) {
+    return f == g || reaches(ov, f, g) || reaches(ov, g, f);
+}
+
+static bool is_ret(Overlay *ov, size_t var) {
+    return strcmp(ov->vars->keys[var].name, "@ret") == 0;
+}
+
+// Inline asm could call anything with a csr.
+static bool asm_calls(char *code) {
+    for (char *c = code; *c != '\0'; c++) {
+        if (tolower((unsigned char)c[0]) == 'c' && tolower((unsigned char)c[1]) == 's' && tolower((unsigned char)c[2]) == 'r')
+            return true;
+    }
+
+    return false;
+}
+
+static void find_reach(Overlay *ov) {
+    const size_t n = ov->func_count;
+    bool *has_asm = calloc(n + 1, sizeof(bool));
+
+    for (size_t f = 0; f < n; f++) {
+        Function *func = &ov->graph->funcs[f];
+        bool calls_anything = false;
+
+        for (size_t i = 0; i < func->callee_count; i++)
+            ov->reach[f * n + func->callees[i]] = true;
+
+        for (size_t i = func->begin + 1; i < func->end; i++) {
+            Op *op = &ov->ir->ops[i];
+
+            if (op->type == OP_CALL && find_function(ov->graph, op->src.ident) == NULL)
+                calls_anything = true;
+            else if (op->type == OP_INLINE_ASM) {
+                has_asm[f] = true;
+                calls_anything |= asm_calls(op->src.string);
+            }
+        }
+
+        for (size_t g = 0; g < n && calls_anything; g++)
+            ov->reach[f * n + g] = true;
+    }
+
+    for (size_t k = 0; k < n; k++) {
+        for (size_t f = 0; f < n; f++) {
+            if (!ov->reach[f * n + k])
+                continue;
+
+            for (size_t g = 0; g < n; g++)
+                ov->reach[f * n + g] |= ov->reach[k * n + g];
+        }
+    }
+
+    // Recursion would need a frame for every call, and asm names the
+    // variables by their labels.
+    for (size_t f = 0; f < n; f++)
+        ov->eligible[f] = !reaches(ov, f, f) && !has_asm[f];
+
+    free(has_asm);
+}
+
+static void find_frames(Overlay *ov) {
+    for (size_t v = 0; v < ov->var_count; v++) {
+        ov->owner[v] = NO_FUNC;
+
+        for (size_t f = 0; f < ov->func_count; f++) {
+            if (in_frame(ov->graph->funcs[f].name, ov->vars->keys[v].scope)) {
+                ov->owner[v] = f;
+                break;
+            }
+        }
+    }
+
+    for (size_t f = 0; f < ov->func_count; f++) {
+        Function *func = &ov->graph->funcs[f];
+        size_t params = 0;
+
+        // The parameters are declared first.
+        for (size_t i = func->begin + 1; i < func->end; i++) {
+            Op *op = &ov->ir->ops[i];
+            size_t var = op->type == OP_NEW_VAR ? value_to_var(ov->vars, &op->src) : NO_VAR;
+
+            if (var >= ov->var_count || ov->owner[var] != f)
+                continue;
+
+            ov->declared[var] = true;
+            ov->is_param[var] = params++ < func->param_count;
+        }
+    }
+}
+
+// What the caller can still read after a subroutine returns: its
+// return value and everything outside the subroutines. Whatever else
+// is live across the call is up to the caller's side.
+static void live_at_exit(Liveness *lv, bool *live) {
+    Overlay *ov = lv->ov;
+    memset(live, 0, ov->var_count * sizeof(bool));
+
+    if (lv->func == NO_FUNC)
+        return;
+
+    for (size_t v = 0; v < ov->var_count; v++) {
+        if (ov->owner[v] == NO_FUNC)
+            live[v] = !is_scratch_var(ov->vars, v);
+        else if (ov->owner[v] == lv->func)
+            live[v] = is_ret(ov, v);
+    }
+}
+
+// Inline asm and code the call graph doesn't know can only name the
+// variables outside the subroutines, the routine's own ones and the
+// ones whose address is taken.
+static void gen_outside(Liveness *lv, bool *live) {
+    Overlay *ov = lv->ov;
+
+    for (size_t v = 0; v < ov->var_count; v++) {
+        live[v] |= !is_scratch_var(ov->vars, v) &&
+            (ov->owner[v] == NO_FUNC || ov->owner[v] == lv->func || is_address_taken(ov->alias, v));
+    }
+}
+
+// Steps the live variables back over the op.
+static void transfer(Liveness *lv, Op *op, bool *live) {
+    Overlay *ov = lv->ov;
+
+    switch (op->type) {
+        case OP_RET:
+            live_at_exit(lv, live);
+            return;
+        case OP_INLINE_ASM:
+            gen_outside(lv, live);
+            return;
+        case OP_CALL: {
+            Function *callee = find_function(ov->graph, op->src.ident);
+            size_t f = callee == NULL ? NO_FUNC : (size_t)(callee - ov->graph->funcs);
+
+            if (f == NO_FUNC) {
+                gen_outside(lv, live);
+                return;
+            }
+
+            // Besides its parameters, the callee writes its own variables
+            // and the ones of what it calls before reading them, the ones
+            // that aren't are left alone anyway. Any asm it runs only
+            // names what's outside the subroutines or has its address
+            // taken.
+            for (size_t v = 0; v < ov->var_count; v++) {
+                size_t g = ov->owner[v];
+                bool reads = !is_scratch_var(ov->vars, v) && call_may_read(ov->graph, op->src.ident, v);
+
+                if (g == NO_FUNC || is_address_taken(ov->alias, v))
+                    live[v] |= reads;
+                else if (g == f)
+                    live[v] |= reads && ov->is_param[v];
+                else if (!reaches(ov, f, g))
+                    live[v] |= reads && !callee->has_asm;
+            }
+            return;
+        }
+        default: break;
+    }
+
+    size_t written = op_writes_var(ov->vars, op);
+    size_t read = op_reads_var(ov->vars, op);
+
+    if (written < ov->var_count)
+        live[written] = false;
+
+    if (read < ov->var_count)
+        live[read] = true;
+}
+
+static void live_out(Liveness *lv, size_t block, bool *live) {
+    Block *b = &lv->cfg->blocks[block];
+
+    if (b->succ_count == 0) {
+        live_at_exit(lv, live);
+        return;
+    }
+
+    memset(live, 0, lv->ov->var_count * sizeof(bool));
+
+    for (size_t i = 0; i < b->succ_count; i++) {
+        bool *in = lv->live_in[b->succs[i]];
+
+        for (size_t v = 0; v < lv->ov->var_count; v++)
+            live[v] |= in[v];
+    }
+}
+
+static void solve(Liveness *lv) {
+    const size_t var_count = lv->ov->var_count;
+    bool *live = malloc((var_count + 1) * sizeof(bool));
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t block = lv->cfg->block_count; block-- > 0; ) {
+            Block *b = &lv->cfg->blocks[block];
+            live_out(lv, block, live);
+
+            for (size_t i = b->end; i-- > b->start; )
+                transfer(lv, &lv->cfg->ir->ops[lv->cfg->index[i]], live);
+
+            if (memcmp(live, lv->live_in[block], var_count * sizeof(bool)) != 0) {
+                memcpy(lv->live_in[block], live, var_count * sizeof(bool));
+                changed = true;
+            }
+        }
+    }
+
+    free(live);
+}
+
+static void interfere(Overlay *ov, size_t a, size_t b) {
+    if (a == NO_NODE || b == NO_NODE || a == b)
+        return;
+
+    ov->adj[a * ov->node_count + b] = true;
+    ov->adj[b * ov->node_count + a] = true;
+}
+
+// Whatever is live after the call can't share with anything the call
+// may run.
+static void note_call(Liveness *lv, Op *op, bool *live) {
+    Overlay *ov = lv->ov;
+    Function *callee = find_function(ov->graph, op->src.ident);
+    size_t f = callee == NULL ? NO_FUNC : (size_t)(callee - ov->graph->funcs);
+
+    for (size_t v = 0; v < ov->var_count; v++) {
+        size_t node = ov->node_of[v];
+
+        if (!live[v] || node == NO_NODE)
+            continue;
+
+        for (size_t g = 0; g < ov->func_count; g++)
+            ov->crosses[node * ov->func_count + g] |= f == NO_FUNC || g == f || reaches(ov, f, g);
+    }
+}
+
+static void add_interference(Liveness *lv) {
+    Overlay *ov = lv->ov;
+    bool *live = malloc((ov->var_count + 1) * sizeof(bool));
+
+    for (size_t block = 0; block < lv->cfg->block_count; block++) {
+        Block *b = &lv->cfg->blocks[block];
+        live_out(lv, block, live);
+
+        for (size_t i = b->end; i-- > b->start; ) {
+            Op *op = &ov->ir->ops[lv->cfg->index[i]];
+            size_t written = op_writes_var(ov->vars, op);
+
+            if (written < ov->var_count && ov->node_of[written] != NO_NODE) {
+                for (size_t v = 0; v < ov->var_count; v++) {
+                    if (live[v])
+                        interfere(ov, ov->node_of[written], ov->node_of[v]);
+                }
+            } else if (op->type == OP_CALL)
+                note_call(lv, op, live);
+
+            transfer(lv, op, live);
+        }
+    }
+
+    // Everything live at the start was written before the call, so it's
+    // all live at once. A subroutine's own variables besides the
+    // parameters were left over from the last call, and anything live
+    // at the start of the program is still zero.
+    bool *entry = lv->live_in[0];
+    size_t *entry_nodes = malloc((ov->node_count + 1) * sizeof(size_t));
+    size_t entry_count = 0;
+
+    for (size_t v = 0; v < ov->var_count; v++) {
+        if (!entry[v])
+            continue;
+        else if (lv->func == NO_FUNC || (ov->owner[v] == lv->func && !ov->is_param[v]))
+            ov->carried[v] = true;
+
+        if (ov->node_of[v] != NO_NODE)
+            entry_nodes[entry_count++] = ov->node_of[v];
+    }
+
+    for (size_t a = 0; a < entry_count; a++) {
+        for (size_t b = a + 1; b < entry_count; b++)
+            interfere(ov, entry_nodes[a], entry_nodes[b]);
+    }
+
+    free(entry_nodes);
+    free(live);
+}
+
+static void analyze_routine(Overlay *ov, size_t n) {
+    CFG *cfg = &ov->cfgs[n];
+    Liveness lv = (Liveness){ .ov = ov, .cfg = cfg, .func = n == 0 ? NO_FUNC : n - 1,
+        .live_in = malloc((cfg->block_count + 1) * sizeof(bool *)) };
+
+    for (size_t b = 0; b < cfg->block_count; b++)
+        lv.live_in[b] = calloc(ov->var_count + 1, sizeof(bool));
+
+    solve(&lv);
+    add_interference(&lv);
+
+    for (size_t b = 0; b < cfg->block_count; b++)
+        free(lv.live_in[b]);
+
+    free(lv.live_in);
+}
+
+static bool nodes_interfere(Overlay *ov, size_t a, size_t b) {
+    size_t fa = ov->owner[ov->nodes[a]];
+    size_t fb = ov->owner[ov->nodes[b]];
+
+    if (ov->adj[a * ov->node_count + b])
+        return true;
+
+    // Something live across a call to its own subroutine, like an argument
+    // the caller knows is still there, has to survive the whole body.
+    if (fa == fb)
+        return ov->crosses[a * ov->func_count + fa] || ov->crosses[b * ov->func_count + fb];
+
+    return may_overlap(ov, fa, fb) || ov->crosses[a * ov->func_count + fb] || ov->crosses[b * ov->func_count + fa];
+}
+
+// Where the address can go without outliving the call.
+static bool may_hold(Escape *e, size_t var) {
+    Overlay *ov = e->ov;
+    size_t f = ov->owner[e->buffer];
+    size_t g = ov->owner[var];
+
+    if (g == NO_FUNC || ov->carried[var] || is_address_taken(ov->alias, var))
+        return false;
+    else if (g != f)
+        return reaches(ov, f, g);
+
+    return !is_ret(ov, var);
+}
+
+static bool holds_address(Escape *e, OpValue *value) {
+    switch (value->type) {
+        case VAL_REG: return e->acc;
+        case VAL_STACK: return e->depth > 0 && e->stack[e->depth - 1];
+        case VAL_VAR:
+        case VAL_RET: {
+            size_t var = value_to_var(e->ov->vars, value);
+
+            if (var >= e->ov->var_count)
+                return false;
+
+            return is_scratch_var(e->ov->vars, var) ? e->scratch[var] : e->holds[var];
+        }
+        default: break;
+    }
+
+    return false;
+}
+
+static void set_holds(Escape *e, OpValue *value, bool holds) {
+    if (value->type == VAL_REG || value->type == VAL_NONE) {
+        e->acc = holds;
+        return;
+    } else if (value->type == VAL_STACK) {
+        if (e->depth > 0)
+            e->stack[e->depth - 1] = holds;
+        else
+            e->escapes |= holds;
+        return;
+    }
+
+    size_t var = value_to_var(e->ov->vars, value);
+
+    if (var >= e->ov->var_count)
+        e->escapes |= holds;
+    else if (is_scratch_var(e->ov->vars, var))
+        e->scratch[var] = holds;
+    else if (holds && !e->holds[var]) {
+        if (may_hold(e, var)) {
+            e->holds[var] = true;
+            e->changed = true;
+        } else
+            e->escapes = true;
+    }
+}
+
+static void push_holds(Escape *e, bool holds) {
+    if (e->depth == e->capacity) {
+        e->capacity = e->capacity == 0 ? 16 : e->capacity * 2;
+        e->stack = realloc(e->stack, e->capacity * sizeof(bool));
+    }
+
+    e->stack[e->depth++] = holds;
+}
+
+static void track_address(Escape *e, Op *op) {
+    switch (op->type) {
+        case OP_LOAD:
+            set_holds(e, &op->dst, holds_address(e, &op->src));
+            break;
+        case OP_STORE:
+            if (op->src.type != VAL__RES__)
+                set_holds(e, &op->dst, holds_address(e, &op->src));
+            break;
+        case OP_PUSH:
+            push_holds(e, holds_address(e, &op->src));
+            break;
+        case OP_POP:
+            // Anything pushed in an earlier block was caught leaving it.
+            set_holds(e, &op->dst, e->depth > 0 && e->stack[--e->depth]);
+            break;
+        case OP_SWP: {
+            bool acc = e->acc;
+            e->acc = holds_address(e, &op->dst);
+            set_holds(e, &op->dst, acc);
+            break;
+        }
+        case OP_REF:
+            e->escapes |= op->src.type == VAL_VAR && value_to_var(e->ov->vars, &op->src) == e->buffer;
+            e->acc = false;
+            break;
+        case OP_STORE_DEREF:
+            e->escapes |= e->acc;
+            break;
+        case OP_INLINE_ASM:
+            e->escapes |= e->acc;
+
+            for (size_t i = 0; i < e->depth; i++)
+                e->escapes |= e->stack[i];
+
+            for (size_t v = 0; v < e->ov->var_count; v++)
+                e->escapes |= e->scratch[v];
+
+            e->acc = false;
+            break;
+        default:
+            // Anything worked out from the address may still point into
+            // the buffer.
+            if (IS_MATH(op->type) || op->type == OP_NOT || op->type == OP_NEG)
+                set_holds(e, &op->dst, holds_address(e, &op->dst) || holds_address(e, &op->src));
+            else if (op_writes_acc(op))
+                e->acc = false;
+            break;
+    }
+}
+
+// The accumulator, the stack and scratch variables are only followed
+// within a block.
+static void leave_block(Escape *e, CFG *cfg, Block *b) {
+    for (size_t i = 0; i < e->depth; i++)
+        e->escapes |= e->stack[i];
+
+    for (size_t i = 0; i < b->succ_count && !e->escapes; i++) {
+        size_t start = cfg->blocks[b->succs[i]].start;
+        e->escapes |= e->acc && acc_live_at(cfg, start);
+
+        for (size_t v = 0; v < e->ov->var_count && !e->escapes; v++)
+            e->escapes |= e->scratch[v] && var_live_at(cfg, e->ov->vars, start, v);
+    }
+
+    e->acc = false;
+    e->depth = 0;
+    memset(e->scratch, 0, e->ov->var_count * sizeof(bool));
+}
+
+// Follows the buffer's address through the whole program until it's
+// known everywhere it can end up.
+static bool buffer_escapes(Overlay *ov, size_t buffer) {
+    Escape e = (Escape){ .ov = ov, .buffer = buffer, .holds = calloc(ov->var_count + 1, sizeof(bool)),
+        .scratch = calloc(ov->var_count + 1, sizeof(bool)), .changed = true };
+
+    e.holds[buffer] = true;
+
+    while (e.changed && !e.escapes) {
+        e.changed = false;
+
+        for (size_t n = 0; n < ov->routine_count && !e.escapes; n++) {
+            CFG *cfg = &ov->cfgs[n];
+
+            for (size_t block = 0; block < cfg->block_count && !e.escapes; block++) {
+                Block *b = &cfg->blocks[block];
+
+                for (size_t i = b->start; i < b->end && !e.escapes; i++)
+                    track_address(&e, &ov->ir->ops[cfg->index[i]]);
+
+                leave_block(&e, cfg, b);
+            }
+        }
+    }
+
+    free(e.holds);
+    free(e.scratch);
+    free(e.stack);
+    return e.escapes;
+}
+
+// Only written by its declaration, so the label always holds the
+// address.
+static bool only_declared(Overlay *ov, size_t buffer) {
+    for (size_t i = 0; i < ov->ir->op_count; i++) {
+        if (op_writes_var(ov->vars, &ov->ir->ops[i]) == buffer)
+            return false;
+    }
+
+    return true;
+}
+
+static size_t find_buffers(Overlay *ov, Buffer **out) {
+    Buffer *buffers = NULL;
+    size_t count = 0;
+
+    for (size_t i = 0; i < ov->ir->op_count; i++) {
+        Op *op = &ov->ir->ops[i];
+
+        if (op->type != OP_STORE || op->src.type != VAL__RES__)
+            continue;
+
+        size_t var = value_to_var(ov->vars, &op->dst);
+
+        if (var >= ov->var_count || ov->owner[var] == NO_FUNC || !ov->eligible[ov->owner[var]] ||
+                !only_declared(ov, var) || buffer_escapes(ov, var))
+            continue;
+
+        // Biggest first, the first buffer of a slot sets its size.
+        size_t at = count;
+
+        while (at > 0 && buffers[at - 1].size < (size_t)op->src.int_const)
+            at--;
+
+        buffers = realloc(buffers, (count + 1) * sizeof(Buffer));
+        memmove(&buffers[at + 1], &buffers[at], (count - at) * sizeof(Buffer));
+        buffers[at] = (Buffer){ .var = var, .size = (size_t)op->src.int_const, .op = i };
+        count++;
+    }
+
+    *out = buffers;
+    return count;
+}
+
+// First fit, every variable goes into the first slot where nothing
+// interferes with it. Returns the number of slots.
+static size_t color_nodes(Overlay *ov, size_t *slot_of) {
+    size_t slot_count = 0;
+    bool *taken = malloc((ov->node_count + 1) * sizeof(bool));
+
+    for (size_t a = 0; a < ov->node_count; a++) {
+        slot_of[a] = NO_NODE;
+
+        if (ov->carried[ov->nodes[a]])
+            continue;
+
+        memset(taken, 0, slot_count * sizeof(bool));
+
+        for (size_t b = 0; b < a; b++) {
+            if (slot_of[b] != NO_NODE && nodes_interfere(ov, a, b))
+                taken[slot_of[b]] = true;
+        }
+
+        slot_of[a] = 0;
+
+        while (slot_of[a] < slot_count && taken[slot_of[a]])
+            slot_of[a]++;
+
+        if (slot_of[a] == slot_count)
+            slot_count++;
+    }
+
+    free(taken);
+    return slot_count;
+}
+
+static size_t color_buffers(Overlay *ov, Buffer *buffers, size_t count) {
+    size_t slot_count = 0;
+
+    for (size_t a = 0; a < count; a++) {
+        buffers[a].slot = slot_count;
+
+        for (size_t slot = 0; slot < slot_count && buffers[a].slot == slot_count; slot++) {
+            bool fits = true;
+
+            for (size_t b = 0; b < a && fits; b++)
+                fits = buffers[b].slot != slot || !may_overlap(ov, ov->owner[buffers[a].var], ov->owner[buffers[b].var]);
+
+            if (fits)
+                buffers[a].slot = slot;
+        }
+
+        if (buffers[a].slot == slot_count)
+            slot_count++;
+    }
+
+    return slot_count;
+}
+
+static void rename_vars(Overlay *ov, OpValue *renamed) {
+    for (size_t i = 0; i < ov->ir->op_count; i++) {
+        Op *op = &ov->ir->ops[i];
+        size_t dst = value_to_var(ov->vars, &op->dst);
+        size_t src = value_to_var(ov->vars, &op->src);
+
+        if (dst < ov->var_count && renamed[dst].type != VAL_NONE)
+            op->dst = renamed[dst];
+
+        if (src < ov->var_count && renamed[src].type != VAL_NONE) {
+            // The slot is declared once for all of them.
+            if (op->type == OP_NEW_VAR)
+                op->type = OP_NOP;
+
+            op->src = renamed[src];
+        }
+    }
+}
+
+// Slots with a single variable are left alone.
+static void share_slots(Overlay *ov, size_t *slot_of, size_t slot_count, Buffer *buffers, size_t buffer_count, size_t buffer_slots) {
+    OpValue *renamed = calloc(ov->var_count + 1, sizeof(OpValue));
+    size_t *members = calloc(slot_count + buffer_slots + 1, sizeof(size_t));
+    Op *decls = malloc((slot_count + 1) * sizeof(Op));
+    size_t decl_count = 0;
+
+    // Named like @temp, which is always declared first.
+    Source global = ov->ir->ops[0].src.source;
+
+    for (size_t a = 0; a < ov->node_count; a++) {
+        if (slot_of[a] != NO_NODE)
+            members[slot_of[a]]++;
+    }
+
+    for (size_t b = 0; b < buffer_count; b++)
+        members[slot_count + buffers[b].slot]++;
+
+    for (size_t slot = 0; slot < slot_count; slot++) {
+        if (members[slot] < 2)
+            continue;
+
+        OpValue value = (OpValue){ .type = VAL_VAR, .source = global, .var = ir_new_name(ov->ir, "@slot") };
+        decls[decl_count++] = (Op){ .type = OP_NEW_VAR, .dst = (OpValue){ .type = VAL_NONE }, .src = value };
+
+        for (size_t a = 0; a < ov->node_count; a++) {
+            if (slot_of[a] == slot)
+                renamed[ov->nodes[a]] = value;
+        }
+    }
+
+    for (size_t slot = 0; slot < buffer_slots; slot++) {
+        if (members[slot_count + slot] < 2)
+            continue;
+
+        OpValue value = (OpValue){ .type = VAL_VAR, .source = global, .var = ir_new_name(ov->ir, "@buffer") };
+        bool first = true;
+
+        for (size_t b = 0; b < buffer_count; b++) {
+            if (buffers[b].slot != slot)
+                continue;
+
+            renamed[buffers[b].var] = value;
+
+            if (!first)
+                ov->ir->ops[buffers[b].op].type = OP_NOP;
+
+            first = false;
+        }
+    }
+
+    rename_vars(ov, renamed);
+    ir_insert(ov->ir, 1, decls, decl_count);
+
+    free(renamed);
+    free(members);
+    free(decls);
+}
+
+void overlay_data_slots(IR *ir) {
+    VarTable vars = create_var_table();
+    CallGraph graph = build_call_graph(ir, &vars);
+    AliasInfo alias = build_alias_info(ir, &vars);
+
+    Overlay ov = (Overlay){ .ir = ir, .vars = &vars, .graph = &graph, .alias = &alias, .var_count = vars.count, .func_count = graph.func_count };
+    ov.owner = malloc((ov.var_count + 1) * sizeof(size_t));
+    ov.is_param = calloc(ov.var_count + 1, sizeof(bool));
+    ov.declared = calloc(ov.var_count + 1, sizeof(bool));
+    ov.carried = calloc(ov.var_count + 1, sizeof(bool));
+    ov.reach = calloc(ov.func_count * ov.func_count + 1, sizeof(bool));
+    ov.eligible = calloc(ov.func_count + 1, sizeof(bool));
+    ov.node_of = malloc((ov.var_count + 1) * sizeof(size_t));
+    ov.nodes = malloc((ov.var_count + 1) * sizeof(size_t));
+
+    find_reach(&ov);
+    find_frames(&ov);
+
+    for (size_t v = 0; v < ov.var_count; v++) {
+        size_t f = ov.owner[v];
+        ov.node_of[v] = NO_NODE;
+
+        if (f != NO_FUNC && ov.eligible[f] && ov.declared[v] && !is_address_taken(&alias, v)) {
+            ov.node_of[v] = ov.node_count;
+            ov.nodes[ov.node_count++] = v;
+        }
+    }
+
+    ov.adj = calloc(ov.node_count * ov.node_count + 1, sizeof(bool));
+    ov.crosses = calloc(ov.node_count * ov.func_count + 1, sizeof(bool));
+
+    // Routine n is subroutine n - 1 of the call graph, both go in
+    // program order.
+    while (nth_routine(ir, ov.routine_count) != NO_ROUTINE)
+        ov.routine_count++;
+
+    ov.cfgs = malloc(ov.routine_count * sizeof(CFG));
+
+    for (size_t n = 0; n < ov.routine_count; n++) {
+        ov.cfgs[n] = build_cfg(ir, nth_routine(ir, n));
+        analyze_routine(&ov, n);
+    }
+
+    Buffer *buffers;
+    size_t buffer_count = find_buffers(&ov, &buffers);
+    size_t buffer_slots = color_buffers(&ov, buffers, buffer_count);
+
+    size_t *slot_of = malloc((ov.node_count + 1) * sizeof(size_t));
+    size_t slot_count = color_nodes(&ov, slot_of);
+
+    for (size_t n = 0; n < ov.routine_count; n++)
+        delete_cfg(&ov.cfgs[n]);
+
+    share_slots(&ov, slot_of, slot_count, buffers, buffer_count, buffer_slots);
+
+    free(slot_of);
+    free(buffers);
+    free(ov.cfgs);
+    free(ov.owner);
+    free(ov.is_param);
+    free(ov.declared);
+    free(ov.carried);
+    free(ov.reach);
+    free(ov.eligible);
+    free(ov.node_of);
+    free(ov.nodes);
+    free(ov.adj);
+    free(ov.crosses);
+    delete_alias_info(&alias);
+    delete_call_graph(&graph);
+    delete_var_table(&vars);
+}
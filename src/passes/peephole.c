@@ -0,0 +1,197 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// The rules themselves are in peephole.rules, these are the helpers
+// the generated matcher uses. Not every rule set needs all of them.
+#define HELPER static __attribute__((unused))
+
+HELPER bool is_acc(OpValue *value) {
+    return IS_ACC((*value));
+}
+
+HELPER bool is_int(OpValue *value) {
+    return value->type == VAL_INT;
+}
+
+HELPER bool is_str(OpValue *value) {
+    return value->type == VAL_STRING;
+}
+
+HELPER bool is_var(OpValue *value) {
+    return value->type == VAL_VAR;
+}
+
+HELPER bool is_ret(OpValue *value) {
+    return value->type == VAL_RET;
+}
+
+HELPER bool is_mem(OpValue *value) {
+    return is_var(value) || is_ret(value);
+}
+
+HELPER bool is_value(OpValue *value) {
+    return is_int(value) || is_str(value) || is_mem(value);
+}
+
+HELPER bool is_temp(OpValue *value) {
+    return is_var(value) && strcmp(value->var, "@temp") == 0;
+}
+
+HELPER bool same_value(OpValue *a, OpValue *b) {
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type) {
+        case VAL_INT: return a->int_const == b->int_const;
+        case VAL_STRING: return strcmp(a->string, b->string) == 0;
+        case VAL_REG: return a->reg == b->reg;
+        case VAL_VAR: return strcmp(a->var, b->var) == 0 && strcmp(a->source.scope, b->source.scope) == 0;
+        case VAL_RET: return strcmp(a->source.func, b->source.func) == 0;
+        case VAL_STACK: return true;
+        default: break;
+    }
+
+    return false;
+}
+
+HELPER int64_t wrap_add(int64_t a, int64_t b) {
+    return (int64_t)((uint64_t)a + (uint64_t)b);
+}
+
+HELPER int64_t wrap_mul(int64_t a, int64_t b) {
+    return (int64_t)((uint64_t)a * (uint64_t)b);
+}
+
+HELPER int64_t wrap_neg(int64_t a) {
+    return (int64_t)(0 - (uint64_t)a);
+}
+
+HELPER OpValue none_value() {
+    return (OpValue){ .type = VAL_NONE };
+}
+
+HELPER OpValue acc_value() {
+    return (OpValue){ .type = VAL_REG, .reg = TEMP_REG };
+}
+
+HELPER OpValue stack_value() {
+    return (OpValue){ .type = VAL_STACK };
+}
+
+HELPER OpValue int_value(int64_t n) {
+    return (OpValue){ .type = VAL_INT, .int_const = n };
+}
+
+HELPER OpValue temp_value() {
+    return (OpValue){ .type = VAL_VAR, .source = (Source){ .scope = GLOBAL, .func = GLOBAL, .module = "" }, .var = "@temp" };
+}
+
+// Where every op is in the control flow graph of its routine, for the
+// rules that need to know what comes after them.
+typedef struct {
+    IR *ir;
+    CFG *cfgs;
+    size_t cfg_count;
+    size_t *routine; // Indexed by op, NO_ROUTINE if it isn't in one.
+    size_t *position;
+} Positions;
+
+static Positions positions;
+
+static void find_positions(IR *ir) {
+    positions = (Positions){ .ir = ir, .cfgs = NULL, .cfg_count = 0,
+        .routine = malloc((ir->op_count + 1) * sizeof(size_t)), .position = malloc((ir->op_count + 1) * sizeof(size_t)) };
+
+    for (size_t i = 0; i < ir->op_count; i++)
+        positions.routine[i] = NO_ROUTINE;
+
+    for (size_t n = 0; nth_routine(ir, n) != NO_ROUTINE; n++) {
+        positions.cfgs = realloc(positions.cfgs, (n + 1) * sizeof(CFG));
+        positions.cfgs[n] = build_cfg(ir, nth_routine(ir, n));
+        positions.cfg_count++;
+
+        for (size_t pos = 0; pos < positions.cfgs[n].index_count; pos++) {
+            positions.routine[positions.cfgs[n].index[pos]] = n;
+            positions.position[positions.cfgs[n].index[pos]] = pos;
+        }
+    }
+}
+
+static void delete_positions() {
+    for (size_t i = 0; i < positions.cfg_count; i++)
+        delete_cfg(&positions.cfgs[i]);
+
+    free(positions.cfgs);
+    free(positions.routine);
+    free(positions.position);
+}
+
+// The rules don't add or remove branches, so the graphs stay valid
+// while they rewrite the ops.
+HELPER bool acc_live_after(Op *op) {
+    const size_t index = (size_t)(op - positions.ir->ops);
+
+    if (positions.routine[index] == NO_ROUTINE)
+        return true;
+
+    return acc_live_at(&positions.cfgs[positions.routine[index]], positions.position[index] + 1);
+}
+
+#include "peephole.inc"
+
+static size_t rule_fires[RULE_COUNT];
+
+// Fills the window with the ops from pos on, skipping NOPs.
+static size_t fill_window(IR *ir, size_t pos, Op **window) {
+    size_t count = 0;
+
+    for (; pos < ir->op_count && count < RULE_MAX_LENGTH; pos++) {
+        if (ir->ops[pos].type != OP_NOP)
+            window[count++] = &ir->ops[pos];
+    }
+
+    return count;
+}
+
+void peephole(IR *ir) {
+    Op *window[RULE_MAX_LENGTH];
+    size_t pos = 0;
+    find_positions(ir);
+
+    while (pos < ir->op_count) {
+        if (ir->ops[pos].type == OP_NOP) {
+            pos++;
+            continue;
+        }
+
+        int rule = match_rules(window, fill_window(ir, pos, window));
+
+        if (rule < 0) {
+            pos++;
+            continue;
+        }
+
+        rule_fires[rule]++;
+
+        // The rewrite may complete a pattern that starts a few ops back.
+        for (size_t back = 1; back < RULE_MAX_LENGTH && pos > 0; ) {
+            if (ir->ops[--pos].type != OP_NOP)
+                back++;
+        }
+    }
+
+    delete_positions();
+}
+
+void print_peephole_stats(FILE *out) {
+    fprintf(out, "%-24s %s\n", "rule", "fired");
+
+    for (size_t i = 0; i < RULE_COUNT; i++)
+        fprintf(out, "%-24s %zu\n", rule_names[i], rule_fires[i]);
+}
@@ -0,0 +1,547 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../callgraph.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MAX_EVAL_STEPS 100000
+#define MAX_EVAL_STACK 1024
+#define MAX_EVAL_DEPTH 256
+
+// Calls to pure subroutines whose arguments are all constants are run
+// here and replaced with their result:
+// load @acc, 1
+// store x, @acc
+// load @acc, 2
+// store y, @acc
+// call sum
+// load @acc, sum@ret
+// becomes load @acc, 3.
+//
+// Variables are static, so a subroutine that reads one of its locals
+// before writing it sees whatever the last call left there. Skipping
+// a call would change that, so only subroutines that write everything
+// before reading it are evaluated.
+
+typedef struct {
+    IR *ir;
+    CallGraph *graph;
+    VarTable *vars;
+    size_t *labels;    // Op index of each label.
+    bool *foldable;    // Indexed by function.
+    bool *returns;     // Always stores its return value before returning.
+} Folder;
+
+typedef struct {
+    int64_t *values;
+    bool *defined;
+    int64_t acc;
+    int64_t flag_acc;
+    int64_t flag_operand;
+    int64_t stack[MAX_EVAL_STACK];
+    size_t stack_size;
+    size_t returns[MAX_EVAL_DEPTH];
+    size_t depth;
+} Machine;
+
+static size_t ret_var(Folder *folder, Function *func) {
+    OpValue ret = (OpValue){ .type = VAL_RET, .source = (Source){ .func = func->name } };
+    return value_to_var(folder->vars, &ret);
+}
+
+// The parameters are the first variables declared in the subroutine.
+static void find_params(Folder *folder, Function *func, size_t *params) {
+    size_t count = 0;
+
+    for (size_t i = func->begin + 1; i < func->end && count < func->param_count; i++) {
+        if (folder->ir->ops[i].type == OP_NEW_VAR)
+            params[count++] = intern_var(folder->vars, folder->ir->ops[i].src.source.scope, folder->ir->ops[i].src.var);
+    }
+}
+
+// Goes through a block with the variables written so far in state.
+// When checking, a read of anything else fails and a return without
+// the return value clears returns.
+static bool transfer(Folder *folder, CFG *cfg, size_t b, bool *state, size_t ret, bool checking, bool *returns) {
+    Block *block = &cfg->blocks[b];
+    bool ok = true;
+
+    for (size_t pos = block->start; pos < block->end; pos++) {
+        Op *op = &folder->ir->ops[cfg->index[pos]];
+        size_t read = op_reads_var(folder->vars, op);
+        size_t written = op_writes_var(folder->vars, op);
+
+        if (checking && read != NO_VAR && !state[read])
+            ok = false;
+        else if (checking && op->type == OP_RET && !state[ret])
+            *returns = false;
+
+        if (written != NO_VAR)
+            state[written] = true;
+
+        if (op->type == OP_CALL) {
+            Function *callee = find_function(folder->graph, op->src.ident);
+
+            if (callee != NULL && folder->returns[callee - folder->graph->funcs])
+                state[ret_var(folder, callee)] = true;
+        }
+    }
+
+    return ok;
+}
+
+// Checks that every variable the subroutine reads has been written by
+// then on every path, and whether the return value always is.
+static bool reads_defined(Folder *folder, Function *func, bool *returns) {
+    CFG cfg = build_cfg(folder->ir, func->begin);
+    const size_t var_count = folder->vars->count;
+    bool *out = malloc(cfg.block_count * var_count * sizeof(bool) + 1);
+    bool *state = malloc(var_count * sizeof(bool) + 1);
+    size_t *params = malloc((func->param_count + 1) * sizeof(size_t));
+    const size_t ret = ret_var(folder, func);
+    bool ok = true;
+
+    find_params(folder, func, params);
+    memset(out, true, cfg.block_count * var_count * sizeof(bool));
+    *returns = true;
+
+    // Iterate until nothing changes, then check the reads once more.
+    for (bool changed = true, checking = false; changed || checking; ) {
+        bool check = checking;
+        changed = false;
+
+        for (size_t n = 0; n < cfg.order_count; n++) {
+            size_t b = cfg.order[n];
+            Block *block = &cfg.blocks[b];
+
+            memset(state, b != 0, var_count * sizeof(bool));
+
+            if (b == 0) {
+                for (size_t i = 0; i < func->param_count; i++)
+                    state[params[i]] = true;
+            }
+
+            for (size_t p = 0; p < block->pred_count; p++) {
+                for (size_t v = 0; v < var_count; v++)
+                    state[v] &= out[block->preds[p] * var_count + v];
+            }
+
+            ok &= transfer(folder, &cfg, b, state, ret, check, returns);
+
+            if (memcmp(&out[b * var_count], state, var_count * sizeof(bool)) != 0) {
+                memcpy(&out[b * var_count], state, var_count * sizeof(bool));
+                changed = true;
+            }
+        }
+
+        checking = !changed && !check;
+    }
+
+    free(params);
+    free(state);
+    free(out);
+    delete_cfg(&cfg);
+    return ok;
+}
+
+// Drops subroutines from the foldable set until every one left only
+// calls foldable ones and passes the read check.
+static void find_foldable(Folder *folder) {
+    CallGraph *graph = folder->graph;
+
+    for (size_t f = 0; f < graph->func_count; f++) {
+        folder->foldable[f] = graph->funcs[f].pure && !graph->funcs[f].loads_memory;
+        folder->returns[f] = true;
+    }
+
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t f = 0; f < graph->func_count; f++) {
+            Function *func = &graph->funcs[f];
+
+            if (!folder->foldable[f])
+                continue;
+
+            bool returns;
+            bool ok = reads_defined(folder, func, &returns);
+
+            for (size_t i = 0; i < func->callee_count; i++)
+                ok &= folder->foldable[func->callees[i]];
+
+            if (!ok) {
+                folder->foldable[f] = false;
+                changed = true;
+            }
+
+            if (!returns && folder->returns[f]) {
+                folder->returns[f] = false;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool read_value(Folder *folder, Machine *m, OpValue *value, int64_t *out) {
+    switch (value->type) {
+        case VAL_INT:
+            *out = value->int_const;
+            return true;
+        case VAL_REG:
+            *out = m->acc;
+            return true;
+        case VAL_VAR:
+        case VAL_RET: {
+            size_t var = value_to_var(folder->vars, value);
+
+            if (var == NO_VAR || !m->defined[var])
+                return false;
+
+            *out = m->values[var];
+            return true;
+        }
+        default: break;
+    }
+
+    return false;
+}
+
+static bool write_value(Folder *folder, Machine *m, OpValue *value, int64_t n) {
+    if (IS_ACC((*value))) {
+        m->acc = n;
+        return true;
+    }
+
+    size_t var = value_to_var(folder->vars, value);
+
+    if (var == NO_VAR)
+        return false;
+
+    m->values[var] = n;
+    m->defined[var] = true;
+    return true;
+}
+
+static bool relation(OpType type, int64_t operand, int64_t acc) {
+    switch (type) {
+        case OP_EQ: return operand == acc;
+        case OP_NEQ: return operand != acc;
+        case OP_LT: return operand < acc;
+        case OP_LTE: return operand <= acc;
+        case OP_GT: return operand > acc;
+        default: break;
+    }
+
+    return operand >= acc;
+}
+
+static bool math(OpType type, int64_t a, int64_t b, int64_t *out) {
+    switch (type) {
+        case OP_ADD: *out = (int64_t)((uint64_t)a + (uint64_t)b); return true;
+        case OP_SUB: *out = (int64_t)((uint64_t)a - (uint64_t)b); return true;
+        case OP_MUL: *out = (int64_t)((uint64_t)a * (uint64_t)b); return true;
+        case OP_DIV:
+        case OP_MOD:
+            if (b == 0 || (a == INT64_MIN && b == -1))
+                return false;
+
+            *out = type == OP_DIV ? a / b : a % b;
+            return true;
+        case OP_SHL:
+        case OP_SHR:
+            if (b < 0 || b > 63)
+                return false;
+
+            *out = type == OP_SHL ? (int64_t)((uint64_t)a << b) : (a < 0 ? ~(~a >> b) : a >> b);
+            return true;
+        case OP_AND: *out = a & b; return true;
+        case OP_OR: *out = a | b; return true;
+        case OP_XOR: *out = a ^ b; return true;
+        default: break;
+    }
+
+    return false;
+}
+
+// Runs a subroutine on the machine, false if it does anything that
+// can't be done at compile time or takes too long.
+static bool run(Folder *folder, Machine *m, Function *func) {
+    IR *ir = folder->ir;
+    size_t pc = func->begin + 1;
+    int64_t n;
+
+    for (size_t steps = 0; steps < MAX_EVAL_STEPS; steps++) {
+        Op *op = &ir->ops[pc++];
+
+        switch (op->type) {
+            case OP_NOP:
+            case OP_NEW_VAR:
+            case OP_NEW_BRANCH: break;
+            case OP_LOAD:
+                if (!IS_ACC(op->dst) || !read_value(folder, m, &op->src, &m->acc))
+                    return false;
+                break;
+            case OP_STORE:
+                if (op->src.type == VAL__RES__ || !IS_ACC(op->src) || !write_value(folder, m, &op->dst, m->acc))
+                    return false;
+                break;
+            case OP_PUSH:
+                if (m->stack_size == MAX_EVAL_STACK || !read_value(folder, m, &op->src, &n))
+                    return false;
+
+                m->stack[m->stack_size++] = n;
+                break;
+            case OP_POP:
+                if (m->stack_size == 0 || !write_value(folder, m, &op->dst, m->stack[--m->stack_size]))
+                    return false;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_SHL:
+            case OP_SHR:
+            case OP_AND:
+            case OP_OR:
+            case OP_XOR:
+                if (!IS_ACC(op->dst) || !read_value(folder, m, &op->src, &n) || !math(op->type, m->acc, n, &m->acc))
+                    return false;
+                break;
+            case OP_NEG:
+                if (!IS_ACC(op->src))
+                    return false;
+
+                m->acc = (int64_t)(0 - (uint64_t)m->acc);
+                break;
+            case OP_SWP: {
+                int64_t acc = m->acc;
+
+                if (!read_value(folder, m, &op->dst, &m->acc) || !write_value(folder, m, &op->dst, acc))
+                    return false;
+                break;
+            }
+            case OP_COMPARE:
+                if (!IS_ACC(op->dst) || !read_value(folder, m, &op->src, &m->flag_operand))
+                    return false;
+
+                m->flag_acc = m->acc;
+                break;
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LT:
+            case OP_LTE:
+            case OP_GT:
+            case OP_GTE:
+                if (!IS_ACC(op->dst))
+                    return false;
+
+                m->acc = relation(op->type, m->flag_operand, m->flag_acc);
+                break;
+            case OP_BRANCH_TRUE:
+            case OP_BRANCH_FALSE:
+                if ((m->acc != 0) == (op->type == OP_BRANCH_TRUE))
+                    pc = folder->labels[op->dst.branch];
+                break;
+            case OP_BRANCH_EQ:
+            case OP_BRANCH_NEQ:
+            case OP_BRANCH_LT:
+            case OP_BRANCH_LTE:
+            case OP_BRANCH_GT:
+            case OP_BRANCH_GTE:
+                if (relation(OP_EQ + (op->type - OP_BRANCH_EQ), m->flag_operand, m->flag_acc))
+                    pc = folder->labels[op->dst.branch];
+                break;
+            case OP_JUMP:
+                pc = folder->labels[op->dst.branch];
+                break;
+            case OP_CALL: {
+                Function *callee = find_function(folder->graph, op->src.ident);
+
+                if (callee == NULL || !folder->foldable[callee - folder->graph->funcs] || m->depth == MAX_EVAL_DEPTH)
+                    return false;
+
+                m->returns[m->depth++] = pc;
+                pc = callee->begin + 1;
+                break;
+            }
+            case OP_RET:
+            case OP_FUNC_END:
+                if (m->depth == 0)
+                    return m->stack_size == 0;
+
+                pc = m->returns[--m->depth];
+                break;
+            default: return false;
+        }
+
+        if (pc >= ir->op_count)
+            return false;
+    }
+
+    return false;
+}
+
+static size_t next_op(IR *ir, size_t pos) {
+    while (pos < ir->op_count && ir->ops[pos].type == OP_NOP)
+        pos++;
+
+    return pos;
+}
+
+static size_t previous_op(IR *ir, size_t pos) {
+    while (pos > 0) {
+        if (ir->ops[--pos].type != OP_NOP)
+            return pos;
+    }
+
+    return NO_VAR;
+}
+
+// Evaluates the call at ir->ops[pos] if its arguments are stored from
+// constants right before it, returning how many ops were inserted.
+static size_t fold_call(Folder *folder, Machine *m, size_t pos) {
+    IR *ir = folder->ir;
+    Function *func = find_function(folder->graph, ir->ops[pos].src.ident);
+
+    if (func == NULL || !folder->foldable[func - folder->graph->funcs])
+        return 0;
+
+    size_t *params = malloc((func->param_count + 1) * sizeof(size_t));
+    size_t *stores = malloc((func->param_count + 1) * sizeof(size_t));
+    size_t found = 0;
+
+    find_params(folder, func, params);
+
+    for (size_t i = 0; i < func->param_count; i++)
+        stores[i] = NO_VAR;
+
+    memset(m->defined, false, folder->vars->count * sizeof(bool));
+
+    for (size_t store = previous_op(ir, pos); store != NO_VAR; ) {
+        size_t load = previous_op(ir, store);
+
+        if (load == NO_VAR || ir->ops[store].type != OP_STORE || !IS_ACC(ir->ops[store].src) ||
+                ir->ops[load].type != OP_LOAD || !IS_ACC(ir->ops[load].dst) || ir->ops[load].src.type != VAL_INT)
+            break;
+
+        size_t var = value_to_var(folder->vars, &ir->ops[store].dst);
+        size_t i = 0;
+
+        while (i < func->param_count && params[i] != var)
+            i++;
+
+        if (i == func->param_count)
+            break;
+
+        if (stores[i] == NO_VAR) {
+            stores[i] = store;
+            m->values[var] = ir->ops[load].src.int_const;
+            m->defined[var] = true;
+            found++;
+        }
+
+        store = previous_op(ir, load);
+    }
+
+    m->stack_size = 0;
+    m->depth = 0;
+
+    if (found < func->param_count || !run(folder, m, func)) {
+        free(params);
+        free(stores);
+        return 0;
+    }
+
+    for (size_t i = 0; i < func->param_count; i++) {
+        ir->ops[stores[i]].type = OP_NOP;
+        ir->ops[previous_op(ir, stores[i])].type = OP_NOP;
+    }
+
+    const size_t ret = ret_var(folder, func);
+    const size_t next = next_op(ir, pos + 1);
+    size_t inserted = 0;
+    OpValue acc = (OpValue){ .type = VAL_REG, .reg = TEMP_REG };
+
+    if (m->defined[ret] && next < ir->op_count && ir->ops[next].type == OP_LOAD && IS_ACC(ir->ops[next].dst) &&
+            ir->ops[next].src.type == VAL_RET && strcmp(ir->ops[next].src.source.func, func->name) == 0) {
+        ir->ops[next].src = (OpValue){ .type = VAL_INT, .int_const = m->values[ret] };
+        ir->ops[pos].type = OP_NOP;
+    } else if (m->defined[ret]) {
+        // Something further on reads the return value.
+        Op ops[2] = {
+            (Op){ .type = OP_STORE, .dst = (OpValue){ .type = VAL_RET, .source = ir->ops[pos].src.source }, .src = acc },
+            (Op){ .type = OP_LOAD, .dst = acc, .src = (OpValue){ .type = VAL_INT, .int_const = m->acc } }
+        };
+
+        ops[0].dst.source.func = func->name;
+        ops[0].loc = ops[1].loc = ir->ops[pos].loc;
+        ir->ops[pos] = (Op){ .type = OP_LOAD, .dst = acc, .src = (OpValue){ .type = VAL_INT, .int_const = m->values[ret] },
+            .loc = ir->ops[pos].loc };
+        inserted = m->acc == m->values[ret] ? 1 : 2;
+        ir_insert(ir, pos + 1, ops, inserted);
+    } else
+        ir->ops[pos] = (Op){ .type = OP_LOAD, .dst = acc, .src = (OpValue){ .type = VAL_INT, .int_const = m->acc }, .loc = ir->ops[pos].loc };
+
+    free(params);
+    free(stores);
+    return inserted;
+}
+
+// Moves everything after pos along by count ops.
+static void shift_positions(Folder *folder, size_t pos, size_t count) {
+    for (size_t i = 0; i < folder->ir->label_count; i++) {
+        if (folder->labels[i] > pos)
+            folder->labels[i] += count;
+    }
+
+    for (size_t f = 0; f < folder->graph->func_count; f++) {
+        Function *func = &folder->graph->funcs[f];
+
+        if (func->begin > pos)
+            func->begin += count;
+
+        if (func->end > pos)
+            func->end += count;
+    }
+}
+
+void evaluate_pure_calls(IR *ir) {
+    VarTable vars = create_var_table();
+    CallGraph graph = build_call_graph(ir, &vars);
+    Folder folder = (Folder){ .ir = ir, .graph = &graph, .vars = &vars, .labels = malloc((ir->label_count + 1) * sizeof(size_t)),
+        .foldable = calloc(graph.func_count + 1, sizeof(bool)), .returns = calloc(graph.func_count + 1, sizeof(bool)) };
+
+    find_foldable(&folder);
+
+    Machine *m = malloc(sizeof(Machine));
+    m->values = calloc(vars.count + 1, sizeof(int64_t));
+    m->defined = calloc(vars.count + 1, sizeof(bool));
+
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type == OP_NEW_BRANCH && ir->ops[i].src.branch < ir->label_count)
+            folder.labels[ir->ops[i].src.branch] = i;
+    }
+
+    // Inner calls come first, so their results are constant arguments
+    // by the time the outer ones are reached.
+    for (size_t i = 0; i < ir->op_count; i++) {
+        if (ir->ops[i].type == OP_CALL)
+            shift_positions(&folder, i, fold_call(&folder, m, i));
+    }
+
+    free(m->values);
+    free(m->defined);
+    free(m);
+    free(folder.labels);
+    free(folder.foldable);
+    free(folder.returns);
+    delete_call_graph(&graph);
+    delete_var_table(&vars);
+}
@@ -0,0 +1,315 @@
+#include "../passes.h"
+#include "../ir.h"
+#include "../cfg.h"
+#include "../cost.h"
+#include "../ast.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdint.h>
+
+#define MAX_SEQUENCE 80
+
+// Strength reduction of multiplies, divides and modulos by constants.
+//
+// Math expressions put the right hand side in @temp first:
+// load [int]
+// store @temp
+// load x
+// mul @temp
+// so the constant is folded into the op before anything else, which
+// is cheaper on its own. Then the op is replaced with shifts and adds
+// when the cost table says they're faster.
+//
+// Minstral has no high half multiply, so dividing by constants other
+// than powers of two is left alone.
+
+typedef struct {
+    size_t index;
+    Op ops[MAX_SEQUENCE];
+    size_t count;
+} Rewrite;
+
+typedef struct {
+    IR *ir;
+    CFG *cfg;
+    VarTable *vars;
+    size_t temp;
+    OpValue temp_var;
+    OpValue acc;
+
+    Rewrite *rewrites;
+    size_t rewrite_count;
+} Reducer;
+
+static Op *op_at(Reducer *red, size_t pos) {
+    return &red->ir->ops[red->cfg->index[pos]];
+}
+
+static bool is_temp(Reducer *red, OpValue *value) {
+    return value->type == VAL_VAR && value_to_var(red->vars, value) == red->temp;
+}
+
+// The previous op in the block, skipping NOPs.
+static size_t previous(Reducer *red, size_t block, size_t pos) {
+    while (pos > red->cfg->blocks[block].start) {
+        pos--;
+
+        if (op_at(red, pos)->type != OP_NOP)
+            return pos;
+    }
+
+    return NO_BLOCK;
+}
+
+static bool is_acc_load(Op *op) {
+    return op->type == OP_LOAD && IS_ACC(op->dst);
+}
+
+static int log2_exact(uint64_t n) {
+    if (n == 0 || (n & (n - 1)) != 0)
+        return -1;
+
+    int k = 0;
+
+    while (n >>= 1)
+        k++;
+
+    return k;
+}
+
+static void emit(Rewrite *rw, OpType type, OpValue src) {
+    assert(rw->count < MAX_SEQUENCE);
+    rw->ops[rw->count++] = (Op){ .type = type, .dst = (OpValue){ .type = VAL_REG, .reg = TEMP_REG }, .src = src };
+}
+
+static OpValue int_value(int64_t n) {
+    return (OpValue){ .type = VAL_INT, .int_const = n };
+}
+
+// x * n with the accumulator holding x and a copy of it in x_mem,
+// going through the bits of n from the top like Horner's rule.
+static void emit_shift_add(Rewrite *rw, uint64_t n, OpValue x_mem) {
+    int top = 63;
+
+    while (!(n >> top & 1))
+        top--;
+
+    int shift = 0;
+
+    for (int bit = top - 1; bit >= 0; bit--) {
+        shift++;
+
+        if (!(n >> bit & 1))
+            continue;
+
+        emit(rw, OP_SHL, int_value(shift));
+        emit(rw, OP_ADD, x_mem);
+        shift = 0;
+    }
+
+    if (shift > 0)
+        emit(rw, OP_SHL, int_value(shift));
+}
+
+// Bias a negative dividend by 2^k - 1 so the shift rounds toward zero:
+// (x + ((x >> 63) & (2^k - 1)))
+static void emit_round_to_zero(Rewrite *rw, int k, OpValue x_mem) {
+    emit(rw, OP_SHR, int_value(63));
+    emit(rw, OP_AND, int_value((int64_t)((UINT64_C(1) << k) - 1)));
+    emit(rw, OP_ADD, x_mem);
+}
+
+static bool reduce(Reducer *red, Op *op, OpValue x_mem, Rewrite *rw) {
+    int64_t n = op->src.int_const;
+    uint64_t magnitude = n < 0 ? -(uint64_t)n : (uint64_t)n;
+    int k = log2_exact(magnitude);
+
+    // INT64_MIN has no magnitude to work with.
+    if (n == INT64_MIN)
+        return false;
+
+    switch (op->type) {
+        case OP_MUL:
+            if (n == 0) {
+                rw->ops[rw->count++] = (Op){ .type = OP_LOAD, .dst = red->acc, .src = int_value(0) };
+                return true;
+            } else if (k > 0)
+                emit(rw, OP_SHL, int_value(k));
+            else if (k < 0) {
+                if (x_mem.type == VAL_NONE)
+                    return false;
+
+                emit_shift_add(rw, magnitude, x_mem);
+            }
+
+            if (n < 0)
+                emit(rw, OP_NEG, red->acc);
+            return true;
+        case OP_DIV:
+            if (k < 0 || (k > 0 && x_mem.type == VAL_NONE))
+                return false;
+            else if (k > 0) {
+                emit_round_to_zero(rw, k, x_mem);
+                emit(rw, OP_SHR, int_value(k));
+            }
+
+            if (n < 0)
+                emit(rw, OP_NEG, red->acc);
+            return true;
+        case OP_MOD:
+            // The sign of the result follows the dividend, so the
+            // divisor's doesn't matter.
+            if (k == 0) {
+                rw->ops[rw->count++] = (Op){ .type = OP_LOAD, .dst = red->acc, .src = int_value(0) };
+                return true;
+            } else if (k < 0 || x_mem.type == VAL_NONE)
+                return false;
+
+            // x - ((x + bias) & -2^k)
+            emit_round_to_zero(rw, k, x_mem);
+            emit(rw, OP_AND, int_value(-(int64_t)(UINT64_C(1) << k)));
+            emit(rw, OP_SUB, x_mem);
+            emit(rw, OP_NEG, red->acc);
+            return true;
+        default: break;
+    }
+
+    return false;
+}
+
+// load [int], store @temp, load x, op @temp -> load x, op [int]
+static void fold_constant_operand(Reducer *red, size_t block, size_t pos) {
+    Op *op = op_at(red, pos);
+    size_t load_x = previous(red, block, pos);
+    size_t store = load_x == NO_BLOCK ? NO_BLOCK : previous(red, block, load_x);
+    size_t load_n = store == NO_BLOCK ? NO_BLOCK : previous(red, block, store);
+
+    if (load_n == NO_BLOCK)
+        return;
+
+    Op *x = op_at(red, load_x);
+    Op *st = op_at(red, store);
+    Op *ld = op_at(red, load_n);
+
+    if (!is_acc_load(x) || (x->src.type != VAL_VAR && x->src.type != VAL_RET && x->src.type != VAL_INT) || is_temp(red, &x->src) ||
+            st->type != OP_STORE || !is_temp(red, &st->dst) || !IS_ACC(st->src) ||
+            !is_acc_load(ld) || ld->src.type != VAL_INT ||
+            var_live_at(red->cfg, red->vars, pos + 1, red->temp))
+        return;
+
+    op->src = ld->src;
+    st->type = OP_NOP;
+    ld->type = OP_NOP;
+}
+
+static void reduce_block(Reducer *red, size_t block) {
+    Block *b = &red->cfg->blocks[block];
+
+    for (size_t pos = b->start; pos < b->end; pos++) {
+        Op *op = op_at(red, pos);
+
+        if ((op->type != OP_MUL && op->type != OP_DIV && op->type != OP_MOD) || !IS_ACC(op->dst))
+            continue;
+
+        if (is_temp(red, &op->src))
+            fold_constant_operand(red, block, pos);
+
+        if (op->src.type != VAL_INT)
+            continue;
+
+        // Most sequences need the dividend twice. It's either still
+        // in the variable it was loaded from, or it goes into @temp.
+        OpValue x_mem = (OpValue){ .type = VAL_NONE };
+        bool store_x = false;
+        size_t prev = previous(red, block, pos);
+
+        if (prev != NO_BLOCK && is_acc_load(op_at(red, prev)) &&
+                (op_at(red, prev)->src.type == VAL_VAR || op_at(red, prev)->src.type == VAL_RET))
+            x_mem = op_at(red, prev)->src;
+        else if (!var_live_at(red->cfg, red->vars, pos + 1, red->temp)) {
+            x_mem = red->temp_var;
+            store_x = true;
+        }
+
+        Rewrite rw = (Rewrite){ .index = red->cfg->index[pos], .count = 0 };
+
+        if (store_x)
+            rw.ops[rw.count++] = (Op){ .type = OP_STORE, .dst = red->temp_var, .src = red->acc };
+
+        size_t before = rw.count;
+
+        if (!reduce(red, op, x_mem, &rw))
+            continue;
+
+        // The store isn't needed after all if the sequence doesn't use it.
+        if (store_x) {
+            bool used = false;
+
+            for (size_t i = before; i < rw.count; i++)
+                used |= is_temp(red, &rw.ops[i].src);
+
+            if (!used) {
+                memmove(rw.ops, rw.ops + 1, (rw.count - 1) * sizeof(Op));
+                rw.count--;
+            }
+        }
+
+        if (ops_cost(rw.ops, rw.count) >= op_cost(op))
+            continue;
+
+        red->rewrites = realloc(red->rewrites, (red->rewrite_count + 1) * sizeof(Rewrite));
+        red->rewrites[red->rewrite_count++] = rw;
+    }
+}
+
+static int compare_rewrites(const void *a, const void *b) {
+    const Rewrite *x = a;
+    const Rewrite *y = b;
+    return (x->index < y->index) - (x->index > y->index);
+}
+
+void strength_reduction(IR *ir) {
+    VarTable vars = create_var_table();
+    intern_all_vars(&vars, ir);
+
+    Reducer red = (Reducer){ .ir = ir, .vars = &vars, .temp = intern_var(&vars, GLOBAL, "@temp"),
+        .temp_var = (OpValue){ .type = VAL_VAR, .source = (Source){ .scope = GLOBAL, .func = GLOBAL, .module = "" }, .var = "@temp" },
+        .acc = (OpValue){ .type = VAL_REG, .reg = TEMP_REG }, .rewrites = NULL, .rewrite_count = 0 };
+
+    for (size_t n = 0; nth_routine(ir, n) != NO_ROUTINE; n++) {
+        CFG cfg = build_cfg(ir, nth_routine(ir, n));
+        red.cfg = &cfg;
+
+        for (size_t b = 0; b < cfg.block_count; b++)
+            reduce_block(&red, b);
+
+        // Back to front so the indices stay valid while inserting.
+        if (red.rewrite_count > 1)
+            qsort(red.rewrites, red.rewrite_count, sizeof(Rewrite), compare_rewrites);
+
+        for (size_t i = 0; i < red.rewrite_count; i++) {
+            Rewrite *rw = &red.rewrites[i];
+
+            if (rw->count == 0) {
+                ir->ops[rw->index].type = OP_NOP;
+                continue;
+            }
+
+            // The whole sequence stands for the op it replaces.
+            for (size_t k = 0; k < rw->count; k++)
+                rw->ops[k].loc = ir->ops[rw->index].loc;
+
+            ir->ops[rw->index] = rw->ops[0];
+            ir_insert(ir, rw->index + 1, rw->ops + 1, rw->count - 1);
+        }
+
+        red.rewrite_count = 0;
+        delete_cfg(&cfg);
+    }
+
+    free(red.rewrites);
+    delete_var_table(&vars);
+}
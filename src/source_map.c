@@ -0,0 +1,117 @@
+#include "source_map.h"
+#include "ir.h"
+#include "backend.h"
+#include "assembler.h"
+#include "utils.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+static char *own_file(SourceMap *map, char *file) {
+    for (size_t i = 0; i < map->file_count; i++) {
+        if (strcmp(map->files[i], file) == 0)
+            return map->files[i];
+    }
+
+    map->files = realloc(map->files, (map->file_count + 1) * sizeof(char *));
+    map->files[map->file_count] = mystrdup(file);
+    return map->files[map->file_count++];
+}
+
+// Both the marks and the instructions are in the order they were
+// written, so every instruction takes the last mark at or before it.
+SourceMap create_source_map(Program *program, Sink *sink) {
+    SourceMap map = (SourceMap){ .ranges = malloc((program->code_count + 1) * sizeof(SourceRange)), .range_count = 0,
+        .files = NULL, .file_count = 0 };
+    SourceMark *marks = sink->marks[SECT_TEXT];
+    const size_t mark_count = sink->mark_counts[SECT_TEXT];
+    size_t mark = 0;
+
+    for (size_t i = 0; i < program->code_count; i++) {
+        while (mark < mark_count && marks[mark].offset <= program->offsets[i])
+            mark++;
+
+        if (mark == 0)
+            continue;
+
+        Location *loc = &marks[mark - 1].loc;
+        SourceRange *last = map.range_count > 0 ? &map.ranges[map.range_count - 1] : NULL;
+
+        if (last != NULL && last->loc.ln == loc->ln && last->loc.col == loc->col && strcmp(last->loc.file, loc->file) == 0)
+            continue;
+
+        map.ranges[map.range_count++] = (SourceRange){ .address = i,
+            .loc = (Location){ .file = own_file(&map, loc->file), .ln = loc->ln, .col = loc->col } };
+    }
+
+    return map;
+}
+
+void delete_source_map(SourceMap *map) {
+    for (size_t i = 0; i < map->file_count; i++)
+        free(map->files[i]);
+
+    free(map->files);
+    free(map->ranges);
+}
+
+Location *find_location(SourceMap *map, size_t address) {
+    size_t low = 0;
+    size_t high = map->range_count;
+
+    // The first range past the address.
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+
+        if (map->ranges[mid].address <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low == 0 ? NULL : &map->ranges[low - 1].loc;
+}
+
+char *runtime_error(SourceMap *map, char *file, size_t address, const char *what) {
+    Location *loc = map != NULL ? find_location(map, address) : NULL;
+    char *text;
+    int len;
+
+    if (loc != NULL) {
+        len = snprintf(NULL, 0, ESC_BOLD "%s:%zu:%zu: " ESC_RED "error: " ESC_NORMAL "%s at instruction %zu\n", loc->file, loc->ln, loc->col, what, address);
+        text = malloc(len + 1);
+        sprintf(text, ESC_BOLD "%s:%zu:%zu: " ESC_RED "error: " ESC_NORMAL "%s at instruction %zu\n", loc->file, loc->ln, loc->col, what, address);
+    } else {
+        len = snprintf(NULL, 0, ESC_BOLD "%s: " ESC_RED "error: " ESC_NORMAL "%s at instruction %zu\n", file, what, address);
+        text = malloc(len + 1);
+        sprintf(text, ESC_BOLD "%s: " ESC_RED "error: " ESC_NORMAL "%s at instruction %zu\n", file, what, address);
+    }
+
+    return text;
+}
+
+// One range a line, "address line:col", after a "file" line naming
+// where the ranges below it are from.
+bool write_source_map(SourceMap *map, char *path) {
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL)
+        return false;
+
+    char *file = NULL;
+
+    for (size_t i = 0; i < map->range_count; i++) {
+        SourceRange *range = &map->ranges[i];
+
+        if (range->loc.file != file) {
+            file = range->loc.file;
+            fprintf(f, "file %s\n", file);
+        }
+
+        fprintf(f, "%zu %zu:%zu\n", range->address, range->loc.ln, range->loc.col);
+    }
+
+    return fclose(f) == 0;
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef SOURCE_MAP_H
+#define SOURCE_MAP_H
+
+#include "ir.h"
+#include "backend.h"
+#include "assembler.h"
+#include <stdbool.h>
+
+// Instructions from address on, up to the next range, came from loc.
+typedef struct {
+    size_t address;
+    Location loc;
+} SourceRange;
+
+// Keeps its own copies of the file names, so it outlives the AST.
+typedef struct SourceMap {
+    SourceRange *ranges;
+    size_t range_count;
+    char **files;
+    size_t file_count;
+} SourceMap;
+
+SourceMap create_source_map(Program *program, Sink *sink);
+void delete_source_map(SourceMap *map);
+// NULL if nothing is known about the instruction.
+Location *find_location(SourceMap *map, size_t address);
+bool write_source_map(SourceMap *map, char *path);
+// The line a runtime error at address is reported with, the way
+// log_error writes it. map can be NULL, then it's against file.
+char *runtime_error(SourceMap *map, char *file, size_t address, const char *what);
+
+#endif
\ No newline at end of file
@@ -5,6 +5,38 @@
 #include <stdbool.h>
 #include <assert.h>
 
+#define STARTING_BUILDER_CAP 128
+
+StringBuilder create_string_builder() {
+    StringBuilder sb = (StringBuilder){ .data = malloc(STARTING_BUILDER_CAP), .len = 0, .capacity = STARTING_BUILDER_CAP };
+    sb.data[0] = '\0';
+    return sb;
+}
+
+static void append_len(StringBuilder *sb, char *str, size_t len) {
+    if (sb->len + len + 1 > sb->capacity) {
+        while (sb->len + len + 1 > sb->capacity)
+            sb->capacity *= 2;
+
+        sb->data = realloc(sb->data, sb->capacity);
+    }
+
+    memcpy(sb->data + sb->len, str, len + 1);
+    sb->len += len;
+}
+
+void append_string(StringBuilder *sb, char *str) {
+    append_len(sb, str, strlen(str));
+}
+
+void append_builder(StringBuilder *sb, StringBuilder *other) {
+    append_len(sb, other->data, other->len);
+}
+
+void delete_string_builder(StringBuilder *sb) {
+    free(sb->data);
+}
+
 char *mystrdup(char *str) {
     char *dup = malloc(strlen(str) + 1);
     strcpy(dup, str);
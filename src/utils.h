@@ -2,6 +2,20 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+// A growing string that knows its length, so appending doesn't have to
+// rescan what's already there.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} StringBuilder;
+
+StringBuilder create_string_builder();
+void append_string(StringBuilder *sb, char *str);
+void append_builder(StringBuilder *sb, StringBuilder *other);
+void delete_string_builder(StringBuilder *sb);
 
 char *mystrdup(char *str);
 char *get_basename(char *file);
@@ -0,0 +1,170 @@
+#include "x86.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+Code create_code() {
+    return (Code){ .bytes = malloc(4096), .len = 0, .capacity = 4096, .labels = malloc(64 * sizeof(size_t)), .label_count = 0,
+        .label_capacity = 64, .fixups = malloc(64 * sizeof(size_t)), .fixup_labels = malloc(64 * sizeof(size_t)),
+        .fixup_count = 0, .fixup_capacity = 64 };
+}
+
+void delete_code(Code *code) {
+    free(code->bytes);
+    free(code->labels);
+    free(code->fixups);
+    free(code->fixup_labels);
+}
+
+size_t new_label(Code *code) {
+    if (code->label_count == code->label_capacity) {
+        code->label_capacity *= 2;
+        code->labels = realloc(code->labels, code->label_capacity * sizeof(size_t));
+    }
+
+    code->labels[code->label_count] = NO_OFFSET;
+    return code->label_count++;
+}
+
+void place_label(Code *code, size_t label) {
+    code->labels[label] = code->len;
+}
+
+// Fills in every rel32, false if a label was never placed.
+bool link_code(Code *code) {
+    for (size_t i = 0; i < code->fixup_count; i++) {
+        const size_t target = code->labels[code->fixup_labels[i]];
+
+        if (target == NO_OFFSET)
+            return false;
+
+        const uint32_t rel = (uint32_t)((int64_t)target - (int64_t)(code->fixups[i] + 4));
+        memcpy(&code->bytes[code->fixups[i]], &rel, 4);
+    }
+
+    return true;
+}
+
+void put8(Code *code, uint8_t byte) {
+    if (code->len == code->capacity) {
+        code->capacity *= 2;
+        code->bytes = realloc(code->bytes, code->capacity);
+    }
+
+    code->bytes[code->len++] = byte;
+}
+
+void put32(Code *code, uint32_t word) {
+    for (int i = 0; i < 4; i++)
+        put8(code, (uint8_t)(word >> (i * 8)));
+}
+
+void put64(Code *code, uint64_t word) {
+    for (int i = 0; i < 8; i++)
+        put8(code, (uint8_t)(word >> (i * 8)));
+}
+
+static void put_opcode(Code *code, uint32_t opcode) {
+    if (opcode > 0xff)
+        put8(code, (uint8_t)(opcode >> 8));
+
+    put8(code, (uint8_t)opcode);
+}
+
+// A REX prefix is always written, it's what makes sil and dil usable
+// and costs nothing for the rest.
+static void put_rex(Code *code, bool wide, int reg, int index, int base) {
+    put8(code, 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+}
+
+void x86_rr(Code *code, bool wide, uint32_t opcode, int reg, int rm) {
+    put_rex(code, wide, reg, 0, rm);
+    put_opcode(code, opcode);
+    put8(code, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Always a SIB byte and a disp32, so r12 and r13 need nothing special.
+void x86_mem(Code *code, bool wide, uint32_t opcode, int reg, int base, int index, int scale, int32_t disp) {
+    const int scale_bits = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+
+    put_rex(code, wide, reg, index == NO_INDEX ? 0 : index, base);
+    put_opcode(code, opcode);
+    put8(code, 0x80 | ((reg & 7) << 3) | 4);
+    put8(code, (index == NO_INDEX ? 0 : scale_bits << 6) | ((index == NO_INDEX ? 4 : index & 7) << 3) | (base & 7));
+    put32(code, (uint32_t)disp);
+}
+
+void x86_mov_imm(Code *code, int reg, int64_t value) {
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+        x86_rr(code, true, X86_STORE_IMM, 0, reg);
+        put32(code, (uint32_t)value);
+        return;
+    }
+
+    put_rex(code, true, 0, 0, reg);
+    put8(code, 0xb8 + (reg & 7));
+    put64(code, (uint64_t)value);
+}
+
+void x86_push(Code *code, int reg) {
+    if (reg >= 8)
+        put8(code, 0x41);
+
+    put8(code, 0x50 + (reg & 7));
+}
+
+void x86_pop(Code *code, int reg) {
+    if (reg >= 8)
+        put8(code, 0x41);
+
+    put8(code, 0x58 + (reg & 7));
+}
+
+static void put_rel32(Code *code, size_t label) {
+    if (code->fixup_count == code->fixup_capacity) {
+        code->fixup_capacity *= 2;
+        code->fixups = realloc(code->fixups, code->fixup_capacity * sizeof(size_t));
+        code->fixup_labels = realloc(code->fixup_labels, code->fixup_capacity * sizeof(size_t));
+    }
+
+    code->fixups[code->fixup_count] = code->len;
+    code->fixup_labels[code->fixup_count++] = label;
+    put32(code, 0);
+}
+
+void x86_jcc(Code *code, Cond cond, size_t label) {
+    put8(code, 0x0f);
+    put8(code, 0x80 | cond);
+    put_rel32(code, label);
+}
+
+// Sets the whole register to 0 or 1.
+void x86_setcc(Code *code, Cond cond, int reg) {
+    x86_rr(code, false, 0x0f90 | cond, 0, reg);
+    x86_rr(code, false, X86_LOAD_BYTE, reg, reg);
+}
+
+void x86_jmp(Code *code, size_t label) {
+    put8(code, 0xe9);
+    put_rel32(code, label);
+}
+
+void x86_call(Code *code, size_t label) {
+    put8(code, 0xe8);
+    put_rel32(code, label);
+}
+
+void x86_ret(Code *code) {
+    put8(code, 0xc3);
+}
+
+void x86_cqo(Code *code) {
+    put8(code, 0x48);
+    put8(code, 0x99);
+}
+
+void x86_syscall(Code *code) {
+    put8(code, 0x0f);
+    put8(code, 0x05);
+}
\ No newline at end of file
@@ -0,0 +1,92 @@
+#ifndef X86_H
+#define X86_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+} Reg;
+
+#define NO_INDEX (-1)
+
+typedef enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_S = 0x8,
+    CC_NS = 0x9,
+    CC_L = 0xc,
+    CC_GE = 0xd,
+    CC_LE = 0xe,
+    CC_G = 0xf
+} Cond;
+
+// Opcodes for the forms below, two byte ones start with 0x0f.
+#define X86_ADD 0x03
+#define X86_OR 0x0b
+#define X86_AND 0x23
+#define X86_SUB 0x2b
+#define X86_XOR 0x33
+#define X86_CMP 0x3b
+#define X86_TEST 0x85
+#define X86_STORE_BYTE 0x88
+#define X86_STORE 0x89
+#define X86_LOAD 0x8b
+#define X86_LEA 0x8d
+#define X86_IMUL 0x0faf
+#define X86_LOAD_BYTE 0x0fb6
+#define X86_GROUP_IMM 0x81  // /0 add, /5 sub, /7 cmp with an imm32.
+#define X86_GROUP_SHIFT 0xd3 // /4 shl, /7 sar by cl.
+#define X86_GROUP_UNARY 0xf7 // /2 not, /3 neg, /6 div, /7 idiv.
+#define X86_GROUP_INC 0xff   // /0 inc, /1 dec.
+#define X86_STORE_IMM 0xc7   // /0 with an imm32.
+
+// Machine code with labels that are patched in once everything is
+// placed, jumps and calls are always rel32.
+typedef struct {
+    uint8_t *bytes;
+    size_t len;
+    size_t capacity;
+
+    size_t *labels; // Offset of every label, NO_OFFSET until placed.
+    size_t label_count;
+    size_t label_capacity;
+
+    size_t *fixups; // Positions of rel32s, each followed by its label in fixup_labels.
+    size_t *fixup_labels;
+    size_t fixup_count;
+    size_t fixup_capacity;
+} Code;
+
+#define NO_OFFSET ((size_t)-1)
+
+Code create_code();
+void delete_code(Code *code);
+size_t new_label(Code *code);
+void place_label(Code *code, size_t label);
+bool link_code(Code *code);
+
+void put8(Code *code, uint8_t byte);
+void put32(Code *code, uint32_t word);
+void put64(Code *code, uint64_t word);
+
+// op reg, rm with both registers.
+void x86_rr(Code *code, bool wide, uint32_t opcode, int reg, int rm);
+// op reg, [base + index * scale + disp].
+void x86_mem(Code *code, bool wide, uint32_t opcode, int reg, int base, int index, int scale, int32_t disp);
+void x86_mov_imm(Code *code, int reg, int64_t value);
+void x86_push(Code *code, int reg);
+void x86_pop(Code *code, int reg);
+void x86_jcc(Code *code, Cond cond, size_t label);
+void x86_setcc(Code *code, Cond cond, int reg);
+void x86_jmp(Code *code, size_t label);
+void x86_call(Code *code, size_t label);
+void x86_ret(Code *code);
+void x86_cqo(Code *code);
+void x86_syscall(Code *code);
+
+#endif
\ No newline at end of file
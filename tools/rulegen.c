@@ -0,0 +1,526 @@
+// Compiles the peephole rules into C.
+//
+// usage: rulegen <rules files...> <output file>
+//
+// Every rule becomes a function that checks the operands of a window of
+// ops and rewrites it, and the rules are dispatched through a decision
+// tree of nested switches on the op types, so matching a window costs a
+// few jumps no matter how many rules there are.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#define MAX_LINE 512
+#define MAX_OPS 8
+#define MAX_BINDINGS 16
+
+typedef enum {
+    LAYOUT_DST_SRC,
+    LAYOUT_DST,
+    LAYOUT_SRC
+} Layout;
+
+typedef struct {
+    const char *mnemonic;
+    const char *type;
+    Layout layout;
+} Mnemonic;
+
+// The same names the IR printer uses.
+static const Mnemonic mnemonics[] = {
+    { "load", "OP_LOAD", LAYOUT_DST_SRC },
+    { "store", "OP_STORE", LAYOUT_DST_SRC },
+    { "push", "OP_PUSH", LAYOUT_SRC },
+    { "pop", "OP_POP", LAYOUT_DST },
+    { "add", "OP_ADD", LAYOUT_DST_SRC },
+    { "sub", "OP_SUB", LAYOUT_DST_SRC },
+    { "mul", "OP_MUL", LAYOUT_DST_SRC },
+    { "div", "OP_DIV", LAYOUT_DST_SRC },
+    { "mod", "OP_MOD", LAYOUT_DST_SRC },
+    { "shl", "OP_SHL", LAYOUT_DST_SRC },
+    { "shr", "OP_SHR", LAYOUT_DST_SRC },
+    { "and", "OP_AND", LAYOUT_DST_SRC },
+    { "or", "OP_OR", LAYOUT_DST_SRC },
+    { "xor", "OP_XOR", LAYOUT_DST_SRC },
+    { "not", "OP_NOT", LAYOUT_SRC },
+    { "neg", "OP_NEG", LAYOUT_SRC },
+    { "swap", "OP_SWP", LAYOUT_DST_SRC },
+    { "compare", "OP_COMPARE", LAYOUT_DST_SRC },
+    { "eq", "OP_EQ", LAYOUT_DST },
+    { "neq", "OP_NEQ", LAYOUT_DST },
+    { "lt", "OP_LT", LAYOUT_DST },
+    { "lte", "OP_LTE", LAYOUT_DST },
+    { "gt", "OP_GT", LAYOUT_DST },
+    { "gte", "OP_GTE", LAYOUT_DST },
+    { "deref", "OP_DEREF", LAYOUT_DST_SRC }
+};
+
+typedef struct {
+    const Mnemonic *mnemonic;
+    char *operands[2]; // dst, src, NULL if the layout doesn't have it.
+} RuleOp;
+
+typedef struct {
+    char *name;
+    char *path;
+    int line;
+    RuleOp pattern[MAX_OPS];
+    size_t pattern_count;
+    RuleOp replacement[MAX_OPS];
+    size_t replacement_count;
+    char *guard;
+} Rule;
+
+typedef struct Node {
+    const char *type;
+    struct Node **children;
+    size_t child_count;
+    size_t *rules; // Rules whose pattern ends here.
+    size_t rule_count;
+} Node;
+
+static char *path;
+static int line_number;
+
+static void fail(const char *message) {
+    fprintf(stderr, "%s:%d: error: %s\n", path, line_number, message);
+    exit(EXIT_FAILURE);
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s))
+        s++;
+
+    char *end = s + strlen(s);
+
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+static char *copy(const char *s) {
+    char *c = malloc(strlen(s) + 1);
+    strcpy(c, s);
+    return c;
+}
+
+static const Mnemonic *find_mnemonic(const char *name) {
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+        if (strcmp(mnemonics[i].mnemonic, name) == 0)
+            return &mnemonics[i];
+    }
+
+    fail("unknown op");
+    return NULL;
+}
+
+static RuleOp parse_op(char *line) {
+    RuleOp op = (RuleOp){ .operands = { NULL, NULL } };
+    char *space = line;
+
+    while (*space != '\0' && !isspace((unsigned char)*space))
+        space++;
+
+    char *rest = *space == '\0' ? space : space + 1;
+    *space = '\0';
+    op.mnemonic = find_mnemonic(line);
+
+    // Braces may hold commas, so split on the first one outside them.
+    char *comma = NULL;
+    int depth = 0;
+
+    for (char *c = rest; *c != '\0' && comma == NULL; c++) {
+        if (*c == '{')
+            depth++;
+        else if (*c == '}')
+            depth--;
+        else if (*c == ',' && depth == 0)
+            comma = c;
+    }
+
+    if (comma != NULL)
+        *comma = '\0';
+
+    char *first = trim(rest);
+    char *second = comma == NULL ? NULL : trim(comma + 1);
+
+    if (op.mnemonic->layout == LAYOUT_DST_SRC) {
+        if (second == NULL)
+            fail("expected two operands");
+
+        op.operands[0] = copy(first);
+        op.operands[1] = copy(second);
+    } else {
+        if (second != NULL || *first == '\0')
+            fail("expected one operand");
+
+        op.operands[op.mnemonic->layout == LAYOUT_DST ? 0 : 1] = copy(first);
+    }
+
+    return op;
+}
+
+// Adds the rules in the file after the ones already parsed.
+static Rule *parse_rules(FILE *file, Rule *rules, size_t *out_count) {
+    size_t count = *out_count;
+    Rule *rule = NULL;
+    bool replacing = false;
+    char buffer[MAX_LINE];
+
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        line_number++;
+
+        char *hash = strchr(buffer, '#');
+
+        if (hash != NULL)
+            *hash = '\0';
+
+        char *line = trim(buffer);
+
+        if (*line == '\0')
+            continue;
+        else if (strncmp(line, "rule ", 5) == 0) {
+            if (rule != NULL)
+                fail("missing end");
+
+            rules = realloc(rules, (count + 1) * sizeof(Rule));
+            rule = &rules[count++];
+            *rule = (Rule){ .name = copy(trim(line + 5)), .path = path, .line = line_number, .guard = NULL };
+            replacing = false;
+        } else if (rule == NULL)
+            fail("expected a rule");
+        else if (strcmp(line, "=>") == 0)
+            replacing = true;
+        else if (strcmp(line, "end") == 0) {
+            if (!replacing || rule->pattern_count == 0)
+                fail("incomplete rule");
+            else if (rule->replacement_count > rule->pattern_count)
+                fail("replacement is longer than the pattern");
+
+            rule = NULL;
+        } else if (strncmp(line, "when ", 5) == 0) {
+            char *guard = trim(line + 5);
+
+            if (replacing || *guard != '{' || guard[strlen(guard) - 1] != '}')
+                fail("expected a guard in braces before =>");
+
+            rule->guard = copy(guard);
+        } else if (replacing) {
+            if (rule->replacement_count == MAX_OPS)
+                fail("too many ops");
+
+            rule->replacement[rule->replacement_count++] = parse_op(line);
+        } else {
+            if (rule->pattern_count == MAX_OPS)
+                fail("too many ops");
+
+            rule->pattern[rule->pattern_count++] = parse_op(line);
+        }
+    }
+
+    if (rule != NULL)
+        fail("missing end");
+
+    *out_count = count;
+    return rules;
+}
+
+static const char *kind_check(const char *kind) {
+    static const char *kinds[][2] = {
+        { "acc", "is_acc" },
+        { "int", "is_int" },
+        { "str", "is_str" },
+        { "var", "is_var" },
+        { "ret", "is_ret" },
+        { "mem", "is_mem" },
+        { "value", "is_value" }
+    };
+
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        if (strcmp(kinds[i][0], kind) == 0)
+            return kinds[i][1];
+    }
+
+    fail("unknown operand kind");
+    return NULL;
+}
+
+// Writes an expression in braces with $name replaced by the binding.
+static void emit_expression(FILE *out, const char *expr) {
+    for (const char *c = expr + 1; c[1] != '\0'; c++) {
+        if (*c == '$') {
+            fputs("v_", out);
+            continue;
+        }
+
+        fputc(*c, out);
+    }
+}
+
+static bool is_integer(const char *s) {
+    if (*s == '-')
+        s++;
+
+    if (!isdigit((unsigned char)*s))
+        return false;
+
+    while (isdigit((unsigned char)*s))
+        s++;
+
+    return *s == '\0';
+}
+
+static void emit_match(FILE *out, const char *value, const char *operand, char bound[][64], size_t *bound_count) {
+    if (strcmp(operand, "_") == 0)
+        return;
+    else if (strcmp(operand, "@acc") == 0)
+        fprintf(out, "    if (!is_acc(&%s))\n        return false;\n", value);
+    else if (strcmp(operand, "@temp") == 0)
+        fprintf(out, "    if (!is_temp(&%s))\n        return false;\n", value);
+    else if (strcmp(operand, "^") == 0)
+        fprintf(out, "    if (%s.type != VAL_STACK)\n        return false;\n", value);
+    else if (is_integer(operand))
+        fprintf(out, "    if (!is_int(&%s) || %s.int_const != %s)\n        return false;\n", value, value, operand);
+    else if (*operand == '$') {
+        char name[64];
+        const char *colon = strchr(operand, ':');
+        size_t len = colon == NULL ? strlen(operand + 1) : (size_t)(colon - operand - 1);
+
+        if (len == 0 || len >= sizeof(name))
+            fail("bad binding name");
+
+        memcpy(name, operand + 1, len);
+        name[len] = '\0';
+
+        if (strcmp(name, "last") == 0)
+            fail("$last is the last op of the pattern, it can't be bound");
+
+        bool seen = false;
+
+        for (size_t i = 0; i < *bound_count && !seen; i++)
+            seen = strcmp(bound[i], name) == 0;
+
+        if (seen)
+            fprintf(out, "    if (!same_value(&%s, &v_%s))\n        return false;\n", value, name);
+        else {
+            if (*bound_count == MAX_BINDINGS)
+                fail("too many bindings");
+
+            strcpy(bound[(*bound_count)++], name);
+            fprintf(out, "    OpValue v_%s = %s;\n", name, value);
+        }
+
+        if (colon != NULL)
+            fprintf(out, "    if (!%s(&v_%s))\n        return false;\n", kind_check(colon + 1), name);
+    } else
+        fail("bad operand in pattern");
+}
+
+static void emit_value(FILE *out, const char *operand) {
+    if (operand == NULL)
+        fputs("none_value()", out);
+    else if (strcmp(operand, "@acc") == 0)
+        fputs("acc_value()", out);
+    else if (strcmp(operand, "@temp") == 0)
+        fputs("temp_value()", out);
+    else if (strcmp(operand, "^") == 0)
+        fputs("stack_value()", out);
+    else if (is_integer(operand))
+        fprintf(out, "int_value(%s)", operand);
+    else if (*operand == '{') {
+        fputs("int_value(", out);
+        emit_expression(out, operand);
+        fputc(')', out);
+    } else if (*operand == '$' && strchr(operand, ':') == NULL)
+        fprintf(out, "v_%s", operand + 1);
+    else
+        fail("bad operand in replacement");
+}
+
+static void emit_rule(FILE *out, Rule *rule, size_t index) {
+    char bound[MAX_BINDINGS][64];
+    size_t bound_count = 0;
+
+    path = rule->path;
+    line_number = rule->line;
+    fprintf(out, "// %s\nstatic bool rule_%zu(Op **w) {\n", rule->name, index);
+
+    for (size_t i = 0; i < rule->pattern_count; i++) {
+        for (size_t k = 0; k < 2; k++) {
+            if (rule->pattern[i].operands[k] == NULL)
+                continue;
+
+            char value[32];
+            sprintf(value, "w[%zu]->%s", i, k == 0 ? "dst" : "src");
+            emit_match(out, value, rule->pattern[i].operands[k], bound, &bound_count);
+        }
+    }
+
+    // Some bindings are only there to be compared.
+    for (size_t i = 0; i < bound_count; i++)
+        fprintf(out, "    (void)v_%s;\n", bound[i]);
+
+    if (rule->guard != NULL) {
+        if (strstr(rule->guard, "$last") != NULL)
+            fprintf(out, "    Op *v_last = w[%zu];\n", rule->pattern_count - 1);
+
+        fputs("    if (!(", out);
+        emit_expression(out, rule->guard);
+        fputs("))\n        return false;\n", out);
+    }
+
+    for (size_t i = 0; i < rule->pattern_count; i++) {
+        if (i >= rule->replacement_count) {
+            fprintf(out, "    w[%zu]->type = OP_NOP;\n", i);
+            continue;
+        }
+
+        RuleOp *op = &rule->replacement[i];
+        fprintf(out, "    *w[%zu] = (Op){ .type = %s, .dst = ", i, op->mnemonic->type);
+        emit_value(out, op->operands[0]);
+        fputs(", .src = ", out);
+        emit_value(out, op->operands[1]);
+        fprintf(out, ", .loc = w[%zu]->loc };\n", i);
+    }
+
+    fputs("    return true;\n}\n\n", out);
+}
+
+static Node *new_node(const char *type) {
+    Node *node = calloc(1, sizeof(Node));
+    node->type = type;
+    return node;
+}
+
+static void insert_rule(Node *root, Rule *rule, size_t index) {
+    Node *node = root;
+
+    for (size_t i = 0; i < rule->pattern_count; i++) {
+        Node *child = NULL;
+
+        for (size_t k = 0; k < node->child_count && child == NULL; k++) {
+            if (strcmp(node->children[k]->type, rule->pattern[i].mnemonic->type) == 0)
+                child = node->children[k];
+        }
+
+        if (child == NULL) {
+            child = new_node(rule->pattern[i].mnemonic->type);
+            node->children = realloc(node->children, (node->child_count + 1) * sizeof(Node *));
+            node->children[node->child_count++] = child;
+        }
+
+        node = child;
+    }
+
+    node->rules = realloc(node->rules, (node->rule_count + 1) * sizeof(size_t));
+    node->rules[node->rule_count++] = index;
+}
+
+static void indent(FILE *out, size_t depth) {
+    for (size_t i = 0; i < depth; i++)
+        fputs("    ", out);
+}
+
+// Longer patterns are tried first, then the ones ending here in the
+// order they're written.
+static void emit_node(FILE *out, Node *node, size_t position, size_t depth) {
+    if (node->child_count > 0) {
+        indent(out, depth);
+        fprintf(out, "if (n > %zu) {\n", position);
+        indent(out, depth + 1);
+        fprintf(out, "switch (w[%zu]->type) {\n", position);
+
+        for (size_t i = 0; i < node->child_count; i++) {
+            indent(out, depth + 2);
+            fprintf(out, "case %s:\n", node->children[i]->type);
+            emit_node(out, node->children[i], position + 1, depth + 3);
+            indent(out, depth + 3);
+            fputs("break;\n", out);
+        }
+
+        indent(out, depth + 2);
+        fputs("default: break;\n", out);
+        indent(out, depth + 1);
+        fputs("}\n", out);
+        indent(out, depth);
+        fputs("}\n", out);
+    }
+
+    for (size_t i = 0; i < node->rule_count; i++) {
+        indent(out, depth);
+        fprintf(out, "if (rule_%zu(w))\n", node->rules[i]);
+        indent(out, depth + 1);
+        fprintf(out, "return %zu;\n", node->rules[i]);
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <rules files...> <output file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t count = 0;
+    Rule *rules = NULL;
+
+    for (int i = 1; i < argc - 1; i++) {
+        path = argv[i];
+        line_number = 0;
+        FILE *file = fopen(path, "r");
+
+        if (file == NULL) {
+            fprintf(stderr, "error: failed to open file '%s'\n", path);
+            return EXIT_FAILURE;
+        }
+
+        rules = parse_rules(file, rules, &count);
+        fclose(file);
+    }
+
+    FILE *out = fopen(argv[argc - 1], "w");
+
+    if (out == NULL) {
+        fprintf(stderr, "error: failed to open file '%s'\n", argv[argc - 1]);
+        return EXIT_FAILURE;
+    }
+
+    size_t max_length = 0;
+    Node *root = new_node(NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        if (rules[i].pattern_count > max_length)
+            max_length = rules[i].pattern_count;
+
+        insert_rule(root, &rules[i], i);
+    }
+
+    fputs("// Generated by tools/rulegen from", out);
+
+    for (int i = 1; i < argc - 1; i++)
+        fprintf(out, " %s", argv[i]);
+
+    fputs(", don't edit.\n\n", out);
+    fprintf(out, "#define RULE_COUNT %zu\n#define RULE_MAX_LENGTH %zu\n\n", count, max_length);
+    fputs("static const char *rule_names[RULE_COUNT + 1] = {\n", out);
+
+    for (size_t i = 0; i < count; i++)
+        fprintf(out, "    \"%s\",\n", rules[i].name);
+
+    fputs("    NULL\n};\n\n", out);
+
+    for (size_t i = 0; i < count; i++)
+        emit_rule(out, &rules[i], i);
+
+    fputs("// Applies the first rule that matches the window of n ops, returning\n"
+          "// its index or -1.\n"
+          "static int match_rules(Op **w, size_t n) {\n", out);
+    emit_node(out, root, 0, 1);
+    fputs("    return -1;\n}\n", out);
+
+    fclose(out);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,983 @@
+// Searches for shorter Minstral instruction sequences.
+//
+// usage: superopt <output file> <hand written rules> <assembly files...>
+//
+// Every straight line window of up to MAX_WINDOW instructions in the
+// assembly mbc produced is run on a few hundred random machine states,
+// then every cheaper sequence over the same operands is run on the same
+// states. The ones that always end up in the same state are written out
+// as peephole rules, most often seen first, for src/passes/superopt.rules.
+// Windows that a hand written rule or a shorter found rule already
+// rewrites some of are skipped. `make superopt-rules` runs it on the
+// programs in tools/corpus and examples.
+//
+// Only the accumulator, stack, flag and memory instructions are modelled,
+// anything else ends the window. The accumulator, the flags, the stack and
+// every variable the window names have to come out the same, so the rules
+// don't depend on what's live after them.
+
+#include "../src/cost.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#define MAX_LINE 512
+#define MAX_NAME 64
+#define MAX_PATTERNS 256
+#define MAX_RUN 256
+#define MAX_WINDOW 3
+#define MAX_VARS 3
+#define MAX_INTS 3
+#define MAX_CANDIDATES 128
+#define STACK_DEPTH 8
+#define TEST_COUNT 1024
+
+typedef enum {
+    FORM_VALUE, // lda x, add x, cmp x...
+    FORM_MEM,   // sta x
+    FORM_PUSH,  // psh or psh x
+    FORM_POP,   // pop or pop x
+    FORM_ACC    // seq, not...
+} Form;
+
+typedef struct {
+    const char *name;
+    const char *ir; // The name the IR printer uses.
+    OpType type;
+    Form form;
+    bool search; // Whether replacements can use it.
+} RuleMnemonic;
+
+// The rules give not and neg no destination, so they can only be removed.
+static const RuleMnemonic mnemonics[] = {
+    { "lda", "load", OP_LOAD, FORM_VALUE, true },
+    { "sta", "store", OP_STORE, FORM_MEM, true },
+    { "psh", "push", OP_PUSH, FORM_PUSH, true },
+    { "pop", "pop", OP_POP, FORM_POP, true },
+    { "add", "add", OP_ADD, FORM_VALUE, true },
+    { "sub", "sub", OP_SUB, FORM_VALUE, true },
+    { "mul", "mul", OP_MUL, FORM_VALUE, true },
+    { "shl", "shl", OP_SHL, FORM_VALUE, true },
+    { "shr", "shr", OP_SHR, FORM_VALUE, true },
+    { "and", "and", OP_AND, FORM_VALUE, true },
+    { "or", "or", OP_OR, FORM_VALUE, true },
+    { "xor", "xor", OP_XOR, FORM_VALUE, true },
+    { "not", "not", OP_NOT, FORM_ACC, false },
+    { "neg", "neg", OP_NEG, FORM_ACC, false },
+    { "cmp", "compare", OP_COMPARE, FORM_VALUE, true },
+    { "seq", "eq", OP_EQ, FORM_ACC, true },
+    { "sne", "neq", OP_NEQ, FORM_ACC, true },
+    { "slt", "lt", OP_LT, FORM_ACC, true },
+    { "sle", "lte", OP_LTE, FORM_ACC, true },
+    { "sgt", "gt", OP_GT, FORM_ACC, true },
+    { "sge", "gte", OP_GTE, FORM_ACC, true }
+};
+
+#define MNEMONIC_COUNT (sizeof(mnemonics) / sizeof(mnemonics[0]))
+
+// Constants a replacement can use besides the window's own.
+static const int64_t constants[] = { 0, 1, -1 };
+
+typedef enum {
+    ARG_ACC,
+    ARG_VAR,  // The nth variable the window names.
+    ARG_INT,  // The nth integer binding.
+    ARG_CONST
+} ArgKind;
+
+typedef struct {
+    ArgKind kind;
+    int64_t value;
+} Arg;
+
+typedef struct {
+    const RuleMnemonic *mnemonic;
+    Arg arg;
+} Insn;
+
+typedef struct {
+    Insn insns[MAX_WINDOW];
+    size_t count;
+    size_t var_count;
+    size_t int_count;
+    int64_t literals[MAX_WINDOW]; // The integers it was built from.
+    size_t literal_count;
+    char key[MAX_LINE];
+    size_t seen;
+} Window;
+
+typedef struct {
+    int64_t acc;
+    int64_t left; // The flags are what cmp compared.
+    int64_t right;
+    int64_t cells[MAX_VARS];
+    int64_t stack[STACK_DEPTH];
+    size_t depth;
+} State;
+
+typedef struct {
+    State start;
+    int64_t ints[MAX_INTS];
+    size_t cell_of[MAX_VARS]; // Different variables can share a cell to check aliasing.
+} Test;
+
+typedef struct {
+    Window *window;
+    Insn insns[MAX_WINDOW];
+    size_t count;
+    unsigned int cost;
+    bool distinct; // Only holds when the variables are different.
+} Rule;
+
+// What a rule's pattern accepts for an operand. Bindings have to match
+// the same operand every time they're used.
+typedef enum {
+    MATCH_ACC,
+    MATCH_CONST,
+    MATCH_ANY,     // _
+    MATCH_VAR,     // $x:mem and the generated variables.
+    MATCH_INT,     // $a:int, a literal integer matches too.
+    MATCH_VALUE,   // $x:value
+    MATCH_BINDING  // $x, anything.
+} MatchKind;
+
+typedef struct {
+    MatchKind kind;
+    size_t binding;
+    int64_t value; // For MATCH_CONST.
+} MatchArg;
+
+typedef struct {
+    const RuleMnemonic *mnemonic;
+    MatchArg arg;
+} MatchInsn;
+
+typedef struct {
+    MatchInsn insns[MAX_WINDOW];
+    size_t count;
+    bool distinct; // The variable bindings have to be different.
+} Pattern;
+
+// A line of assembly split in two, the operand is empty for the
+// accumulator.
+typedef struct {
+    char mnemonic[8];
+    char operand[MAX_NAME];
+} Line;
+
+static uint64_t random_state = 0x9e3779b97f4a7c15;
+
+static uint64_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+// Values that tend to break rewrites, and the window's own integers and
+// their neighbours, come up most of the time.
+static int64_t random_value(Window *w) {
+    static const int64_t special[] = { 0, 1, -1, 2, 3, 7, 8, 63, 64, INT64_MIN, INT64_MAX };
+    const uint64_t r = next_random();
+
+    if (r % 3 == 0)
+        return (int64_t)next_random();
+    else if (r % 3 == 1 || w->literal_count == 0)
+        return special[(r >> 2) % (sizeof(special) / sizeof(special[0]))];
+
+    return (int64_t)((uint64_t)w->literals[(r >> 2) % w->literal_count] + (r >> 8) % 3 - 1);
+}
+
+static const RuleMnemonic *find_mnemonic(const char *name) {
+    for (size_t i = 0; i < MNEMONIC_COUNT; i++) {
+        if (strcmp(mnemonics[i].name, name) == 0)
+            return &mnemonics[i];
+    }
+
+    return NULL;
+}
+
+static const RuleMnemonic *find_ir_mnemonic(const char *name) {
+    for (size_t i = 0; i < MNEMONIC_COUNT; i++) {
+        if (strcmp(mnemonics[i].ir, name) == 0)
+            return &mnemonics[i];
+    }
+
+    return NULL;
+}
+
+static bool is_integer(const char *s) {
+    if (*s == '-')
+        s++;
+
+    if (!isdigit((unsigned char)*s))
+        return false;
+
+    while (isdigit((unsigned char)*s))
+        s++;
+
+    return *s == '\0';
+}
+
+static unsigned int insns_cost(Insn *insns, size_t count) {
+    unsigned int cost = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Op op = (Op){ .type = insns[i].mnemonic->type };
+        cost += op_cost(&op);
+    }
+
+    return cost;
+}
+
+static bool valid_insn(const RuleMnemonic *mnemonic, ArgKind kind) {
+    switch (mnemonic->form) {
+        case FORM_VALUE: return kind != ARG_ACC;
+        case FORM_MEM: return kind == ARG_VAR;
+        case FORM_PUSH: return true;
+        case FORM_POP: return kind == ARG_ACC || kind == ARG_VAR;
+        default: return kind == ARG_ACC;
+    }
+}
+
+// Turns lines into a window, the variables and integers become bindings
+// in the order they're first seen. Integers stay as they are when
+// literal is set. Returns false for anything that isn't modelled.
+static bool build_window(Line *lines, size_t count, bool literal, Window *w) {
+    char vars[MAX_VARS][MAX_NAME];
+    int64_t ints[MAX_INTS];
+
+    *w = (Window){ .count = count, .var_count = 0, .int_count = 0, .seen = 1 };
+
+    for (size_t i = 0; i < count; i++) {
+        const RuleMnemonic *mnemonic = find_mnemonic(lines[i].mnemonic);
+        char *operand = lines[i].operand;
+        Arg arg = (Arg){ .kind = ARG_ACC, .value = 0 };
+
+        if (mnemonic == NULL)
+            return false;
+        else if (is_integer(operand)) {
+            int64_t value = strtoll(operand, NULL, 10);
+            w->literals[w->literal_count++] = value;
+
+            if (literal)
+                arg = (Arg){ .kind = ARG_CONST, .value = value };
+            else {
+                size_t n = 0;
+
+                while (n < w->int_count && ints[n] != value)
+                    n++;
+
+                if (n == MAX_INTS)
+                    return false;
+                else if (n == w->int_count)
+                    ints[w->int_count++] = value;
+
+                arg = (Arg){ .kind = ARG_INT, .value = (int64_t)n };
+            }
+        } else if (*operand == '_') {
+            // Strings are their own kind of operand in the IR.
+            if (strncmp(operand, "_@c", 3) == 0 && isdigit((unsigned char)operand[3]))
+                return false;
+
+            size_t n = 0;
+
+            while (n < w->var_count && strcmp(vars[n], operand) != 0)
+                n++;
+
+            if (n == MAX_VARS)
+                return false;
+            else if (n == w->var_count)
+                strcpy(vars[w->var_count++], operand);
+
+            arg = (Arg){ .kind = ARG_VAR, .value = (int64_t)n };
+        } else if (*operand != '\0')
+            return false;
+
+        if (!valid_insn(mnemonic, arg.kind))
+            return false;
+
+        w->insns[i] = (Insn){ .mnemonic = mnemonic, .arg = arg };
+    }
+
+    // The key tells windows apart after the names are gone.
+    size_t len = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Arg *arg = &w->insns[i].arg;
+        len += sprintf(w->key + len, "%s %d %lld;", w->insns[i].mnemonic->name, (int)arg->kind, (long long)arg->value);
+    }
+
+    return true;
+}
+
+static int64_t arg_value(State *s, Test *t, Arg *arg) {
+    switch (arg->kind) {
+        case ARG_ACC: return s->acc;
+        case ARG_VAR: return s->cells[t->cell_of[arg->value]];
+        case ARG_INT: return t->ints[arg->value];
+        default: return arg->value;
+    }
+}
+
+// Runs the instructions the way the VM does, with the same wrap around.
+// Returns false if the stack runs out.
+static bool run(Insn *insns, size_t count, Test *t, State *s) {
+    *s = t->start;
+
+    for (size_t i = 0; i < count; i++) {
+        Insn *insn = &insns[i];
+        const uint64_t acc = (uint64_t)s->acc;
+        const int64_t value = arg_value(s, t, &insn->arg);
+
+        switch (insn->mnemonic->type) {
+            case OP_LOAD: s->acc = value; break;
+            case OP_STORE: s->cells[t->cell_of[insn->arg.value]] = s->acc; break;
+            case OP_PUSH:
+                if (s->depth == STACK_DEPTH)
+                    return false;
+
+                s->stack[s->depth++] = value;
+                break;
+            case OP_POP:
+                if (s->depth == 0)
+                    return false;
+
+                if (insn->arg.kind == ARG_ACC)
+                    s->acc = s->stack[--s->depth];
+                else
+                    s->cells[t->cell_of[insn->arg.value]] = s->stack[--s->depth];
+
+                s->stack[s->depth] = 0;
+                break;
+            case OP_ADD: s->acc = (int64_t)(acc + (uint64_t)value); break;
+            case OP_SUB: s->acc = (int64_t)(acc - (uint64_t)value); break;
+            case OP_MUL: s->acc = (int64_t)(acc * (uint64_t)value); break;
+            case OP_SHL: s->acc = (int64_t)(acc << (value & 63)); break;
+            case OP_SHR: s->acc = s->acc >> (value & 63); break;
+            case OP_AND: s->acc &= value; break;
+            case OP_OR: s->acc |= value; break;
+            case OP_XOR: s->acc ^= value; break;
+            case OP_NOT: s->acc = ~s->acc; break;
+            case OP_NEG: s->acc = (int64_t)(0 - acc); break;
+            case OP_COMPARE:
+                s->left = s->acc;
+                s->right = value;
+                break;
+            case OP_EQ: s->acc = s->right == s->left; break;
+            case OP_NEQ: s->acc = s->right != s->left; break;
+            case OP_LT: s->acc = s->right < s->left; break;
+            case OP_LTE: s->acc = s->right <= s->left; break;
+            case OP_GT: s->acc = s->right > s->left; break;
+            default: s->acc = s->right >= s->left; break;
+        }
+    }
+
+    return true;
+}
+
+static bool same_state(State *a, State *b) {
+    if (a->acc != b->acc || a->left != b->left || a->right != b->right || a->depth != b->depth)
+        return false;
+
+    return memcmp(a->cells, b->cells, sizeof(a->cells)) == 0 && memcmp(a->stack, b->stack, sizeof(a->stack)) == 0;
+}
+
+static void make_tests(Test *tests, size_t count, Window *w, bool alias) {
+    for (size_t i = 0; i < count; i++) {
+        Test *t = &tests[i];
+        t->start = (State){ .acc = random_value(w), .left = random_value(w), .right = random_value(w), .depth = 3 };
+
+        for (size_t k = 0; k < MAX_VARS; k++) {
+            t->start.cells[k] = random_value(w);
+            t->cell_of[k] = alias && w->var_count > 0 ? next_random() % w->var_count : k;
+        }
+
+        for (size_t k = 0; k < t->start.depth; k++)
+            t->start.stack[k] = random_value(w);
+
+        for (size_t k = 0; k < MAX_INTS; k++)
+            t->ints[k] = random_value(w);
+    }
+}
+
+// Whether the instructions end up where the window does on every test.
+// The pattern can't be run on a test it isn't valid for, so those don't
+// count.
+static bool equivalent(Window *w, Insn *insns, size_t count, Test *tests) {
+    for (size_t i = 0; i < TEST_COUNT; i++) {
+        State expected, actual;
+
+        if (!run(w->insns, w->count, &tests[i], &expected))
+            continue;
+        else if (!run(insns, count, &tests[i], &actual) || !same_state(&expected, &actual))
+            return false;
+    }
+
+    return true;
+}
+
+static size_t make_candidates(Window *w, Insn *out) {
+    Arg args[MAX_VARS + MAX_INTS + 4];
+    size_t arg_count = 0;
+
+    args[arg_count++] = (Arg){ .kind = ARG_ACC, .value = 0 };
+
+    for (size_t i = 0; i < w->var_count; i++)
+        args[arg_count++] = (Arg){ .kind = ARG_VAR, .value = (int64_t)i };
+
+    for (size_t i = 0; i < w->int_count; i++)
+        args[arg_count++] = (Arg){ .kind = ARG_INT, .value = (int64_t)i };
+
+    for (size_t i = 0; i < sizeof(constants) / sizeof(constants[0]); i++)
+        args[arg_count++] = (Arg){ .kind = ARG_CONST, .value = constants[i] };
+
+    size_t count = 0;
+
+    for (size_t m = 0; m < MNEMONIC_COUNT; m++) {
+        for (size_t a = 0; a < arg_count && mnemonics[m].search; a++) {
+            if (valid_insn(&mnemonics[m], args[a].kind) && count < MAX_CANDIDATES)
+                out[count++] = (Insn){ .mnemonic = &mnemonics[m], .arg = args[a] };
+        }
+    }
+
+    return count;
+}
+
+typedef struct {
+    Window *window;
+    Test *tests;
+    Insn *candidates;
+    size_t candidate_count;
+    Insn current[MAX_WINDOW];
+    Rule *best;
+} Search;
+
+static void search(Search *s, size_t length, size_t depth) {
+    if (depth == length) {
+        const unsigned int cost = insns_cost(s->current, length);
+
+        if (cost < s->best->cost && equivalent(s->window, s->current, length, s->tests)) {
+            memcpy(s->best->insns, s->current, length * sizeof(Insn));
+            s->best->count = length;
+            s->best->cost = cost;
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; i < s->candidate_count; i++) {
+        s->current[depth] = s->candidates[i];
+
+        // Nothing beats the best so far once the prefix costs as much.
+        if (insns_cost(s->current, depth + 1) < s->best->cost)
+            search(s, length, depth + 1);
+    }
+}
+
+// Finds the cheapest sequence no longer than the window, shorter ones
+// win ties.
+static bool superoptimize(Window *w, Rule *rule) {
+    Test tests[TEST_COUNT];
+    Insn candidates[MAX_CANDIDATES];
+
+    make_tests(tests, TEST_COUNT, w, false);
+    *rule = (Rule){ .window = w, .count = w->count, .cost = insns_cost(w->insns, w->count), .distinct = false };
+
+    const unsigned int cost = rule->cost;
+    Search s = (Search){ .window = w, .tests = tests, .candidates = candidates,
+        .candidate_count = make_candidates(w, candidates), .best = rule };
+
+    for (size_t length = 0; length <= w->count; length++)
+        search(&s, length, 0);
+
+    if (rule->cost == cost)
+        return false;
+
+    make_tests(tests, TEST_COUNT, w, true);
+    rule->distinct = w->var_count > 1 && !equivalent(w, rule->insns, rule->count, tests);
+    return true;
+}
+
+static void write_arg(FILE *out, Arg *arg, bool *bound, bool pattern) {
+    static const char var_names[] = "xyz";
+    static const char int_names[] = "abc";
+
+    switch (arg->kind) {
+        case ARG_ACC:
+            fputs("@acc", out);
+            break;
+        case ARG_VAR:
+            fprintf(out, "$%c", var_names[arg->value]);
+
+            if (pattern && !bound[arg->value]) {
+                fputs(":mem", out);
+                bound[arg->value] = true;
+            }
+            break;
+        case ARG_INT:
+            fprintf(out, "$%c", int_names[arg->value]);
+
+            if (pattern && !bound[MAX_VARS + arg->value]) {
+                fputs(":int", out);
+                bound[MAX_VARS + arg->value] = true;
+            }
+            break;
+        default:
+            fprintf(out, "%lld", (long long)arg->value);
+            break;
+    }
+}
+
+// Writes the instruction the way the IR printer writes its op.
+static void write_insn(FILE *out, Insn *insn, bool *bound, bool pattern) {
+    Arg acc = (Arg){ .kind = ARG_ACC, .value = 0 };
+    fprintf(out, "    %s ", insn->mnemonic->ir);
+
+    switch (insn->mnemonic->form) {
+        case FORM_VALUE:
+            write_arg(out, &acc, bound, pattern);
+            fputs(", ", out);
+            write_arg(out, &insn->arg, bound, pattern);
+            break;
+        case FORM_MEM:
+            write_arg(out, &insn->arg, bound, pattern);
+            fputs(", ", out);
+            write_arg(out, &acc, bound, pattern);
+            break;
+        default:
+            write_arg(out, &insn->arg, bound, pattern);
+            break;
+    }
+
+    fputc('\n', out);
+}
+
+static void write_rule(FILE *out, Rule *rule, size_t index) {
+    bool bound[MAX_VARS + MAX_INTS] = { false };
+
+    fprintf(out, "# Seen %zu time%s.\nrule superopt_%zu\n", rule->window->seen, rule->window->seen == 1 ? "" : "s", index);
+
+    for (size_t i = 0; i < rule->window->count; i++)
+        write_insn(out, &rule->window->insns[i], bound, true);
+
+    if (rule->distinct) {
+        fputs("when {", out);
+
+        for (size_t a = 0; a < rule->window->var_count; a++) {
+            for (size_t b = a + 1; b < rule->window->var_count; b++)
+                fprintf(out, "%s!same_value(&$%c, &$%c)", a + b > 1 ? " && " : "", "xyz"[a], "xyz"[b]);
+        }
+
+        fputs("}\n", out);
+    }
+
+    fputs("=>\n", out);
+
+    for (size_t i = 0; i < rule->count; i++)
+        write_insn(out, &rule->insns[i], bound, false);
+
+    fputs("end\n\n", out);
+}
+
+static bool ends_run(const char *mnemonic) {
+    return find_mnemonic(mnemonic) == NULL;
+}
+
+static bool has_literal(Window *w) {
+    for (size_t i = 0; i < w->count; i++) {
+        if (w->insns[i].arg.kind == ARG_CONST)
+            return true;
+    }
+
+    return false;
+}
+
+static void add_window(Window **windows, size_t *count, size_t *capacity, Window *w) {
+    if (*count == *capacity) {
+        *capacity *= 2;
+        *windows = realloc(*windows, *capacity * sizeof(Window));
+    }
+
+    (*windows)[(*count)++] = *w;
+}
+
+static void add_windows(Line *run, size_t run_len, Window **windows, size_t *count, size_t *capacity) {
+    for (size_t start = 0; start < run_len; start++) {
+        for (size_t len = 2; len <= MAX_WINDOW && start + len <= run_len; len++) {
+            Window w;
+
+            if (build_window(&run[start], len, false, &w))
+                add_window(windows, count, capacity, &w);
+
+            if (build_window(&run[start], len, true, &w) && has_literal(&w))
+                add_window(windows, count, capacity, &w);
+        }
+    }
+}
+
+// Collects the windows of every straight line run in the text section.
+static bool read_windows(char *path, Window **windows, size_t *count, size_t *capacity) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "error: failed to open file '%s'\n", path);
+        return false;
+    }
+
+    Line run[MAX_RUN];
+    size_t run_len = 0;
+    char buffer[MAX_LINE];
+    bool in_text = true;
+
+    while (fgets(buffer, sizeof(buffer), file) != NULL && in_text) {
+        Line line = (Line){ .mnemonic = "", .operand = "" };
+        char mnemonic[MAX_LINE], operand[MAX_LINE];
+        int fields = sscanf(buffer, "%511s %511s", mnemonic, operand);
+
+        if (strcmp(mnemonic, ".data") == 0)
+            in_text = false;
+
+        if (fields < 1)
+            continue;
+
+        for (char *c = mnemonic; *c != '\0'; c++)
+            *c = (char)tolower((unsigned char)*c);
+
+        bool fits = strlen(mnemonic) < sizeof(line.mnemonic) && (fields < 2 || strlen(operand) < sizeof(line.operand));
+
+        if (!in_text || !fits || ends_run(mnemonic) || run_len == MAX_RUN) {
+            // The cmp 0 before beq and bne belongs to the branch op.
+            bool branch_bool = strcmp(mnemonic, "beq") == 0 || strcmp(mnemonic, "bne") == 0;
+
+            if (branch_bool && run_len > 0 && strcmp(run[run_len - 1].mnemonic, "cmp") == 0 && strcmp(run[run_len - 1].operand, "0") == 0)
+                run_len--;
+
+            add_windows(run, run_len, windows, count, capacity);
+            run_len = 0;
+            continue;
+        }
+
+        strcpy(line.mnemonic, mnemonic);
+
+        if (fields == 2)
+            strcpy(line.operand, operand);
+
+        run[run_len++] = line;
+    }
+
+    add_windows(run, run_len, windows, count, capacity);
+    fclose(file);
+    return true;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    return strcmp(((Window *)a)->key, ((Window *)b)->key);
+}
+
+static int compare_rules(const void *a, const void *b) {
+    const Rule *ra = a, *rb = b;
+
+    if (ra->window->seen != rb->window->seen)
+        return ra->window->seen < rb->window->seen ? 1 : -1;
+
+    return strcmp(ra->window->key, rb->window->key);
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s))
+        s++;
+
+    char *end = s + strlen(s);
+
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+// Returns false for operands the search doesn't model.
+static bool parse_match_arg(char *operand, char names[][MAX_NAME], size_t *name_count, MatchArg *arg) {
+    if (strcmp(operand, "@acc") == 0)
+        *arg = (MatchArg){ .kind = MATCH_ACC };
+    else if (strcmp(operand, "_") == 0)
+        *arg = (MatchArg){ .kind = MATCH_ANY };
+    else if (is_integer(operand))
+        *arg = (MatchArg){ .kind = MATCH_CONST, .value = strtoll(operand, NULL, 10) };
+    else if (*operand == '$') {
+        char *colon = strchr(operand, ':');
+        const char *kind = colon == NULL ? "" : colon + 1;
+
+        if (colon != NULL)
+            *colon = '\0';
+
+        if (strcmp(kind, "") == 0)
+            arg->kind = MATCH_BINDING;
+        else if (strcmp(kind, "mem") == 0 || strcmp(kind, "var") == 0 || strcmp(kind, "ret") == 0)
+            arg->kind = MATCH_VAR;
+        else if (strcmp(kind, "int") == 0)
+            arg->kind = MATCH_INT;
+        else if (strcmp(kind, "value") == 0)
+            arg->kind = MATCH_VALUE;
+        else
+            return false;
+
+        size_t n = 0;
+
+        while (n < *name_count && strcmp(names[n], operand + 1) != 0)
+            n++;
+
+        if (n == MAX_VARS + MAX_INTS || strlen(operand + 1) >= MAX_NAME)
+            return false;
+        else if (n == *name_count)
+            strcpy(names[(*name_count)++], operand + 1);
+
+        arg->binding = n;
+    } else
+        return false;
+
+    return true;
+}
+
+// An op the way the IR printer writes it, like "load @acc, $x:value".
+static bool parse_match_insn(char *line, char names[][MAX_NAME], size_t *name_count, MatchInsn *insn) {
+    char *operands = line + strcspn(line, " ");
+
+    if (*operands != '\0')
+        *operands++ = '\0';
+
+    char *comma = strchr(operands, ',');
+    char *second = NULL;
+
+    if (comma != NULL) {
+        *comma = '\0';
+        second = trim(comma + 1);
+    }
+
+    char *first = trim(operands);
+    insn->mnemonic = find_ir_mnemonic(line);
+
+    if (insn->mnemonic == NULL)
+        return false;
+
+    switch (insn->mnemonic->form) {
+        case FORM_VALUE:
+            return second != NULL && strcmp(first, "@acc") == 0 && parse_match_arg(second, names, name_count, &insn->arg);
+        case FORM_MEM:
+            return second != NULL && strcmp(second, "@acc") == 0 && parse_match_arg(first, names, name_count, &insn->arg);
+        default:
+            return second == NULL && parse_match_arg(first, names, name_count, &insn->arg);
+    }
+}
+
+// Reads the patterns of the hand written rules. Rules with a condition,
+// or with anything the search doesn't model, are left out, they can only
+// make it skip fewer windows.
+static bool read_patterns(char *path, Pattern *patterns, size_t *count) {
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        fprintf(stderr, "error: failed to open file '%s'\n", path);
+        return false;
+    }
+
+    char buffer[MAX_LINE];
+    char names[MAX_VARS + MAX_INTS][MAX_NAME];
+    size_t name_count = 0;
+    Pattern pattern;
+    bool in_pattern = false;
+    bool usable = false;
+
+    while (fgets(buffer, sizeof(buffer), file) != NULL) {
+        char *hash = strchr(buffer, '#');
+
+        if (hash != NULL)
+            *hash = '\0';
+
+        char *line = trim(buffer);
+
+        if (*line == '\0')
+            continue;
+        else if (strncmp(line, "rule ", 5) == 0) {
+            pattern = (Pattern){ .count = 0, .distinct = false };
+            name_count = 0;
+            in_pattern = usable = true;
+        } else if (strncmp(line, "when ", 5) == 0)
+            usable = false;
+        else if (strcmp(line, "=>") == 0) {
+            if (in_pattern && usable && pattern.count > 0 && *count < MAX_PATTERNS)
+                patterns[(*count)++] = pattern;
+
+            in_pattern = false;
+        } else if (in_pattern && usable) {
+            usable = pattern.count < MAX_WINDOW && parse_match_insn(line, names, &name_count, &pattern.insns[pattern.count]);
+            pattern.count++;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+static Pattern rule_pattern(Rule *rule) {
+    Pattern pattern = (Pattern){ .count = rule->window->count, .distinct = rule->distinct };
+
+    for (size_t i = 0; i < rule->window->count; i++) {
+        Arg *arg = &rule->window->insns[i].arg;
+        MatchArg *m = &pattern.insns[i].arg;
+        pattern.insns[i].mnemonic = rule->window->insns[i].mnemonic;
+
+        switch (arg->kind) {
+            case ARG_ACC: *m = (MatchArg){ .kind = MATCH_ACC }; break;
+            case ARG_VAR: *m = (MatchArg){ .kind = MATCH_VAR, .binding = (size_t)arg->value }; break;
+            case ARG_INT: *m = (MatchArg){ .kind = MATCH_INT, .binding = MAX_VARS + (size_t)arg->value }; break;
+            default: *m = (MatchArg){ .kind = MATCH_CONST, .value = arg->value }; break;
+        }
+    }
+
+    return pattern;
+}
+
+static bool match_arg(MatchArg *m, Arg *arg, Arg *bound, bool *is_bound) {
+    switch (m->kind) {
+        case MATCH_ACC: return arg->kind == ARG_ACC;
+        case MATCH_CONST: return arg->kind == ARG_CONST && arg->value == m->value;
+        case MATCH_ANY: return true;
+        default: break;
+    }
+
+    if (is_bound[m->binding])
+        return bound[m->binding].kind == arg->kind && bound[m->binding].value == arg->value;
+
+    bool fits;
+
+    switch (m->kind) {
+        case MATCH_VAR: fits = arg->kind == ARG_VAR; break;
+        case MATCH_INT: fits = arg->kind == ARG_INT || arg->kind == ARG_CONST; break;
+        case MATCH_VALUE: fits = arg->kind != ARG_ACC; break;
+        default: fits = true; break;
+    }
+
+    bound[m->binding] = *arg;
+    is_bound[m->binding] = fits;
+    return fits;
+}
+
+static bool match_pattern(Pattern *pattern, Insn *insns, size_t count) {
+    Arg bound[MAX_VARS + MAX_INTS];
+    bool is_bound[MAX_VARS + MAX_INTS] = { false };
+
+    if (pattern->count != count)
+        return false;
+
+    for (size_t i = 0; i < count; i++) {
+        if (pattern->insns[i].mnemonic != insns[i].mnemonic || !match_arg(&pattern->insns[i].arg, &insns[i].arg, bound, is_bound))
+            return false;
+    }
+
+    for (size_t a = 0; a < MAX_VARS && pattern->distinct; a++) {
+        for (size_t b = a + 1; b < MAX_VARS; b++) {
+            if (is_bound[a] && is_bound[b] && bound[a].kind == bound[b].kind && bound[a].value == bound[b].value)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// The peephole would rewrite part of the window before a rule for the
+// whole of it got the chance, so it wouldn't fire. A literal window
+// whose rule with bindings was found is covered the same way.
+static bool covered(Pattern *patterns, size_t pattern_count, Window *w) {
+    for (size_t start = 0; start < w->count; start++) {
+        for (size_t len = 1; start + len <= w->count; len++) {
+            for (size_t i = 0; i < pattern_count; i++) {
+                if (match_pattern(&patterns[i], &w->insns[start], len))
+                    return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <output file> <hand written rules> <assembly files...>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Pattern *patterns = malloc(MAX_PATTERNS * sizeof(Pattern));
+    size_t pattern_count = 0;
+
+    if (!read_patterns(argv[2], patterns, &pattern_count))
+        return EXIT_FAILURE;
+
+    size_t capacity = 1024;
+    size_t count = 0;
+    Window *windows = malloc(capacity * sizeof(Window));
+
+    for (int i = 3; i < argc; i++) {
+        if (!read_windows(argv[i], &windows, &count, &capacity))
+            return EXIT_FAILURE;
+    }
+
+    qsort(windows, count, sizeof(Window), compare_keys);
+    size_t unique = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(windows[unique - 1].key, windows[i].key) == 0)
+            windows[unique - 1].seen++;
+        else
+            windows[unique++] = windows[i];
+    }
+
+    // The ones with bindings go first so they can cover the literal ones,
+    // and shorter ones first so they can cover the longer ones.
+    Rule *rules = malloc((unique + 1) * sizeof(Rule));
+    size_t rule_count = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t len = 1; len <= MAX_WINDOW; len++) {
+            for (size_t i = 0; i < unique; i++) {
+                Window *w = &windows[i];
+
+                if (w->count != len || has_literal(w) != (pass == 1) || covered(patterns, pattern_count, w))
+                    continue;
+
+                if (superoptimize(w, &rules[rule_count])) {
+                    if (pattern_count < MAX_PATTERNS)
+                        patterns[pattern_count++] = rule_pattern(&rules[rule_count]);
+
+                    rule_count++;
+                }
+            }
+        }
+    }
+
+    qsort(rules, rule_count, sizeof(Rule), compare_rules);
+
+    FILE *out = fopen(argv[1], "w");
+
+    if (out == NULL) {
+        fprintf(stderr, "error: failed to open file '%s'\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "# Peephole rules found by tools/superopt in %zu windows of %d assembly\n"
+                 "# files, compiled into src/passes/peephole.inc after peephole.rules.\n"
+                 "# Regenerate from the programs in tools/corpus and examples with:\n"
+                 "#     make superopt-rules\n\n", unique, argc - 3);
+
+    for (size_t i = 0; i < rule_count; i++)
+        write_rule(out, &rules[i], i);
+
+    fclose(out);
+    free(rules);
+    free(windows);
+    free(patterns);
+    return EXIT_SUCCESS;
+}